@@ -26,6 +26,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef IRECV_API
   #ifdef IRECV_STATIC
@@ -70,7 +71,8 @@ typedef enum {
 	IRECV_POSTCOMMAND         = 3,
 	IRECV_CONNECTED           = 4,
 	IRECV_DISCONNECTED        = 5,
-	IRECV_PROGRESS            = 6
+	IRECV_PROGRESS            = 6,
+	IRECV_CONSOLE             = 7
 } irecv_event_type;
 
 typedef struct {
@@ -117,11 +119,206 @@ typedef struct {
 	irecv_device_event_type type;
 	enum irecv_mode mode;
 	struct irecv_device_info *device_info;
+	uint64_t seq;       /* position in the device event journal */
+	uint64_t timestamp; /* microseconds on a monotonic clock */
 } irecv_device_event_t;
 
+/* one record of the device event journal, see irecv_device_events_since() */
+struct irecv_device_journal_entry {
+	uint64_t seq;
+	uint64_t timestamp;
+	irecv_device_event_type type;
+	enum irecv_mode mode;
+	struct irecv_device_info device_info;
+};
+
+enum irecv_device_filter_mode {
+	IRECV_FILTER_RECOVERY = 1 << 0,
+	IRECV_FILTER_DFU      = 1 << 1, /* DFU and Port DFU */
+	IRECV_FILTER_WTF      = 1 << 2,
+	IRECV_FILTER_KIS      = 1 << 3  /* Debug USB */
+};
+
+/* empty fields match everything; devices outside the mode/PID part of every subscription are not opened */
+struct irecv_device_event_filter {
+	unsigned int modes; /* IRECV_FILTER_* bits */
+	const uint16_t *pids;
+	unsigned int num_pids;
+	const uint64_t *ecids;
+	unsigned int num_ecids;
+	unsigned int cpid;
+};
+
 typedef struct irecv_client_private irecv_client_private;
 typedef irecv_client_private* irecv_client_t;
 
+#define IRECV_USB_MAX_PORT_DEPTH 7
+
+struct irecv_usb_topology {
+	uint8_t bus;
+	uint8_t address;
+	uint8_t port_depth;
+	uint8_t port_path[IRECV_USB_MAX_PORT_DEPTH];
+};
+
+typedef struct irecv_scheduler* irecv_scheduler_t;
+
+typedef struct irecv_port_history* irecv_port_history_t;
+
+enum {
+	IRECV_HISTORY_PORT   = 0,
+	IRECV_HISTORY_DEVICE = 1
+};
+
+/* rates are per transfer; last_update is in seconds since the epoch */
+struct irecv_port_history_entry {
+	int kind;
+	uint8_t bus;
+	uint8_t port_depth;
+	uint8_t port_path[IRECV_USB_MAX_PORT_DEPTH];
+	uint64_t ecid;
+	uint64_t last_update;
+	uint64_t transfers;
+	double throughput;
+	double expected_throughput;
+	double failure_rate;
+	double retry_rate;
+	double stall_rate;
+	double timeout_rate;
+	int degraded;
+};
+
+enum {
+	IRECV_DIGEST_NONE   = 0,
+	IRECV_DIGEST_CRC32  = (1 << 0),
+	IRECV_DIGEST_SHA256 = (1 << 1),
+	IRECV_DIGEST_SHA384 = (1 << 2)
+};
+
+struct irecv_upload_result {
+	irecv_error_t status;
+	uint64_t bytes;
+	unsigned int digests;
+	uint32_t crc32;
+	unsigned char sha256[32];
+	unsigned char sha384[48];
+};
+
+/* one part of a scattered upload; the same layout as a POSIX struct iovec */
+struct irecv_iovec {
+	void *iov_base;
+	size_t iov_len;
+};
+
+/* return non-zero to abort the transfer */
+typedef int (*irecv_recv_sink_cb_t)(const unsigned char* data, size_t size, void* user_data);
+
+typedef struct irecv_group* irecv_group_t;
+
+typedef struct irecv_image_store* irecv_image_store_t;
+
+typedef struct irecv_expect* irecv_expect_t;
+
+typedef struct irecv_future* irecv_future_t;
+
+/* marker kinds reported by IRECV_CONSOLE events; callers pick their own
+ * kinds for custom markers starting at IRECV_CONSOLE_USER */
+enum {
+	IRECV_CONSOLE_PROMPT = 1,
+	IRECV_CONSOLE_IMAGE_LOAD,
+	IRECV_CONSOLE_PANIC,
+	IRECV_CONSOLE_WAITING,
+	IRECV_CONSOLE_COMMAND_ERROR,
+	IRECV_CONSOLE_USER = 0x100
+};
+
+enum {
+	IRECV_CONSOLE_LINE_START = (1 << 0), /* only match at the beginning of a line */
+	IRECV_CONSOLE_IMMEDIATE  = (1 << 1)  /* report at the match, not at the end of the line */
+};
+
+/* passed in the data of an IRECV_CONSOLE event, size is sizeof(struct irecv_console_event);
+ * line is NUL terminated, cut to the first 255 bytes, and only valid during the callback */
+struct irecv_console_event {
+	int kind;
+	uint64_t timestamp; /* monotonic, in microseconds */
+	const char* line;
+	size_t length;
+};
+
+/* runs on the client's queue thread, or on the caller's if the future is already done */
+typedef void (*irecv_future_cb_t)(irecv_future_t future, void* user_data);
+
+enum irecv_timing_phase {
+	IRECV_TIMING_INIT = 0,
+	IRECV_TIMING_ENUMERATE,
+	IRECV_TIMING_OPEN,
+	IRECV_TIMING_CONFIGURE,
+	IRECV_TIMING_DESCRIPTORS,
+	IRECV_TIMING_NONCES,
+	IRECV_TIMING_KIS_INIT,
+	IRECV_TIMING_UPLOAD,
+	IRECV_TIMING_MANIFEST,
+	IRECV_TIMING_RESET,
+	IRECV_TIMING_CLOSE
+};
+
+/* times are microseconds on a monotonic clock; ecid is 0 until the device is identified */
+struct irecv_timing {
+	enum irecv_timing_phase phase;
+	uint64_t ecid;
+	uint64_t start;
+	uint64_t duration;
+	uint64_t bytes;
+	irecv_error_t error;
+};
+
+typedef void (*irecv_timing_cb_t)(const struct irecv_timing* timing, void* user_data);
+
+struct irecv_group_member_result {
+	irecv_client_t client;
+	irecv_error_t error;
+	uint64_t bytes;
+	double elapsed;
+};
+
+struct irecv_group_stats {
+	uint64_t bytes;
+	double elapsed;
+	double throughput;
+	unsigned int succeeded;
+	unsigned int failed;
+};
+
+enum irecv_transfer_phase {
+	IRECV_TRANSFER_IDLE      = 0,
+	IRECV_TRANSFER_WAITING   = 1,
+	IRECV_TRANSFER_UPLOAD    = 2,
+	IRECV_TRANSFER_DOWNLOAD  = 3,
+	IRECV_TRANSFER_FINISHING = 4,
+	IRECV_TRANSFER_DONE      = 5,
+	IRECV_TRANSFER_FAILED    = 6
+};
+
+/* times are microseconds on a monotonic clock */
+struct irecv_transfer_progress {
+	uint64_t bytes_done;
+	uint64_t bytes_total;
+	int phase;
+	uint64_t start_time;
+	uint64_t last_ack_time;
+};
+
+struct irecv_scheduler_controller_stats {
+	uint8_t bus;
+	unsigned int active_streams;
+	unsigned int stream_limit;
+	uint64_t bytes_transferred;
+	double throughput;
+	double peak_throughput;
+	double utilization;
+};
+
 enum {
 	IRECV_SEND_OPT_NONE              = 0,
 	IRECV_SEND_OPT_DFU_NOTIFY_FINISH = (1 << 0),
@@ -138,9 +335,13 @@ IRECV_API const char* irecv_version();
 /* device connectivity */
 IRECV_API irecv_error_t irecv_open_with_ecid(irecv_client_t* client, uint64_t ecid);
 IRECV_API irecv_error_t irecv_open_with_ecid_and_attempts(irecv_client_t* pclient, uint64_t ecid, int attempts);
+/* descriptors only: no configuration change, no interface claim; transfers to the device are refused */
+IRECV_API irecv_error_t irecv_open_with_ecid_readonly(irecv_client_t* pclient, uint64_t ecid);
 IRECV_API irecv_error_t irecv_reset(irecv_client_t client);
 IRECV_API irecv_error_t irecv_close(irecv_client_t client);
 IRECV_API irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause);
+/* follows the device by ECID; returns IRECV_E_UNSUPPORTED if the device did not report one */
+IRECV_API irecv_error_t irecv_set_auto_reconnect(irecv_client_t client, unsigned int timeout_ms);
 
 /* misc */
 IRECV_API irecv_error_t irecv_receive(irecv_client_t client);
@@ -154,22 +355,104 @@ IRECV_API irecv_error_t irecv_usb_set_configuration(irecv_client_t client, int c
 IRECV_API irecv_error_t irecv_usb_set_interface(irecv_client_t client, int usb_interface, int usb_alt_interface);
 IRECV_API int irecv_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout);
 IRECV_API int irecv_usb_bulk_transfer(irecv_client_t client, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+IRECV_API irecv_error_t irecv_get_usb_topology(irecv_client_t client, struct irecv_usb_topology* topology);
+
+/* upload scheduling; detach and free wait for the client's transfer in
+ * flight, so do not call them from its callbacks. A transfer waiting for a
+ * hub or controller whose streams made no progress for 30 seconds fails
+ * with IRECV_E_TIMEOUT. */
+IRECV_API irecv_error_t irecv_scheduler_new(irecv_scheduler_t* scheduler, unsigned int max_streams_per_hub, unsigned int max_streams_per_controller);
+IRECV_API irecv_error_t irecv_scheduler_free(irecv_scheduler_t scheduler);
+IRECV_API irecv_error_t irecv_scheduler_set_adaptive(irecv_scheduler_t scheduler, int enable);
+IRECV_API irecv_error_t irecv_scheduler_attach(irecv_scheduler_t scheduler, irecv_client_t client);
+IRECV_API irecv_error_t irecv_scheduler_detach(irecv_client_t client);
+IRECV_API irecv_error_t irecv_scheduler_get_controller_stats(irecv_scheduler_t scheduler, struct irecv_scheduler_controller_stats* stats, unsigned int max_count, unsigned int* count);
+IRECV_API irecv_error_t irecv_set_bandwidth_limit(irecv_client_t client, uint64_t bytes_per_second);
+
+/* port history; half_life is in seconds (0 for a week). Ranked best first:
+ * port entries name the last device seen there, device entries the last port */
+IRECV_API irecv_error_t irecv_port_history_open(const char* path, unsigned int half_life, irecv_port_history_t* history);
+IRECV_API irecv_error_t irecv_port_history_close(irecv_port_history_t history);
+IRECV_API irecv_error_t irecv_port_history_attach(irecv_port_history_t history, irecv_client_t client);
+IRECV_API irecv_error_t irecv_port_history_detach(irecv_client_t client);
+IRECV_API irecv_error_t irecv_port_history_rank(irecv_port_history_t history, int kind, struct irecv_port_history_entry* entries, unsigned int max_count, unsigned int* count);
+
+/* client groups */
+IRECV_API irecv_error_t irecv_group_new(irecv_group_t* group, unsigned int max_workers);
+IRECV_API irecv_error_t irecv_group_free(irecv_group_t group);
+IRECV_API irecv_error_t irecv_group_add(irecv_group_t group, irecv_client_t client);
+IRECV_API irecv_error_t irecv_group_remove(irecv_group_t group, irecv_client_t client);
+IRECV_API irecv_error_t irecv_group_send_buffer(irecv_group_t group, const unsigned char* buffer, unsigned long length, unsigned int options);
+IRECV_API irecv_error_t irecv_group_send_file(irecv_group_t group, const char* filename, unsigned int options);
+IRECV_API irecv_error_t irecv_group_send_command(irecv_group_t group, const char* command);
+IRECV_API irecv_error_t irecv_group_setenv(irecv_group_t group, const char* variable, const char* value);
+IRECV_API irecv_error_t irecv_group_execute_script(irecv_group_t group, const char* script);
+IRECV_API irecv_error_t irecv_group_get_results(irecv_group_t group, struct irecv_group_member_result* results, unsigned int max_count, unsigned int* count);
+IRECV_API irecv_error_t irecv_group_get_stats(irecv_group_t group, struct irecv_group_stats* stats);
 
 /* events */
 typedef void(*irecv_device_event_cb_t)(const irecv_device_event_t* event, void *user_data);
 typedef struct irecv_device_event_context* irecv_device_event_context_t;
 IRECV_API irecv_error_t irecv_device_event_subscribe(irecv_device_event_context_t *context, irecv_device_event_cb_t callback, void *user_data);
+IRECV_API irecv_error_t irecv_device_event_subscribe_filtered(irecv_device_event_context_t *context, const struct irecv_device_event_filter *filter, irecv_device_event_cb_t callback, void *user_data);
 IRECV_API irecv_error_t irecv_device_event_unsubscribe(irecv_device_event_context_t context);
+/* events after cursor (0 for all); resync is set when the cursor fell out of the journal and the entries describe the attached devices instead.
+ * The journal is written by the event thread, which only runs while there is at least one device event subscription, and it is
+ * emptied when the last one ends: a process that only polls has to hold a subscription (with a callback that does nothing) meanwhile */
+IRECV_API irecv_error_t irecv_device_events_since(uint64_t cursor, struct irecv_device_journal_entry **entries, unsigned int *count, uint64_t *next_cursor, int *resync);
+IRECV_API void irecv_device_events_free(struct irecv_device_journal_entry *entries);
 typedef int(*irecv_event_cb_t)(irecv_client_t client, const irecv_event_t* event);
 IRECV_API irecv_error_t irecv_event_subscribe(irecv_client_t client, irecv_event_type type, irecv_event_cb_t callback, void *user_data);
 IRECV_API irecv_error_t irecv_event_unsubscribe(irecv_client_t client, irecv_event_type type);
 
 /* I/O */
 IRECV_API irecv_error_t irecv_send_file(irecv_client_t client, const char* filename, unsigned int options);
+IRECV_API irecv_error_t irecv_send_fd(irecv_client_t client, int fd, unsigned int options);
 IRECV_API irecv_error_t irecv_send_command(irecv_client_t client, const char* command);
 IRECV_API irecv_error_t irecv_send_command_breq(irecv_client_t client, const char* command, uint8_t b_request);
 IRECV_API irecv_error_t irecv_send_buffer(irecv_client_t client, unsigned char* buffer, unsigned long length, unsigned int options);
+IRECV_API irecv_error_t irecv_send_iov(irecv_client_t client, const struct irecv_iovec* iov, unsigned int count, unsigned int options);
+IRECV_API irecv_error_t irecv_set_upload_digests(irecv_client_t client, unsigned int digests);
+IRECV_API irecv_error_t irecv_get_upload_result(irecv_client_t client, struct irecv_upload_result* result);
 IRECV_API irecv_error_t irecv_recv_buffer(irecv_client_t client, char* buffer, unsigned long length);
+IRECV_API irecv_error_t irecv_recv_stream(irecv_client_t client, uint64_t length, irecv_recv_sink_cb_t sink, void* user_data);
+IRECV_API irecv_error_t irecv_recv_to_file(irecv_client_t client, const char* filename, uint64_t length);
+IRECV_API irecv_error_t irecv_get_transfer_progress(irecv_client_t client, struct irecv_transfer_progress* progress);
+
+/* image store; digests are SHA-256 (32 bytes) */
+IRECV_API irecv_error_t irecv_image_store_open(const char* path, uint64_t max_size, irecv_image_store_t* store);
+IRECV_API irecv_error_t irecv_image_store_close(irecv_image_store_t store);
+IRECV_API irecv_error_t irecv_image_store_add_buffer(irecv_image_store_t store, const unsigned char* buffer, unsigned long length, unsigned char* digest);
+IRECV_API irecv_error_t irecv_image_store_add_file(irecv_image_store_t store, const char* filename, unsigned char* digest);
+IRECV_API irecv_error_t irecv_image_store_remove(irecv_image_store_t store, const unsigned char* digest);
+IRECV_API irecv_error_t irecv_send_image_by_digest(irecv_client_t client, irecv_image_store_t store, const unsigned char* digest, unsigned int options);
+
+/* metrics in OpenMetrics text format; the rendered text must be freed by the caller */
+IRECV_API irecv_error_t irecv_metrics_render(char** text, size_t* length);
+IRECV_API irecv_error_t irecv_metrics_serve(const char* socket_path);
+IRECV_API irecv_error_t irecv_metrics_stop(void);
+
+/* per-phase timings; the callback runs on the thread doing the work */
+IRECV_API irecv_error_t irecv_set_timing_callback(irecv_timing_cb_t callback, void* user_data);
+IRECV_API const char* irecv_timing_phase_name(enum irecv_timing_phase phase);
+
+/* console automation; literal patterns are matched incrementally, the
+ * earliest match wins and its id is returned so callers can branch on it */
+IRECV_API irecv_error_t irecv_expect_new(irecv_client_t client, irecv_expect_t* expect);
+IRECV_API irecv_error_t irecv_expect_free(irecv_expect_t expect);
+IRECV_API irecv_error_t irecv_expect_add(irecv_expect_t expect, const char* pattern, int id);
+IRECV_API irecv_error_t irecv_expect_clear(irecv_expect_t expect);
+IRECV_API irecv_error_t irecv_expect_set_timeout(irecv_expect_t expect, unsigned int timeout_ms);
+IRECV_API irecv_error_t irecv_expect_send(irecv_expect_t expect, const char* command);
+IRECV_API irecv_error_t irecv_expect_wait(irecv_expect_t expect, int* id);
+IRECV_API irecv_error_t irecv_expect_wait_any(irecv_expect_t* expects, unsigned int count, unsigned int timeout_ms, unsigned int* index, int* id);
+IRECV_API irecv_error_t irecv_expect_get_output(irecv_expect_t expect, const char** data, size_t* length);
+
+/* console markers reported through IRECV_CONSOLE; a client starts out with
+ * the default iBoot markers, clear them to use custom ones only. Do not
+ * change the markers while a receive is in progress. */
+IRECV_API irecv_error_t irecv_console_add_marker(irecv_client_t client, int kind, const char* pattern, unsigned int flags);
+IRECV_API irecv_error_t irecv_console_clear_markers(irecv_client_t client);
 
 /* commands */
 IRECV_API irecv_error_t irecv_saveenv(irecv_client_t client);
@@ -179,6 +462,23 @@ IRECV_API irecv_error_t irecv_setenv_np(irecv_client_t client, const char* varia
 IRECV_API irecv_error_t irecv_reboot(irecv_client_t client);
 IRECV_API irecv_error_t irecv_getret(irecv_client_t client, unsigned int* value);
 
+/* command queue; entries run in order on a thread owned by the client and
+ * fail with IRECV_E_NO_DEVICE if the client is closed first. Upload buffers
+ * must stay valid until their future is done. Do not mix with the direct
+ * calls on the same client. A setenv followed by another for the same
+ * variable is not sent; both futures get the result of the second. The
+ * client may be closed from a callback. */
+IRECV_API irecv_error_t irecv_submit_command(irecv_client_t client, const char* command, irecv_future_t* future);
+IRECV_API irecv_error_t irecv_submit_upload(irecv_client_t client, const unsigned char* buffer, unsigned long length, unsigned int options, irecv_future_t* future);
+IRECV_API irecv_error_t irecv_submit_getenv(irecv_client_t client, const char* variable, irecv_future_t* future);
+/* returns the result of the entry, or IRECV_E_TIMEOUT; 0 waits forever */
+IRECV_API irecv_error_t irecv_future_wait(irecv_future_t future, unsigned int timeout_ms);
+IRECV_API int irecv_future_is_done(irecv_future_t future);
+/* waits; the value of a getenv entry stays valid until the future is freed */
+IRECV_API irecv_error_t irecv_future_get_value(irecv_future_t future, const char** value);
+IRECV_API irecv_error_t irecv_future_set_callback(irecv_future_t future, irecv_future_cb_t callback, void* user_data);
+IRECV_API void irecv_future_free(irecv_future_t future);
+
 /* device information */
 IRECV_API irecv_error_t irecv_get_mode(irecv_client_t client, int* mode);
 IRECV_API const struct irecv_device_info* irecv_get_device_info(irecv_client_t client);
@@ -0,0 +1,557 @@
+/*
+ * libirecovery.hpp
+ * Header-only C++20 interface to libirecovery
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef LIBIRECOVERY_HPP
+#define LIBIRECOVERY_HPP
+
+#if __cplusplus < 202002L && (!defined(_MSVC_LANG) || _MSVC_LANG < 202002L)
+#error "libirecovery.hpp requires C++20"
+#endif
+
+#include <libirecovery.h>
+
+#include <atomic>
+#include <concepts>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <span>
+#include <utility>
+
+/*
+ * Thin, exception-free wrappers: every handle is a move-only owner of the
+ * corresponding C object, operations return irecv_error_t like the C API,
+ * and data is passed as spans so nothing is copied or allocated on top of
+ * what the C functions do themselves.
+ */
+namespace irecv {
+
+using error = irecv_error_t;
+
+inline const char* strerror(error err) noexcept
+{
+	return irecv_strerror(err);
+}
+
+/* malloc'd C strings returned by the library, e.g. from getenv */
+struct free_deleter {
+	void operator()(void* p) const noexcept { std::free(p); }
+};
+using unique_cstr = std::unique_ptr<char, free_deleter>;
+
+/*
+ * Awaitables continue their coroutine through an executor, an object with a
+ * noexcept post() that resumes the handle on a thread of its choosing, e.g.
+ * by queueing it to an event loop. The header starts no threads of its own.
+ */
+template <typename E>
+concept executor = requires(E& e, std::coroutine_handle<> h) {
+	{ e.post(h) } noexcept;
+};
+
+/* resumes right away, on the thread that completed the operation */
+struct inline_executor {
+	void post(std::coroutine_handle<> h) const noexcept { h.resume(); }
+};
+
+template <typename T>
+struct result {
+	error err = IRECV_E_UNKNOWN_ERROR;
+	T value{};
+
+	explicit operator bool() const noexcept { return err == IRECV_E_SUCCESS; }
+};
+
+namespace detail {
+
+/* move-only owner of a C handle released with Close */
+template <typename Handle, auto Close>
+class handle {
+public:
+	handle() noexcept = default;
+	explicit handle(Handle h) noexcept : h_(h) {}
+	handle(const handle&) = delete;
+	handle& operator=(const handle&) = delete;
+	handle(handle&& other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+	handle& operator=(handle&& other) noexcept
+	{
+		if (this != &other) {
+			reset(std::exchange(other.h_, nullptr));
+		}
+		return *this;
+	}
+	~handle() { reset(); }
+
+	Handle get() const noexcept { return h_; }
+	Handle release() noexcept { return std::exchange(h_, nullptr); }
+	void reset(Handle h = nullptr) noexcept
+	{
+		if (h_) {
+			Close(h_);
+		}
+		h_ = h;
+	}
+	explicit operator bool() const noexcept { return h_ != nullptr; }
+
+private:
+	Handle h_ = nullptr;
+};
+
+inline void close_client(irecv_client_t c) noexcept { irecv_close(c); }
+inline void close_events(irecv_device_event_context_t c) noexcept { irecv_device_event_unsubscribe(c); }
+inline void close_store(irecv_image_store_t s) noexcept { irecv_image_store_close(s); }
+inline void close_group(irecv_group_t g) noexcept { irecv_group_free(g); }
+inline void close_scheduler(irecv_scheduler_t s) noexcept { irecv_scheduler_free(s); }
+inline void close_port_history(irecv_port_history_t h) noexcept { irecv_port_history_close(h); }
+inline void close_future(irecv_future_t f) noexcept { irecv_future_free(f); }
+
+inline struct irecv_iovec make_iov(std::span<const std::byte> data) noexcept
+{
+	struct irecv_iovec iov;
+	/* the library never writes to upload buffers */
+	iov.iov_base = const_cast<std::byte*>(data.data());
+	iov.iov_len = data.size();
+	return iov;
+}
+
+/*
+ * The direct upload and command calls have no completion callbacks. Their
+ * awaitables move the coroutine to the executor and make the blocking call
+ * there once it resumes; with inline_executor the call is made right away
+ * on the awaiting thread.
+ */
+template <typename Op, executor Executor>
+class blocking_awaitable {
+public:
+	blocking_awaitable(Op op, Executor& ex) noexcept : op_(std::move(op)), ex_(&ex) {}
+
+	bool await_ready() const noexcept { return std::same_as<Executor, inline_executor>; }
+	void await_suspend(std::coroutine_handle<> h) noexcept { ex_->post(h); }
+	error await_resume() noexcept { return op_(); }
+
+private:
+	Op op_;
+	Executor* ex_;
+};
+
+/*
+ * Waits for a queued entry through its completion callback, which runs on
+ * the client's queue thread. With inline_executor the coroutine continues on
+ * that thread: it may co_await further entries of the same client, but must
+ * not block on them with irecv_future_wait() or use the direct calls.
+ */
+template <executor Executor>
+class future_awaitable {
+public:
+	future_awaitable(irecv_future_t future, Executor& ex) noexcept : future_(future), ex_(&ex) {}
+
+	bool await_ready() const noexcept { return irecv_future_is_done(future_) != 0; }
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		handle_ = h;
+		irecv_future_set_callback(future_, &future_awaitable::on_done, this);
+		/* whoever comes second resumes; if the callback ran inline, do not suspend */
+		return !claimed_.exchange(true);
+	}
+	error await_resume() const noexcept { return irecv_future_wait(future_, 0); }
+
+private:
+	static void on_done(irecv_future_t, void* user_data) noexcept
+	{
+		auto* self = static_cast<future_awaitable*>(user_data);
+		if (self->claimed_.exchange(true)) {
+			self->ex_->post(self->handle_);
+		}
+	}
+
+	irecv_future_t future_;
+	Executor* ex_;
+	std::coroutine_handle<> handle_;
+	std::atomic<bool> claimed_{false};
+};
+
+inline inline_executor default_executor;
+
+} // namespace detail
+
+class future : public detail::handle<irecv_future_t, detail::close_future> {
+public:
+	using handle::handle;
+
+	error wait(unsigned int timeout_ms = 0) const noexcept { return irecv_future_wait(get(), timeout_ms); }
+	bool done() const noexcept { return irecv_future_is_done(get()) != 0; }
+
+	/* the getenv value stays owned by the future */
+	result<const char*> value() const noexcept
+	{
+		result<const char*> r;
+		r.err = irecv_future_get_value(get(), &r.value);
+		return r;
+	}
+
+	detail::future_awaitable<inline_executor> operator co_await() const noexcept { return { get(), detail::default_executor }; }
+
+	/* co_await f.via(ex) continues on ex instead of the client's queue thread */
+	template <executor Executor>
+	detail::future_awaitable<Executor> via(Executor& ex) const noexcept { return { get(), ex }; }
+};
+
+class client : public detail::handle<irecv_client_t, detail::close_client> {
+public:
+	using handle::handle;
+
+	static result<client> open(uint64_t ecid = 0, int attempts = 1) noexcept
+	{
+		irecv_client_t c = nullptr;
+		error err = (attempts > 1) ? irecv_open_with_ecid_and_attempts(&c, ecid, attempts) : irecv_open_with_ecid(&c, ecid);
+		return { err, client(err == IRECV_E_SUCCESS ? c : nullptr) };
+	}
+
+	static result<client> open_readonly(uint64_t ecid = 0) noexcept
+	{
+		irecv_client_t c = nullptr;
+		error err = irecv_open_with_ecid_readonly(&c, ecid);
+		return { err, client(err == IRECV_E_SUCCESS ? c : nullptr) };
+	}
+
+	/* irecv_reconnect() closes the client when it fails, this one is empty afterwards */
+	error reconnect(int initial_pause = 0) noexcept
+	{
+		irecv_client_t c = irecv_reconnect(release(), initial_pause);
+		if (!c) {
+			return IRECV_E_UNABLE_TO_CONNECT;
+		}
+		handle::reset(c);
+		return IRECV_E_SUCCESS;
+	}
+
+	error reset() noexcept { return irecv_reset(get()); }
+	error set_auto_reconnect(unsigned int timeout_ms) noexcept { return irecv_set_auto_reconnect(get(), timeout_ms); }
+
+	const irecv_device_info* device_info() const noexcept { return irecv_get_device_info(get()); }
+
+	result<int> mode() const noexcept
+	{
+		result<int> r;
+		r.err = irecv_get_mode(get(), &r.value);
+		return r;
+	}
+
+	error send(std::span<const std::byte> data, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		struct irecv_iovec iov = detail::make_iov(data);
+		return irecv_send_iov(get(), &iov, 1, options);
+	}
+
+	error send(std::span<const struct irecv_iovec> parts, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		return irecv_send_iov(get(), parts.data(), static_cast<unsigned int>(parts.size()), options);
+	}
+
+	error send_file(const char* filename, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		return irecv_send_file(get(), filename, options);
+	}
+
+	error send_fd(int fd, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		return irecv_send_fd(get(), fd, options);
+	}
+
+	error send_image(irecv_image_store_t store, std::span<const unsigned char, 32> digest, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		return irecv_send_image_by_digest(get(), store, digest.data(), options);
+	}
+
+	error recv(std::span<std::byte> buffer) noexcept
+	{
+		return irecv_recv_buffer(get(), reinterpret_cast<char*>(buffer.data()), static_cast<unsigned long>(buffer.size()));
+	}
+
+	error send_command(const char* command) noexcept { return irecv_send_command(get(), command); }
+	error setenv(const char* name, const char* value) noexcept { return irecv_setenv(get(), name, value); }
+	error saveenv() noexcept { return irecv_saveenv(get()); }
+	error reboot() noexcept { return irecv_reboot(get()); }
+
+	result<unique_cstr> getenv(const char* name) noexcept
+	{
+		char* value = nullptr;
+		error err = irecv_getenv(get(), name, &value);
+		return { err, unique_cstr(value) };
+	}
+
+	/* queued counterparts, safe to call from several threads; the upload data must outlive the future */
+	result<future> submit_command(const char* command) noexcept
+	{
+		irecv_future_t f = nullptr;
+		error err = irecv_submit_command(get(), command, &f);
+		return { err, future(f) };
+	}
+
+	result<future> submit_upload(std::span<const std::byte> data, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		irecv_future_t f = nullptr;
+		error err = irecv_submit_upload(get(), reinterpret_cast<const unsigned char*>(data.data()), static_cast<unsigned long>(data.size()), options, &f);
+		return { err, future(f) };
+	}
+
+	result<future> submit_getenv(const char* name) noexcept
+	{
+		irecv_future_t f = nullptr;
+		error err = irecv_submit_getenv(get(), name, &f);
+		return { err, future(f) };
+	}
+
+	result<irecv_transfer_progress> progress() const noexcept
+	{
+		result<irecv_transfer_progress> r;
+		r.err = irecv_get_transfer_progress(get(), &r.value);
+		return r;
+	}
+
+	error add_console_marker(int kind, const char* pattern, unsigned int flags = 0) noexcept { return irecv_console_add_marker(get(), kind, pattern, flags); }
+	error clear_console_markers() noexcept { return irecv_console_clear_markers(get()); }
+
+	/* co_await-able operations; the spans and strings must outlive the await */
+	template <executor Executor = inline_executor>
+	auto async_send(std::span<const std::byte> data, unsigned int options = IRECV_SEND_OPT_NONE, Executor& ex = detail::default_executor) noexcept
+	{
+		auto op = [c = get(), data, options]() noexcept {
+			struct irecv_iovec iov = detail::make_iov(data);
+			return irecv_send_iov(c, &iov, 1, options);
+		};
+		return detail::blocking_awaitable<decltype(op), Executor>(op, ex);
+	}
+
+	template <executor Executor = inline_executor>
+	auto async_send_file(const char* filename, unsigned int options = IRECV_SEND_OPT_NONE, Executor& ex = detail::default_executor) noexcept
+	{
+		auto op = [c = get(), filename, options]() noexcept {
+			return irecv_send_file(c, filename, options);
+		};
+		return detail::blocking_awaitable<decltype(op), Executor>(op, ex);
+	}
+
+	template <executor Executor = inline_executor>
+	auto async_send_command(const char* command, Executor& ex = detail::default_executor) noexcept
+	{
+		auto op = [c = get(), command]() noexcept {
+			return irecv_send_command(c, command);
+		};
+		return detail::blocking_awaitable<decltype(op), Executor>(op, ex);
+	}
+};
+
+/*
+ * Device event subscription. The handler is referenced, not copied, so it
+ * must outlive the subscription.
+ */
+class device_events : public detail::handle<irecv_device_event_context_t, detail::close_events> {
+public:
+	using handle::handle;
+
+	template <typename F>
+	static result<device_events> subscribe(F& handler) noexcept
+	{
+		irecv_device_event_context_t ctx = nullptr;
+		error err = irecv_device_event_subscribe(&ctx, [](const irecv_device_event_t* event, void* user_data) {
+			(*static_cast<F*>(user_data))(*event);
+		}, &handler);
+		return { err, device_events(err == IRECV_E_SUCCESS ? ctx : nullptr) };
+	}
+
+	template <typename F>
+	static result<device_events> subscribe(F& handler, const irecv_device_event_filter& filter) noexcept
+	{
+		irecv_device_event_context_t ctx = nullptr;
+		error err = irecv_device_event_subscribe_filtered(&ctx, &filter, [](const irecv_device_event_t* event, void* user_data) {
+			(*static_cast<F*>(user_data))(*event);
+		}, &handler);
+		return { err, device_events(err == IRECV_E_SUCCESS ? ctx : nullptr) };
+	}
+};
+
+/*
+ * co_await-able wait for a device (ecid 0 matches any) to show up, built on
+ * the hotplug events. Devices already attached are reported right away. The
+ * event callback runs with the library's listener lock held, so the
+ * coroutine is handed to the executor, whose post() must not resume it
+ * before returning.
+ */
+template <executor Executor>
+class wait_for_device {
+	static_assert(!std::same_as<Executor, inline_executor>, "wait_for_device cannot resume inside the event callback");
+
+public:
+	explicit wait_for_device(Executor& ex, uint64_t ecid = 0) noexcept : ex_(&ex), ecid_(ecid) {}
+	wait_for_device(const wait_for_device&) = delete;
+	wait_for_device& operator=(const wait_for_device&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		irecv_device_event_context_t ctx = nullptr;
+		handle_ = h;
+		err_ = irecv_device_event_subscribe(&ctx, &wait_for_device::on_event, this);
+		ctx_ = ctx;
+		/* existing devices are reported before subscribing returns; whoever comes second resumes */
+		return err_ == IRECV_E_SUCCESS && !claimed_.exchange(true);
+	}
+
+	result<irecv_mode> await_resume() noexcept
+	{
+		if (ctx_) {
+			irecv_device_event_unsubscribe(ctx_);
+			ctx_ = nullptr;
+		}
+		return { err_, mode_ };
+	}
+
+private:
+	static void on_event(const irecv_device_event_t* event, void* user_data) noexcept
+	{
+		auto* self = static_cast<wait_for_device*>(user_data);
+		if (event->type != IRECV_DEVICE_ADD) {
+			return;
+		}
+		if (self->ecid_ != 0 && (!event->device_info || event->device_info->ecid != self->ecid_)) {
+			return;
+		}
+		if (self->fired_.exchange(true)) {
+			return;
+		}
+		self->mode_ = event->mode;
+		if (self->claimed_.exchange(true)) {
+			self->ex_->post(self->handle_);
+		}
+	}
+
+	Executor* ex_;
+	uint64_t ecid_;
+	irecv_device_event_context_t ctx_ = nullptr;
+	std::coroutine_handle<> handle_;
+	std::atomic<bool> fired_{false};
+	std::atomic<bool> claimed_{false};
+	irecv_mode mode_{};
+	error err_ = IRECV_E_UNKNOWN_ERROR;
+};
+
+class image_store : public detail::handle<irecv_image_store_t, detail::close_store> {
+public:
+	using handle::handle;
+
+	static result<image_store> open(const char* path, uint64_t max_size = 0) noexcept
+	{
+		irecv_image_store_t s = nullptr;
+		error err = irecv_image_store_open(path, max_size, &s);
+		return { err, image_store(err == IRECV_E_SUCCESS ? s : nullptr) };
+	}
+
+	error add(std::span<const std::byte> data, std::span<unsigned char, 32> digest) noexcept
+	{
+		return irecv_image_store_add_buffer(get(), reinterpret_cast<const unsigned char*>(data.data()), static_cast<unsigned long>(data.size()), digest.data());
+	}
+
+	error add_file(const char* filename, std::span<unsigned char, 32> digest) noexcept
+	{
+		return irecv_image_store_add_file(get(), filename, digest.data());
+	}
+
+	error remove(std::span<const unsigned char, 32> digest) noexcept
+	{
+		return irecv_image_store_remove(get(), digest.data());
+	}
+};
+
+class scheduler : public detail::handle<irecv_scheduler_t, detail::close_scheduler> {
+public:
+	using handle::handle;
+
+	static result<scheduler> create(unsigned int max_streams_per_hub, unsigned int max_streams_per_controller) noexcept
+	{
+		irecv_scheduler_t s = nullptr;
+		error err = irecv_scheduler_new(&s, max_streams_per_hub, max_streams_per_controller);
+		return { err, scheduler(err == IRECV_E_SUCCESS ? s : nullptr) };
+	}
+
+	error attach(client& c) noexcept { return irecv_scheduler_attach(get(), c.get()); }
+};
+
+class port_history : public detail::handle<irecv_port_history_t, detail::close_port_history> {
+public:
+	using handle::handle;
+
+	static result<port_history> open(const char* path, unsigned int half_life = 0) noexcept
+	{
+		irecv_port_history_t h = nullptr;
+		error err = irecv_port_history_open(path, half_life, &h);
+		return { err, port_history(err == IRECV_E_SUCCESS ? h : nullptr) };
+	}
+
+	error attach(client& c) noexcept { return irecv_port_history_attach(get(), c.get()); }
+
+	/* fills out best first; the value is the total number of entries, which may exceed out.size() */
+	result<unsigned int> rank(int kind, std::span<irecv_port_history_entry> out) const noexcept
+	{
+		result<unsigned int> r;
+		r.err = irecv_port_history_rank(get(), kind, out.data(), static_cast<unsigned int>(out.size()), &r.value);
+		return r;
+	}
+};
+
+class group : public detail::handle<irecv_group_t, detail::close_group> {
+public:
+	using handle::handle;
+
+	static result<group> create(unsigned int max_workers = 0) noexcept
+	{
+		irecv_group_t g = nullptr;
+		error err = irecv_group_new(&g, max_workers);
+		return { err, group(err == IRECV_E_SUCCESS ? g : nullptr) };
+	}
+
+	/* the client stays owned by the caller and must outlive its membership */
+	error add(client& c) noexcept { return irecv_group_add(get(), c.get()); }
+	error remove(client& c) noexcept { return irecv_group_remove(get(), c.get()); }
+
+	error send(std::span<const std::byte> data, unsigned int options = IRECV_SEND_OPT_NONE) noexcept
+	{
+		return irecv_group_send_buffer(get(), reinterpret_cast<const unsigned char*>(data.data()), static_cast<unsigned long>(data.size()), options);
+	}
+
+	error send_command(const char* command) noexcept { return irecv_group_send_command(get(), command); }
+
+	result<irecv_group_stats> stats() const noexcept
+	{
+		result<irecv_group_stats> r;
+		r.err = irecv_group_get_stats(get(), &r.value);
+		return r;
+	}
+};
+
+/* OpenMetrics text of the library counters */
+inline result<unique_cstr> metrics() noexcept
+{
+	char* text = nullptr;
+	error err = irecv_metrics_render(&text, nullptr);
+	return { err, unique_cstr(text) };
+}
+
+} // namespace irecv
+
+#endif
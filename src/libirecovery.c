@@ -24,13 +24,26 @@
 #endif
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#endif
 
 #include <libimobiledevice-glue/collection.h>
 #include <libimobiledevice-glue/thread.h>
@@ -42,6 +55,9 @@
 #if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
 #define HAVE_LIBUSB_HOTPLUG_API 1
 #endif
+#if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105))
+#define HAVE_LIBUSB_DEV_MEM 1
+#endif
 #else
 #include <CoreFoundation/CoreFoundation.h>
 #include <IOKit/usb/IOUSBLib.h>
@@ -70,6 +86,12 @@
 #endif
 
 #include "libirecovery.h"
+#include "sha2.h"
+
+/* counters, reference counts and flags shared between threads use the __atomic builtins */
+#if !defined(USE_DUMMY) && !defined(__GNUC__) && !defined(__clang__)
+#error "libirecovery needs a compiler with the GCC/Clang __atomic builtins"
+#endif
 
 // Reference: https://stackoverflow.com/a/2390626/1806760
 // Initializer/finalizer sample for MSVC and GCC/Clang.
@@ -98,6 +120,77 @@
         static void f(void)
 #endif
 
+#ifndef USE_DUMMY
+struct irecv_session {
+	irecv_device_event_context_t events;
+	mutex_t mutex;
+	cond_t cond;
+	uint64_t ecid;
+	unsigned int timeout;
+	int detached;
+	int attached;
+};
+
+#define IRECV_METRICS_BUCKETS 11
+
+enum {
+	IRECV_METRICS_OP_UPLOAD = 0,
+	IRECV_METRICS_OP_DOWNLOAD,
+	IRECV_METRICS_OP_COMMAND,
+	IRECV_METRICS_OPS
+};
+
+struct irecv_metrics_histogram {
+	uint64_t buckets[IRECV_METRICS_BUCKETS + 1];
+	uint64_t sum_us;
+	uint64_t count;
+};
+
+struct irecv_client_metrics {
+	uint64_t bytes_sent;
+	uint64_t bytes_received;
+	uint64_t transfers_ok;
+	uint64_t transfers_failed;
+	uint64_t retries;
+	uint64_t stalls;
+	uint64_t timeouts;
+	struct irecv_metrics_histogram latency[IRECV_METRICS_OPS];
+};
+
+struct irecv_progress_state {
+	uint32_t seq;
+	int phase;
+	uint64_t bytes_done;
+	uint64_t bytes_total;
+	uint64_t start_time;
+	uint64_t last_ack_time;
+};
+
+enum {
+	IRECV_STRATEGY_BULK      = (1 << 0), /* uploads over the bulk pipe of a claimed interface */
+	IRECV_STRATEGY_DFU_CLASS = (1 << 1), /* DFU class requests (CLRSTATUS) apply */
+	IRECV_STRATEGY_DFU_CRC   = (1 << 2)  /* the upload loop computes the DFU CRC */
+};
+
+/* how transfers are done in a given mode, bound to the client once at open */
+struct irecv_strategy {
+	const char* name;
+	uint16_t recv_packet_size;
+	unsigned int flags;
+};
+
+/* what a transfer in flight holds of its scheduler; while sched is set,
+ * detaching the client or freeing the scheduler waits for the transfer */
+struct irecv_sched_slot {
+	struct irecv_scheduler *sched;
+	struct irecv_sched_group *hub;
+	struct irecv_sched_group *controller;
+	uint64_t pending;
+	uint64_t flushed;
+	int reserved;
+};
+#endif
+
 struct irecv_client_private {
 	int debug;
 	int usb_config;
@@ -105,8 +198,11 @@ struct irecv_client_private {
 	int usb_alt_interface;
 	unsigned int mode;
 	int isKIS;
+	int readonly;
 	struct irecv_device_info device_info;
 #ifndef USE_DUMMY
+	const struct irecv_strategy *strategy;
+	struct irecv_device_info_blob *device_info_blob;
 #ifndef _WIN32
 #ifndef HAVE_IOKIT
 	libusb_device_handle* handle;
@@ -123,6 +219,24 @@ struct irecv_client_private {
 	irecv_event_cb_t precommand_callback;
 	irecv_event_cb_t postcommand_callback;
 	irecv_event_cb_t disconnected_callback;
+	irecv_event_cb_t console_callback;
+	struct irecv_usb_topology topology;
+	struct irecv_scheduler *scheduler;
+	struct irecv_sched_slot sched_slot;
+	uint64_t bandwidth_limit;
+	uint64_t bandwidth_start;
+	uint64_t bandwidth_bytes;
+	unsigned int upload_digests;
+	struct irecv_upload_result upload_result;
+	struct irecv_digest_ctx *digest;
+	struct irecv_progress_state progress;
+	struct irecv_session *session;
+	struct irecv_client_metrics metrics;
+	int metrics_registered;
+	struct irecv_port_history *port_history;
+	uint64_t history_mark[3];
+	struct irecv_queue *queue;
+	struct irecv_console *console;
 #endif
 };
 
@@ -156,6 +270,25 @@ static libusb_context* libirecovery_context = NULL;
 #endif
 #endif
 
+#ifndef USE_DUMMY
+static uint64_t irecv_time_us(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER counter;
+	if (freq.QuadPart == 0) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)(counter.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(counter.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+#endif
+
 static struct irecv_device irecv_devices[] = {
 	/* iPhone */
 	{ "iPhone1,1",   "m68ap",    0x00, 0x8900, "iPhone 2G" },
@@ -622,9 +755,22 @@ struct collection listeners;
 static mutex_t listener_mutex;
 struct collection devices;
 static mutex_t device_mutex;
+static struct collection metrics_clients;
+static mutex_t metrics_mutex;
+static irecv_timing_cb_t timing_callback = NULL;
+static void* timing_user_data = NULL;
+static uint64_t timing_init_start = 0;
+static uint64_t timing_init_end = 0;
+static unsigned int listener_pid_mask = 0;
+static int device_rescan = 0;
+static mutex_t journal_mutex;
+static struct collection journal_attached;
+static mutex_t sched_attach_mutex;
+static cond_t sched_attach_cond;
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
 static CFRunLoopRef iokit_runloop = NULL;
+static CFRunLoopSourceRef iokit_rescan_source = NULL;
 #else
 static libusb_context* irecv_hotplug_ctx = NULL;
 #endif
@@ -643,6 +789,12 @@ static void _irecv_deinit(void)
 #endif
 	collection_free(&listeners);
 	mutex_destroy(&listener_mutex);
+	collection_free(&journal_attached);
+	mutex_destroy(&journal_mutex);
+	collection_free(&metrics_clients);
+	mutex_destroy(&metrics_mutex);
+	cond_destroy(&sched_attach_cond);
+	mutex_destroy(&sched_attach_mutex);
 #endif
 }
 
@@ -654,6 +806,7 @@ INITIALIZER(_irecv_init)
 		irecv_set_debug_level(libirecovery_debug);
 	}
 #ifndef USE_DUMMY
+	timing_init_start = irecv_time_us();
 #ifndef _WIN32
 #ifndef HAVE_IOKIT
 	libusb_init(&libirecovery_context);
@@ -661,10 +814,119 @@ INITIALIZER(_irecv_init)
 #endif
 	collection_init(&listeners);
 	mutex_init(&listener_mutex);
+	collection_init(&journal_attached);
+	mutex_init(&journal_mutex);
+	collection_init(&metrics_clients);
+	mutex_init(&metrics_mutex);
+	mutex_init(&sched_attach_mutex);
+	cond_init(&sched_attach_cond);
+	timing_init_end = irecv_time_us();
 #endif
 	atexit(_irecv_deinit);
 }
 
+#ifndef USE_DUMMY
+/*
+ * Counters for the metrics exporter. Updates are relaxed atomic adds so
+ * they cost next to nothing when nobody is scraping; everything else is
+ * done by irecv_metrics_render().
+ */
+static const uint64_t irecv_metrics_bounds[IRECV_METRICS_BUCKETS] = {
+	1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 30000000, 60000000
+};
+
+static struct irecv_client_metrics metrics_total;
+static struct irecv_metrics_histogram metrics_dispatch_lag;
+static uint64_t metrics_hotplug_add = 0;
+static uint64_t metrics_hotplug_remove = 0;
+static uint64_t metrics_open_retries = 0;
+static int64_t metrics_registry_size = 0;
+
+static void irecv_metrics_observe(struct irecv_metrics_histogram* h, uint64_t us)
+{
+	unsigned int i = 0;
+	while (i < IRECV_METRICS_BUCKETS && us > irecv_metrics_bounds[i]) {
+		i++;
+	}
+	__atomic_fetch_add(&h->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+}
+
+static void irecv_metrics_operation(irecv_client_t client, int op, uint64_t bytes, uint64_t elapsed_us, irecv_error_t error)
+{
+	struct irecv_client_metrics* m[2] = { &client->metrics, &metrics_total };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (op == IRECV_METRICS_OP_UPLOAD) {
+			__atomic_fetch_add(&m[i]->bytes_sent, bytes, __ATOMIC_RELAXED);
+		} else if (op == IRECV_METRICS_OP_DOWNLOAD) {
+			__atomic_fetch_add(&m[i]->bytes_received, bytes, __ATOMIC_RELAXED);
+		}
+		if (op != IRECV_METRICS_OP_COMMAND) {
+			__atomic_fetch_add((error == IRECV_E_SUCCESS) ? &m[i]->transfers_ok : &m[i]->transfers_failed, 1, __ATOMIC_RELAXED);
+		}
+		irecv_metrics_observe(&m[i]->latency[op], elapsed_us);
+	}
+}
+
+static void irecv_metrics_retry(irecv_client_t client)
+{
+	__atomic_fetch_add(&client->metrics.retries, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&metrics_total.retries, 1, __ATOMIC_RELAXED);
+}
+
+/* classify a failed USB transfer */
+static void irecv_metrics_usb_error(irecv_client_t client, int stalled)
+{
+	if (stalled) {
+		__atomic_fetch_add(&client->metrics.stalls, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&metrics_total.stalls, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&client->metrics.timeouts, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&metrics_total.timeouts, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void irecv_metrics_register(irecv_client_t client)
+{
+	mutex_lock(&metrics_mutex);
+	if (!client->metrics_registered) {
+		collection_add(&metrics_clients, client);
+		client->metrics_registered = 1;
+	}
+	mutex_unlock(&metrics_mutex);
+}
+
+static void irecv_metrics_unregister(irecv_client_t client)
+{
+	mutex_lock(&metrics_mutex);
+	if (client->metrics_registered) {
+		collection_remove(&metrics_clients, client);
+		client->metrics_registered = 0;
+	}
+	mutex_unlock(&metrics_mutex);
+}
+
+static void irecv_timing_report(irecv_client_t client, enum irecv_timing_phase phase, uint64_t start, uint64_t bytes, irecv_error_t error)
+{
+	irecv_timing_cb_t callback = __atomic_load_n(&timing_callback, __ATOMIC_ACQUIRE);
+	struct irecv_timing timing;
+
+	if (!callback) {
+		return;
+	}
+	timing.phase = phase;
+	timing.ecid = (client) ? client->device_info.ecid : 0;
+	timing.start = start;
+	timing.duration = irecv_time_us() - start;
+	timing.bytes = bytes;
+	timing.error = error;
+	callback(&timing, timing_user_data);
+}
+#endif
+
 #ifdef HAVE_IOKIT
 static int iokit_get_string_descriptor_ascii(irecv_client_t client, uint8_t desc_index, unsigned char * buffer, int size)
 {
@@ -751,15 +1013,124 @@ static int irecv_get_string_descriptor_ascii(irecv_client_t client, uint8_t desc
 #endif
 }
 
+/* all variable-length fields of a device info live in one refcounted block */
+struct irecv_device_info_blob {
+	int refcount;
+	size_t size;
+	unsigned char data[];
+};
+
+#define IRECV_NONCE_MAX 128
+
+static struct irecv_device_info_blob* irecv_device_info_blob_retain(struct irecv_device_info_blob* blob)
+{
+	if (blob) {
+		__atomic_add_fetch(&blob->refcount, 1, __ATOMIC_RELAXED);
+	}
+	return blob;
+}
+
+static void irecv_device_info_blob_release(struct irecv_device_info_blob* blob)
+{
+	if (blob && __atomic_sub_fetch(&blob->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(blob);
+	}
+}
+
+static char* irecv_device_info_blob_put_string(unsigned char** p, const char* str)
+{
+	if (!str) {
+		return NULL;
+	}
+	char* res = (char*)*p;
+	size_t len = strlen(str) + 1;
+	memcpy(*p, str, len);
+	*p += len;
+	return res;
+}
+
+static unsigned char* irecv_device_info_blob_put_data(unsigned char** p, const unsigned char* data, unsigned int size)
+{
+	if (!data || size == 0) {
+		return NULL;
+	}
+	unsigned char* res = *p;
+	memcpy(*p, data, size);
+	*p += size;
+	return res;
+}
+
+/* Copy the strings and nonces currently referenced by info (which may point
+ * into the old blob or into caller scratch buffers) into a single new blob
+ * and replace *pblob with it. */
+static void irecv_device_info_pack(struct irecv_device_info* info, struct irecv_device_info_blob** pblob)
+{
+	struct irecv_device_info_blob* old = *pblob;
+	struct irecv_device_info_blob* blob = NULL;
+	size_t size = 0;
+
+	if (info->serial_string) size += strlen(info->serial_string) + 1;
+	if (info->srnm) size += strlen(info->srnm) + 1;
+	if (info->imei) size += strlen(info->imei) + 1;
+	if (info->srtg) size += strlen(info->srtg) + 1;
+	if (info->ap_nonce) size += info->ap_nonce_size;
+	if (info->sep_nonce) size += info->sep_nonce_size;
+
+	if (size > 0) {
+		blob = (struct irecv_device_info_blob*)malloc(sizeof(struct irecv_device_info_blob) + size);
+	}
+	if (blob) {
+		unsigned char* p = blob->data;
+		blob->refcount = 1;
+		blob->size = size;
+		info->serial_string = irecv_device_info_blob_put_string(&p, info->serial_string);
+		info->srnm = irecv_device_info_blob_put_string(&p, info->srnm);
+		info->imei = irecv_device_info_blob_put_string(&p, info->imei);
+		info->srtg = irecv_device_info_blob_put_string(&p, info->srtg);
+		info->ap_nonce = irecv_device_info_blob_put_data(&p, info->ap_nonce, info->ap_nonce_size);
+		info->sep_nonce = irecv_device_info_blob_put_data(&p, info->sep_nonce, info->sep_nonce_size);
+	} else {
+		info->serial_string = NULL;
+		info->srnm = NULL;
+		info->imei = NULL;
+		info->srtg = NULL;
+		info->ap_nonce = NULL;
+		info->ap_nonce_size = 0;
+		info->sep_nonce = NULL;
+		info->sep_nonce_size = 0;
+	}
+
+	*pblob = blob;
+	irecv_device_info_blob_release(old);
+}
+
+/* make dst share the device info of src without copying the variable-length fields */
+static void irecv_device_info_share(struct irecv_device_info* dst, struct irecv_device_info_blob** pdstblob, const struct irecv_device_info* src, struct irecv_device_info_blob* srcblob)
+{
+	struct irecv_device_info_blob* old = *pdstblob;
+	*dst = *src;
+	*pdstblob = irecv_device_info_blob_retain(srcblob);
+	irecv_device_info_blob_release(old);
+}
+
+static void irecv_device_info_clear(struct irecv_device_info* info, struct irecv_device_info_blob** pblob)
+{
+	irecv_device_info_blob_release(*pblob);
+	*pblob = NULL;
+	memset(info, '\0', sizeof(struct irecv_device_info));
+}
+
 static void irecv_load_device_info_from_iboot_string(irecv_client_t client, const char* iboot_string)
 {
 	if (!client || !iboot_string) {
 		return;
 	}
 
+	struct irecv_device_info_blob* old = client->device_info_blob;
+	client->device_info_blob = NULL;
 	memset(&client->device_info, '\0', sizeof(struct irecv_device_info));
 
-	client->device_info.serial_string = strdup(iboot_string);
+	client->device_info.serial_string = (char*)iboot_string;
 
 	char* ptr;
 
@@ -800,47 +1171,52 @@ static void irecv_load_device_info_from_iboot_string(irecv_client_t client, cons
 		sscanf(ptr, "IBFL:%x", &client->device_info.ibfl);
 	}
 
-	char tmp[256];
-	tmp[0] = '\0';
+	char srnm[256];
+	char imei[256];
+	char srtg[256];
+	srnm[0] = '\0';
 	ptr = strstr(iboot_string, "SRNM:[");
 	if (ptr != NULL) {
-		sscanf(ptr, "SRNM:[%s]", tmp);
-		ptr = strrchr(tmp, ']');
+		sscanf(ptr, "SRNM:[%255s]", srnm);
+		ptr = strrchr(srnm, ']');
 		if (ptr != NULL) {
 			*ptr = '\0';
 		}
-		client->device_info.srnm = strdup(tmp);
+		client->device_info.srnm = srnm;
 	}
 
-	tmp[0] = '\0';
+	imei[0] = '\0';
 	ptr = strstr(iboot_string, "IMEI:[");
 	if (ptr != NULL) {
-		sscanf(ptr, "IMEI:[%s]", tmp);
-		ptr = strrchr(tmp, ']');
+		sscanf(ptr, "IMEI:[%255s]", imei);
+		ptr = strrchr(imei, ']');
 		if (ptr != NULL) {
 			*ptr = '\0';
 		}
-		client->device_info.imei = strdup(tmp);
+		client->device_info.imei = imei;
 	}
 
-	tmp[0] = '\0';
+	srtg[0] = '\0';
 	ptr = strstr(iboot_string, "SRTG:[");
 	if (ptr != NULL) {
-		sscanf(ptr, "SRTG:[%s]", tmp);
-		ptr = strrchr(tmp, ']');
+		sscanf(ptr, "SRTG:[%255s]", srtg);
+		ptr = strrchr(srtg, ']');
 		if (ptr != NULL) {
 			*ptr = '\0';
 		}
-		client->device_info.srtg = strdup(tmp);
+		client->device_info.srtg = srtg;
 	}
 
 	client->device_info.pid = client->mode;
 	if (client->isKIS) {
 		client->device_info.pid = KIS_PRODUCT_ID;
 	}
+
+	irecv_device_info_pack(&client->device_info, &client->device_info_blob);
+	irecv_device_info_blob_release(old);
 }
 
-static void irecv_copy_nonce_with_tag_from_buffer(const char* tag, unsigned char** nonce, unsigned int* nonce_size, const char *buf)
+static int irecv_copy_nonce_with_tag_from_buffer(const char* tag, unsigned char* nonce, unsigned int* nonce_size, const char *buf)
 {
 	int taglen = strlen(tag);
 	int nlen = 0;
@@ -876,19 +1252,19 @@ static void irecv_copy_nonce_with_tag_from_buffer(const char* tag, unsigned char
 
 	if (nlen == 0) {
 		debug("%s: WARNING: couldn't find tag %s in string %s\n", __func__, tag, buf);
-		return;
+		return 0;
 	}
 
-	unsigned char *nn = malloc(nlen);
-	if (!nn) {
-		return;
+	if (nlen > IRECV_NONCE_MAX) {
+		debug("%s: ERROR: nonce for tag %s too long (%d bytes)\n", __func__, tag, nlen);
+		return 0;
 	}
 
 	int i = 0;
 	for (i = 0; i < nlen; i++) {
 		int val = 0;
 		if (sscanf(nonce_string+(i*2), "%02X", &val) == 1) {
-			nn[i] = (unsigned char)val;
+			nonce[i] = (unsigned char)val;
 		} else {
 			debug("%s: ERROR: unexpected data in nonce result (%2s)\n", __func__, nonce_string+(i*2));
 			break;
@@ -897,26 +1273,46 @@ static void irecv_copy_nonce_with_tag_from_buffer(const char* tag, unsigned char
 
 	if (i != nlen) {
 		debug("%s: ERROR: unable to parse nonce\n", __func__);
-		free(nn);
-		return;
+		return 0;
 	}
 
-	*nonce = nn;
 	*nonce_size = nlen;
+	return 1;
+}
+
+static void irecv_load_nonces_from_buffer(irecv_client_t client, const char *buf)
+{
+	unsigned char ap_nonce[IRECV_NONCE_MAX];
+	unsigned char sep_nonce[IRECV_NONCE_MAX];
+	unsigned int ap_nonce_size = 0;
+	unsigned int sep_nonce_size = 0;
+
+	client->device_info.ap_nonce = NULL;
+	client->device_info.ap_nonce_size = 0;
+	client->device_info.sep_nonce = NULL;
+	client->device_info.sep_nonce_size = 0;
+
+	if (irecv_copy_nonce_with_tag_from_buffer("NONC", ap_nonce, &ap_nonce_size, buf)) {
+		client->device_info.ap_nonce = ap_nonce;
+		client->device_info.ap_nonce_size = ap_nonce_size;
+	}
+	if (irecv_copy_nonce_with_tag_from_buffer("SNON", sep_nonce, &sep_nonce_size, buf)) {
+		client->device_info.sep_nonce = sep_nonce;
+		client->device_info.sep_nonce_size = sep_nonce_size;
+	}
+
+	irecv_device_info_pack(&client->device_info, &client->device_info_blob);
 }
 
-static void irecv_copy_nonce_with_tag(irecv_client_t client, const char* tag, unsigned char** nonce, unsigned int* nonce_size)
+static void irecv_load_nonces(irecv_client_t client)
 {
-	if (!client || !tag) {
+	if (!client) {
 		return;
 	}
 
 	char buf[256];
 	int len = 0;
 
-	*nonce = NULL;
-	*nonce_size = 0;
-
 	memset(buf, 0, 256);
 	len = irecv_get_string_descriptor_ascii(client, 1, (unsigned char*) buf, 255);
 	if (len < 0) {
@@ -926,7 +1322,7 @@ static void irecv_copy_nonce_with_tag(irecv_client_t client, const char* tag, un
 
 	buf[len] = 0;
 
-	irecv_copy_nonce_with_tag_from_buffer(tag,nonce,nonce_size,buf);
+	irecv_load_nonces_from_buffer(client, buf);
 }
 
 #ifndef _WIN32
@@ -1093,8 +1489,7 @@ static irecv_error_t irecv_kis_load_device_info(irecv_client_t client)
 		debug("Manufacturer: %s\n", kisInfo.manufacturer);
 		debug("Product: %s\n", kisInfo.product);
 		debug("Nonces: %s\n", kisInfo.nonces);
-		irecv_copy_nonce_with_tag_from_buffer("NONC", &client->device_info.ap_nonce, &client->device_info.ap_nonce_size, kisInfo.nonces);
-		irecv_copy_nonce_with_tag_from_buffer("SNON", &client->device_info.sep_nonce, &client->device_info.sep_nonce_size, kisInfo.nonces);
+		irecv_load_nonces_from_buffer(client, kisInfo.nonces);
 		debug("VID: 0x%04x\n", kisInfo.vid);
 		debug("PID: 0x%04x\n", kisInfo.pid);
 	}
@@ -1140,8 +1535,7 @@ static irecv_error_t irecv_kis_load_device_info(irecv_client_t client)
 		return IRECV_E_INVALID_INPUT;
 	debug("Nonces: %s\n", buf);
 
-	irecv_copy_nonce_with_tag_from_buffer("NONC", &client->device_info.ap_nonce, &client->device_info.ap_nonce_size, buf);
-	irecv_copy_nonce_with_tag_from_buffer("SNON", &client->device_info.sep_nonce, &client->device_info.sep_nonce_size, buf);
+	irecv_load_nonces_from_buffer(client, buf);
 
 	debug("VID: 0x%04x\n", di.deviceDescriptor.idVendor);
 	debug("PID: 0x%04x\n", di.deviceDescriptor.idProduct);
@@ -1314,9 +1708,30 @@ static void iokit_cfdictionary_set_short(CFMutableDictionaryRef dict, const void
 }
 #endif
 
+static irecv_error_t irecv_session_reattach(irecv_client_t client);
+
+static void irecv_session_mark_detached(struct irecv_session *session)
+{
+	mutex_lock(&session->mutex);
+	session->attached = 0;
+	__atomic_store_n(&session->detached, 1, __ATOMIC_RELEASE);
+	mutex_unlock(&session->mutex);
+}
+
 static int check_context(irecv_client_t client)
 {
-	if (client == NULL || client->handle == NULL) {
+	if (client == NULL) {
+		return IRECV_E_NO_DEVICE;
+	}
+
+	if (client->session && __atomic_load_n(&client->session->detached, __ATOMIC_ACQUIRE)) {
+		/* the device went away, wait for it to come back before failing */
+		if (irecv_session_reattach(client) != IRECV_E_SUCCESS) {
+			return IRECV_E_NO_DEVICE;
+		}
+	}
+
+	if (client->handle == NULL) {
 		return IRECV_E_NO_DEVICE;
 	}
 
@@ -1364,11 +1779,19 @@ int irecv_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, u
 #ifdef USE_DUMMY
 	return IRECV_E_UNSUPPORTED;
 #else
+	/* read-only clients may only issue device-to-host requests */
+	if (client->readonly && !(bm_request_type & 0x80)) {
+		return IRECV_E_UNSUPPORTED;
+	}
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
 	return iokit_usb_control_transfer(client, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
 #else
-	return libusb_control_transfer(client->handle, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+	int ret = libusb_control_transfer(client->handle, bm_request_type, b_request, w_value, w_index, data, w_length, timeout);
+	if (ret == LIBUSB_ERROR_PIPE || ret == LIBUSB_ERROR_TIMEOUT) {
+		irecv_metrics_usb_error(client, ret == LIBUSB_ERROR_PIPE);
+	}
+	return ret;
 #endif
 #else
 	DWORD count = 0;
@@ -1499,12 +1922,24 @@ int irecv_usb_bulk_transfer(irecv_client_t client,
 #else
 	int ret;
 
+	if (client->readonly) {
+		return IRECV_E_UNSUPPORTED;
+	}
+
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
-	return iokit_usb_bulk_transfer(client, endpoint, data, length, transferred, timeout);
+	ret = iokit_usb_bulk_transfer(client, endpoint, data, length, transferred, timeout);
+	if (ret == IRECV_E_PIPE) {
+		irecv_metrics_usb_error(client, 1);
+	}
 #else
 	ret = libusb_bulk_transfer(client->handle, endpoint, data, length, transferred, timeout);
 	if (ret < 0) {
+		/* bulk reads are console polls, which end with a timeout once the
+		 * device has nothing more to say; only count those on writes */
+		if (ret == LIBUSB_ERROR_PIPE || (ret == LIBUSB_ERROR_TIMEOUT && !(endpoint & 0x80))) {
+			irecv_metrics_usb_error(client, ret == LIBUSB_ERROR_PIPE);
+		}
 		libusb_clear_halt(client->handle, endpoint);
 	}
 #endif
@@ -1523,7 +1958,8 @@ int irecv_usb_bulk_transfer(irecv_client_t client,
 
 #ifndef USE_DUMMY
 #ifdef HAVE_IOKIT
-static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_t service)
+/* with readonly set the device is not opened, so other clients keep their access to it */
+static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_t service, int readonly)
 {
 	IOReturn result;
 	irecv_client_t client;
@@ -1560,6 +1996,7 @@ static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_
 	result = (*plug)->QueryInterface(plug, CFUUIDGetUUIDBytes(kIOUSBDeviceInterfaceID320), (LPVOID *)&(client->handle));
 	IODestroyPlugInInterface(plug);
 	if (result != kIOReturnSuccess) {
+		irecv_device_info_clear(&client->device_info, &client->device_info_blob);
 		free(client);
 		return IRECV_E_UNKNOWN_ERROR;
 	}
@@ -1569,9 +2006,16 @@ static irecv_error_t iokit_usb_open_service(irecv_client_t *pclient, io_service_
 	client->mode = mode;
 	debug("opening device %04x:%04x @ %#010x...\n", kAppleVendorID, client->mode, locationID);
 
+	if (readonly) {
+		client->readonly = 1;
+		*pclient = client;
+		return IRECV_E_SUCCESS;
+	}
+
 	result = (*client->handle)->USBDeviceOpenSeize(client->handle);
 	if (result != kIOReturnSuccess) {
 		(*client->handle)->Release(client->handle);
+		irecv_device_info_clear(&client->device_info, &client->device_info_blob);
 		free(client);
 		return IRECV_E_UNABLE_TO_CONNECT;
 	}
@@ -1597,13 +2041,15 @@ static io_iterator_t iokit_usb_get_iterator_for_pid(UInt16 pid)
 	return iterator;
 }
 
-static irecv_error_t iokit_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
+static irecv_error_t iokit_open_with_ecid(irecv_client_t* pclient, uint64_t ecid, int readonly)
 {
 	io_service_t service, ret_service;
 	io_iterator_t iterator;
 	CFStringRef usbSerial = NULL;
 	CFStringRef ecidString = NULL;
 	CFRange range;
+	uint64_t start = irecv_time_us();
+	irecv_error_t error;
 
 	UInt16 wtf_pids[] = { IRECV_K_WTF_MODE, 0};
 	UInt16 all_pids[] = { IRECV_K_WTF_MODE, IRECV_K_DFU_MODE, IRECV_K_PORT_DFU_MODE, IRECV_K_RECOVERY_MODE_1, IRECV_K_RECOVERY_MODE_2, IRECV_K_RECOVERY_MODE_3, IRECV_K_RECOVERY_MODE_4, KIS_PRODUCT_ID, 0 };
@@ -1642,9 +2088,14 @@ static irecv_error_t iokit_open_with_ecid(irecv_client_t* pclient, uint64_t ecid
 				}
 
 				if (pids[i] == KIS_PRODUCT_ID) {
+					if (readonly) {
+						/* the ECID is only available through KIS requests */
+						IOObjectRelease(service);
+						continue;
+					}
 					// In KIS Mode, we have to open the device in order to get
 					// it's ECID
-					irecv_error_t err = iokit_usb_open_service(pclient, service);
+					irecv_error_t err = iokit_usb_open_service(pclient, service, 0);
 					if (err != IRECV_E_SUCCESS) {
 						debug("%s: failed to open KIS device\n", __func__);
 						continue;
@@ -1685,7 +2136,12 @@ static irecv_error_t iokit_open_with_ecid(irecv_client_t* pclient, uint64_t ecid
 	if (ret_service == IO_OBJECT_NULL)
 		return IRECV_E_UNABLE_TO_CONNECT;
 
-	return iokit_usb_open_service(pclient, ret_service);
+	irecv_timing_report(NULL, IRECV_TIMING_ENUMERATE, start, 0, IRECV_E_SUCCESS);
+	start = irecv_time_us();
+	error = iokit_usb_open_service(pclient, ret_service, readonly);
+	irecv_timing_report(*pclient, IRECV_TIMING_OPEN, start, 0, error);
+
+	return error;
 }
 #endif
 
@@ -1706,9 +2162,11 @@ static irecv_error_t libusb_usb_open_handle_with_descriptor_and_ecid(irecv_clien
 
 	if (client->mode != KIS_PRODUCT_ID) {
 		char serial_str[256];
+		uint64_t start = irecv_time_us();
 		memset(serial_str, 0, 256);
 		irecv_get_string_descriptor_ascii(client, usb_descriptor->iSerialNumber, (unsigned char*)serial_str, 255);
 		irecv_load_device_info_from_iboot_string(client, serial_str);
+		irecv_timing_report(client, IRECV_TIMING_DESCRIPTORS, start, 0, IRECV_E_SUCCESS);
 	}
 
 	if (ecid != 0 && client->mode != KIS_PRODUCT_ID) {
@@ -1730,6 +2188,7 @@ static irecv_error_t libusb_open_with_ecid(irecv_client_t* pclient, uint64_t eci
 	struct libusb_device* usb_device = NULL;
 	struct libusb_device** usb_device_list = NULL;
 	struct libusb_device_descriptor usb_descriptor;
+	uint64_t start = irecv_time_us();
 
 	*pclient = NULL;
 	int usb_device_count = libusb_get_device_list(libirecovery_context, &usb_device_list);
@@ -1762,9 +2221,12 @@ static irecv_error_t libusb_open_with_ecid(irecv_client_t* pclient, uint64_t eci
 				}
 
 				debug("opening device %04x:%04x...\n", usb_descriptor.idVendor, usb_descriptor.idProduct);
+				irecv_timing_report(NULL, IRECV_TIMING_ENUMERATE, start, 0, IRECV_E_SUCCESS);
 
 				struct libusb_device_handle* usb_handle = NULL;
+				start = irecv_time_us();
 				int libusb_error = libusb_open(usb_device, &usb_handle);
+				irecv_timing_report(NULL, IRECV_TIMING_OPEN, start, 0, (libusb_error == 0) ? IRECV_E_SUCCESS : IRECV_E_UNABLE_TO_CONNECT);
 				if (usb_handle == NULL || libusb_error != 0) {
 					debug("%s: can't connect to device: %s\n", __func__, libusb_error_name(libusb_error));
 
@@ -1780,6 +2242,7 @@ static irecv_error_t libusb_open_with_ecid(irecv_client_t* pclient, uint64_t eci
 				if (ret == IRECV_E_SUCCESS) {
 					break;
 				}
+				start = irecv_time_us();
 			}
 		}
 	}
@@ -1790,11 +2253,51 @@ static irecv_error_t libusb_open_with_ecid(irecv_client_t* pclient, uint64_t eci
 #endif
 #endif
 
-irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
+#ifndef USE_DUMMY
+static void irecv_load_usb_topology(irecv_client_t client)
 {
-#ifdef USE_DUMMY
-	return IRECV_E_UNSUPPORTED;
+	memset(&client->topology, '\0', sizeof(struct irecv_usb_topology));
+#ifndef _WIN32
+#ifdef HAVE_IOKIT
+	UInt32 locationID = 0;
+	USBDeviceAddress address = 0;
+	int i;
+
+	if ((*client->handle)->GetLocationID(client->handle, &locationID) != kIOReturnSuccess) {
+		return;
+	}
+	if ((*client->handle)->GetDeviceAddress(client->handle, &address) == kIOReturnSuccess) {
+		client->topology.address = (uint8_t)address;
+	}
+	/* locationID is 0xBBPPPPPP: bus number followed by one nibble per hub port */
+	client->topology.bus = (locationID >> 24) & 0xFF;
+	for (i = 0; i < 6; i++) {
+		uint8_t port = (locationID >> (20 - (i * 4))) & 0xF;
+		if (port == 0) {
+			break;
+		}
+		client->topology.port_path[client->topology.port_depth++] = port;
+	}
 #else
+	libusb_device *device = libusb_get_device(client->handle);
+	client->topology.bus = libusb_get_bus_number(device);
+	client->topology.address = libusb_get_device_address(device);
+#if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
+	int depth = libusb_get_port_numbers(device, client->topology.port_path, IRECV_USB_MAX_PORT_DEPTH);
+	if (depth > 0) {
+		client->topology.port_depth = (uint8_t)depth;
+	}
+#endif
+#endif
+#endif
+}
+#endif
+
+#ifndef USE_DUMMY
+static void irecv_strategy_bind(irecv_client_t client);
+
+static irecv_error_t irecv_open_with_ecid_mode(irecv_client_t* pclient, uint64_t ecid, int readonly)
+{
 	irecv_error_t error = IRECV_E_UNABLE_TO_CONNECT;
 
 	if (libirecovery_debug) {
@@ -1802,12 +2305,14 @@ irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
 	}
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
-	error = iokit_open_with_ecid(pclient, ecid);
+	error = iokit_open_with_ecid(pclient, ecid, readonly);
 #else
 	error = libusb_open_with_ecid(pclient, ecid);
 #endif
 #else
+	uint64_t start = irecv_time_us();
 	error = win32_open_with_ecid(pclient, ecid);
+	irecv_timing_report(*pclient, IRECV_TIMING_OPEN, start, 0, error);
 #endif
 	irecv_client_t client = *pclient;
 	if (error != IRECV_E_SUCCESS) {
@@ -1815,8 +2320,32 @@ irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
 		return error;
 	}
 
+	irecv_load_usb_topology(client);
+	irecv_strategy_bind(client);
+
+	if (readonly) {
+		/* descriptors only: leave the configuration and interfaces to whoever is using the device */
+		client->readonly = 1;
+		if (client->mode == KIS_PRODUCT_ID) {
+			/* device info needs KIS requests on a claimed interface */
+			if (ecid != 0) {
+				irecv_close(client);
+				*pclient = NULL;
+				return IRECV_E_NO_DEVICE;
+			}
+		} else {
+			uint64_t nonce_start = irecv_time_us();
+			irecv_load_nonces(client);
+			irecv_timing_report(client, IRECV_TIMING_NONCES, nonce_start, 0, IRECV_E_SUCCESS);
+		}
+		irecv_metrics_register(client);
+		return IRECV_E_SUCCESS;
+	}
+
+	uint64_t configure_start = irecv_time_us();
 	error = irecv_usb_set_configuration(client, 1);
 	if (error != IRECV_E_SUCCESS) {
+		irecv_timing_report(client, IRECV_TIMING_CONFIGURE, configure_start, 0, error);
 		debug("Failed to set configuration, error %d\n", error);
 		irecv_close(client);
 		return error;
@@ -1831,6 +2360,7 @@ irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
 		}
 	}
 
+	irecv_timing_report(client, IRECV_TIMING_CONFIGURE, configure_start, 0, error);
 	if (error != IRECV_E_SUCCESS) {
 		debug("Failed to set interface, error %d\n", error);
 		irecv_close(client);
@@ -1838,14 +2368,18 @@ irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
 	}
 
 	if (client->mode == KIS_PRODUCT_ID) {
+		uint64_t kis_start = irecv_time_us();
 		error = irecv_kis_init(client);
+		irecv_timing_report(client, IRECV_TIMING_KIS_INIT, kis_start, 0, error);
 		if (error != IRECV_E_SUCCESS) {
 			debug("irecv_kis_init failed, error %d\n", error);
 			irecv_close(client);
 			return error;
 		}
 
+		kis_start = irecv_time_us();
 		error = irecv_kis_load_device_info(client);
+		irecv_timing_report(client, IRECV_TIMING_DESCRIPTORS, kis_start, 0, error);
 		if (error != IRECV_E_SUCCESS) {
 			debug("irecv_kis_load_device_info failed, error %d\n", error);
 			irecv_close(client);
@@ -1856,12 +2390,15 @@ irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
 			return IRECV_E_NO_DEVICE; //wrong device
 		}
 		debug("found device with ECID %016" PRIx64 "\n", (uint64_t)client->device_info.ecid);
+		irecv_strategy_bind(client);
 	} else {
-		irecv_copy_nonce_with_tag(client, "NONC", &client->device_info.ap_nonce, &client->device_info.ap_nonce_size);
-		irecv_copy_nonce_with_tag(client, "SNON", &client->device_info.sep_nonce, &client->device_info.sep_nonce_size);
+		uint64_t nonce_start = irecv_time_us();
+		irecv_load_nonces(client);
+		irecv_timing_report(client, IRECV_TIMING_NONCES, nonce_start, 0, IRECV_E_SUCCESS);
 	}
 
 	if (error == IRECV_E_SUCCESS) {
+		irecv_metrics_register(*pclient);
 		if ((*pclient)->connected_callback != NULL) {
 			irecv_event_t event;
 			event.size = 0;
@@ -1872,6 +2409,24 @@ irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
 		}
 	}
 	return error;
+}
+#endif
+
+irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, uint64_t ecid)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	return irecv_open_with_ecid_mode(pclient, ecid, 0);
+#endif
+}
+
+irecv_error_t irecv_open_with_ecid_readonly(irecv_client_t* pclient, uint64_t ecid)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	return irecv_open_with_ecid_mode(pclient, ecid, 1);
 #endif
 }
 
@@ -1883,6 +2438,9 @@ irecv_error_t irecv_usb_set_configuration(irecv_client_t client, int configurati
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
+	if (client->readonly)
+		return IRECV_E_UNSUPPORTED;
+
 #ifndef _WIN32
 	debug("Setting to configuration %d\n", configuration);
 
@@ -2001,6 +2559,9 @@ irecv_error_t irecv_usb_set_interface(irecv_client_t client, int usb_interface,
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
+	if (client->readonly)
+		return IRECV_E_UNSUPPORTED;
+
 	debug("Setting to interface %d:%d\n", usb_interface, usb_alt_interface);
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
@@ -2040,6 +2601,10 @@ irecv_error_t irecv_reset(irecv_client_t client)
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
+	if (client->readonly)
+		return IRECV_E_UNSUPPORTED;
+
+	uint64_t start = irecv_time_us();
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
 	IOReturn result;
@@ -2061,6 +2626,12 @@ irecv_error_t irecv_reset(irecv_client_t client)
 	DWORD count;
 	DeviceIoControl(client->handle, 0x22000C, NULL, 0, NULL, 0, &count, NULL);
 #endif
+	irecv_timing_report(client, IRECV_TIMING_RESET, start, 0, IRECV_E_SUCCESS);
+
+	if (client->session) {
+		/* the device re-enumerates, the next operation re-binds to it */
+		irecv_session_mark_detached(client->session);
+	}
 
 	return IRECV_E_SUCCESS;
 #endif
@@ -2080,6 +2651,7 @@ irecv_error_t irecv_open_with_ecid_and_attempts(irecv_client_t* pclient, uint64_
 		}
 		if (irecv_open_with_ecid(pclient, ecid) != IRECV_E_SUCCESS) {
 			debug("Connection failed. Waiting 1 sec before retry.\n");
+			__atomic_fetch_add(&metrics_open_retries, 1, __ATOMIC_RELAXED);
 			sleep(1);
 		} else {
 			return IRECV_E_SUCCESS;
@@ -2120,6 +2692,10 @@ irecv_error_t irecv_event_subscribe(irecv_client_t client, irecv_event_type type
 		client->disconnected_callback = callback;
 		break;
 
+	case IRECV_CONSOLE:
+		client->console_callback = callback;
+		break;
+
 	default:
 		return IRECV_E_UNKNOWN_ERROR;
 	}
@@ -2158,6 +2734,10 @@ irecv_error_t irecv_event_unsubscribe(irecv_client_t client, irecv_event_type ty
 		client->disconnected_callback = NULL;
 		break;
 
+	case IRECV_CONSOLE:
+		client->console_callback = NULL;
+		break;
+
 	default:
 		return IRECV_E_UNKNOWN_ERROR;
 	}
@@ -2167,47 +2747,264 @@ irecv_error_t irecv_event_unsubscribe(irecv_client_t client, irecv_event_type ty
 }
 
 #ifndef USE_DUMMY
+/*
+ * Subscription filters. The mode and PID parts of every filter are folded
+ * into a mask with one bit per product ID we handle, and the union of all
+ * masks decides whether an arriving device is probed (opened, serial read)
+ * at all. ECID and chip ID are only known after probing, so they only
+ * select which listeners get the event.
+ */
+static const uint16_t irecv_filter_pids[] = { IRECV_K_WTF_MODE, IRECV_K_DFU_MODE, IRECV_K_PORT_DFU_MODE, IRECV_K_RECOVERY_MODE_1, IRECV_K_RECOVERY_MODE_2, IRECV_K_RECOVERY_MODE_3, IRECV_K_RECOVERY_MODE_4, KIS_PRODUCT_ID };
+#define IRECV_FILTER_PID_COUNT (sizeof(irecv_filter_pids) / sizeof(irecv_filter_pids[0]))
+
 struct irecv_device_event_context {
 	irecv_device_event_cb_t callback;
 	void *user_data;
+	unsigned int pid_mask;
+	uint64_t *ecids;
+	unsigned int num_ecids;
+	unsigned int cpid;
 };
 
+/* devices nobody wanted when they arrived are kept as unprobed entries so they can be probed later */
 struct irecv_usb_device_info {
 	struct irecv_device_info device_info;
+	struct irecv_device_info_blob *device_info_blob;
 	enum irecv_mode mode;
 	uint32_t location;
 	int alive;
+	int probed;
+	uint16_t pid;
+	uint64_t seq;
+	uint64_t timestamp;
+#if !defined(_WIN32) && !defined(HAVE_IOKIT)
+	libusb_device *device;
+#endif
 };
 
-#ifdef _WIN32
-struct irecv_win_dev_ctx {
-	PSP_DEVICE_INTERFACE_DETAIL_DATA_A details;
-	uint32_t location;
-};
-#else
-#ifdef HAVE_IOKIT
-struct irecv_iokit_dev_ctx {
-	io_service_t device;
-	IOUSBDeviceInterface **dev;
-};
-#endif
-#endif
+static unsigned int irecv_filter_pid_bit(uint16_t pid)
+{
+	unsigned int i;
+	for (i = 0; i < IRECV_FILTER_PID_COUNT; i++) {
+		if (irecv_filter_pids[i] == pid) {
+			return 1u << i;
+		}
+	}
+	return 0;
+}
 
-static int _irecv_is_recovery_device(void *device)
+static unsigned int irecv_filter_mode_of(uint16_t pid)
 {
-	uint16_t vendor_id = 0;
-	uint16_t product_id = 0;
-#ifdef _WIN32
-	const char *path = (const char*)device;
-	unsigned int vendor = 0;
-	unsigned int product = 0;
-	if (sscanf(path, "\\usb#vid_%04x&pid_%04x#", &vendor, &product) != 2) {
-		return 0;
+	switch (pid) {
+		case IRECV_K_RECOVERY_MODE_1:
+		case IRECV_K_RECOVERY_MODE_2:
+		case IRECV_K_RECOVERY_MODE_3:
+		case IRECV_K_RECOVERY_MODE_4:
+			return IRECV_FILTER_RECOVERY;
+		case IRECV_K_DFU_MODE:
+		case IRECV_K_PORT_DFU_MODE:
+			return IRECV_FILTER_DFU;
+		case IRECV_K_WTF_MODE:
+			return IRECV_FILTER_WTF;
+		case KIS_PRODUCT_ID:
+			return IRECV_FILTER_KIS;
+		default:
+			return 0;
 	}
-	vendor_id = (uint16_t)vendor;
-	product_id = (uint16_t)product;
-#else
-#ifdef HAVE_IOKIT
+}
+
+static unsigned int irecv_filter_pid_mask(const struct irecv_device_event_filter *filter)
+{
+	unsigned int mask = 0;
+	unsigned int i, j;
+
+	for (i = 0; i < IRECV_FILTER_PID_COUNT; i++) {
+		uint16_t pid = irecv_filter_pids[i];
+		if (filter && filter->modes && !(filter->modes & irecv_filter_mode_of(pid))) {
+			continue;
+		}
+		if (filter && filter->num_pids > 0) {
+			for (j = 0; j < filter->num_pids; j++) {
+				if (filter->pids[j] == pid) {
+					break;
+				}
+			}
+			if (j == filter->num_pids) {
+				continue;
+			}
+		}
+		mask |= 1u << i;
+	}
+
+	return mask;
+}
+
+/* recompute the union of all filters; needs listener_mutex */
+static void irecv_listeners_update_mask(void)
+{
+	unsigned int mask = 0;
+
+	FOREACH(struct irecv_device_event_context* context, &listeners) {
+		mask |= context->pid_mask;
+	} ENDFOREACH
+	unsigned int old = __atomic_exchange_n(&listener_pid_mask, mask, __ATOMIC_ACQ_REL);
+	if (mask & ~old) {
+		/* devices skipped so far may be wanted now */
+		__atomic_store_n(&device_rescan, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Device event journal. Every ADD/REMOVE the event thread delivers is also
+ * recorded in a ring with a sequence number and a timestamp, so consumers
+ * can catch up with irecv_device_events_since() instead of re-enumerating.
+ * Records share the refcounted device info blob of the device entry. The
+ * devices attached at the moment are tracked as well; a cursor that fell
+ * out of the ring is answered with them.
+ */
+#define IRECV_JOURNAL_SIZE 1024
+
+struct irecv_journal_record {
+	uint64_t seq;
+	uint64_t timestamp;
+	irecv_device_event_type type;
+	enum irecv_mode mode;
+	uint32_t location;
+	struct irecv_device_info device_info;
+	struct irecv_device_info_blob *device_info_blob;
+};
+
+static struct irecv_journal_record journal[IRECV_JOURNAL_SIZE];
+static uint64_t journal_seq = 0;
+static uint64_t journal_first = 1;
+
+struct irecv_journal_batch {
+	unsigned int count;
+	struct irecv_device_info_blob **blobs;
+	struct irecv_device_journal_entry entries[];
+};
+
+static void irecv_journal_record(irecv_device_event_type type, struct irecv_usb_device_info *devinfo)
+{
+	uint64_t now = irecv_time_us();
+
+	mutex_lock(&journal_mutex);
+	uint64_t seq = ++journal_seq;
+	struct irecv_journal_record *rec = &journal[seq % IRECV_JOURNAL_SIZE];
+	if (seq - journal_first >= IRECV_JOURNAL_SIZE) {
+		journal_first = seq - IRECV_JOURNAL_SIZE + 1;
+	}
+	rec->seq = seq;
+	rec->timestamp = now;
+	rec->type = type;
+	rec->mode = devinfo->mode;
+	rec->location = devinfo->location;
+	irecv_device_info_share(&rec->device_info, &rec->device_info_blob, &devinfo->device_info, devinfo->device_info_blob);
+
+	if (type == IRECV_DEVICE_ADD) {
+		struct irecv_journal_record *att = (struct irecv_journal_record*)calloc(1, sizeof(struct irecv_journal_record));
+		if (att) {
+			*att = *rec;
+			att->device_info_blob = irecv_device_info_blob_retain(rec->device_info_blob);
+			collection_add(&journal_attached, att);
+		}
+	} else {
+		FOREACH(struct irecv_journal_record *att, &journal_attached) {
+			if (att->location == devinfo->location) {
+				collection_remove(&journal_attached, att);
+				irecv_device_info_blob_release(att->device_info_blob);
+				free(att);
+				break;
+			}
+		} ENDFOREACH
+	}
+	mutex_unlock(&journal_mutex);
+
+	devinfo->seq = seq;
+	devinfo->timestamp = now;
+}
+
+/* the event thread is gone and nothing is known about attached devices anymore */
+static void irecv_journal_reset(void)
+{
+	uint64_t seq;
+
+	mutex_lock(&journal_mutex);
+	for (seq = journal_first; seq <= journal_seq; seq++) {
+		struct irecv_journal_record *rec = &journal[seq % IRECV_JOURNAL_SIZE];
+		irecv_device_info_clear(&rec->device_info, &rec->device_info_blob);
+	}
+	journal_first = journal_seq + 1;
+	FOREACH(struct irecv_journal_record *att, &journal_attached) {
+		collection_remove(&journal_attached, att);
+		irecv_device_info_blob_release(att->device_info_blob);
+		free(att);
+	} ENDFOREACH
+	mutex_unlock(&journal_mutex);
+}
+
+static void irecv_journal_export(struct irecv_journal_batch *batch, const struct irecv_journal_record *rec, irecv_device_event_type type)
+{
+	struct irecv_device_journal_entry *entry = &batch->entries[batch->count];
+	entry->seq = rec->seq;
+	entry->timestamp = rec->timestamp;
+	entry->type = type;
+	entry->mode = rec->mode;
+	entry->device_info = rec->device_info;
+	batch->blobs[batch->count] = irecv_device_info_blob_retain(rec->device_info_blob);
+	batch->count++;
+}
+
+static int irecv_listener_accepts(const struct irecv_device_event_context *context, const struct irecv_usb_device_info *devinfo)
+{
+	unsigned int i;
+
+	if (!(context->pid_mask & irecv_filter_pid_bit(devinfo->pid))) {
+		return 0;
+	}
+	if (context->cpid != 0 && devinfo->device_info.cpid != context->cpid) {
+		return 0;
+	}
+	if (context->num_ecids == 0) {
+		return 1;
+	}
+	for (i = 0; i < context->num_ecids; i++) {
+		if (devinfo->device_info.ecid == context->ecids[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#ifdef _WIN32
+struct irecv_win_dev_ctx {
+	PSP_DEVICE_INTERFACE_DETAIL_DATA_A details;
+	uint32_t location;
+};
+#else
+#ifdef HAVE_IOKIT
+struct irecv_iokit_dev_ctx {
+	io_service_t device;
+	IOUSBDeviceInterface **dev;
+};
+#endif
+#endif
+
+static int _irecv_is_recovery_device(void *device)
+{
+	uint16_t vendor_id = 0;
+	uint16_t product_id = 0;
+#ifdef _WIN32
+	const char *path = (const char*)device;
+	unsigned int vendor = 0;
+	unsigned int product = 0;
+	if (sscanf(path, "\\usb#vid_%04x&pid_%04x#", &vendor, &product) != 2) {
+		return 0;
+	}
+	vendor_id = (uint16_t)vendor;
+	product_id = (uint16_t)product;
+#else
+#ifdef HAVE_IOKIT
 	kern_return_t kr;
 	IOUSBDeviceInterface **dev = device;
 	kr = (*dev)->GetDeviceVendor(dev, &vendor_id);
@@ -2255,6 +3052,41 @@ static int _irecv_is_recovery_device(void *device)
 	return 1;
 }
 
+/*
+ * Decide whether the device at location is worth probing. Devices nobody
+ * subscribed to are recorded without being opened; on libusb the device is
+ * referenced so it can be probed when a subscription asks for it later.
+ */
+static int _irecv_should_probe(uint32_t location, uint16_t product_id, void *device)
+{
+	FOREACH(struct irecv_usb_device_info *devinfo, &devices) {
+		if (devinfo->location == location) {
+			/* already known, e.g. seen again by a rescan */
+			return 0;
+		}
+	} ENDFOREACH
+
+	if (__atomic_load_n(&listener_pid_mask, __ATOMIC_ACQUIRE) & irecv_filter_pid_bit(product_id)) {
+		return 1;
+	}
+
+	debug("%s: no subscription for %04x devices, not probing location %#x\n", __func__, product_id, location);
+	struct irecv_usb_device_info *usb_dev_info = (struct irecv_usb_device_info*)calloc(1, sizeof(struct irecv_usb_device_info));
+	if (!usb_dev_info) {
+		return 0;
+	}
+	usb_dev_info->location = location;
+	usb_dev_info->alive = 1;
+	usb_dev_info->pid = product_id;
+	usb_dev_info->mode = (enum irecv_mode)product_id;
+#if !defined(_WIN32) && !defined(HAVE_IOKIT)
+	usb_dev_info->device = libusb_ref_device((libusb_device*)device);
+#endif
+	collection_add(&devices, usb_dev_info);
+
+	return 0;
+}
+
 static void* _irecv_handle_device_add(void *userdata)
 {
 	struct irecv_client_private client_loc;
@@ -2263,6 +3095,7 @@ static void* _irecv_handle_device_add(void *userdata)
 	uint16_t product_id = 0;
 	irecv_error_t error = 0;
 	irecv_client_t client = NULL;
+	uint64_t detected = irecv_time_us();
 
 	memset(serial_str, 0, 256);
 #ifdef _WIN32
@@ -2295,6 +3128,10 @@ static void* _irecv_handle_device_add(void *userdata)
 
 	product_id = (uint16_t)pid;
 
+	if (!_irecv_should_probe(location, product_id, NULL)) {
+		return NULL;
+	}
+
 	if (product_id == KIS_PRODUCT_ID) {
 		client = (irecv_client_t)malloc(sizeof(struct irecv_client_private));
 		if (client == NULL) {
@@ -2355,11 +3192,15 @@ static void* _irecv_handle_device_add(void *userdata)
 		return NULL;
 	}
 
+	if (!_irecv_should_probe(location, product_id, NULL)) {
+		return NULL;
+	}
+
 	if (product_id == KIS_PRODUCT_ID) {
 		IOObjectRetain(device);
 		int i = 0;
 		for (i = 0; i < 10; i++) {
-			error = iokit_usb_open_service(&client, device);
+			error = iokit_usb_open_service(&client, device, 0);
 			if (error == IRECV_E_SUCCESS) {
 				break;
 			}
@@ -2395,6 +3236,10 @@ static void* _irecv_handle_device_add(void *userdata)
 	uint8_t address = libusb_get_device_address(device);
 	location = (bus << 16) | address;
 
+	if (!_irecv_should_probe(location, product_id, device)) {
+		return NULL;
+	}
+
 	libusb_error = libusb_open(device, &usb_handle);
 	if (usb_handle == NULL || libusb_error != 0) {
 		debug("%s: ERROR: can't connect to device: %s\n", __func__, libusb_error_name(libusb_error));
@@ -2477,47 +3322,81 @@ static void* _irecv_handle_device_add(void *userdata)
 	irecv_load_device_info_from_iboot_string(&client_loc, serial_str);
 
 	struct irecv_usb_device_info *usb_dev_info = (struct irecv_usb_device_info*)malloc(sizeof(struct irecv_usb_device_info));
-	memcpy(&(usb_dev_info->device_info), &(client_loc.device_info), sizeof(struct irecv_device_info));
+	usb_dev_info->device_info_blob = NULL;
+	irecv_device_info_share(&usb_dev_info->device_info, &usb_dev_info->device_info_blob, &client_loc.device_info, client_loc.device_info_blob);
+	irecv_device_info_blob_release(client_loc.device_info_blob);
 	usb_dev_info->location = location;
 	usb_dev_info->alive = 1;
 	usb_dev_info->mode = client_loc.mode;
+	usb_dev_info->probed = 1;
+	usb_dev_info->pid = (client_loc.isKIS) ? KIS_PRODUCT_ID : product_id;
+#if !defined(_WIN32) && !defined(HAVE_IOKIT)
+	usb_dev_info->device = NULL;
+#endif
 
 	collection_add(&devices, usb_dev_info);
+	__atomic_fetch_add(&metrics_registry_size, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&metrics_hotplug_add, 1, __ATOMIC_RELAXED);
+	irecv_journal_record(IRECV_DEVICE_ADD, usb_dev_info);
 
 	irecv_device_event_t dev_event;
 	dev_event.type = IRECV_DEVICE_ADD;
 	dev_event.mode = client_loc.mode;
 	dev_event.device_info = &(usb_dev_info->device_info);
+	dev_event.seq = usb_dev_info->seq;
+	dev_event.timestamp = usb_dev_info->timestamp;
+
+	irecv_metrics_observe(&metrics_dispatch_lag, irecv_time_us() - detected);
 
 	mutex_lock(&listener_mutex);
 	FOREACH(struct irecv_device_event_context* context, &listeners) {
-		context->callback(&dev_event, context->user_data);
+		if (irecv_listener_accepts(context, usb_dev_info)) {
+			context->callback(&dev_event, context->user_data);
+		}
 	} ENDFOREACH
 	mutex_unlock(&listener_mutex);
 
 	return NULL;
 }
 
+static void _irecv_free_unprobed(struct irecv_usb_device_info *devinfo)
+{
+#if !defined(_WIN32) && !defined(HAVE_IOKIT)
+	if (devinfo->device) {
+		libusb_unref_device(devinfo->device);
+	}
+#endif
+	free(devinfo);
+}
+
 static void _irecv_handle_device_remove(struct irecv_usb_device_info *devinfo)
 {
+	if (!devinfo->probed) {
+		/* nobody was told about it */
+		collection_remove(&devices, devinfo);
+		_irecv_free_unprobed(devinfo);
+		return;
+	}
+
+	irecv_journal_record(IRECV_DEVICE_REMOVE, devinfo);
+
 	irecv_device_event_t dev_event;
 	dev_event.type = IRECV_DEVICE_REMOVE;
 	dev_event.mode = devinfo->mode;
 	dev_event.device_info = &(devinfo->device_info);
+	dev_event.seq = devinfo->seq;
+	dev_event.timestamp = devinfo->timestamp;
 	mutex_lock(&listener_mutex);
 	FOREACH(struct irecv_device_event_context* context, &listeners) {
-		context->callback(&dev_event, context->user_data);
+		if (irecv_listener_accepts(context, devinfo)) {
+			context->callback(&dev_event, context->user_data);
+		}
 	} ENDFOREACH
 	mutex_unlock(&listener_mutex);
-	free(devinfo->device_info.srnm);
-	devinfo->device_info.srnm = NULL;
-	free(devinfo->device_info.imei);
-	devinfo->device_info.imei = NULL;
-	free(devinfo->device_info.srtg);
-	devinfo->device_info.srtg = NULL;
-	free(devinfo->device_info.serial_string);
-	devinfo->device_info.serial_string = NULL;
+	irecv_device_info_clear(&devinfo->device_info, &devinfo->device_info_blob);
 	devinfo->alive = 0;
+	__atomic_fetch_sub(&metrics_registry_size, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&metrics_hotplug_remove, 1, __ATOMIC_RELAXED);
 	collection_remove(&devices, devinfo);
 	free(devinfo);
 }
@@ -2621,6 +3500,59 @@ static int _irecv_usb_hotplug_cb(libusb_context *ctx, libusb_device *device, lib
 #endif /* !HAVE_IOKIT */
 #endif /* !_WIN32 */
 
+/*
+ * Runs on the event thread after a subscription widened the union of
+ * filters: unprobed devices that are wanted now are probed. The polling
+ * backends simply forget them so the next poll finds them as new devices.
+ */
+static void _irecv_rescan_unprobed(void)
+{
+	if (!__atomic_exchange_n(&device_rescan, 0, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	unsigned int mask = __atomic_load_n(&listener_pid_mask, __ATOMIC_ACQUIRE);
+	struct collection wanted;
+	collection_init(&wanted);
+	FOREACH(struct irecv_usb_device_info *devinfo, &devices) {
+		if (!devinfo->probed && (mask & irecv_filter_pid_bit(devinfo->pid))) {
+			collection_remove(&devices, devinfo);
+			collection_add(&wanted, devinfo);
+		}
+	} ENDFOREACH
+
+	FOREACH(struct irecv_usb_device_info *devinfo, &wanted) {
+#if !defined(_WIN32) && !defined(HAVE_IOKIT)
+		if (devinfo->device) {
+			_irecv_handle_device_add(devinfo->device);
+		}
+#endif
+		_irecv_free_unprobed(devinfo);
+	} ENDFOREACH
+	collection_free(&wanted);
+
+#ifdef HAVE_IOKIT
+	/* IOKit only notifies once per device, so look the wanted ones up again */
+	unsigned int i;
+	for (i = 0; i < IRECV_FILTER_PID_COUNT; i++) {
+		if (!(mask & (1u << i))) {
+			continue;
+		}
+		io_iterator_t iterator = iokit_usb_get_iterator_for_pid(irecv_filter_pids[i]);
+		if (iterator) {
+			iokit_device_added(NULL, iterator);
+			IOObjectRelease(iterator);
+		}
+	}
+#endif
+}
+
+#ifdef HAVE_IOKIT
+static void iokit_rescan_perform(void *info)
+{
+	_irecv_rescan_unprobed();
+}
+#endif
+
 struct _irecv_event_handler_info {
 	cond_t startup_cond;
 	mutex_t startup_mutex;
@@ -2646,6 +3578,8 @@ static void *_irecv_event_handler(void* data)
 		DWORD i;
 		int k;
 
+		_irecv_rescan_unprobed();
+
 		FOREACH(struct irecv_usb_device_info *devinfo, &devices) {
 			devinfo->alive = 0;
 		} ENDFOREACH
@@ -2782,6 +3716,12 @@ static void *_irecv_event_handler(void* data)
 	iokit_runloop = CFRunLoopGetCurrent();
 	CFRunLoopAddSource(iokit_runloop, runLoopSource, kCFRunLoopDefaultMode);
 
+	CFRunLoopSourceContext rescanContext;
+	memset(&rescanContext, '\0', sizeof(rescanContext));
+	rescanContext.perform = iokit_rescan_perform;
+	iokit_rescan_source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &rescanContext);
+	CFRunLoopAddSource(iokit_runloop, iokit_rescan_source, kCFRunLoopDefaultMode);
+
 	uint16_t pids[9] = { IRECV_K_WTF_MODE, IRECV_K_DFU_MODE, IRECV_K_RECOVERY_MODE_1, IRECV_K_RECOVERY_MODE_2, IRECV_K_RECOVERY_MODE_3, IRECV_K_RECOVERY_MODE_4, IRECV_K_PORT_DFU_MODE, KIS_PRODUCT_ID, 0 };
 	int i = 0;
 	while (pids[i] > 0) {
@@ -2814,6 +3754,10 @@ static void *_irecv_event_handler(void* data)
 
 	CFRunLoopRun();
 
+	CFRunLoopSourceInvalidate(iokit_rescan_source);
+	CFRelease(iokit_rescan_source);
+	iokit_rescan_source = NULL;
+
 #else /* !HAVE_IOKIT */
 #ifdef HAVE_LIBUSB_HOTPLUG_API
 	static libusb_hotplug_callback_handle usb_hotplug_cb_handle;
@@ -2828,6 +3772,7 @@ static void *_irecv_event_handler(void* data)
 		struct timeval tv;
 		tv.tv_sec = tv.tv_usec = 0;
 		libusb_handle_events_timeout(irecv_hotplug_ctx, &tv);
+		_irecv_rescan_unprobed();
 
 		mutex_lock(&listener_mutex);
 		if (collection_count(&listeners) == 0) {
@@ -2848,6 +3793,7 @@ static void *_irecv_event_handler(void* data)
 	mutex_unlock(&(info->startup_mutex));
 
 	do {
+		_irecv_rescan_unprobed();
 		cnt = libusb_get_device_list(irecv_hotplug_ctx, &devs);
 		if (cnt < 0) {
 			debug("%s: FATAL: Failed to get device list: %s\n", __func__, libusb_error_name(cnt));
@@ -2904,6 +3850,11 @@ static void *_irecv_event_handler(void* data)
 #endif /* !USE_DUMMY */
 
 irecv_error_t irecv_device_event_subscribe(irecv_device_event_context_t *context, irecv_device_event_cb_t callback, void *user_data)
+{
+	return irecv_device_event_subscribe_filtered(context, NULL, callback, user_data);
+}
+
+irecv_error_t irecv_device_event_subscribe_filtered(irecv_device_event_context_t *context, const struct irecv_device_event_filter *filter, irecv_device_event_cb_t callback, void *user_data)
 {
 #ifdef USE_DUMMY
 	return IRECV_E_UNSUPPORTED;
@@ -2911,16 +3862,33 @@ irecv_error_t irecv_device_event_subscribe(irecv_device_event_context_t *context
 	if (!context || !callback)
 		return IRECV_E_INVALID_INPUT;
 
-	struct irecv_device_event_context* _context = malloc(sizeof(struct irecv_device_event_context));
+	if (filter && ((filter->num_pids > 0 && !filter->pids) || (filter->num_ecids > 0 && !filter->ecids)))
+		return IRECV_E_INVALID_INPUT;
+
+	struct irecv_device_event_context* _context = calloc(1, sizeof(struct irecv_device_event_context));
 	if (!_context) {
 		return IRECV_E_OUT_OF_MEMORY;
 	}
 
 	_context->callback = callback;
 	_context->user_data = user_data;
+	_context->pid_mask = irecv_filter_pid_mask(filter);
+	if (filter) {
+		_context->cpid = filter->cpid;
+		if (filter->num_ecids > 0) {
+			_context->ecids = (uint64_t*)malloc(sizeof(uint64_t) * filter->num_ecids);
+			if (!_context->ecids) {
+				free(_context);
+				return IRECV_E_OUT_OF_MEMORY;
+			}
+			memcpy(_context->ecids, filter->ecids, sizeof(uint64_t) * filter->num_ecids);
+			_context->num_ecids = filter->num_ecids;
+		}
+	}
 
 	mutex_lock(&listener_mutex);
 	collection_add(&listeners, _context);
+	irecv_listeners_update_mask();
 
 	if (th_event_handler == THREAD_T_NULL || !thread_alive(th_event_handler)) {
 		mutex_unlock(&listener_mutex);
@@ -2942,16 +3910,25 @@ irecv_error_t irecv_device_event_subscribe(irecv_device_event_context_t *context
 		cond_destroy(&info.startup_cond);
 		mutex_destroy(&info.startup_mutex);
 	} else {
-		/* send DEVICE_ADD events to the new listener */
+		/* send DEVICE_ADD events to the new listener; devices nobody wanted before are probed by the event thread */
 		FOREACH(struct irecv_usb_device_info *devinfo, &devices) {
-			if (devinfo && devinfo->alive) {
+			if (devinfo && devinfo->alive && devinfo->probed && irecv_listener_accepts(_context, devinfo)) {
 				irecv_device_event_t ev;
 				ev.type = IRECV_DEVICE_ADD;
 				ev.mode = devinfo->mode;
 				ev.device_info = &(devinfo->device_info);
+				/* replayed events carry the journal position of the original ADD */
+				ev.seq = devinfo->seq;
+				ev.timestamp = devinfo->timestamp;
 				_context->callback(&ev, _context->user_data);
 			}
 		} ENDFOREACH
+#ifdef HAVE_IOKIT
+		if (__atomic_load_n(&device_rescan, __ATOMIC_ACQUIRE) && iokit_rescan_source && iokit_runloop) {
+			CFRunLoopSourceSignal(iokit_rescan_source);
+			CFRunLoopWakeUp(iokit_runloop);
+		}
+#endif
 		mutex_unlock(&listener_mutex);
 	}
 
@@ -2971,6 +3948,7 @@ irecv_error_t irecv_device_event_unsubscribe(irecv_device_event_context_t contex
 
 	mutex_lock(&listener_mutex);
 	collection_remove(&listeners, context);
+	irecv_listeners_update_mask();
 	int num = collection_count(&listeners);
 	mutex_unlock(&listener_mutex);
 
@@ -2986,19 +3964,18 @@ irecv_error_t irecv_device_event_unsubscribe(irecv_device_event_context_t contex
 		th_event_handler = THREAD_T_NULL;
 		mutex_lock(&device_mutex);
 		FOREACH(struct irecv_usb_device_info *devinfo, &devices) {
-			free(devinfo->device_info.srnm);
-			devinfo->device_info.srnm = NULL;
-			free(devinfo->device_info.imei);
-			devinfo->device_info.imei = NULL;
-			free(devinfo->device_info.srtg);
-			devinfo->device_info.srtg = NULL;
-			free(devinfo->device_info.serial_string);
-			devinfo->device_info.serial_string = NULL;
+			if (!devinfo->probed) {
+				_irecv_free_unprobed(devinfo);
+				continue;
+			}
+			irecv_device_info_clear(&devinfo->device_info, &devinfo->device_info_blob);
+			__atomic_fetch_sub(&metrics_registry_size, 1, __ATOMIC_RELAXED);
 			free(devinfo);
 		} ENDFOREACH
 		collection_free(&devices);
 		mutex_unlock(&device_mutex);
 		mutex_destroy(&device_mutex);
+		irecv_journal_reset();
 #ifndef _WIN32
 #ifndef HAVE_IOKIT
 		libusb_exit(irecv_hotplug_ctx);
@@ -3007,56 +3984,150 @@ irecv_error_t irecv_device_event_unsubscribe(irecv_device_event_context_t contex
 #endif
 	}
 
+	free(context->ecids);
 	free(context);
 
 	return IRECV_E_SUCCESS;
 #endif
 }
 
-irecv_error_t irecv_close(irecv_client_t client)
+irecv_error_t irecv_device_events_since(uint64_t cursor, struct irecv_device_journal_entry **entries, unsigned int *count, uint64_t *next_cursor, int *resync)
 {
 #ifdef USE_DUMMY
 	return IRECV_E_UNSUPPORTED;
 #else
-	if (client != NULL) {
-		if (client->disconnected_callback != NULL) {
-			irecv_event_t event;
-			event.size = 0;
-			event.data = NULL;
-			event.progress = 0;
-			event.type = IRECV_DISCONNECTED;
-			client->disconnected_callback(client, &event);
+	if (!entries || !count || !next_cursor)
+		return IRECV_E_INVALID_INPUT;
+
+	*entries = NULL;
+	*count = 0;
+	if (resync) {
+		*resync = 0;
+	}
+
+	mutex_lock(&journal_mutex);
+	/* cursors from before the oldest record (or from a previous process) can't be continued */
+	int missed = (cursor + 1 < journal_first) || (cursor > journal_seq);
+	size_t n = (missed) ? (size_t)collection_count(&journal_attached) : (size_t)(journal_seq - cursor);
+	struct irecv_journal_batch *batch = (struct irecv_journal_batch*)calloc(1, sizeof(struct irecv_journal_batch) + n * sizeof(struct irecv_device_journal_entry));
+	if (batch) {
+		batch->blobs = (struct irecv_device_info_blob**)calloc((n > 0) ? n : 1, sizeof(struct irecv_device_info_blob*));
+	}
+	if (!batch || !batch->blobs) {
+		mutex_unlock(&journal_mutex);
+		free(batch);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	if (missed) {
+		/* current state instead of history, as ADD events */
+		FOREACH(struct irecv_journal_record *att, &journal_attached) {
+			irecv_journal_export(batch, att, IRECV_DEVICE_ADD);
+		} ENDFOREACH
+	} else {
+		uint64_t seq;
+		for (seq = cursor + 1; seq <= journal_seq; seq++) {
+			struct irecv_journal_record *rec = &journal[seq % IRECV_JOURNAL_SIZE];
+			irecv_journal_export(batch, rec, rec->type);
 		}
+	}
+	*next_cursor = journal_seq;
+	mutex_unlock(&journal_mutex);
+
+	if (resync) {
+		*resync = missed;
+	}
+	*count = batch->count;
+	*entries = batch->entries;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+void irecv_device_events_free(struct irecv_device_journal_entry *entries)
+{
+#ifndef USE_DUMMY
+	unsigned int i;
+
+	if (!entries) {
+		return;
+	}
+	struct irecv_journal_batch *batch = (struct irecv_journal_batch*)((char*)entries - offsetof(struct irecv_journal_batch, entries));
+	for (i = 0; i < batch->count; i++) {
+		irecv_device_info_blob_release(batch->blobs[i]);
+	}
+	free(batch->blobs);
+	free(batch);
+#endif
+}
+
+#ifndef USE_DUMMY
+static void irecv_close_usb(irecv_client_t client)
+{
 #ifndef _WIN32
 #ifdef HAVE_IOKIT
-		if (client->usbInterface) {
-			(*client->usbInterface)->USBInterfaceClose(client->usbInterface);
-			(*client->usbInterface)->Release(client->usbInterface);
-			client->usbInterface = NULL;
-		}
-		if (client->handle) {
+	if (client->usbInterface) {
+		(*client->usbInterface)->USBInterfaceClose(client->usbInterface);
+		(*client->usbInterface)->Release(client->usbInterface);
+		client->usbInterface = NULL;
+	}
+	if (client->handle) {
+		if (!client->readonly) {
 			(*client->handle)->USBDeviceClose(client->handle);
-			(*client->handle)->Release(client->handle);
-			client->handle = NULL;
 		}
+		(*client->handle)->Release(client->handle);
+		client->handle = NULL;
+	}
 #else
-		if (client->handle != NULL) {
-			if ((client->mode != IRECV_K_DFU_MODE) && (client->mode != IRECV_K_PORT_DFU_MODE) && (client->mode != IRECV_K_WTF_MODE) && (client->isKIS == 0)) {
-				libusb_release_interface(client->handle, client->usb_interface);
-			}
-			libusb_close(client->handle);
-			client->handle = NULL;
+	if (client->handle != NULL) {
+		if (!client->strategy) {
+			irecv_strategy_bind(client);
+		}
+		if ((client->strategy->flags & IRECV_STRATEGY_BULK) && !client->readonly) {
+			libusb_release_interface(client->handle, client->usb_interface);
 		}
+		libusb_close(client->handle);
+		client->handle = NULL;
+	}
 #endif
 #else
+	if (client->handle != NULL) {
 		CloseHandle(client->handle);
+		client->handle = NULL;
+	}
 #endif
-		free(client->device_info.srnm);
-		free(client->device_info.imei);
-		free(client->device_info.srtg);
-		free(client->device_info.serial_string);
-		free(client->device_info.ap_nonce);
-		free(client->device_info.sep_nonce);
+}
+#endif
+
+#ifndef USE_DUMMY
+static void irecv_queue_stop(irecv_client_t client);
+static void irecv_console_free(irecv_client_t client);
+#endif
+
+irecv_error_t irecv_close(irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (client != NULL) {
+		irecv_set_auto_reconnect(client, 0);
+		irecv_queue_stop(client);
+		if (client->disconnected_callback != NULL) {
+			irecv_event_t event;
+			event.size = 0;
+			event.data = NULL;
+			event.progress = 0;
+			event.type = IRECV_DISCONNECTED;
+			client->disconnected_callback(client, &event);
+		}
+		uint64_t start = irecv_time_us();
+		irecv_close_usb(client);
+		irecv_timing_report(client, IRECV_TIMING_CLOSE, start, 0, IRECV_E_SUCCESS);
+		irecv_scheduler_detach(client);
+		irecv_port_history_detach(client);
+		irecv_metrics_unregister(client);
+		irecv_console_free(client);
+
+		irecv_device_info_clear(&client->device_info, &client->device_info_blob);
 
 		free(client);
 		client = NULL;
@@ -3102,7 +4173,9 @@ static irecv_error_t irecv_send_command_raw(irecv_client_t client, const char* c
 	}
 
 	if (length > 0) {
-		irecv_usb_control_transfer(client, 0x40, b_request, 0, 0, (unsigned char*) command, length + 1, USB_TIMEOUT);
+		uint64_t start = irecv_time_us();
+		int ret = irecv_usb_control_transfer(client, 0x40, b_request, 0, 0, (unsigned char*) command, length + 1, USB_TIMEOUT);
+		irecv_metrics_operation(client, IRECV_METRICS_OP_COMMAND, 0, irecv_time_us() - start, (ret < 0) ? IRECV_E_USB_UPLOAD : IRECV_E_SUCCESS);
 	}
 
 	return IRECV_E_SUCCESS;
@@ -3119,6 +4192,9 @@ irecv_error_t irecv_send_command_breq(irecv_client_t client, const char* command
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
+	if (client->readonly)
+		return IRECV_E_UNSUPPORTED;
+
 	unsigned int length = strlen(command);
 	if (length >= 0x100) {
 		return IRECV_E_INVALID_INPUT;
@@ -3159,364 +4235,5397 @@ irecv_error_t irecv_send_command(irecv_client_t client, const char* command)
 	return irecv_send_command_breq(client, command, 0);
 }
 
-irecv_error_t irecv_send_file(irecv_client_t client, const char* filename, unsigned int options)
-{
-#ifdef USE_DUMMY
-	return IRECV_E_UNSUPPORTED;
-#else
-	if (check_context(client) != IRECV_E_SUCCESS)
-		return IRECV_E_NO_DEVICE;
-
-	FILE* file = fopen(filename, "rb");
+#ifndef USE_DUMMY
+/*
+ * Per-client submission queue. Producers append entries under a short lock
+ * and a single owner thread, started on the first submission, takes the
+ * whole pending list at once and runs it in order, so producers never wait
+ * behind a transfer. Adjacent getenv entries for the same variable share
+ * one round trip, and of adjacent setenv commands for the same variable
+ * only the last one is sent, as nothing can observe the values before it.
+ * Other commands are neither merged nor pipelined: they may have side
+ * effects, and iBoot only completes the control transfer carrying a
+ * command once it has run it.
+ */
+enum {
+	IRECV_QUEUE_COMMAND = 0,
+	IRECV_QUEUE_UPLOAD,
+	IRECV_QUEUE_GETENV
+};
+
+struct irecv_future {
+	mutex_t mutex;
+	cond_t cond;
+	int refs;
+	int done;
+	irecv_error_t error;
+	char* value;
+	irecv_future_cb_t callback;
+	void* user_data;
+};
+
+struct irecv_queue_entry {
+	int type;
+	char* text;
+	const unsigned char* buffer;
+	unsigned long length;
+	unsigned int options;
+	struct irecv_future* future;
+	struct irecv_queue_entry* next;
+};
+
+struct irecv_queue {
+	irecv_client_t client;
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t cond;
+	struct irecv_queue_entry* head;
+	struct irecv_queue_entry* tail;
+	int stopping;
+	int detached;
+};
+
+static void irecv_future_release(struct irecv_future* future)
+{
+	if (__atomic_sub_fetch(&future->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(future->value);
+		cond_destroy(&future->cond);
+		mutex_destroy(&future->mutex);
+		free(future);
+	}
+}
+
+/* takes ownership of value */
+static void irecv_future_complete(struct irecv_future* future, irecv_error_t error, char* value)
+{
+	mutex_lock(&future->mutex);
+	future->error = error;
+	future->value = value;
+	future->done = 1;
+	irecv_future_cb_t callback = future->callback;
+	void* user_data = future->user_data;
+	cond_signal(&future->cond);
+	mutex_unlock(&future->mutex);
+
+	if (callback) {
+		callback(future, user_data);
+	}
+	irecv_future_release(future);
+}
+
+static void irecv_queue_entry_free(struct irecv_queue_entry* entry)
+{
+	free(entry->text);
+	free(entry);
+}
+
+/* whether the calling thread is the queue thread, e.g. inside a completion callback */
+static int irecv_queue_is_current(struct irecv_queue* queue)
+{
+#ifdef _WIN32
+	return GetThreadId(queue->thread) == GetCurrentThreadId();
+#else
+	return pthread_equal(queue->thread, pthread_self());
+#endif
+}
+
+/* length of the variable name if command is a setenv, 0 otherwise */
+static size_t irecv_queue_setenv_name(const char* command, const char** name)
+{
+	if (strncmp(command, "setenv ", 7) != 0) {
+		return 0;
+	}
+	*name = command + 7;
+	while (**name == ' ') {
+		(*name)++;
+	}
+	return strcspn(*name, " ");
+}
+
+/* whether command b, sent right after a, makes a redundant */
+static int irecv_queue_supersedes(const char* a, const char* b)
+{
+	const char* name_a = NULL;
+	const char* name_b = NULL;
+	size_t len = irecv_queue_setenv_name(a, &name_a);
+
+	return len > 0 && irecv_queue_setenv_name(b, &name_b) == len && strncmp(name_a, name_b, len) == 0;
+}
+
+static void* irecv_queue_thread(void* data)
+{
+	struct irecv_queue* queue = (struct irecv_queue*)data;
+	irecv_client_t client = queue->client;
+
+	mutex_lock(&queue->mutex);
+	while (1) {
+		if (!queue->head) {
+			if (queue->stopping) {
+				break;
+			}
+			cond_wait(&queue->cond, &queue->mutex);
+			continue;
+		}
+		struct irecv_queue_entry* batch = queue->head;
+		queue->head = queue->tail = NULL;
+		mutex_unlock(&queue->mutex);
+
+		while (batch) {
+			struct irecv_queue_entry* entry = batch;
+			batch = entry->next;
+
+			if (__atomic_load_n(&queue->stopping, __ATOMIC_ACQUIRE)) {
+				irecv_future_complete(entry->future, IRECV_E_NO_DEVICE, NULL);
+				irecv_queue_entry_free(entry);
+				continue;
+			}
+
+			irecv_error_t error;
+			char* value = NULL;
+			switch (entry->type) {
+			case IRECV_QUEUE_UPLOAD:
+				error = irecv_send_buffer(client, (unsigned char*)entry->buffer, entry->length, entry->options);
+				break;
+			case IRECV_QUEUE_GETENV:
+				error = irecv_getenv(client, entry->text, &value);
+				while (batch && batch->type == IRECV_QUEUE_GETENV && strcmp(batch->text, entry->text) == 0) {
+					struct irecv_queue_entry* same = batch;
+					batch = same->next;
+					irecv_future_complete(same->future, error, (value) ? strdup(value) : NULL);
+					irecv_queue_entry_free(same);
+				}
+				break;
+			default: {
+				/* skip setenvs overwritten before anything could read them; they complete with the one sent */
+				struct irecv_queue_entry* skipped = NULL;
+				struct irecv_queue_entry** skipped_tail = &skipped;
+				while (batch && batch->type == IRECV_QUEUE_COMMAND && irecv_queue_supersedes(entry->text, batch->text)) {
+					*skipped_tail = entry;
+					skipped_tail = &entry->next;
+					entry = batch;
+					batch = entry->next;
+				}
+				*skipped_tail = NULL;
+				error = irecv_send_command(client, entry->text);
+				while (skipped) {
+					struct irecv_queue_entry* same = skipped;
+					skipped = same->next;
+					irecv_future_complete(same->future, error, NULL);
+					irecv_queue_entry_free(same);
+				}
+				break;
+			}
+			}
+			irecv_future_complete(entry->future, error, value);
+			irecv_queue_entry_free(entry);
+		}
+
+		mutex_lock(&queue->mutex);
+	}
+	int detached = queue->detached;
+	mutex_unlock(&queue->mutex);
+
+	/* the client was closed from a callback on this thread, nobody else will free the queue */
+	if (detached) {
+		cond_destroy(&queue->cond);
+		mutex_destroy(&queue->mutex);
+		free(queue);
+	}
+
+	return NULL;
+}
+
+static struct irecv_queue* irecv_queue_get(irecv_client_t client)
+{
+	struct irecv_queue* queue = __atomic_load_n(&client->queue, __ATOMIC_ACQUIRE);
+	if (queue) {
+		return queue;
+	}
+
+	queue = (struct irecv_queue*)calloc(1, sizeof(struct irecv_queue));
+	if (!queue) {
+		return NULL;
+	}
+	queue->client = client;
+	mutex_init(&queue->mutex);
+	cond_init(&queue->cond);
+
+	/* producers may race to create the queue, only one of them starts its thread */
+	struct irecv_queue* expected = NULL;
+	if (!__atomic_compare_exchange_n(&client->queue, &expected, queue, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		cond_destroy(&queue->cond);
+		mutex_destroy(&queue->mutex);
+		free(queue);
+		return expected;
+	}
+	if (thread_new(&queue->thread, irecv_queue_thread, queue) != 0) {
+		debug("Failed to start command queue thread\n");
+		queue->thread = THREAD_T_NULL;
+	}
+
+	return queue;
+}
+
+static irecv_error_t irecv_queue_submit(irecv_client_t client, struct irecv_queue_entry* entry, irecv_future_t* future)
+{
+	struct irecv_queue* queue = irecv_queue_get(client);
+	if (!queue || queue->thread == THREAD_T_NULL) {
+		irecv_queue_entry_free(entry);
+		return (queue) ? IRECV_E_UNKNOWN_ERROR : IRECV_E_OUT_OF_MEMORY;
+	}
+
+	struct irecv_future* f = (struct irecv_future*)calloc(1, sizeof(struct irecv_future));
+	if (!f) {
+		irecv_queue_entry_free(entry);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	mutex_init(&f->mutex);
+	cond_init(&f->cond);
+	f->refs = 2;
+	entry->future = f;
+
+	mutex_lock(&queue->mutex);
+	if (queue->stopping) {
+		mutex_unlock(&queue->mutex);
+		irecv_queue_entry_free(entry);
+		irecv_future_release(f);
+		irecv_future_release(f);
+		return IRECV_E_NO_DEVICE;
+	}
+	if (queue->tail) {
+		queue->tail->next = entry;
+	} else {
+		queue->head = entry;
+	}
+	queue->tail = entry;
+	cond_signal(&queue->cond);
+	mutex_unlock(&queue->mutex);
+
+	*future = f;
+
+	return IRECV_E_SUCCESS;
+}
+
+/* entries that have not started yet fail with IRECV_E_NO_DEVICE */
+static void irecv_queue_stop(irecv_client_t client)
+{
+	struct irecv_queue* queue = client->queue;
+	if (!queue) {
+		return;
+	}
+
+	if (queue->thread != THREAD_T_NULL && irecv_queue_is_current(queue)) {
+		/* closed from a completion callback: the thread can't join itself, so it
+		 * fails the rest of its batch without touching the client and frees the queue */
+		mutex_lock(&queue->mutex);
+		__atomic_store_n(&queue->stopping, 1, __ATOMIC_RELEASE);
+		queue->detached = 1;
+		mutex_unlock(&queue->mutex);
+		thread_detach(queue->thread);
+		client->queue = NULL;
+		return;
+	}
+
+	mutex_lock(&queue->mutex);
+	__atomic_store_n(&queue->stopping, 1, __ATOMIC_RELEASE);
+	cond_signal(&queue->cond);
+	mutex_unlock(&queue->mutex);
+
+	if (queue->thread != THREAD_T_NULL) {
+		thread_join(queue->thread);
+		thread_free(queue->thread);
+	}
+
+	cond_destroy(&queue->cond);
+	mutex_destroy(&queue->mutex);
+	free(queue);
+	client->queue = NULL;
+}
+
+static struct irecv_queue_entry* irecv_queue_entry_new(int type, const char* text)
+{
+	struct irecv_queue_entry* entry = (struct irecv_queue_entry*)calloc(1, sizeof(struct irecv_queue_entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->type = type;
+	if (text) {
+		entry->text = strdup(text);
+		if (!entry->text) {
+			free(entry);
+			return NULL;
+		}
+	}
+
+	return entry;
+}
+#endif
+
+irecv_error_t irecv_submit_command(irecv_client_t client, const char* command, irecv_future_t* future)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (!command || !future || strlen(command) >= 0x100) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_queue_entry* entry = irecv_queue_entry_new(IRECV_QUEUE_COMMAND, command);
+	if (!entry) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	return irecv_queue_submit(client, entry, future);
+#endif
+}
+
+irecv_error_t irecv_submit_upload(irecv_client_t client, const unsigned char* buffer, unsigned long length, unsigned int options, irecv_future_t* future)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if ((!buffer && length > 0) || !future) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_queue_entry* entry = irecv_queue_entry_new(IRECV_QUEUE_UPLOAD, NULL);
+	if (!entry) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	entry->buffer = buffer;
+	entry->length = length;
+	entry->options = options;
+
+	return irecv_queue_submit(client, entry, future);
+#endif
+}
+
+irecv_error_t irecv_submit_getenv(irecv_client_t client, const char* variable, irecv_future_t* future)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (!variable || !future) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_queue_entry* entry = irecv_queue_entry_new(IRECV_QUEUE_GETENV, variable);
+	if (!entry) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	return irecv_queue_submit(client, entry, future);
+#endif
+}
+
+irecv_error_t irecv_future_wait(irecv_future_t future, unsigned int timeout_ms)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!future) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	uint64_t deadline = (timeout_ms > 0) ? irecv_time_us() + (uint64_t)timeout_ms * 1000 : 0;
+
+	mutex_lock(&future->mutex);
+	while (!future->done) {
+		if (deadline == 0) {
+			cond_wait(&future->cond, &future->mutex);
+			continue;
+		}
+		uint64_t now = irecv_time_us();
+		if (now >= deadline) {
+			mutex_unlock(&future->mutex);
+			return IRECV_E_TIMEOUT;
+		}
+		cond_wait_timeout(&future->cond, &future->mutex, (unsigned int)((deadline - now + 999) / 1000));
+	}
+	/* there is no broadcast, so every woken waiter wakes the next one */
+	cond_signal(&future->cond);
+	irecv_error_t error = future->error;
+	mutex_unlock(&future->mutex);
+
+	return error;
+#endif
+}
+
+int irecv_future_is_done(irecv_future_t future)
+{
+#ifdef USE_DUMMY
+	return 0;
+#else
+	if (!future) {
+		return 0;
+	}
+
+	mutex_lock(&future->mutex);
+	int done = future->done;
+	mutex_unlock(&future->mutex);
+
+	return done;
+#endif
+}
+
+irecv_error_t irecv_future_get_value(irecv_future_t future, const char** value)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!future || !value) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	irecv_error_t error = irecv_future_wait(future, 0);
+	*value = future->value;
+
+	return error;
+#endif
+}
+
+irecv_error_t irecv_future_set_callback(irecv_future_t future, irecv_future_cb_t callback, void* user_data)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!future) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&future->mutex);
+	int done = future->done;
+	if (!done) {
+		future->callback = callback;
+		future->user_data = user_data;
+	}
+	mutex_unlock(&future->mutex);
+
+	if (done && callback) {
+		callback(future, user_data);
+	}
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+void irecv_future_free(irecv_future_t future)
+{
+#ifndef USE_DUMMY
+	if (future) {
+		irecv_future_release(future);
+	}
+#endif
+}
+
+#ifndef USE_DUMMY
+#define IRECV_SCHED_MAX_LEVEL 32
+#define IRECV_SCHED_WINDOW_US 250000
+/* transferred bytes are added to the groups in batches, not per packet */
+#define IRECV_SCHED_BATCH_BYTES 0x40000
+#define IRECV_SCHED_BATCH_US 50000
+/* a waiter gives up when the transfers holding the slots made no progress
+ * for this long; a live transfer accounts at least every USB timeout */
+#define IRECV_SCHED_STALL_US ((uint64_t)USB_TIMEOUT * 3 * 1000)
+
+struct irecv_sched_group {
+	int is_controller;
+	uint8_t bus;
+	uint8_t port_depth;
+	uint8_t port_path[IRECV_USB_MAX_PORT_DEPTH];
+	unsigned int active;
+	unsigned int limit;
+	uint64_t bytes;
+	uint64_t window_start;
+	uint64_t window_bytes;
+	uint64_t last_activity;
+	double throughput;
+	double peak_throughput;
+	double level_throughput[IRECV_SCHED_MAX_LEVEL + 1];
+};
+
+struct irecv_scheduler {
+	mutex_t mutex;
+	cond_t cond;
+	unsigned int max_per_hub;
+	unsigned int max_per_controller;
+	int adaptive;
+	struct collection groups;
+	struct collection clients;
+};
+
+static void irecv_sched_update_limit(struct irecv_scheduler *sched, struct irecv_sched_group *group)
+{
+	unsigned int max = (group->is_controller) ? sched->max_per_controller : sched->max_per_hub;
+	unsigned int level;
+	unsigned int best = 0;
+
+	if (max == 0 || max > IRECV_SCHED_MAX_LEVEL) {
+		max = IRECV_SCHED_MAX_LEVEL;
+	}
+	group->limit = max;
+	if (!sched->adaptive) {
+		return;
+	}
+
+	for (level = 1; level <= max; level++) {
+		if (group->level_throughput[level] > group->level_throughput[best]) {
+			best = level;
+		}
+	}
+	if (best == 0) {
+		return;
+	}
+
+	/* probe one stream above the best level until it has been measured */
+	if (best < max && group->level_throughput[best + 1] == 0) {
+		group->limit = best + 1;
+		return;
+	}
+
+	/* prefer more concurrency when it costs less than 5% of the best aggregate throughput */
+	for (level = max; level > best; level--) {
+		if (group->level_throughput[level] >= group->level_throughput[best] * 0.95) {
+			break;
+		}
+	}
+	group->limit = level;
+}
+
+static struct irecv_sched_group* irecv_sched_get_group(struct irecv_scheduler *sched, const struct irecv_usb_topology *topology, int is_controller)
+{
+	/* a hub is identified by the port path of its downstream devices without the last port */
+	uint8_t depth = (is_controller || topology->port_depth == 0) ? 0 : topology->port_depth - 1;
+
+	FOREACH(struct irecv_sched_group *group, &sched->groups) {
+		if (group->is_controller == is_controller && group->bus == topology->bus && group->port_depth == depth && memcmp(group->port_path, topology->port_path, depth) == 0) {
+			return group;
+		}
+	} ENDFOREACH
+
+	struct irecv_sched_group *group = (struct irecv_sched_group*)calloc(1, sizeof(struct irecv_sched_group));
+	if (!group) {
+		return NULL;
+	}
+	group->is_controller = is_controller;
+	group->bus = topology->bus;
+	group->port_depth = depth;
+	memcpy(group->port_path, topology->port_path, depth);
+	irecv_sched_update_limit(sched, group);
+	collection_add(&sched->groups, group);
+
+	return group;
+}
+
+static void irecv_sched_group_flush(struct irecv_sched_group *group, uint64_t now, uint64_t min_window)
+{
+	uint64_t elapsed = now - group->window_start;
+
+	if (group->active > 0 && group->window_start > 0 && elapsed >= min_window && group->window_bytes > 0) {
+		unsigned int level = (group->active > IRECV_SCHED_MAX_LEVEL) ? IRECV_SCHED_MAX_LEVEL : group->active;
+		group->throughput = (double)group->window_bytes * 1000000.0 / (double)elapsed;
+		if (group->level_throughput[level] == 0) {
+			group->level_throughput[level] = group->throughput;
+		} else {
+			group->level_throughput[level] = group->level_throughput[level] * 0.7 + group->throughput * 0.3;
+		}
+		if (group->throughput > group->peak_throughput) {
+			group->peak_throughput = group->throughput;
+		}
+	}
+	group->window_start = now;
+	group->window_bytes = 0;
+}
+
+/*
+ * client->scheduler is only changed with sched_attach_mutex held, and a
+ * transfer pins the scheduler in its slot under the same mutex, so detach
+ * and free can wait for transfers in flight before letting go of it. Lock
+ * order is sched_attach_mutex before the scheduler mutex.
+ */
+static irecv_error_t irecv_sched_acquire_slot(irecv_client_t client, uint64_t stall_us)
+{
+	struct irecv_sched_slot *slot = &client->sched_slot;
+	struct irecv_scheduler *sched;
+	uint64_t now;
+
+	client->bandwidth_start = irecv_time_us();
+	client->bandwidth_bytes = 0;
+
+	mutex_lock(&sched_attach_mutex);
+	sched = client->scheduler;
+	slot->sched = sched;
+	mutex_unlock(&sched_attach_mutex);
+	if (!sched) {
+		return IRECV_E_SUCCESS;
+	}
+
+	mutex_lock(&sched->mutex);
+	struct irecv_sched_group *hub = irecv_sched_get_group(sched, &client->topology, 0);
+	struct irecv_sched_group *controller = irecv_sched_get_group(sched, &client->topology, 1);
+	if (hub && controller) {
+		uint64_t wait_start = irecv_time_us();
+		while (hub->active >= hub->limit || controller->active >= controller->limit) {
+			struct irecv_sched_group *busy = (hub->active >= hub->limit) ? hub : controller;
+			uint64_t last = (busy->last_activity > wait_start) ? busy->last_activity : wait_start;
+			if (irecv_time_us() - last >= stall_us) {
+				mutex_unlock(&sched->mutex);
+				if (stall_us > 0) {
+					debug("%s: no progress on the %s for %u s, giving up\n", __func__, (busy == hub) ? "hub" : "controller", (unsigned int)(stall_us / 1000000));
+				}
+				mutex_lock(&sched_attach_mutex);
+				slot->sched = NULL;
+				cond_signal(&sched_attach_cond);
+				mutex_unlock(&sched_attach_mutex);
+				return IRECV_E_TIMEOUT;
+			}
+			/* cond_signal only wakes a single waiter, so do not rely on being woken up */
+			cond_wait_timeout(&sched->cond, &sched->mutex, 50);
+		}
+		now = irecv_time_us();
+		irecv_sched_group_flush(hub, now, IRECV_SCHED_WINDOW_US / 5);
+		irecv_sched_group_flush(controller, now, IRECV_SCHED_WINDOW_US / 5);
+		hub->active++;
+		controller->active++;
+		hub->last_activity = controller->last_activity = now;
+		client->bandwidth_start = now;
+	}
+	slot->hub = (hub && controller) ? hub : NULL;
+	slot->controller = (hub && controller) ? controller : NULL;
+	slot->pending = 0;
+	slot->flushed = client->bandwidth_start;
+	mutex_unlock(&sched->mutex);
+
+	return IRECV_E_SUCCESS;
+}
+
+/* a transfer on a slot reserved by irecv_sched_reserve() keeps it when it ends */
+static irecv_error_t irecv_sched_acquire(irecv_client_t client)
+{
+	if (client->sched_slot.reserved) {
+		client->bandwidth_start = irecv_time_us();
+		client->bandwidth_bytes = 0;
+		return IRECV_E_SUCCESS;
+	}
+
+	return irecv_sched_acquire_slot(client, IRECV_SCHED_STALL_US);
+}
+
+/* adds the bytes transferred since the last batch to the slot's groups */
+static void irecv_sched_flush_pending(struct irecv_sched_slot *slot, uint64_t now)
+{
+	struct irecv_scheduler *sched = slot->sched;
+	struct irecv_sched_group *groups[2] = { slot->hub, slot->controller };
+	int i;
+
+	mutex_lock(&sched->mutex);
+	for (i = 0; i < 2; i++) {
+		groups[i]->bytes += slot->pending;
+		groups[i]->window_bytes += slot->pending;
+		groups[i]->last_activity = now;
+		if (now - groups[i]->window_start >= IRECV_SCHED_WINDOW_US) {
+			irecv_sched_group_flush(groups[i], now, IRECV_SCHED_WINDOW_US);
+			irecv_sched_update_limit(sched, groups[i]);
+		}
+	}
+	mutex_unlock(&sched->mutex);
+	slot->pending = 0;
+	slot->flushed = now;
+}
+
+static void irecv_sched_account(irecv_client_t client, uint64_t bytes)
+{
+	struct irecv_sched_slot *slot = &client->sched_slot;
+	uint64_t now = irecv_time_us();
+
+	if (slot->hub) {
+		slot->pending += bytes;
+		if (slot->pending >= IRECV_SCHED_BATCH_BYTES || now - slot->flushed >= IRECV_SCHED_BATCH_US) {
+			irecv_sched_flush_pending(slot, now);
+		}
+	}
+
+	if (client->bandwidth_limit > 0) {
+		client->bandwidth_bytes += bytes;
+		uint64_t expected = client->bandwidth_bytes * 1000000 / client->bandwidth_limit;
+		uint64_t elapsed = now - client->bandwidth_start;
+		if (expected > elapsed) {
+			usleep((useconds_t)(expected - elapsed));
+		}
+	}
+}
+
+static void irecv_sched_release(irecv_client_t client)
+{
+	struct irecv_sched_slot *slot = &client->sched_slot;
+	struct irecv_scheduler *sched = slot->sched;
+
+	if (!sched || slot->reserved) {
+		return;
+	}
+
+	if (slot->hub) {
+		uint64_t now = irecv_time_us();
+		if (slot->pending > 0) {
+			irecv_sched_flush_pending(slot, now);
+		}
+		mutex_lock(&sched->mutex);
+		irecv_sched_group_flush(slot->hub, now, IRECV_SCHED_WINDOW_US / 5);
+		slot->hub->active--;
+		irecv_sched_update_limit(sched, slot->hub);
+		irecv_sched_group_flush(slot->controller, now, IRECV_SCHED_WINDOW_US / 5);
+		slot->controller->active--;
+		irecv_sched_update_limit(sched, slot->controller);
+		cond_signal(&sched->cond);
+		mutex_unlock(&sched->mutex);
+	}
+
+	mutex_lock(&sched_attach_mutex);
+	slot->sched = NULL;
+	slot->hub = NULL;
+	slot->controller = NULL;
+	cond_signal(&sched_attach_cond);
+	mutex_unlock(&sched_attach_mutex);
+}
+
+/*
+ * Holds a slot across several transfers, for members of a group upload that
+ * must not wait for a slot once they share a ring with others. Without wait
+ * the slot is only taken if it is free right now.
+ */
+static irecv_error_t irecv_sched_reserve(irecv_client_t client, int wait)
+{
+	irecv_error_t error = irecv_sched_acquire_slot(client, (wait) ? IRECV_SCHED_STALL_US : 0);
+	if (error == IRECV_E_SUCCESS) {
+		client->sched_slot.reserved = 1;
+	}
+
+	return error;
+}
+
+static void irecv_sched_unreserve(irecv_client_t client)
+{
+	if (client->sched_slot.reserved) {
+		client->sched_slot.reserved = 0;
+		irecv_sched_release(client);
+	}
+}
+
+/* called with sched_attach_mutex held */
+static void irecv_sched_wait_idle(irecv_client_t client, struct irecv_scheduler *sched)
+{
+	while (client->sched_slot.sched == sched) {
+		/* cond_signal only wakes a single waiter, so do not rely on being woken up */
+		cond_wait_timeout(&sched_attach_cond, &sched_attach_mutex, 50);
+	}
+}
+#endif
+
+irecv_error_t irecv_get_usb_topology(irecv_client_t client, struct irecv_usb_topology* topology)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (!topology) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	memcpy(topology, &client->topology, sizeof(struct irecv_usb_topology));
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_scheduler_new(irecv_scheduler_t* scheduler, unsigned int max_streams_per_hub, unsigned int max_streams_per_controller)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!scheduler) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_scheduler *sched = (struct irecv_scheduler*)calloc(1, sizeof(struct irecv_scheduler));
+	if (!sched) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	sched->max_per_hub = max_streams_per_hub;
+	sched->max_per_controller = max_streams_per_controller;
+	mutex_init(&sched->mutex);
+	cond_init(&sched->cond);
+	collection_init(&sched->groups);
+	collection_init(&sched->clients);
+
+	*scheduler = sched;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_scheduler_free(irecv_scheduler_t scheduler)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!scheduler) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	/* no new transfers may pin it, then wait for those in flight */
+	mutex_lock(&sched_attach_mutex);
+	FOREACH(irecv_client_t client, &scheduler->clients) {
+		client->scheduler = NULL;
+	} ENDFOREACH
+	FOREACH(irecv_client_t client, &scheduler->clients) {
+		irecv_sched_wait_idle(client, scheduler);
+	} ENDFOREACH
+	mutex_unlock(&sched_attach_mutex);
+
+	mutex_lock(&scheduler->mutex);
+	FOREACH(struct irecv_sched_group *group, &scheduler->groups) {
+		free(group);
+	} ENDFOREACH
+	collection_free(&scheduler->groups);
+	collection_free(&scheduler->clients);
+	mutex_unlock(&scheduler->mutex);
+
+	cond_destroy(&scheduler->cond);
+	mutex_destroy(&scheduler->mutex);
+	free(scheduler);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_scheduler_set_adaptive(irecv_scheduler_t scheduler, int enable)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!scheduler) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&scheduler->mutex);
+	scheduler->adaptive = enable;
+	FOREACH(struct irecv_sched_group *group, &scheduler->groups) {
+		irecv_sched_update_limit(scheduler, group);
+	} ENDFOREACH
+	cond_signal(&scheduler->cond);
+	mutex_unlock(&scheduler->mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_scheduler_attach(irecv_scheduler_t scheduler, irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!scheduler || !client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	irecv_scheduler_detach(client);
+
+	mutex_lock(&sched_attach_mutex);
+	mutex_lock(&scheduler->mutex);
+	collection_add(&scheduler->clients, client);
+	client->scheduler = scheduler;
+	mutex_unlock(&scheduler->mutex);
+	mutex_unlock(&sched_attach_mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_scheduler_detach(irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&sched_attach_mutex);
+	struct irecv_scheduler *sched = client->scheduler;
+	if (sched) {
+		client->scheduler = NULL;
+		irecv_sched_wait_idle(client, sched);
+		mutex_lock(&sched->mutex);
+		collection_remove(&sched->clients, client);
+		mutex_unlock(&sched->mutex);
+	}
+	mutex_unlock(&sched_attach_mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_scheduler_get_controller_stats(irecv_scheduler_t scheduler, struct irecv_scheduler_controller_stats* stats, unsigned int max_count, unsigned int* count)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!scheduler || !count || (max_count > 0 && !stats)) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	unsigned int n = 0;
+	uint64_t now = irecv_time_us();
+
+	mutex_lock(&scheduler->mutex);
+	FOREACH(struct irecv_sched_group *group, &scheduler->groups) {
+		if (!group->is_controller) {
+			continue;
+		}
+		if (n < max_count) {
+			struct irecv_scheduler_controller_stats *st = &stats[n];
+			st->bus = group->bus;
+			st->active_streams = group->active;
+			st->stream_limit = group->limit;
+			st->bytes_transferred = group->bytes;
+			st->throughput = group->throughput;
+			if (group->active == 0 && now - group->last_activity > 1000000) {
+				st->throughput = 0;
+			}
+			st->peak_throughput = group->peak_throughput;
+			st->utilization = (group->peak_throughput > 0) ? st->throughput / group->peak_throughput : 0;
+		}
+		n++;
+	} ENDFOREACH
+	mutex_unlock(&scheduler->mutex);
+
+	*count = n;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_set_bandwidth_limit(irecv_client_t client, uint64_t bytes_per_second)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	client->bandwidth_limit = bytes_per_second;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#ifndef USE_DUMMY
+struct irecv_readahead;
+static struct irecv_readahead* irecv_readahead_new(irecv_client_t client, FILE* file, uint64_t length, int usb_buffers, unsigned int readers);
+static void irecv_readahead_free(struct irecv_readahead* ra);
+static void irecv_readahead_release(struct irecv_readahead* ra, unsigned int reader, uint64_t index);
+static irecv_error_t irecv_send_shared(irecv_client_t client, struct irecv_readahead* ra, unsigned int reader, unsigned int options);
+
+enum irecv_group_op_type {
+	IRECV_GROUP_OP_SEND_IOV,
+	IRECV_GROUP_OP_SEND_FILE,
+	IRECV_GROUP_OP_SEND_COMMAND,
+	IRECV_GROUP_OP_SETENV,
+	IRECV_GROUP_OP_EXECUTE_SCRIPT
+};
+
+struct irecv_group_op {
+	enum irecv_group_op_type type;
+	struct irecv_iovec iov;
+	FILE* file;
+	uint64_t length;
+	unsigned int options;
+	const char* arg1;
+	const char* arg2;
+};
+
+struct irecv_group {
+	mutex_t mutex;
+	unsigned int max_workers;
+	struct irecv_group_member_result *members;
+	unsigned int count;
+	unsigned int capacity;
+	/* state of the running broadcast; file uploads run in waves of one member per worker and scheduler slot */
+	const struct irecv_group_op *op;
+	unsigned int first;
+	unsigned int next;
+	unsigned int end;
+	struct irecv_readahead *ra;
+	struct irecv_group_stats stats;
+};
+
+static void irecv_group_run_member(struct irecv_group *group, struct irecv_group_member_result *member, unsigned int reader)
+{
+	const struct irecv_group_op *op = group->op;
+	irecv_client_t client = member->client;
+	uint64_t start = irecv_time_us();
+
+	switch (op->type) {
+	case IRECV_GROUP_OP_SEND_IOV:
+		member->error = irecv_send_iov(client, &op->iov, 1, op->options);
+		member->bytes = client->upload_result.bytes;
+		break;
+	case IRECV_GROUP_OP_SEND_FILE:
+		member->error = irecv_send_shared(client, group->ra, reader, op->options);
+		member->bytes = client->upload_result.bytes;
+		break;
+	case IRECV_GROUP_OP_SEND_COMMAND:
+		member->error = irecv_send_command(client, op->arg1);
+		member->bytes = (member->error == IRECV_E_SUCCESS) ? strlen(op->arg1) + 1 : 0;
+		break;
+	case IRECV_GROUP_OP_SETENV:
+		member->error = irecv_setenv(client, op->arg1, op->arg2);
+		member->bytes = 0;
+		break;
+	case IRECV_GROUP_OP_EXECUTE_SCRIPT:
+		member->error = irecv_execute_script(client, op->arg1);
+		member->bytes = 0;
+		break;
+	default:
+		member->error = IRECV_E_UNSUPPORTED;
+		member->bytes = 0;
+		break;
+	}
+
+	member->elapsed = (double)(irecv_time_us() - start) / 1000000.0;
+}
+
+static void* irecv_group_worker(void* data)
+{
+	struct irecv_group *group = (struct irecv_group*)data;
+
+	while (1) {
+		mutex_lock(&group->mutex);
+		if (group->next >= group->end) {
+			mutex_unlock(&group->mutex);
+			break;
+		}
+		unsigned int index = group->next++;
+		mutex_unlock(&group->mutex);
+
+		irecv_group_run_member(group, &group->members[index], index - group->first);
+		/* a member started after this one would keep the shared ring from moving on */
+		if (group->ra) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static irecv_error_t irecv_group_run(struct irecv_group *group, const struct irecv_group_op *op)
+{
+	THREAD_T *workers = NULL;
+	unsigned int num_workers = 0;
+	unsigned int i;
+	irecv_error_t error = IRECV_E_SUCCESS;
+
+	mutex_lock(&group->mutex);
+	if (group->op != NULL) {
+		mutex_unlock(&group->mutex);
+		return IRECV_E_INVALID_INPUT;
+	}
+	group->op = op;
+	for (i = 0; i < group->count; i++) {
+		group->members[i].error = IRECV_E_UNKNOWN_ERROR;
+		group->members[i].bytes = 0;
+		group->members[i].elapsed = 0;
+	}
+	mutex_unlock(&group->mutex);
+
+	uint64_t start = irecv_time_us();
+
+	num_workers = group->count;
+	if (group->max_workers > 0 && num_workers > group->max_workers) {
+		num_workers = group->max_workers;
+	}
+	if (num_workers > 1) {
+		workers = (THREAD_T*)calloc(num_workers - 1, sizeof(THREAD_T));
+	}
+	if (!workers) {
+		num_workers = 1;
+	}
+
+	/* a file is read once per wave and every worker of the wave uploads it to one member */
+	unsigned int first = 0;
+	while (first < group->count) {
+		unsigned int wave = group->count - first;
+		if (op->type == IRECV_GROUP_OP_SEND_FILE && wave > num_workers) {
+			wave = num_workers;
+		}
+		struct irecv_readahead *ra = NULL;
+		unsigned int reserved = 0;
+		if (op->type == IRECV_GROUP_OP_SEND_FILE) {
+			/* a member waiting for a scheduler slot would stall the shared ring for
+			 * the others, so the wave only takes members that have one; the first
+			 * member of the wave waits for its slot */
+			while (reserved < wave) {
+				irecv_error_t res = irecv_sched_reserve(group->members[first + reserved].client, (reserved == 0));
+				if (res != IRECV_E_SUCCESS) {
+					if (reserved == 0) {
+						group->members[first].error = res;
+					}
+					break;
+				}
+				reserved++;
+			}
+			if (reserved == 0) {
+				first++;
+				continue;
+			}
+			wave = reserved;
+			if (fseek(op->file, 0, SEEK_SET) == 0) {
+				ra = irecv_readahead_new(NULL, op->file, op->length, 0, wave);
+			}
+			if (!ra) {
+				for (i = first; i < first + wave; i++) {
+					group->members[i].error = IRECV_E_OUT_OF_MEMORY;
+					irecv_sched_unreserve(group->members[i].client);
+				}
+				first += wave;
+				continue;
+			}
+		}
+
+		mutex_lock(&group->mutex);
+		group->first = first;
+		group->next = first;
+		group->end = first + wave;
+		group->ra = ra;
+		mutex_unlock(&group->mutex);
+
+		unsigned int started = 0;
+		unsigned int spawn = ((wave < num_workers) ? wave : num_workers) - 1;
+		for (i = 0; i < spawn; i++) {
+			if (thread_new(&workers[started], irecv_group_worker, group) == 0) {
+				started++;
+			}
+		}
+		if (ra && started < wave - 1) {
+			/* fewer workers than readers: leave the rest for the next wave */
+			mutex_lock(&group->mutex);
+			group->end = first + started + 1;
+			mutex_unlock(&group->mutex);
+			for (i = started + 1; i < wave; i++) {
+				irecv_readahead_release(ra, i, UINT64_MAX);
+			}
+			wave = started + 1;
+		}
+		/* the calling thread is a worker too */
+		irecv_group_worker(group);
+		for (i = 0; i < started; i++) {
+			thread_join(workers[i]);
+			thread_free(workers[i]);
+		}
+
+		mutex_lock(&group->mutex);
+		group->ra = NULL;
+		mutex_unlock(&group->mutex);
+		irecv_readahead_free(ra);
+		for (i = first; i < first + reserved; i++) {
+			irecv_sched_unreserve(group->members[i].client);
+		}
+		first += wave;
+	}
+	free(workers);
+
+	mutex_lock(&group->mutex);
+	memset(&group->stats, '\0', sizeof(struct irecv_group_stats));
+	group->stats.elapsed = (double)(irecv_time_us() - start) / 1000000.0;
+	for (i = 0; i < group->count; i++) {
+		group->stats.bytes += group->members[i].bytes;
+		if (group->members[i].error == IRECV_E_SUCCESS) {
+			group->stats.succeeded++;
+		} else {
+			group->stats.failed++;
+			if (error == IRECV_E_SUCCESS) {
+				error = group->members[i].error;
+			}
+		}
+	}
+	if (group->stats.elapsed > 0) {
+		group->stats.throughput = (double)group->stats.bytes / group->stats.elapsed;
+	}
+	group->op = NULL;
+	mutex_unlock(&group->mutex);
+
+	return error;
+}
+#endif
+
+irecv_error_t irecv_group_new(irecv_group_t* group, unsigned int max_workers)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_group *grp = (struct irecv_group*)calloc(1, sizeof(struct irecv_group));
+	if (!grp) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	grp->max_workers = max_workers;
+	mutex_init(&grp->mutex);
+
+	*group = grp;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_group_free(irecv_group_t group)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_destroy(&group->mutex);
+	free(group->members);
+	free(group);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_group_add(irecv_group_t group, irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	unsigned int i;
+
+	if (!group || !client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&group->mutex);
+	if (group->op != NULL) {
+		mutex_unlock(&group->mutex);
+		return IRECV_E_INVALID_INPUT;
+	}
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].client == client) {
+			mutex_unlock(&group->mutex);
+			return IRECV_E_SUCCESS;
+		}
+	}
+	if (group->count == group->capacity) {
+		unsigned int capacity = (group->capacity > 0) ? group->capacity * 2 : 8;
+		struct irecv_group_member_result *members = (struct irecv_group_member_result*)realloc(group->members, capacity * sizeof(struct irecv_group_member_result));
+		if (!members) {
+			mutex_unlock(&group->mutex);
+			return IRECV_E_OUT_OF_MEMORY;
+		}
+		group->members = members;
+		group->capacity = capacity;
+	}
+	memset(&group->members[group->count], '\0', sizeof(struct irecv_group_member_result));
+	group->members[group->count].client = client;
+	group->count++;
+	mutex_unlock(&group->mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_group_remove(irecv_group_t group, irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	unsigned int i;
+
+	if (!group || !client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&group->mutex);
+	if (group->op != NULL) {
+		mutex_unlock(&group->mutex);
+		return IRECV_E_INVALID_INPUT;
+	}
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i].client == client) {
+			memmove(&group->members[i], &group->members[i+1], (group->count - i - 1) * sizeof(struct irecv_group_member_result));
+			group->count--;
+			break;
+		}
+	}
+	mutex_unlock(&group->mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_group_send_buffer(irecv_group_t group, const unsigned char* buffer, unsigned long length, unsigned int options)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || (!buffer && length > 0)) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_group_op op;
+	memset(&op, '\0', sizeof(op));
+	op.type = IRECV_GROUP_OP_SEND_IOV;
+	op.iov.iov_base = (void*)buffer;
+	op.iov.iov_len = length;
+	op.options = options;
+
+	return irecv_group_run(group, &op);
+#endif
+}
+
+irecv_error_t irecv_group_send_file(irecv_group_t group, const char* filename, unsigned int options)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || !filename) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+
+	/* the members stream from a read-ahead ring they share, so the file has
+	 * to be seekable for the case it takes more than one wave */
+	struct stat fst;
+	if (fstat(fileno(file), &fst) < 0) {
+		fclose(file);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	if (!S_ISREG(fst.st_mode)) {
+		fclose(file);
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_group_op op;
+	memset(&op, '\0', sizeof(op));
+	op.type = IRECV_GROUP_OP_SEND_FILE;
+	op.file = file;
+	op.length = (uint64_t)fst.st_size;
+	op.options = options;
+
+	irecv_error_t error = irecv_group_run(group, &op);
+	fclose(file);
+
+	return error;
+#endif
+}
+
+irecv_error_t irecv_group_send_command(irecv_group_t group, const char* command)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || !command) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_group_op op;
+	memset(&op, '\0', sizeof(op));
+	op.type = IRECV_GROUP_OP_SEND_COMMAND;
+	op.arg1 = command;
+
+	return irecv_group_run(group, &op);
+#endif
+}
+
+irecv_error_t irecv_group_setenv(irecv_group_t group, const char* variable, const char* value)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || !variable || !value) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_group_op op;
+	memset(&op, '\0', sizeof(op));
+	op.type = IRECV_GROUP_OP_SETENV;
+	op.arg1 = variable;
+	op.arg2 = value;
+
+	return irecv_group_run(group, &op);
+#endif
+}
+
+irecv_error_t irecv_group_execute_script(irecv_group_t group, const char* script)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || !script) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_group_op op;
+	memset(&op, '\0', sizeof(op));
+	op.type = IRECV_GROUP_OP_EXECUTE_SCRIPT;
+	op.arg1 = script;
+
+	return irecv_group_run(group, &op);
+#endif
+}
+
+irecv_error_t irecv_group_get_results(irecv_group_t group, struct irecv_group_member_result* results, unsigned int max_count, unsigned int* count)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || !count || (max_count > 0 && !results)) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&group->mutex);
+	unsigned int n = (group->count < max_count) ? group->count : max_count;
+	if (n > 0) {
+		memcpy(results, group->members, n * sizeof(struct irecv_group_member_result));
+	}
+	*count = group->count;
+	mutex_unlock(&group->mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_group_get_stats(irecv_group_t group, struct irecv_group_stats* stats)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!group || !stats) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&group->mutex);
+	memcpy(stats, &group->stats, sizeof(struct irecv_group_stats));
+	mutex_unlock(&group->mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#ifndef USE_DUMMY
+/*
+ * Progress is published with a sequence lock: the transfer thread is the
+ * only writer, readers retry until they observe an even, unchanged sequence.
+ */
+#define IRECV_SEQ_GET(st, field) __atomic_load_n(&(st)->field, __ATOMIC_RELAXED)
+#define IRECV_SEQ_PUT(st, field, value) __atomic_store_n(&(st)->field, (value), __ATOMIC_RELAXED)
+
+static void irecv_seq_write_begin(struct irecv_progress_state *st)
+{
+	__atomic_store_n(&st->seq, __atomic_load_n(&st->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void irecv_seq_write_end(struct irecv_progress_state *st)
+{
+	__atomic_store_n(&st->seq, __atomic_load_n(&st->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t irecv_seq_read_begin(const struct irecv_progress_state *st)
+{
+	return __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE);
+}
+
+/* non-zero if the fields read since irecv_seq_read_begin() may be torn */
+static int irecv_seq_read_retry(const struct irecv_progress_state *st, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (seq & 1) || seq != IRECV_SEQ_GET(st, seq);
+}
+
+static void irecv_progress_store(irecv_client_t client, int phase, uint64_t done, uint64_t total, uint64_t start, uint64_t ack)
+{
+	struct irecv_progress_state *st = &client->progress;
+
+	irecv_seq_write_begin(st);
+	IRECV_SEQ_PUT(st, phase, phase);
+	IRECV_SEQ_PUT(st, bytes_done, done);
+	IRECV_SEQ_PUT(st, bytes_total, total);
+	IRECV_SEQ_PUT(st, start_time, start);
+	IRECV_SEQ_PUT(st, last_ack_time, ack);
+	irecv_seq_write_end(st);
+}
+
+static void irecv_port_history_mark(irecv_client_t client);
+static void irecv_port_history_note(irecv_client_t client, uint64_t bytes, uint64_t elapsed_us, irecv_error_t error);
+
+static void irecv_progress_begin(irecv_client_t client, int phase, uint64_t total)
+{
+	uint64_t now = irecv_time_us();
+	if (phase == IRECV_TRANSFER_UPLOAD || phase == IRECV_TRANSFER_DOWNLOAD) {
+		irecv_port_history_mark(client);
+	}
+	irecv_progress_store(client, phase, 0, total, now, now);
+}
+
+static void irecv_progress_advance(irecv_client_t client, uint64_t done)
+{
+	struct irecv_progress_state *st = &client->progress;
+	irecv_progress_store(client, st->phase, done, st->bytes_total, st->start_time, irecv_time_us());
+}
+
+/* move to phase; error is what ended the current phase. Only the data phase of an upload is
+ * timed here, a manifest step reports its own outcome, so a failure is charged to the phase
+ * that was running when it happened */
+static void irecv_progress_leave(irecv_client_t client, int phase, irecv_error_t error)
+{
+	struct irecv_progress_state *st = &client->progress;
+	if (st->phase == IRECV_TRANSFER_UPLOAD && phase != IRECV_TRANSFER_UPLOAD) {
+		irecv_timing_report(client, IRECV_TIMING_UPLOAD, st->start_time, st->bytes_done, error);
+	}
+	irecv_progress_store(client, phase, st->bytes_done, st->bytes_total, st->start_time, st->last_ack_time);
+}
+
+static void irecv_progress_set_phase(irecv_client_t client, int phase)
+{
+	irecv_progress_leave(client, phase, IRECV_E_SUCCESS);
+}
+
+static void irecv_progress_end(irecv_client_t client, irecv_error_t error)
+{
+	struct irecv_progress_state *st = &client->progress;
+	int op = (st->phase == IRECV_TRANSFER_DOWNLOAD) ? IRECV_METRICS_OP_DOWNLOAD : IRECV_METRICS_OP_UPLOAD;
+	uint64_t elapsed = irecv_time_us() - st->start_time;
+	irecv_metrics_operation(client, op, st->bytes_done, elapsed, error);
+	irecv_port_history_note(client, st->bytes_done, elapsed, error);
+	irecv_progress_leave(client, (error == IRECV_E_SUCCESS) ? IRECV_TRANSFER_DONE : IRECV_TRANSFER_FAILED, error);
+}
+#endif
+
+irecv_error_t irecv_get_transfer_progress(irecv_client_t client, struct irecv_transfer_progress* progress)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client || !progress) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_progress_state *st = &client->progress;
+	uint32_t seq;
+
+	do {
+		seq = irecv_seq_read_begin(st);
+		progress->phase = IRECV_SEQ_GET(st, phase);
+		progress->bytes_done = IRECV_SEQ_GET(st, bytes_done);
+		progress->bytes_total = IRECV_SEQ_GET(st, bytes_total);
+		progress->start_time = IRECV_SEQ_GET(st, start_time);
+		progress->last_ack_time = IRECV_SEQ_GET(st, last_ack_time);
+	} while (irecv_seq_read_retry(st, seq));
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#ifndef USE_DUMMY
+/* uploads below this size are hashed inline instead of on a worker thread */
+#define IRECV_DIGEST_THREAD_MIN 0x40000
+#define IRECV_DIGEST_QUEUE_SIZE 16
+
+struct irecv_digest_ctx {
+	unsigned int digests;
+	int external_crc;
+	int crc_done;
+	uint32_t crc;
+	irecv_sha256_ctx sha256;
+	irecv_sha384_ctx sha384;
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t cond;
+	const unsigned char* seg_data[IRECV_DIGEST_QUEUE_SIZE];
+	size_t seg_len[IRECV_DIGEST_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	int finished;
+};
+
+static void irecv_digest_process(struct irecv_digest_ctx *ctx, const unsigned char* data, size_t len)
+{
+	if ((ctx->digests & IRECV_DIGEST_CRC32) && !ctx->external_crc) {
+		size_t i;
+		for (i = 0; i < len; i++) {
+			crc32_step(ctx->crc, data[i]);
+		}
+	}
+	if (ctx->digests & IRECV_DIGEST_SHA256) {
+		irecv_sha256_update(&ctx->sha256, data, len);
+	}
+	if (ctx->digests & IRECV_DIGEST_SHA384) {
+		irecv_sha384_update(&ctx->sha384, data, len);
+	}
+}
+
+static void* irecv_digest_thread(void* data)
+{
+	struct irecv_digest_ctx *ctx = (struct irecv_digest_ctx*)data;
+
+	mutex_lock(&ctx->mutex);
+	while (1) {
+		if (ctx->head == ctx->tail) {
+			if (ctx->finished) {
+				break;
+			}
+			cond_wait(&ctx->cond, &ctx->mutex);
+			continue;
+		}
+		unsigned int slot = ctx->tail % IRECV_DIGEST_QUEUE_SIZE;
+		const unsigned char* seg = ctx->seg_data[slot];
+		size_t seglen = ctx->seg_len[slot];
+		mutex_unlock(&ctx->mutex);
+
+		irecv_digest_process(ctx, seg, seglen);
+
+		mutex_lock(&ctx->mutex);
+		ctx->tail++;
+		cond_signal(&ctx->cond);
+	}
+	mutex_unlock(&ctx->mutex);
+
+	return NULL;
+}
+
+static void irecv_digest_begin(irecv_client_t client, unsigned long length, int external_crc)
+{
+	memset(&client->upload_result, '\0', sizeof(struct irecv_upload_result));
+	client->digest = NULL;
+
+	if (client->upload_digests == IRECV_DIGEST_NONE) {
+		return;
+	}
+
+	struct irecv_digest_ctx *ctx = (struct irecv_digest_ctx*)calloc(1, sizeof(struct irecv_digest_ctx));
+	if (!ctx) {
+		return;
+	}
+	ctx->digests = client->upload_digests;
+	ctx->external_crc = external_crc;
+	ctx->crc = 0xFFFFFFFF;
+	irecv_sha256_init(&ctx->sha256);
+	irecv_sha384_init(&ctx->sha384);
+	ctx->thread = THREAD_T_NULL;
+
+	/* hash on a separate thread so the digest work overlaps with the USB transfers */
+	if (length >= IRECV_DIGEST_THREAD_MIN && (ctx->digests & ~(external_crc ? IRECV_DIGEST_CRC32 : 0))) {
+		mutex_init(&ctx->mutex);
+		cond_init(&ctx->cond);
+		if (thread_new(&ctx->thread, irecv_digest_thread, ctx) != 0) {
+			debug("Failed to start digest thread, hashing inline\n");
+			cond_destroy(&ctx->cond);
+			mutex_destroy(&ctx->mutex);
+			ctx->thread = THREAD_T_NULL;
+		}
+	}
+
+	client->digest = ctx;
+}
+
+static void irecv_digest_feed(irecv_client_t client, const unsigned char* data, size_t len)
+{
+	struct irecv_digest_ctx *ctx = client->digest;
+
+	client->upload_result.bytes += len;
+
+	if (!ctx || len == 0) {
+		return;
+	}
+
+	if (ctx->thread == THREAD_T_NULL) {
+		irecv_digest_process(ctx, data, len);
+		return;
+	}
+
+	mutex_lock(&ctx->mutex);
+	if (ctx->head - ctx->tail > 1) {
+		/* extend the newest pending segment (never the one being hashed) if this one directly follows it */
+		unsigned int last = (ctx->head - 1) % IRECV_DIGEST_QUEUE_SIZE;
+		if (ctx->seg_data[last] + ctx->seg_len[last] == data) {
+			ctx->seg_len[last] += len;
+			mutex_unlock(&ctx->mutex);
+			return;
+		}
+	}
+	while (ctx->head - ctx->tail >= IRECV_DIGEST_QUEUE_SIZE) {
+		cond_wait(&ctx->cond, &ctx->mutex);
+	}
+	ctx->seg_data[ctx->head % IRECV_DIGEST_QUEUE_SIZE] = data;
+	ctx->seg_len[ctx->head % IRECV_DIGEST_QUEUE_SIZE] = len;
+	ctx->head++;
+	cond_signal(&ctx->cond);
+	mutex_unlock(&ctx->mutex);
+}
+
+/* wait until the digest thread is done with all memory handed to it so far */
+static void irecv_digest_flush(irecv_client_t client)
+{
+	struct irecv_digest_ctx *ctx = client->digest;
+
+	if (!ctx || ctx->thread == THREAD_T_NULL) {
+		return;
+	}
+
+	mutex_lock(&ctx->mutex);
+	while (ctx->head != ctx->tail) {
+		cond_wait(&ctx->cond, &ctx->mutex);
+	}
+	mutex_unlock(&ctx->mutex);
+}
+
+static void irecv_digest_set_crc(irecv_client_t client, uint32_t crc)
+{
+	if (client->digest && client->digest->external_crc) {
+		client->digest->crc = crc;
+		client->digest->crc_done = 1;
+	}
+}
+
+static void irecv_digest_end(irecv_client_t client, irecv_error_t status)
+{
+	struct irecv_digest_ctx *ctx = client->digest;
+
+	client->upload_result.status = status;
+
+	if (!ctx) {
+		return;
+	}
+	client->digest = NULL;
+
+	if (ctx->thread != THREAD_T_NULL) {
+		mutex_lock(&ctx->mutex);
+		ctx->finished = 1;
+		cond_signal(&ctx->cond);
+		mutex_unlock(&ctx->mutex);
+		thread_join(ctx->thread);
+		thread_free(ctx->thread);
+		cond_destroy(&ctx->cond);
+		mutex_destroy(&ctx->mutex);
+	}
+
+	if (ctx->digests & IRECV_DIGEST_CRC32) {
+		if (!ctx->external_crc || ctx->crc_done) {
+			client->upload_result.crc32 = ~ctx->crc;
+			client->upload_result.digests |= IRECV_DIGEST_CRC32;
+		}
+	}
+	if (ctx->digests & IRECV_DIGEST_SHA256) {
+		irecv_sha256_final(&ctx->sha256, client->upload_result.sha256);
+		client->upload_result.digests |= IRECV_DIGEST_SHA256;
+	}
+	if (ctx->digests & IRECV_DIGEST_SHA384) {
+		irecv_sha384_final(&ctx->sha384, client->upload_result.sha384);
+		client->upload_result.digests |= IRECV_DIGEST_SHA384;
+	}
+
+	free(ctx);
+}
+#endif
+
+irecv_error_t irecv_set_upload_digests(irecv_client_t client, unsigned int digests)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client || (digests & ~(IRECV_DIGEST_CRC32 | IRECV_DIGEST_SHA256 | IRECV_DIGEST_SHA384))) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	client->upload_digests = digests;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_get_upload_result(irecv_client_t client, struct irecv_upload_result* result)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client || !result) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	memcpy(result, &client->upload_result, sizeof(struct irecv_upload_result));
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#ifndef USE_DUMMY
+static irecv_error_t irecv_get_status(irecv_client_t client, unsigned int* status)
+{
+	if (check_context(client) != IRECV_E_SUCCESS) {
+		*status = 0;
+		return IRECV_E_NO_DEVICE;
+	}
+
+	unsigned char buffer[6];
+	memset(buffer, '\0', 6);
+	if (irecv_usb_control_transfer(client, 0xA1, 3, 0, 0, buffer, 6, USB_TIMEOUT) != 6) {
+		*status = 0;
+		return IRECV_E_USB_STATUS;
+	}
+
+	*status = (unsigned int) buffer[4];
+
+	return IRECV_E_SUCCESS;
+}
+
+/* progress events carry the byte count as int */
+static int irecv_event_size(uint64_t count)
+{
+	return (count > INT_MAX) ? INT_MAX : (int)count;
+}
+
+/*
+ * Staging memory for bulk transfers. Where libusb supports it (usbfs on
+ * Linux) the buffer is mapped from the kernel so transfers are DMA'd
+ * straight out of it instead of being copied for every URB; otherwise, or
+ * when usbfs refuses the allocation, it comes from the heap. The mapping
+ * belongs to the handle it was allocated from and has to be returned to
+ * that handle, so the buffer remembers it. A client with auto-reconnect
+ * may swap its handle in the middle of a send, closing the one a mapping
+ * came from; such clients always get heap memory.
+ * The saving is the kernel's per-URB copy; it only exists with usbfs and a
+ * real device, so it has not been measured.
+ */
+struct irecv_usb_buffer {
+	unsigned char* data;
+	size_t size;
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+#ifdef HAVE_LIBUSB_DEV_MEM
+	libusb_device_handle* handle;
+#endif
+#endif
+#endif
+};
+
+static unsigned char* irecv_usb_buffer_alloc(irecv_client_t client, struct irecv_usb_buffer* buffer, size_t size)
+{
+	memset(buffer, '\0', sizeof(struct irecv_usb_buffer));
+	buffer->size = size;
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+#ifdef HAVE_LIBUSB_DEV_MEM
+	if (client && client->handle && !client->session) {
+		buffer->data = libusb_dev_mem_alloc(client->handle, size);
+		if (buffer->data) {
+			buffer->handle = client->handle;
+			return buffer->data;
+		}
+		debug("%s: libusb_dev_mem_alloc failed, falling back to heap memory\n", __func__);
+	}
+#endif
+#endif
+#endif
+	buffer->data = (unsigned char*)malloc(size);
+	return buffer->data;
+}
+
+static void irecv_usb_buffer_free(struct irecv_usb_buffer* buffer)
+{
+	if (!buffer->data) {
+		return;
+	}
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+#ifdef HAVE_LIBUSB_DEV_MEM
+	if (buffer->handle) {
+		libusb_dev_mem_free(buffer->handle, buffer->data, buffer->size);
+		buffer->handle = NULL;
+		buffer->data = NULL;
+		return;
+	}
+#endif
+#endif
+#endif
+	free(buffer->data);
+	buffer->data = NULL;
+}
+
+/*
+ * Read-ahead for images sent from a file: a reader thread keeps a small ring
+ * of chunks filled ahead of the transfer engine, so that the latency of slow
+ * or networked storage overlaps with the USB transfers instead of stalling
+ * before the first packet. The chunk size is a multiple of every packet size
+ * used by the send paths, so packets normally never straddle two chunks.
+ * Pipes are read the same way with an unknown length; the ring then doubles
+ * as the buffer between the producer on the other end and the device, and
+ * the number of chunks is only settled once the reader hits end of file.
+ * A group upload shares one ring between several readers: a slot is only
+ * refilled once every reader has sent it, and the DFU CRC of the image is
+ * computed by the reader thread so the members don't each hash the file.
+ */
+#define IRECV_READAHEAD_CHUNK 0x100000
+#define IRECV_READAHEAD_DEPTH 4
+#define IRECV_LENGTH_UNKNOWN UINT64_MAX
+
+struct irecv_readahead {
+	irecv_client_t client;
+	FILE* file;
+	uint64_t length;
+	uint64_t chunks;
+	struct irecv_usb_buffer buf;
+	size_t fill[IRECV_READAHEAD_DEPTH];
+	uint64_t head;
+	uint64_t tail;
+	int error;
+	int stop;
+	unsigned int readers;
+	uint64_t* released;
+	int crc_valid;
+	uint32_t crc;
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t cond;
+	cond_t space;
+};
+
+/* read chunk number index into its ring slot; returns 1 when a stream ended within (or right before) it */
+static int irecv_readahead_fill(struct irecv_readahead* ra, uint64_t index)
+{
+	uint64_t offset = index * IRECV_READAHEAD_CHUNK;
+	size_t size = (ra->length - offset > IRECV_READAHEAD_CHUNK) ? IRECV_READAHEAD_CHUNK : (size_t)(ra->length - offset);
+	unsigned int slot = index % IRECV_READAHEAD_DEPTH;
+
+	unsigned char* chunk = ra->buf.data + (size_t)slot * IRECV_READAHEAD_CHUNK;
+	size_t n = fread(chunk, 1, size, ra->file);
+	ra->fill[slot] = n;
+	if (ra->crc_valid) {
+		size_t i;
+		for (i = 0; i < n; i++) {
+			crc32_step(ra->crc, chunk[i]);
+		}
+	}
+	if (n != size) {
+		if (ra->length == IRECV_LENGTH_UNKNOWN && !ferror(ra->file)) {
+			return 1;
+		}
+		debug("%s: short read at offset %" PRIu64 "\n", __func__, offset + n);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* settle the chunk count once fill() saw the end of a stream at chunk index */
+static void irecv_readahead_eof(struct irecv_readahead* ra, uint64_t index)
+{
+	ra->chunks = index + ((ra->fill[index % IRECV_READAHEAD_DEPTH] > 0) ? 1 : 0);
+	ra->head = ra->chunks;
+}
+
+/* wake the readers waiting for a chunk; cond_signal only wakes one of them, so shared readers also poll */
+static void irecv_readahead_wake(struct irecv_readahead* ra)
+{
+	unsigned int i;
+
+	for (i = 0; i < ra->readers; i++) {
+		cond_signal(&ra->cond);
+	}
+}
+
+static void* irecv_readahead_thread(void* data)
+{
+	struct irecv_readahead* ra = (struct irecv_readahead*)data;
+
+	mutex_lock(&ra->mutex);
+	while (!ra->stop && ra->head < ra->chunks) {
+		if (ra->head - ra->tail >= IRECV_READAHEAD_DEPTH) {
+			cond_wait(&ra->space, &ra->mutex);
+			continue;
+		}
+		uint64_t index = ra->head;
+		mutex_unlock(&ra->mutex);
+
+		int res = irecv_readahead_fill(ra, index);
+
+		mutex_lock(&ra->mutex);
+		if (res < 0) {
+			ra->error = 1;
+		} else if (res > 0) {
+			irecv_readahead_eof(ra, index);
+		} else {
+			ra->head++;
+		}
+		irecv_readahead_wake(ra);
+		if (res != 0) {
+			break;
+		}
+	}
+	mutex_unlock(&ra->mutex);
+
+	return NULL;
+}
+
+/* with usb_buffers set, the chunks are allocated as bulk staging memory so packets go out without a copy;
+ * length is IRECV_LENGTH_UNKNOWN for pipes, which are read until end of file. With more than one reader
+ * the ring is shared (see irecv_readahead_release()) and can't use the staging memory of a single client. */
+static struct irecv_readahead* irecv_readahead_new(irecv_client_t client, FILE* file, uint64_t length, int usb_buffers, unsigned int readers)
+{
+	struct irecv_readahead* ra = (struct irecv_readahead*)calloc(1, sizeof(struct irecv_readahead));
+	if (!ra) {
+		return NULL;
+	}
+	ra->client = client;
+	ra->file = file;
+	ra->length = length;
+	ra->readers = readers;
+	if (readers > 1) {
+		ra->released = (uint64_t*)calloc(readers, sizeof(uint64_t));
+		if (!ra->released) {
+			free(ra);
+			return NULL;
+		}
+		ra->crc_valid = 1;
+		ra->crc = 0xFFFFFFFF;
+		usb_buffers = 0;
+	}
+	if (length == IRECV_LENGTH_UNKNOWN) {
+		ra->chunks = IRECV_LENGTH_UNKNOWN;
+	} else {
+		ra->chunks = (length + IRECV_READAHEAD_CHUNK - 1) / IRECV_READAHEAD_CHUNK;
+	}
+	ra->thread = THREAD_T_NULL;
+
+	size_t depth = (ra->chunks < IRECV_READAHEAD_DEPTH) ? (size_t)ra->chunks : IRECV_READAHEAD_DEPTH;
+	if (depth > 0) {
+		if (!irecv_usb_buffer_alloc((usb_buffers) ? client : NULL, &ra->buf, depth * IRECV_READAHEAD_CHUNK)) {
+			free(ra->released);
+			free(ra);
+			return NULL;
+		}
+	}
+
+	/* a single chunk is read inline when the engine asks for it, unless several readers ask at once */
+	if (ra->chunks > 1 || (ra->released && ra->chunks > 0)) {
+		mutex_init(&ra->mutex);
+		cond_init(&ra->cond);
+		cond_init(&ra->space);
+		if (thread_new(&ra->thread, irecv_readahead_thread, ra) != 0) {
+			cond_destroy(&ra->space);
+			cond_destroy(&ra->cond);
+			mutex_destroy(&ra->mutex);
+			ra->thread = THREAD_T_NULL;
+			if (ra->released) {
+				debug("Failed to start shared read-ahead thread\n");
+				irecv_usb_buffer_free(&ra->buf);
+				free(ra->released);
+				free(ra);
+				return NULL;
+			}
+			debug("Failed to start read-ahead thread, reading inline\n");
+		}
+	}
+
+	return ra;
+}
+
+static void irecv_readahead_free(struct irecv_readahead* ra)
+{
+	if (!ra) {
+		return;
+	}
+	if (ra->thread != THREAD_T_NULL) {
+		mutex_lock(&ra->mutex);
+		ra->stop = 1;
+		cond_signal(&ra->space);
+		mutex_unlock(&ra->mutex);
+		thread_join(ra->thread);
+		thread_free(ra->thread);
+		cond_destroy(&ra->space);
+		cond_destroy(&ra->cond);
+		mutex_destroy(&ra->mutex);
+	}
+	irecv_usb_buffer_free(&ra->buf);
+	free(ra->released);
+	free(ra);
+}
+
+/* return chunk number index, waiting for the reader if needed; NULL past the end and on read errors */
+static const unsigned char* irecv_readahead_get(struct irecv_readahead* ra, uint64_t index, size_t* size)
+{
+	if (ra->thread == THREAD_T_NULL) {
+		if (index >= ra->chunks || ra->error) {
+			return NULL;
+		}
+		if (index >= ra->head) {
+			int res = irecv_readahead_fill(ra, index);
+			if (res < 0) {
+				ra->error = 1;
+				return NULL;
+			}
+			if (res > 0) {
+				irecv_readahead_eof(ra, index);
+				if (index >= ra->chunks) {
+					return NULL;
+				}
+			} else {
+				ra->head = index + 1;
+			}
+		}
+	} else {
+		mutex_lock(&ra->mutex);
+		while (ra->head <= index && index < ra->chunks && !ra->error) {
+			if (ra->released) {
+				cond_wait_timeout(&ra->cond, &ra->mutex, 10);
+			} else {
+				cond_wait(&ra->cond, &ra->mutex);
+			}
+		}
+		int failed = (ra->head <= index);
+		mutex_unlock(&ra->mutex);
+		if (failed) {
+			return NULL;
+		}
+	}
+
+	unsigned int slot = index % IRECV_READAHEAD_DEPTH;
+	*size = ra->fill[slot];
+
+	return ra->buf.data + (size_t)slot * IRECV_READAHEAD_CHUNK;
+}
+
+static int irecv_readahead_failed(struct irecv_readahead* ra)
+{
+	if (ra->thread == THREAD_T_NULL) {
+		return ra->error;
+	}
+	mutex_lock(&ra->mutex);
+	int error = ra->error;
+	mutex_unlock(&ra->mutex);
+	return error;
+}
+
+/* the DFU CRC over the whole image, computed while reading; only valid once the last chunk was handed out */
+static uint32_t irecv_readahead_crc(struct irecv_readahead* ra)
+{
+	if (ra->thread == THREAD_T_NULL) {
+		return ra->crc;
+	}
+	mutex_lock(&ra->mutex);
+	uint32_t crc = ra->crc;
+	mutex_unlock(&ra->mutex);
+	return crc;
+}
+
+/* hand all chunks before index back to the reader thread; a shared ring only moves on once every
+ * reader is past them, and a reader that is done (or gave up) passes UINT64_MAX */
+static void irecv_readahead_release(struct irecv_readahead* ra, unsigned int reader, uint64_t index)
+{
+	unsigned int i;
+
+	if (ra->thread == THREAD_T_NULL) {
+		/* a shared ring without a thread is empty */
+		if (!ra->released) {
+			ra->tail = index;
+		}
+		return;
+	}
+	mutex_lock(&ra->mutex);
+	if (ra->released) {
+		ra->released[reader] = index;
+		for (i = 0; i < ra->readers; i++) {
+			if (ra->released[i] < index) {
+				index = ra->released[i];
+			}
+		}
+	}
+	if (index == UINT64_MAX) {
+		ra->stop = 1;
+		cond_signal(&ra->space);
+	} else if (index > ra->tail) {
+		ra->tail = index;
+		cond_signal(&ra->space);
+	}
+	mutex_unlock(&ra->mutex);
+}
+
+struct irecv_payload {
+	const struct irecv_iovec* iov;
+	unsigned int count;
+	uint64_t length;
+	uint64_t offset;
+	unsigned int part;
+	size_t part_offset;
+	unsigned int pkt_part;
+	size_t pkt_offset;
+	size_t pkt_length;
+	unsigned char* bounce;
+	size_t bounce_size;
+	irecv_error_t error;
+	struct irecv_readahead* ra;
+	unsigned int ra_reader;
+	uint64_t ra_chunk;
+	uint64_t ra_released;
+	size_t ra_offset;
+	const unsigned char* pkt_seg[2];
+	size_t pkt_seg_len[2];
+	int crc_valid;
+	uint32_t crc;
+};
+
+static irecv_error_t irecv_payload_init(struct irecv_payload* payload, const struct irecv_iovec* iov, unsigned int count)
+{
+	unsigned int i;
+
+	memset(payload, '\0', sizeof(struct irecv_payload));
+	if (count > 0 && !iov) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	for (i = 0; i < count; i++) {
+		if (iov[i].iov_len > 0 && !iov[i].iov_base) {
+			return IRECV_E_INVALID_INPUT;
+		}
+		if ((uint64_t)iov[i].iov_len > UINT64_MAX - payload->length) {
+			return IRECV_E_INVALID_INPUT;
+		}
+		payload->length += iov[i].iov_len;
+	}
+	payload->iov = iov;
+	payload->count = count;
+
+	return IRECV_E_SUCCESS;
+}
+
+static void irecv_payload_init_readahead(struct irecv_payload* payload, struct irecv_readahead* ra, unsigned int reader)
+{
+	memset(payload, '\0', sizeof(struct irecv_payload));
+	payload->length = ra->length;
+	payload->ra = ra;
+	payload->ra_reader = reader;
+	payload->crc_valid = ra->crc_valid;
+}
+
+static int irecv_payload_reserve(struct irecv_payload* payload, size_t size)
+{
+	if (payload->bounce_size < size) {
+		unsigned char* bounce = (unsigned char*)realloc(payload->bounce, size);
+		if (!bounce) {
+			payload->error = IRECV_E_OUT_OF_MEMORY;
+			return -1;
+		}
+		payload->bounce = bounce;
+		payload->bounce_size = size;
+	}
+	return 0;
+}
+
+/*
+ * Take the next size bytes from the read-ahead ring. Chunks are only handed
+ * back once the engine asks for the following packet, so the memory of the
+ * previous packet stays valid until it has been digested.
+ */
+static const unsigned char* irecv_payload_take_readahead(irecv_client_t client, struct irecv_payload* payload, unsigned char* dst, size_t size)
+{
+	struct irecv_readahead* ra = payload->ra;
+	const unsigned char* chunk;
+	size_t chunk_size = 0;
+	unsigned int seg = 0;
+
+	if (payload->ra_released < payload->ra_chunk) {
+		irecv_digest_flush(client);
+		irecv_readahead_release(ra, payload->ra_reader, payload->ra_chunk);
+		payload->ra_released = payload->ra_chunk;
+	}
+
+	payload->pkt_seg_len[0] = 0;
+	payload->pkt_seg_len[1] = 0;
+	payload->pkt_length = size;
+
+	chunk = irecv_readahead_get(ra, payload->ra_chunk, &chunk_size);
+	if (chunk && payload->ra_offset == chunk_size && size > 0) {
+		payload->ra_chunk++;
+		payload->ra_offset = 0;
+		chunk = irecv_readahead_get(ra, payload->ra_chunk, &chunk_size);
+	}
+	if (!chunk) {
+		payload->error = IRECV_E_UNKNOWN_ERROR;
+		return NULL;
+	}
+
+	if (!dst && chunk_size - payload->ra_offset >= size) {
+		const unsigned char* data = chunk + payload->ra_offset;
+		payload->pkt_seg[0] = data;
+		payload->pkt_seg_len[0] = size;
+		payload->ra_offset += size;
+		payload->offset += size;
+		return data;
+	}
+
+	if (!dst) {
+		if (irecv_payload_reserve(payload, size) < 0) {
+			return NULL;
+		}
+		dst = payload->bounce;
+	}
+
+	unsigned char* p = dst;
+	while (size > 0) {
+		if (payload->ra_offset == chunk_size) {
+			payload->ra_chunk++;
+			payload->ra_offset = 0;
+			chunk = irecv_readahead_get(ra, payload->ra_chunk, &chunk_size);
+			if (!chunk) {
+				payload->error = IRECV_E_UNKNOWN_ERROR;
+				return NULL;
+			}
+		}
+		size_t avail = chunk_size - payload->ra_offset;
+		size_t n = (avail < size) ? avail : size;
+		memcpy(p, chunk + payload->ra_offset, n);
+		if (seg < 2) {
+			payload->pkt_seg[seg] = chunk + payload->ra_offset;
+			payload->pkt_seg_len[seg] = n;
+			seg++;
+		}
+		p += n;
+		size -= n;
+		payload->ra_offset += n;
+		payload->offset += n;
+	}
+
+	return dst;
+}
+
+/*
+ * Number of bytes, up to want, that are left in the payload. For streams this
+ * waits until the reader has either buffered that much or reached the end;
+ * read errors are left in payload->error.
+ */
+static size_t irecv_payload_available(struct irecv_payload* payload, size_t want)
+{
+	struct irecv_readahead* ra = payload->ra;
+
+	if (payload->length != IRECV_LENGTH_UNKNOWN) {
+		uint64_t left = payload->length - payload->offset;
+		return (left < want) ? (size_t)left : want;
+	}
+
+	uint64_t index = payload->ra_chunk;
+	size_t offset = payload->ra_offset;
+	size_t avail = 0;
+	while (avail < want) {
+		size_t chunk_size = 0;
+		if (!irecv_readahead_get(ra, index, &chunk_size)) {
+			if (irecv_readahead_failed(ra)) {
+				payload->error = IRECV_E_UNKNOWN_ERROR;
+			}
+			break;
+		}
+		avail += chunk_size - offset;
+		index++;
+		offset = 0;
+	}
+
+	return (avail < want) ? avail : want;
+}
+
+static void irecv_payload_free(struct irecv_payload* payload)
+{
+	free(payload->bounce);
+	payload->bounce = NULL;
+	payload->bounce_size = 0;
+}
+
+static void irecv_payload_skip_empty(struct irecv_payload* payload)
+{
+	while (payload->part < payload->count && payload->part_offset >= payload->iov[payload->part].iov_len) {
+		payload->part++;
+		payload->part_offset = 0;
+	}
+}
+
+/* copy the next size bytes into dst, crossing part boundaries as needed */
+static irecv_error_t irecv_payload_read(irecv_client_t client, struct irecv_payload* payload, unsigned char* dst, size_t size)
+{
+	if (payload->ra) {
+		return irecv_payload_take_readahead(client, payload, dst, size) ? IRECV_E_SUCCESS : payload->error;
+	}
+
+	irecv_payload_skip_empty(payload);
+	payload->pkt_part = payload->part;
+	payload->pkt_offset = payload->part_offset;
+	payload->pkt_length = size;
+
+	while (size > 0) {
+		irecv_payload_skip_empty(payload);
+		size_t avail = payload->iov[payload->part].iov_len - payload->part_offset;
+		size_t n = (avail < size) ? avail : size;
+		memcpy(dst, (const unsigned char*)payload->iov[payload->part].iov_base + payload->part_offset, n);
+		dst += n;
+		size -= n;
+		payload->part_offset += n;
+		payload->offset += n;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* return the next size bytes as one contiguous block; only packets straddling parts are copied */
+static const unsigned char* irecv_payload_next(irecv_client_t client, struct irecv_payload* payload, size_t size, int* is_last)
+{
+	const unsigned char* data = NULL;
+
+	if (payload->ra) {
+		data = irecv_payload_take_readahead(client, payload, NULL, size);
+		if (data && is_last) {
+			*is_last = (irecv_payload_available(payload, 1) == 0);
+		}
+		return data;
+	}
+
+	irecv_payload_skip_empty(payload);
+	if (size > 0 && payload->iov[payload->part].iov_len - payload->part_offset >= size) {
+		data = (const unsigned char*)payload->iov[payload->part].iov_base + payload->part_offset;
+		payload->pkt_part = payload->part;
+		payload->pkt_offset = payload->part_offset;
+		payload->pkt_length = size;
+		payload->part_offset += size;
+		payload->offset += size;
+	} else if (size > 0) {
+		if (irecv_payload_reserve(payload, size) < 0) {
+			return NULL;
+		}
+		irecv_payload_read(client, payload, payload->bounce, size);
+		data = payload->bounce;
+	}
+	if (is_last) {
+		*is_last = (payload->offset == payload->length);
+	}
+
+	return data;
+}
+
+/* hand the bytes of the packet just taken to the digest, using the caller's memory */
+static void irecv_payload_digest(irecv_client_t client, struct irecv_payload* payload)
+{
+	unsigned int part = payload->pkt_part;
+	size_t offset = payload->pkt_offset;
+	size_t left = payload->pkt_length;
+
+	if (payload->ra) {
+		int i;
+		for (i = 0; i < 2; i++) {
+			if (payload->pkt_seg_len[i] > 0) {
+				irecv_digest_feed(client, payload->pkt_seg[i], payload->pkt_seg_len[i]);
+			}
+		}
+		return;
+	}
+
+	while (left > 0 && part < payload->count) {
+		size_t avail = payload->iov[part].iov_len - offset;
+		size_t n = (avail < left) ? avail : left;
+		if (n > 0) {
+			irecv_digest_feed(client, (const unsigned char*)payload->iov[part].iov_base + offset, n);
+		}
+		left -= n;
+		part++;
+		offset = 0;
+	}
+}
+
+static irecv_error_t irecv_kis_send_payload(irecv_client_t client, struct irecv_payload* payload, unsigned int options)
+{
+	if (client->mode != IRECV_K_DFU_MODE) {
+		return IRECV_E_UNSUPPORTED;
+	}
+
+	uint64_t origLen = payload->length;
+	int streaming = (origLen == IRECV_LENGTH_UNKNOWN);
+
+	if ((options & IRECV_SEND_OPT_DFU_NOTIFY_FINISH) && !streaming && origLen > UINT32_MAX) {
+		/* the image size is passed to the device as a 32-bit value */
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_usb_buffer chunk_buffer;
+	KIS_upload_chunk *chunk = (KIS_upload_chunk*)irecv_usb_buffer_alloc(client, &chunk_buffer, sizeof(KIS_upload_chunk));
+	if (!chunk) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	memset(chunk, '\0', sizeof(KIS_upload_chunk));
+	uint64_t address = 0;
+	while (1) {
+		size_t toUpload = irecv_payload_available(payload, 0x4000);
+		if (payload->error != IRECV_E_SUCCESS) {
+			irecv_usb_buffer_free(&chunk_buffer);
+			return payload->error;
+		}
+		if (toUpload == 0) {
+			break;
+		}
+
+#ifdef _WIN32
+		irecv_error_t error = irecv_payload_read(client, payload, chunk->data, toUpload);
+		if (error != IRECV_E_SUCCESS) {
+			irecv_usb_buffer_free(&chunk_buffer);
+			return error;
+		}
+		chunk->size    = toUpload;
+		chunk->address = address;
+#else
+		irecv_error_t error = irecv_kis_request_init(&chunk->hdr, KIS_PORTAL_RSM, KIS_INDEX_UPLOAD, 3, toUpload, 0);
+		if (error != IRECV_E_SUCCESS) {
+			irecv_usb_buffer_free(&chunk_buffer);
+			debug("Failed to init chunk header, error %d\n", error);
+			return error;
+		}
+
+		chunk->address = address;
+		chunk->size    = toUpload;
+		error = irecv_payload_read(client, payload, chunk->data, toUpload);
+		if (error != IRECV_E_SUCCESS) {
+			irecv_usb_buffer_free(&chunk_buffer);
+			return error;
+		}
+#endif
+
+#ifdef _WIN32
+		DWORD transferred = 0;
+		int ret = DeviceIoControl(client->handle, 0x220008, chunk, sizeof(*chunk), NULL, 0, (PDWORD)&transferred, NULL);
+		error = (ret) ? IRECV_E_SUCCESS : IRECV_E_USB_UPLOAD;
+#else
+		KIS_generic_reply reply;
+		size_t rcvSize = sizeof(reply);
+		error = irecv_kis_request(client, &chunk->hdr, sizeof(*chunk) - (0x4000 - toUpload), &reply.hdr, &rcvSize);
+#endif
+		if (error != IRECV_E_SUCCESS) {
+			irecv_usb_buffer_free(&chunk_buffer);
+			debug("Failed to upload chunk, error %d\n", error);
+			return error;
+		}
+
+		irecv_sched_account(client, toUpload);
+		irecv_payload_digest(client, payload);
+		irecv_progress_advance(client, payload->offset);
+
+		address += toUpload;
+
+		if (client->progress_callback != NULL) {
+			irecv_event_t event;
+			event.progress = streaming ? -1.0 : ((double) address / (double) origLen) * 100.0;
+			event.type = IRECV_PROGRESS;
+			event.data = (char*)"Uploading";
+			event.size = irecv_event_size(address);
+			client->progress_callback(client, &event);
+		} else {
+			debug("Sent: %zu bytes - %" PRIu64 " of %" PRIu64 "\n", toUpload, address, streaming ? address : origLen);
+		}
+	}
+	irecv_usb_buffer_free(&chunk_buffer);
+	origLen = address;
+
+	if (options & IRECV_SEND_OPT_DFU_NOTIFY_FINISH) {
+		if (origLen > UINT32_MAX) {
+			/* only known at this point for streams */
+			return IRECV_E_INVALID_INPUT;
+		}
+		uint64_t manifest_start = irecv_time_us();
+		irecv_progress_set_phase(client, IRECV_TRANSFER_FINISHING);
+#ifdef _WIN32
+		DWORD amount = (DWORD)origLen;
+		DWORD transferred = 0;
+		int ret = DeviceIoControl(client->handle, 0x22000C, &amount, 4, NULL, 0, (PDWORD)&transferred, NULL);
+		irecv_error_t error = (ret) ? IRECV_E_SUCCESS : IRECV_E_USB_UPLOAD;
+#else
+		irecv_error_t error = irecv_kis_config_write32(client, KIS_PORTAL_RSM, KIS_INDEX_BOOT_IMG, (uint32_t)origLen);
+#endif
+		irecv_timing_report(client, IRECV_TIMING_MANIFEST, manifest_start, 0, error);
+		if (error != IRECV_E_SUCCESS) {
+			debug("Failed to boot image, error %d\n", error);
+			return error;
+		}
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* per-packet bookkeeping shared by the recovery and DFU loops */
+static void irecv_send_advance(irecv_client_t client, struct irecv_payload* payload, int size, uint64_t* count)
+{
+	*count += size;
+	irecv_sched_account(client, size);
+	irecv_payload_digest(client, payload);
+	irecv_progress_advance(client, payload->offset);
+	if (client->progress_callback != NULL) {
+		irecv_event_t event;
+		event.progress = (payload->length == IRECV_LENGTH_UNKNOWN) ? -1.0 : ((double) *count/ (double) payload->length) * 100.0;
+		event.type = IRECV_PROGRESS;
+		event.data = (char*)"Uploading";
+		event.size = irecv_event_size(*count);
+		client->progress_callback(client, &event);
+	} else {
+		debug("Sent: %d bytes - %" PRIu64 " of %" PRIu64 "\n", size, *count, (payload->length == IRECV_LENGTH_UNKNOWN) ? *count : payload->length);
+	}
+}
+
+static irecv_error_t irecv_send_recovery(irecv_client_t client, struct irecv_payload* payload)
+{
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	/* initiate transfer */
+	irecv_error_t error = irecv_usb_control_transfer(client, 0x41, 0, 0, 0, NULL, 0, USB_TIMEOUT);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+
+	uint64_t count = 0;
+	int bytes = 0;
+	const unsigned char* data = NULL;
+	/* the packet count is not known up front for streams, so go until the payload runs dry */
+	int is_last = (irecv_payload_available(payload, 1) == 0);
+	if (payload->error != IRECV_E_SUCCESS) {
+		return payload->error;
+	}
+	while (!is_last) {
+		int size = (int)irecv_payload_available(payload, 0x8000);
+		data = irecv_payload_next(client, payload, size, &is_last);
+		if (!data) {
+			return payload->error;
+		}
+		error = irecv_usb_bulk_transfer(client, 0x04, (unsigned char*)data, size, &bytes, USB_TIMEOUT);
+		if (bytes != size) {
+			return IRECV_E_USB_UPLOAD;
+		}
+		if (error != IRECV_E_SUCCESS) {
+			return error;
+		}
+		irecv_send_advance(client, payload, size, &count);
+	}
+	if (payload->error != IRECV_E_SUCCESS) {
+		return payload->error;
+	}
+
+	if (payload->offset % 512 == 0) {
+		/* send a ZLP */
+		bytes = 0;
+		irecv_usb_bulk_transfer(client, 0x04, (unsigned char*)data, 0, &bytes, USB_TIMEOUT);
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t irecv_dfu_begin(irecv_client_t client)
+{
+	uint8_t state = 0;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (irecv_usb_control_transfer(client, 0xa1, 5, 0, 0, (unsigned char*)&state, 1, USB_TIMEOUT) != 1) {
+		return IRECV_E_USB_UPLOAD;
+	}
+	switch (state) {
+	case 2:
+		/* DFU IDLE */
+		break;
+	case 10:
+		debug("DFU ERROR, issuing CLRSTATUS\n");
+		irecv_usb_control_transfer(client, 0x21, 4, 0, 0, NULL, 0, USB_TIMEOUT);
+		return IRECV_E_USB_UPLOAD;
+	default:
+		debug("Unexpected state %d, issuing ABORT\n", state);
+		irecv_usb_control_transfer(client, 0x21, 6, 0, 0, NULL, 0, USB_TIMEOUT);
+		return IRECV_E_USB_UPLOAD;
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+/* wait for dfuDNLOAD-IDLE after a block */
+static irecv_error_t irecv_dfu_wait_idle(irecv_client_t client)
+{
+	unsigned int status = 0;
+	irecv_error_t error = irecv_get_status(client, &status);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+
+	if (status != 5) {
+		int retry = 0;
+
+		while (retry++ < 20) {
+			irecv_metrics_retry(client);
+			irecv_get_status(client, &status);
+			if (status == 5) {
+				break;
+			}
+			sleep(1);
+		}
+
+		if (status != 5) {
+			return IRECV_E_USB_UPLOAD;
+		}
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t irecv_dfu_finish(irecv_client_t client, uint64_t blocks, const unsigned char* data, unsigned int options)
+{
+	if (!(options & IRECV_SEND_OPT_DFU_NOTIFY_FINISH)) {
+		return IRECV_E_SUCCESS;
+	}
+
+	unsigned int status = 0;
+	int i;
+	uint64_t manifest_start = irecv_time_us();
+	irecv_progress_set_phase(client, IRECV_TRANSFER_FINISHING);
+	irecv_usb_control_transfer(client, 0x21, 1, (uint16_t)(blocks & 0xFFFF), 0, (unsigned char*)data, 0, USB_TIMEOUT);
+
+	for (i = 0; i < 2; i++) {
+		irecv_error_t error = irecv_get_status(client, &status);
+		if (error != IRECV_E_SUCCESS) {
+			irecv_timing_report(client, IRECV_TIMING_MANIFEST, manifest_start, 0, error);
+			return error;
+		}
+	}
+
+	if ((options & IRECV_SEND_OPT_DFU_FORCE_ZLP)) {
+		/* we send a pseudo ZLP here just in case */
+		irecv_usb_control_transfer(client, 0x21, 1, 0, 0, 0, 0, USB_TIMEOUT);
+	}
+	irecv_timing_report(client, IRECV_TIMING_MANIFEST, manifest_start, 0, IRECV_E_SUCCESS);
+
+	irecv_reset(client);
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t irecv_send_dfu(irecv_client_t client, struct irecv_payload* payload, unsigned int options)
+{
+	const int packet_size = 0x800;
+	unsigned char dfu_xbuf[12] = {0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 0x55, 0x46, 0x44, 0x10};
+	uint32_t h1 = 0xFFFFFFFF;
+
+	irecv_error_t error = irecv_dfu_begin(client);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+
+	/* the image store hands in a precomputed CRC */
+	int hash = !payload->crc_valid;
+	uint64_t i = 0;
+	uint64_t count = 0;
+	int size = 0;
+	const unsigned char* data = NULL;
+	int is_last = (irecv_payload_available(payload, 1) == 0);
+	if (payload->error != IRECV_E_SUCCESS) {
+		return payload->error;
+	}
+	if (is_last) {
+		/* the digest still reports the CRC of the empty image */
+		irecv_digest_set_crc(client, h1);
+		return irecv_dfu_finish(client, 0, NULL, options);
+	}
+
+	/* every block but the last goes out as is */
+	for (i = 0; ; i++) {
+		size = (int)irecv_payload_available(payload, packet_size);
+		data = irecv_payload_next(client, payload, size, &is_last);
+		if (!data) {
+			return payload->error;
+		}
+		if (hash) {
+			int j;
+			for (j = 0; j < size; j++) {
+				crc32_step(h1, data[j]);
+			}
+		}
+		if (is_last) {
+			break;
+		}
+		if (irecv_usb_control_transfer(client, 0x21, 1, (uint16_t)(i & 0xFFFF), 0, (unsigned char*)data, size, USB_TIMEOUT) != size) {
+			return IRECV_E_USB_UPLOAD;
+		}
+		error = irecv_dfu_wait_idle(client);
+		if (error != IRECV_E_SUCCESS) {
+			return error;
+		}
+		irecv_send_advance(client, payload, size, &count);
+	}
+
+	/* the last block carries the DFU suffix and the CRC over image and suffix */
+	uint16_t block = (uint16_t)(i & 0xFFFF);
+	int j;
+	if (!hash) {
+		h1 = (payload->ra) ? irecv_readahead_crc(payload->ra) : payload->crc;
+	}
+	if (size+16 > packet_size) {
+		if (irecv_usb_control_transfer(client, 0x21, 1, block, 0, (unsigned char*)data, size, USB_TIMEOUT) != size) {
+			return IRECV_E_USB_UPLOAD;
+		}
+		count += size;
+		irecv_sched_account(client, size);
+		size = 0;
+	}
+	irecv_digest_set_crc(client, h1);
+	for (j = 0; j < 12; j++) {
+		crc32_step(h1, dfu_xbuf[j]);
+	}
+
+	unsigned char newbuf[0x800 + 16];
+	if (size > 0) {
+		memcpy(newbuf, data, size);
+	}
+	memcpy(newbuf+size, dfu_xbuf, 12);
+	newbuf[size+12] = h1 & 0xFF;
+	newbuf[size+13] = (h1 >> 8) & 0xFF;
+	newbuf[size+14] = (h1 >> 16) & 0xFF;
+	newbuf[size+15] = (h1 >> 24) & 0xFF;
+	size += 16;
+	if (irecv_usb_control_transfer(client, 0x21, 1, block, 0, newbuf, size, USB_TIMEOUT) != size) {
+		return IRECV_E_USB_UPLOAD;
+	}
+	error = irecv_dfu_wait_idle(client);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+	irecv_send_advance(client, payload, size, &count);
+	if (payload->error != IRECV_E_SUCCESS) {
+		return payload->error;
+	}
+
+	return irecv_dfu_finish(client, i + 1, data, options);
+}
+
+/* IRECV_SEND_OPT_DFU_SMALL_PKT: 64 byte blocks without the DFU suffix */
+static irecv_error_t irecv_send_dfu_small(irecv_client_t client, struct irecv_payload* payload, unsigned int options)
+{
+	irecv_error_t error = irecv_dfu_begin(client);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+
+	uint64_t i = 0;
+	uint64_t count = 0;
+	const unsigned char* data = NULL;
+	int is_last = (irecv_payload_available(payload, 1) == 0);
+	if (payload->error != IRECV_E_SUCCESS) {
+		return payload->error;
+	}
+	for (i = 0; !is_last; i++) {
+		int size = (int)irecv_payload_available(payload, 0x40);
+		data = irecv_payload_next(client, payload, size, &is_last);
+		if (!data) {
+			return payload->error;
+		}
+		if (irecv_usb_control_transfer(client, 0x21, 1, (uint16_t)(i & 0xFFFF), 0, (unsigned char*)data, size, USB_TIMEOUT) != size) {
+			return IRECV_E_USB_UPLOAD;
+		}
+		error = irecv_dfu_wait_idle(client);
+		if (error != IRECV_E_SUCCESS) {
+			return error;
+		}
+		irecv_send_advance(client, payload, size, &count);
+	}
+	if (payload->error != IRECV_E_SUCCESS) {
+		return payload->error;
+	}
+
+	return irecv_dfu_finish(client, i, data, options);
+}
+
+enum {
+	IRECV_STRATEGY_RECOVERY = 0,
+	IRECV_STRATEGY_DFU,
+	IRECV_STRATEGY_DFU_SMALL,
+	IRECV_STRATEGY_KIS
+};
+
+/* KIS sits on top of DFU, so it keeps the DFU download packet size and CLRSTATUS */
+static const struct irecv_strategy irecv_strategies[] = {
+	{ "recovery", 0x2000, IRECV_STRATEGY_BULK },
+	{ "dfu", 0x800, IRECV_STRATEGY_DFU_CLASS | IRECV_STRATEGY_DFU_CRC },
+	{ "dfu-small", 0x800, IRECV_STRATEGY_DFU_CLASS },
+	{ "kis", 0x800, IRECV_STRATEGY_DFU_CLASS }
+};
+
+static void irecv_strategy_bind(irecv_client_t client)
+{
+	int strategy = IRECV_STRATEGY_RECOVERY;
+
+	if (client->isKIS) {
+		strategy = IRECV_STRATEGY_KIS;
+	} else if ((client->mode == IRECV_K_DFU_MODE) || (client->mode == IRECV_K_PORT_DFU_MODE) || (client->mode == IRECV_K_WTF_MODE)) {
+		strategy = IRECV_STRATEGY_DFU;
+	}
+	client->strategy = &irecv_strategies[strategy];
+	debug("%s: %s\n", __func__, client->strategy->name);
+}
+
+static const struct irecv_strategy* irecv_strategy_for_send(irecv_client_t client, unsigned int options)
+{
+	if (!client->strategy) {
+		irecv_strategy_bind(client);
+	}
+	if ((options & IRECV_SEND_OPT_DFU_SMALL_PKT) && client->strategy == &irecv_strategies[IRECV_STRATEGY_DFU]) {
+		return &irecv_strategies[IRECV_STRATEGY_DFU_SMALL];
+	}
+
+	return client->strategy;
+}
+
+static irecv_error_t irecv_send_payload(irecv_client_t client, struct irecv_payload* payload, unsigned int options)
+{
+	irecv_error_t error;
+	const struct irecv_strategy* strategy;
+
+	if (client->readonly) {
+		irecv_payload_free(payload);
+		return IRECV_E_UNSUPPORTED;
+	}
+
+	/* a reattach can bring the device back in another mode, so only pick
+	 * the protocol once the handle is known to be current */
+	if (check_context(client) != IRECV_E_SUCCESS) {
+		irecv_payload_free(payload);
+		return IRECV_E_NO_DEVICE;
+	}
+	strategy = irecv_strategy_for_send(client, options);
+
+	/* streams report a total of 0 while the length is unknown */
+	uint64_t total = (payload->length == IRECV_LENGTH_UNKNOWN) ? 0 : payload->length;
+
+	irecv_progress_begin(client, IRECV_TRANSFER_WAITING, total);
+	error = irecv_sched_acquire(client);
+	if (error != IRECV_E_SUCCESS) {
+		irecv_progress_leave(client, IRECV_TRANSFER_FAILED, error);
+		irecv_payload_free(payload);
+		return error;
+	}
+	irecv_progress_begin(client, IRECV_TRANSFER_UPLOAD, total);
+	irecv_digest_begin(client, payload->length, (strategy->flags & IRECV_STRATEGY_DFU_CRC) != 0);
+	switch (strategy - irecv_strategies) {
+	case IRECV_STRATEGY_DFU:
+		error = irecv_send_dfu(client, payload, options);
+		break;
+	case IRECV_STRATEGY_DFU_SMALL:
+		error = irecv_send_dfu_small(client, payload, options);
+		break;
+	case IRECV_STRATEGY_KIS:
+		error = irecv_kis_send_payload(client, payload, options);
+		break;
+	default:
+		error = irecv_send_recovery(client, payload);
+		break;
+	}
+	irecv_digest_end(client, error);
+	irecv_sched_release(client);
+	irecv_progress_end(client, error);
+	irecv_payload_free(payload);
+
+	return error;
+}
+#endif
+
+irecv_error_t irecv_send_buffer(irecv_client_t client, unsigned char* buffer, unsigned long length, unsigned int options)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct irecv_iovec iov;
+	struct irecv_payload payload;
+
+	iov.iov_base = buffer;
+	iov.iov_len = length;
+	if (irecv_payload_init(&payload, &iov, 1) != IRECV_E_SUCCESS) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	return irecv_send_payload(client, &payload, options);
+#endif
+}
+
+irecv_error_t irecv_send_iov(irecv_client_t client, const struct irecv_iovec* iov, unsigned int count, unsigned int options)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct irecv_payload payload;
+
+	irecv_error_t error = irecv_payload_init(&payload, iov, count);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+
+	return irecv_send_payload(client, &payload, options);
+#endif
+}
+
+#ifndef USE_DUMMY
+static irecv_error_t irecv_send_stream(irecv_client_t client, FILE* file, unsigned int options)
+{
+	struct stat fst;
+	if (fstat(fileno(file), &fst) < 0) {
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	/* the image is streamed through the read-ahead ring instead of being loaded up front;
+	 * recovery mode sends its bulk packets straight out of the ring. Anything that is not
+	 * a regular file (pipes, FIFOs, character devices) is read until end of file. */
+	uint64_t length = S_ISREG(fst.st_mode) ? (uint64_t)fst.st_size : IRECV_LENGTH_UNKNOWN;
+	struct irecv_readahead* ra = irecv_readahead_new(client, file, length, (irecv_strategy_for_send(client, options)->flags & IRECV_STRATEGY_BULK) != 0, 1);
+	if (ra == NULL) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	struct irecv_payload payload;
+	irecv_payload_init_readahead(&payload, ra, 0);
+
+	irecv_error_t error = irecv_send_payload(client, &payload, options);
+	irecv_readahead_free(ra);
+
+	return error;
+}
+
+/* one member of a group upload, reading from the ring shared by the group */
+static irecv_error_t irecv_send_shared(irecv_client_t client, struct irecv_readahead* ra, unsigned int reader, unsigned int options)
+{
+	struct irecv_payload payload;
+	irecv_payload_init_readahead(&payload, ra, reader);
+
+	irecv_error_t error = irecv_send_payload(client, &payload, options);
+	/* don't hold the other members up if this one stopped early */
+	irecv_readahead_release(ra, reader, UINT64_MAX);
+
+	return error;
+}
+#endif
+
+irecv_error_t irecv_send_file(irecv_client_t client, const char* filename, unsigned int options)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL) {
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+
+	irecv_error_t error = irecv_send_stream(client, file, options);
+	fclose(file);
+
+	return error;
+#endif
+}
+
+irecv_error_t irecv_send_fd(irecv_client_t client, int fd, unsigned int options)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (fd < 0) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	/* read through a duplicate so the caller keeps ownership of fd */
+	int dupfd = dup(fd);
+	if (dupfd < 0) {
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	FILE* file = fdopen(dupfd, "rb");
 	if (file == NULL) {
+		close(dupfd);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	irecv_error_t error = irecv_send_stream(client, file, options);
+	fclose(file);
+
+	return error;
+#endif
+}
+
+#if !defined(USE_DUMMY) && !defined(_WIN32)
+/*
+ * Content-addressed image store. Images live in <path>/<sha256>.img and are
+ * described by a fixed-size record in <path>/index, which is mmap'd and
+ * shared between processes using the store (serialized with flock()). Each
+ * record keeps what the send path would otherwise recompute: the image size
+ * and the DFU CRC over the whole image. The least recently sent images are
+ * evicted once the store exceeds its size limit.
+ */
+#define IRECV_STORE_MAGIC "IRSTORE1"
+#define IRECV_STORE_VERSION 1
+#define IRECV_STORE_INITIAL_CAPACITY 64
+
+struct irecv_store_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t capacity;
+	uint64_t clock;
+	uint64_t total_size;
+};
+
+struct irecv_store_entry {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	uint64_t size;
+	uint64_t last_used;
+	uint32_t dfu_crc;
+	uint32_t used;
+};
+
+struct irecv_image_store {
+	char* path;
+	uint64_t max_size;
+	int fd;
+	unsigned char* map;
+	size_t map_size;
+	mutex_t mutex;
+};
+
+#define IRECV_STORE_INDEX_SIZE(capacity) (sizeof(struct irecv_store_header) + (size_t)(capacity) * sizeof(struct irecv_store_entry))
+
+static struct irecv_store_header* irecv_store_header(irecv_image_store_t store)
+{
+	return (struct irecv_store_header*)store->map;
+}
+
+static struct irecv_store_entry* irecv_store_entries(irecv_image_store_t store)
+{
+	return (struct irecv_store_entry*)(store->map + sizeof(struct irecv_store_header));
+}
+
+static int irecv_store_map(irecv_image_store_t store)
+{
+	struct stat st;
+
+	if (store->map) {
+		munmap(store->map, store->map_size);
+		store->map = NULL;
+		store->map_size = 0;
+	}
+	if (fstat(store->fd, &st) < 0 || (size_t)st.st_size < sizeof(struct irecv_store_header)) {
+		return -1;
+	}
+	void* map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd, 0);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+	store->map = (unsigned char*)map;
+	store->map_size = (size_t)st.st_size;
+
+	struct irecv_store_header* hdr = irecv_store_header(store);
+	if (memcmp(hdr->magic, IRECV_STORE_MAGIC, 8) != 0 || hdr->version != IRECV_STORE_VERSION || IRECV_STORE_INDEX_SIZE(hdr->capacity) > store->map_size) {
+		debug("%s: invalid index in %s\n", __func__, store->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int irecv_store_lock(irecv_image_store_t store)
+{
+	mutex_lock(&store->mutex);
+	if (flock(store->fd, LOCK_EX) < 0) {
+		mutex_unlock(&store->mutex);
+		return -1;
+	}
+	/* another process may have grown the index */
+	if (IRECV_STORE_INDEX_SIZE(irecv_store_header(store)->capacity) != store->map_size) {
+		if (irecv_store_map(store) < 0) {
+			flock(store->fd, LOCK_UN);
+			mutex_unlock(&store->mutex);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void irecv_store_unlock(irecv_image_store_t store)
+{
+	flock(store->fd, LOCK_UN);
+	mutex_unlock(&store->mutex);
+}
+
+static void irecv_store_blob_path(irecv_image_store_t store, const unsigned char* digest, char* path, size_t size)
+{
+	char hex[SHA256_DIGEST_LENGTH*2 + 1];
+	int i;
+
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		snprintf(hex + i*2, 3, "%02x", digest[i]);
+	}
+	snprintf(path, size, "%s/%s.img", store->path, hex);
+}
+
+static struct irecv_store_entry* irecv_store_find(irecv_image_store_t store, const unsigned char* digest)
+{
+	struct irecv_store_header* hdr = irecv_store_header(store);
+	struct irecv_store_entry* entries = irecv_store_entries(store);
+	uint32_t i;
+
+	for (i = 0; i < hdr->capacity; i++) {
+		if (entries[i].used && memcmp(entries[i].digest, digest, SHA256_DIGEST_LENGTH) == 0) {
+			return &entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void irecv_store_drop(irecv_image_store_t store, struct irecv_store_entry* entry)
+{
+	char path[PATH_MAX];
+
+	irecv_store_blob_path(store, entry->digest, path, sizeof(path));
+	unlink(path);
+	irecv_store_header(store)->total_size -= entry->size;
+	memset(entry, '\0', sizeof(struct irecv_store_entry));
+}
+
+/* evict least recently used images until size more bytes fit */
+static void irecv_store_evict(irecv_image_store_t store, uint64_t size)
+{
+	struct irecv_store_header* hdr = irecv_store_header(store);
+	struct irecv_store_entry* entries = irecv_store_entries(store);
+
+	if (store->max_size == 0) {
+		return;
+	}
+	while (hdr->total_size + size > store->max_size) {
+		struct irecv_store_entry* oldest = NULL;
+		uint32_t i;
+		for (i = 0; i < hdr->capacity; i++) {
+			if (entries[i].used && (!oldest || entries[i].last_used < oldest->last_used)) {
+				oldest = &entries[i];
+			}
+		}
+		if (!oldest) {
+			break;
+		}
+		debug("%s: evicting image of %" PRIu64 " bytes\n", __func__, oldest->size);
+		irecv_store_drop(store, oldest);
+	}
+}
+
+static struct irecv_store_entry* irecv_store_alloc_entry(irecv_image_store_t store)
+{
+	struct irecv_store_header* hdr = irecv_store_header(store);
+	struct irecv_store_entry* entries = irecv_store_entries(store);
+	uint32_t i;
+
+	for (i = 0; i < hdr->capacity; i++) {
+		if (!entries[i].used) {
+			return &entries[i];
+		}
+	}
+
+	/* index is full, double its capacity */
+	uint32_t capacity = hdr->capacity;
+	if (capacity > UINT32_MAX / 2 || ftruncate(store->fd, (off_t)IRECV_STORE_INDEX_SIZE(capacity * 2)) < 0) {
+		return NULL;
+	}
+	hdr->capacity = capacity * 2;
+	if (irecv_store_map(store) < 0) {
+		return NULL;
+	}
+
+	return &irecv_store_entries(store)[capacity];
+}
+
+static irecv_error_t irecv_store_add_data(irecv_image_store_t store, const unsigned char* data, uint64_t length, unsigned char* digest)
+{
+	unsigned char md[SHA256_DIGEST_LENGTH];
+	char path[PATH_MAX];
+	char tmppath[PATH_MAX + 32];
+	irecv_sha256_ctx sha;
+	uint32_t crc = 0xFFFFFFFF;
+	uint64_t i;
+
+	if (store->max_size > 0 && length > store->max_size) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	irecv_sha256_init(&sha);
+	irecv_sha256_update(&sha, data, (size_t)length);
+	irecv_sha256_final(&sha, md);
+	for (i = 0; i < length; i++) {
+		crc32_step(crc, data[i]);
+	}
+	if (digest) {
+		memcpy(digest, md, SHA256_DIGEST_LENGTH);
+	}
+
+	if (irecv_store_lock(store) < 0) {
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	struct irecv_store_header* hdr = irecv_store_header(store);
+
+	struct irecv_store_entry* entry = irecv_store_find(store, md);
+	if (entry) {
+		entry->last_used = ++hdr->clock;
+		irecv_store_unlock(store);
+		return IRECV_E_SUCCESS;
+	}
+
+	irecv_store_evict(store, length);
+
+	irecv_store_blob_path(store, md, path, sizeof(path));
+	snprintf(tmppath, sizeof(tmppath), "%s.%d.tmp", path, (int)getpid());
+	FILE* f = fopen(tmppath, "wb");
+	if (!f) {
+		irecv_store_unlock(store);
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	if (length > 0 && fwrite(data, 1, (size_t)length, f) != (size_t)length) {
+		fclose(f);
+		unlink(tmppath);
+		irecv_store_unlock(store);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	if (fclose(f) != 0 || rename(tmppath, path) < 0) {
+		unlink(tmppath);
+		irecv_store_unlock(store);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	entry = irecv_store_alloc_entry(store);
+	if (!entry) {
+		unlink(path);
+		irecv_store_unlock(store);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	hdr = irecv_store_header(store);
+	memcpy(entry->digest, md, SHA256_DIGEST_LENGTH);
+	entry->size = length;
+	entry->dfu_crc = crc;
+	entry->last_used = ++hdr->clock;
+	entry->used = 1;
+	hdr->total_size += length;
+
+	irecv_store_unlock(store);
+
+	return IRECV_E_SUCCESS;
+}
+#endif
+
+irecv_error_t irecv_image_store_open(const char* path, uint64_t max_size, irecv_image_store_t* store)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	char index_path[PATH_MAX];
+
+	if (!path || !store) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	*store = NULL;
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	snprintf(index_path, sizeof(index_path), "%s/index", path);
+
+	irecv_image_store_t s = (irecv_image_store_t)calloc(1, sizeof(struct irecv_image_store));
+	if (!s) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	s->path = strdup(path);
+	s->max_size = max_size;
+	s->fd = open(index_path, O_RDWR | O_CREAT, 0644);
+	if (s->fd < 0) {
+		free(s->path);
+		free(s);
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	mutex_init(&s->mutex);
+
+	flock(s->fd, LOCK_EX);
+	struct stat st;
+	if (fstat(s->fd, &st) == 0 && st.st_size == 0) {
+		struct irecv_store_header hdr;
+		memset(&hdr, '\0', sizeof(hdr));
+		memcpy(hdr.magic, IRECV_STORE_MAGIC, 8);
+		hdr.version = IRECV_STORE_VERSION;
+		hdr.capacity = IRECV_STORE_INITIAL_CAPACITY;
+		if (ftruncate(s->fd, (off_t)IRECV_STORE_INDEX_SIZE(hdr.capacity)) < 0 || pwrite(s->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+			debug("%s: failed to create index %s\n", __func__, index_path);
+		}
+	}
+	int res = irecv_store_map(s);
+	flock(s->fd, LOCK_UN);
+	if (res < 0) {
+		irecv_image_store_close(s);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	*store = s;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_image_store_close(irecv_image_store_t store)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!store) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	if (store->map) {
+		munmap(store->map, store->map_size);
+	}
+	close(store->fd);
+	mutex_destroy(&store->mutex);
+	free(store->path);
+	free(store);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_image_store_add_buffer(irecv_image_store_t store, const unsigned char* buffer, unsigned long length, unsigned char* digest)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!store || (!buffer && length > 0)) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	return irecv_store_add_data(store, buffer, length, digest);
+#endif
+}
+
+irecv_error_t irecv_image_store_add_file(irecv_image_store_t store, const char* filename, unsigned char* digest)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!store || !filename) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	if ((uint64_t)st.st_size > SIZE_MAX) {
+		close(fd);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	void* data = NULL;
+	if (st.st_size > 0) {
+		data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return IRECV_E_OUT_OF_MEMORY;
+		}
+	}
+	close(fd);
+
+	irecv_error_t error = irecv_store_add_data(store, (const unsigned char*)data, (uint64_t)st.st_size, digest);
+	if (data) {
+		munmap(data, (size_t)st.st_size);
+	}
+
+	return error;
+#endif
+}
+
+irecv_error_t irecv_image_store_remove(irecv_image_store_t store, const unsigned char* digest)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!store || !digest) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	if (irecv_store_lock(store) < 0) {
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	struct irecv_store_entry* entry = irecv_store_find(store, digest);
+	if (entry) {
+		irecv_store_drop(store, entry);
+	}
+	irecv_store_unlock(store);
+
+	return (entry) ? IRECV_E_SUCCESS : IRECV_E_FILE_NOT_FOUND;
+#endif
+}
+
+irecv_error_t irecv_send_image_by_digest(irecv_client_t client, irecv_image_store_t store, const unsigned char* digest, unsigned int options)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	char path[PATH_MAX];
+
+	if (!store || !digest) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (irecv_store_lock(store) < 0) {
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	struct irecv_store_entry* entry = irecv_store_find(store, digest);
+	if (!entry) {
+		irecv_store_unlock(store);
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+	entry->last_used = ++irecv_store_header(store)->clock;
+	uint64_t length = entry->size;
+	uint32_t crc = entry->dfu_crc;
+
+	/* an image evicted after this point stays readable through the open descriptor */
+	irecv_store_blob_path(store, digest, path, sizeof(path));
+	int fd = open(path, O_RDONLY);
+	irecv_store_unlock(store);
+	if (fd < 0) {
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (uint64_t)st.st_size != length || length > SIZE_MAX) {
+		close(fd);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	void* data = NULL;
+	if (length > 0) {
+		data = mmap(NULL, (size_t)length, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return IRECV_E_OUT_OF_MEMORY;
+		}
+	}
+	close(fd);
+
+	struct irecv_iovec iov;
+	struct irecv_payload payload;
+
+	iov.iov_base = data;
+	iov.iov_len = (size_t)length;
+	irecv_payload_init(&payload, &iov, 1);
+	payload.crc = crc;
+	payload.crc_valid = 1;
+
+	irecv_error_t error = irecv_send_payload(client, &payload, options);
+	if (data) {
+		munmap(data, (size_t)length);
+	}
+
+	return error;
+#endif
+}
+
+#ifndef USE_DUMMY
+#ifndef _WIN32
+/*
+ * Per-port transfer history. Each upload or download of a client attached
+ * to a history is folded into two records: one for the USB port path it
+ * went through and one for the device (ECID). The records keep
+ * exponentially decayed sums, so old outcomes fade with the configured
+ * half-life and a port that got a new cable recovers on its own. The file
+ * is a fixed-size table, mmap'd and shared between processes like the
+ * image store index; the least recently updated record is reused when the
+ * table is full.
+ */
+#define IRECV_HISTORY_MAGIC "IRHIST01"
+#define IRECV_HISTORY_VERSION 1
+#define IRECV_HISTORY_CAPACITY 256
+#define IRECV_HISTORY_DEFAULT_HALF_LIFE (7*24*3600)
+#define IRECV_HISTORY_MIN_SAMPLES 3
+
+struct irecv_history_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t capacity;
+};
+
+struct irecv_history_record {
+	uint32_t used;
+	uint32_t kind;
+	uint64_t ecid;
+	uint8_t bus;
+	uint8_t port_depth;
+	uint8_t port_path[IRECV_USB_MAX_PORT_DEPTH];
+	uint8_t reserved[7];
+	uint64_t last_update;
+	uint64_t samples;
+	double bytes;
+	double seconds;
+	double transfers;
+	double failures;
+	double retries;
+	double stalls;
+	double timeouts;
+};
+
+#define IRECV_HISTORY_SIZE (sizeof(struct irecv_history_header) + IRECV_HISTORY_CAPACITY * sizeof(struct irecv_history_record))
+
+struct irecv_port_history {
+	int fd;
+	unsigned char* map;
+	unsigned int half_life;
+	struct collection clients;
+	mutex_t mutex;
+};
+
+static struct irecv_history_record* irecv_history_records(irecv_port_history_t history)
+{
+	return (struct irecv_history_record*)(history->map + sizeof(struct irecv_history_header));
+}
+
+static int irecv_history_lock(irecv_port_history_t history)
+{
+	mutex_lock(&history->mutex);
+	if (flock(history->fd, LOCK_EX) < 0) {
+		mutex_unlock(&history->mutex);
+		return -1;
+	}
+	return 0;
+}
+
+static void irecv_history_unlock(irecv_port_history_t history)
+{
+	flock(history->fd, LOCK_UN);
+	mutex_unlock(&history->mutex);
+}
+
+/* 0.5^(age/half_life) without pulling in libm */
+static double irecv_history_decay(uint64_t age, unsigned int half_life)
+{
+	uint64_t halvings = age / half_life;
+	double f = (double)(age % half_life) / half_life;
+	double factor;
+
+	if (halvings >= 64) {
+		return 0;
+	}
+	/* 2^-f = e^(-f ln 2); the fourth order series is within 0.3% on [0, 1) */
+	f *= 0.69314718;
+	factor = 1.0 - f + f*f/2 - f*f*f/6 + f*f*f*f/24;
+	while (halvings-- > 0) {
+		factor /= 2;
+	}
+
+	return factor;
+}
+
+static struct irecv_history_record* irecv_history_get(irecv_port_history_t history, int kind, const struct irecv_usb_topology* topology, uint64_t ecid)
+{
+	struct irecv_history_record* records = irecv_history_records(history);
+	struct irecv_history_record* unused = NULL;
+	struct irecv_history_record* oldest = NULL;
+	unsigned int i;
+
+	for (i = 0; i < IRECV_HISTORY_CAPACITY; i++) {
+		struct irecv_history_record* rec = &records[i];
+		if (!rec->used) {
+			if (!unused) {
+				unused = rec;
+			}
+			continue;
+		}
+		if ((int)rec->kind == kind) {
+			if (kind == IRECV_HISTORY_DEVICE) {
+				if (rec->ecid == ecid) {
+					return rec;
+				}
+			} else if (rec->bus == topology->bus && rec->port_depth == topology->port_depth && memcmp(rec->port_path, topology->port_path, topology->port_depth) == 0) {
+				return rec;
+			}
+		}
+		if (!oldest || rec->last_update < oldest->last_update) {
+			oldest = rec;
+		}
+	}
+
+	struct irecv_history_record* rec = (unused) ? unused : oldest;
+	memset(rec, '\0', sizeof(struct irecv_history_record));
+	rec->used = 1;
+	rec->kind = (uint32_t)kind;
+
+	return rec;
+}
+
+static void irecv_history_add(struct irecv_history_record* rec, unsigned int half_life, uint64_t now, uint64_t bytes, uint64_t elapsed_us, irecv_error_t error, const uint64_t* counters)
+{
+	if (rec->samples > 0) {
+		double decay = (now > rec->last_update) ? irecv_history_decay(now - rec->last_update, half_life) : 1.0;
+		rec->bytes *= decay;
+		rec->seconds *= decay;
+		rec->transfers *= decay;
+		rec->failures *= decay;
+		rec->retries *= decay;
+		rec->stalls *= decay;
+		rec->timeouts *= decay;
+	}
+	rec->bytes += (double)bytes;
+	rec->seconds += (double)elapsed_us / 1000000.0;
+	rec->transfers += 1;
+	if (error != IRECV_E_SUCCESS) {
+		rec->failures += 1;
+	}
+	rec->retries += (double)counters[0];
+	rec->stalls += (double)counters[1];
+	rec->timeouts += (double)counters[2];
+	rec->last_update = now;
+	rec->samples++;
+}
+#endif
+
+/* called when an upload or download starts, so the note at its end only
+ * sees the errors of the transfer itself and not those of commands or
+ * console reads in between */
+static void irecv_port_history_mark(irecv_client_t client)
+{
+	client->history_mark[0] = __atomic_load_n(&client->metrics.retries, __ATOMIC_RELAXED);
+	client->history_mark[1] = __atomic_load_n(&client->metrics.stalls, __ATOMIC_RELAXED);
+	client->history_mark[2] = __atomic_load_n(&client->metrics.timeouts, __ATOMIC_RELAXED);
+}
+
+/* called at the end of every upload and download */
+static void irecv_port_history_note(irecv_client_t client, uint64_t bytes, uint64_t elapsed_us, irecv_error_t error)
+{
+#ifndef _WIN32
+	irecv_port_history_t history = client->port_history;
+	uint64_t counters[3];
+
+	if (!history) {
+		return;
+	}
+
+	/* transfer errors since the transfer started */
+	counters[0] = client->metrics.retries - client->history_mark[0];
+	counters[1] = client->metrics.stalls - client->history_mark[1];
+	counters[2] = client->metrics.timeouts - client->history_mark[2];
+	client->history_mark[0] += counters[0];
+	client->history_mark[1] += counters[1];
+	client->history_mark[2] += counters[2];
+
+	if (irecv_history_lock(history) < 0) {
+		return;
+	}
+	uint64_t now = (uint64_t)time(NULL);
+	if (client->topology.port_depth > 0) {
+		struct irecv_history_record* rec = irecv_history_get(history, IRECV_HISTORY_PORT, &client->topology, 0);
+		irecv_history_add(rec, history->half_life, now, bytes, elapsed_us, error, counters);
+		rec->bus = client->topology.bus;
+		rec->port_depth = client->topology.port_depth;
+		memcpy(rec->port_path, client->topology.port_path, IRECV_USB_MAX_PORT_DEPTH);
+		rec->ecid = client->device_info.ecid;
+	}
+	if (client->device_info.ecid != 0) {
+		struct irecv_history_record* rec = irecv_history_get(history, IRECV_HISTORY_DEVICE, NULL, client->device_info.ecid);
+		irecv_history_add(rec, history->half_life, now, bytes, elapsed_us, error, counters);
+		rec->ecid = client->device_info.ecid;
+		rec->bus = client->topology.bus;
+		rec->port_depth = client->topology.port_depth;
+		memcpy(rec->port_path, client->topology.port_path, IRECV_USB_MAX_PORT_DEPTH);
+	}
+	irecv_history_unlock(history);
+#endif
+}
+
+#ifndef _WIN32
+static int irecv_history_compare(const void* a, const void* b)
+{
+	const struct irecv_port_history_entry* ea = (const struct irecv_port_history_entry*)a;
+	const struct irecv_port_history_entry* eb = (const struct irecv_port_history_entry*)b;
+
+	if (ea->expected_throughput != eb->expected_throughput) {
+		return (ea->expected_throughput > eb->expected_throughput) ? -1 : 1;
+	}
+	return (ea->transfers > eb->transfers) ? -1 : (ea->transfers < eb->transfers);
+}
+#endif
+#endif
+
+irecv_error_t irecv_port_history_open(const char* path, unsigned int half_life, irecv_port_history_t* history)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!path || !history) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	*history = NULL;
+
+	irecv_port_history_t h = (irecv_port_history_t)calloc(1, sizeof(struct irecv_port_history));
+	if (!h) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	h->half_life = (half_life > 0) ? half_life : IRECV_HISTORY_DEFAULT_HALF_LIFE;
+	h->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (h->fd < 0) {
+		free(h);
 		return IRECV_E_FILE_NOT_FOUND;
 	}
 
-	struct stat fst;
-	if (fstat(fileno(file), &fst) < 0) {
-		return IRECV_E_UNKNOWN_ERROR;
+	flock(h->fd, LOCK_EX);
+	struct stat st;
+	if (fstat(h->fd, &st) == 0 && st.st_size == 0) {
+		struct irecv_history_header hdr;
+		memset(&hdr, '\0', sizeof(hdr));
+		memcpy(hdr.magic, IRECV_HISTORY_MAGIC, 8);
+		hdr.version = IRECV_HISTORY_VERSION;
+		hdr.capacity = IRECV_HISTORY_CAPACITY;
+		if (ftruncate(h->fd, (off_t)IRECV_HISTORY_SIZE) < 0 || pwrite(h->fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+			debug("%s: failed to create %s\n", __func__, path);
+		}
+	}
+	void* map = MAP_FAILED;
+	if (fstat(h->fd, &st) == 0 && (size_t)st.st_size == IRECV_HISTORY_SIZE) {
+		map = mmap(NULL, IRECV_HISTORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+	}
+	flock(h->fd, LOCK_UN);
+	if (map == MAP_FAILED) {
+		close(h->fd);
+		free(h);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	h->map = (unsigned char*)map;
+
+	struct irecv_history_header* hdr = (struct irecv_history_header*)h->map;
+	if (memcmp(hdr->magic, IRECV_HISTORY_MAGIC, 8) != 0 || hdr->version != IRECV_HISTORY_VERSION || hdr->capacity != IRECV_HISTORY_CAPACITY) {
+		debug("%s: invalid history file %s\n", __func__, path);
+		munmap(h->map, IRECV_HISTORY_SIZE);
+		close(h->fd);
+		free(h);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	collection_init(&h->clients);
+	mutex_init(&h->mutex);
+
+	*history = h;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_port_history_close(irecv_port_history_t history)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!history) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	mutex_lock(&history->mutex);
+	FOREACH(irecv_client_t client, &history->clients) {
+		client->port_history = NULL;
+	} ENDFOREACH
+	collection_free(&history->clients);
+	mutex_unlock(&history->mutex);
+
+	munmap(history->map, IRECV_HISTORY_SIZE);
+	close(history->fd);
+	mutex_destroy(&history->mutex);
+	free(history);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_port_history_attach(irecv_port_history_t history, irecv_client_t client)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!history || !client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	irecv_port_history_detach(client);
+
+	mutex_lock(&history->mutex);
+	collection_add(&history->clients, client);
+	client->port_history = history;
+	irecv_port_history_mark(client);
+	mutex_unlock(&history->mutex);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_port_history_detach(irecv_client_t client)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	irecv_port_history_t history = client->port_history;
+	if (history) {
+		mutex_lock(&history->mutex);
+		collection_remove(&history->clients, client);
+		client->port_history = NULL;
+		mutex_unlock(&history->mutex);
+	}
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_port_history_rank(irecv_port_history_t history, int kind, struct irecv_port_history_entry* entries, unsigned int max_count, unsigned int* count)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct irecv_port_history_entry* all;
+	unsigned int i, n = 0;
+
+	if (!history || !count || (max_count > 0 && !entries) || (kind != IRECV_HISTORY_PORT && kind != IRECV_HISTORY_DEVICE)) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	all = (struct irecv_port_history_entry*)calloc(IRECV_HISTORY_CAPACITY, sizeof(struct irecv_port_history_entry));
+	if (!all) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	if (irecv_history_lock(history) < 0) {
+		free(all);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	struct irecv_history_record* records = irecv_history_records(history);
+	for (i = 0; i < IRECV_HISTORY_CAPACITY; i++) {
+		struct irecv_history_record* rec = &records[i];
+		if (!rec->used || (int)rec->kind != kind || rec->transfers <= 0) {
+			continue;
+		}
+		/* all sums of a record decay alike, so their ratios need no decay */
+		struct irecv_port_history_entry* e = &all[n++];
+		e->kind = kind;
+		e->bus = rec->bus;
+		e->port_depth = rec->port_depth;
+		memcpy(e->port_path, rec->port_path, IRECV_USB_MAX_PORT_DEPTH);
+		e->ecid = rec->ecid;
+		e->last_update = rec->last_update;
+		e->transfers = rec->samples;
+		e->throughput = (rec->seconds > 0) ? rec->bytes / rec->seconds : 0;
+		e->failure_rate = rec->failures / rec->transfers;
+		e->retry_rate = rec->retries / rec->transfers;
+		e->stall_rate = rec->stalls / rec->transfers;
+		e->timeout_rate = rec->timeouts / rec->transfers;
+		/* a failed transfer has to be redone */
+		e->expected_throughput = e->throughput * (1.0 - e->failure_rate);
+	}
+	irecv_history_unlock(history);
+
+	qsort(all, n, sizeof(struct irecv_port_history_entry), irecv_history_compare);
+
+	/* degraded: well below the typical entry, or failing too often to be trusted */
+	double median = 0;
+	unsigned int rated = 0, k = 0;
+	for (i = 0; i < n; i++) {
+		if (all[i].transfers >= IRECV_HISTORY_MIN_SAMPLES) {
+			rated++;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (all[i].transfers >= IRECV_HISTORY_MIN_SAMPLES && k++ == rated / 2) {
+			median = all[i].expected_throughput;
+			break;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		struct irecv_port_history_entry* e = &all[i];
+		if (e->transfers < IRECV_HISTORY_MIN_SAMPLES) {
+			continue;
+		}
+		e->degraded = (e->expected_throughput < median / 2) || (e->failure_rate > 0.25) || (e->stall_rate + e->timeout_rate > 0.5);
+	}
+
+	if (max_count > 0) {
+		memcpy(entries, all, ((n < max_count) ? n : max_count) * sizeof(struct irecv_port_history_entry));
+	}
+	free(all);
+
+	*count = n;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#ifndef USE_DUMMY
+struct irecv_metrics_buf {
+	char* data;
+	size_t length;
+	size_t capacity;
+	int failed;
+};
+
+#ifdef __GNUC__
+static void irecv_metrics_printf(struct irecv_metrics_buf* buf, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+#endif
+static void irecv_metrics_printf(struct irecv_metrics_buf* buf, const char* fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (buf->failed) {
+		return;
+	}
+	while (1) {
+		va_start(ap, fmt);
+		n = vsnprintf(buf->data + buf->length, buf->capacity - buf->length, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			buf->failed = 1;
+			return;
+		}
+		if ((size_t)n < buf->capacity - buf->length) {
+			buf->length += n;
+			return;
+		}
+		size_t capacity = buf->capacity * 2 + n;
+		char* data = (char*)realloc(buf->data, capacity);
+		if (!data) {
+			buf->failed = 1;
+			return;
+		}
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+}
+
+static uint64_t irecv_metrics_load(const uint64_t* value)
+{
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void irecv_metrics_render_histogram(struct irecv_metrics_buf* buf, const char* name, const char* labels, const struct irecv_metrics_histogram* h)
+{
+	uint64_t cumulative = 0;
+	unsigned int i;
+
+	for (i = 0; i < IRECV_METRICS_BUCKETS; i++) {
+		cumulative += irecv_metrics_load(&h->buckets[i]);
+		irecv_metrics_printf(buf, "%s_bucket{%s%sle=\"%g\"} %" PRIu64 "\n", name, labels, (*labels) ? "," : "", (double)irecv_metrics_bounds[i] / 1000000.0, cumulative);
+	}
+	cumulative += irecv_metrics_load(&h->buckets[IRECV_METRICS_BUCKETS]);
+	irecv_metrics_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, (*labels) ? "," : "", cumulative);
+	irecv_metrics_printf(buf, "%s_count%s%s%s %" PRIu64 "\n", name, (*labels) ? "{" : "", labels, (*labels) ? "}" : "", irecv_metrics_load(&h->count));
+	irecv_metrics_printf(buf, "%s_sum%s%s%s %.6f\n", name, (*labels) ? "{" : "", labels, (*labels) ? "}" : "", (double)irecv_metrics_load(&h->sum_us) / 1000000.0);
+}
+
+static const char* irecv_metrics_op_names[IRECV_METRICS_OPS] = { "upload", "download", "command" };
+
+/* render the counters of one client (or the totals, with empty labels) under the given name prefix */
+static void irecv_metrics_render_counters(struct irecv_metrics_buf* buf, const char* prefix, const char* labels, const struct irecv_client_metrics* m, int header)
+{
+	const char* sep = (*labels) ? "," : "";
+	char oplabels[128];
+	char name[64];
+	int op;
+
+#define IRECV_METRICS_COUNTER(metric, help, value) \
+	if (header) { \
+		irecv_metrics_printf(buf, "# TYPE %s_" metric " counter\n# HELP %s_" metric " " help "\n", prefix, prefix); \
+	} \
+	irecv_metrics_printf(buf, "%s_" metric "_total%s%s%s %" PRIu64 "\n", prefix, (*labels) ? "{" : "", labels, (*labels) ? "}" : "", irecv_metrics_load(&value));
+
+	IRECV_METRICS_COUNTER("sent_bytes", "Bytes uploaded to devices.", m->bytes_sent)
+	IRECV_METRICS_COUNTER("received_bytes", "Bytes downloaded from devices.", m->bytes_received)
+	IRECV_METRICS_COUNTER("retries", "DFU status polls repeated while waiting for the device.", m->retries)
+	IRECV_METRICS_COUNTER("stalls", "USB transfers that ended with an endpoint stall.", m->stalls)
+	IRECV_METRICS_COUNTER("timeouts", "USB transfers that timed out.", m->timeouts)
+#undef IRECV_METRICS_COUNTER
+
+	if (header) {
+		irecv_metrics_printf(buf, "# TYPE %s_transfers counter\n# HELP %s_transfers Completed uploads and downloads.\n", prefix, prefix);
+	}
+	irecv_metrics_printf(buf, "%s_transfers_total{%s%sresult=\"success\"} %" PRIu64 "\n", prefix, labels, sep, irecv_metrics_load(&m->transfers_ok));
+	irecv_metrics_printf(buf, "%s_transfers_total{%s%sresult=\"failure\"} %" PRIu64 "\n", prefix, labels, sep, irecv_metrics_load(&m->transfers_failed));
+
+	snprintf(name, sizeof(name), "%s_operation_duration_seconds", prefix);
+	if (header) {
+		irecv_metrics_printf(buf, "# TYPE %s histogram\n# HELP %s Duration of uploads, downloads and commands.\n", name, name);
+	}
+	for (op = 0; op < IRECV_METRICS_OPS; op++) {
+		snprintf(oplabels, sizeof(oplabels), "%s%sop=\"%s\"", labels, sep, irecv_metrics_op_names[op]);
+		irecv_metrics_render_histogram(buf, name, oplabels, &m->latency[op]);
+	}
+}
+#endif
+
+irecv_error_t irecv_metrics_render(char** text, size_t* length)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct irecv_metrics_buf buf;
+	char labels[96];
+	int first = 1;
+
+	if (!text) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	memset(&buf, '\0', sizeof(buf));
+	buf.capacity = 8192;
+	buf.data = (char*)malloc(buf.capacity);
+	if (!buf.data) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	buf.data[0] = '\0';
+
+	irecv_metrics_render_counters(&buf, "irecv", "", &metrics_total, 1);
+
+	irecv_metrics_printf(&buf, "# TYPE irecv_hotplug_events counter\n# HELP irecv_hotplug_events Devices added to and removed from the hotplug registry.\n");
+	irecv_metrics_printf(&buf, "irecv_hotplug_events_total{type=\"add\"} %" PRIu64 "\n", irecv_metrics_load(&metrics_hotplug_add));
+	irecv_metrics_printf(&buf, "irecv_hotplug_events_total{type=\"remove\"} %" PRIu64 "\n", irecv_metrics_load(&metrics_hotplug_remove));
+	irecv_metrics_printf(&buf, "# TYPE irecv_open_retries counter\n# HELP irecv_open_retries Failed attempts of irecv_open_with_ecid_and_attempts().\n");
+	irecv_metrics_printf(&buf, "irecv_open_retries_total %" PRIu64 "\n", irecv_metrics_load(&metrics_open_retries));
+	irecv_metrics_printf(&buf, "# TYPE irecv_hotplug_dispatch_lag_seconds histogram\n# HELP irecv_hotplug_dispatch_lag_seconds Time from device arrival until listeners are notified.\n");
+	irecv_metrics_render_histogram(&buf, "irecv_hotplug_dispatch_lag_seconds", "", &metrics_dispatch_lag);
+	irecv_metrics_printf(&buf, "# TYPE irecv_registry_devices gauge\n# HELP irecv_registry_devices Devices in the hotplug registry.\n");
+	irecv_metrics_printf(&buf, "irecv_registry_devices %" PRId64 "\n", __atomic_load_n(&metrics_registry_size, __ATOMIC_RELAXED));
+
+	mutex_lock(&metrics_mutex);
+	irecv_metrics_printf(&buf, "# TYPE irecv_clients gauge\n# HELP irecv_clients Open clients.\n");
+	irecv_metrics_printf(&buf, "irecv_clients %d\n", collection_count(&metrics_clients));
+	FOREACH(irecv_client_t client, &metrics_clients) {
+		snprintf(labels, sizeof(labels), "ecid=\"0x%016" PRIx64 "\",mode=\"%04x\"", (uint64_t)client->device_info.ecid, client->mode);
+		irecv_metrics_render_counters(&buf, "irecv_client", labels, &client->metrics, first);
+		first = 0;
+	} ENDFOREACH
+	mutex_unlock(&metrics_mutex);
+
+	irecv_metrics_printf(&buf, "# EOF\n");
+
+	if (buf.failed) {
+		free(buf.data);
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	*text = buf.data;
+	if (length) {
+		*length = buf.length;
+	}
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#if !defined(USE_DUMMY) && !defined(_WIN32)
+struct irecv_metrics_server {
+	int fd;
+	char* path;
+	int stop;
+	THREAD_T thread;
+};
+
+static struct irecv_metrics_server* metrics_server = NULL;
+
+static void irecv_metrics_send_all(int fd, const char* data, size_t length)
+{
+	while (length > 0) {
+		ssize_t n = send(fd, data, length, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		data += n;
+		length -= n;
+	}
+}
+
+/* answer one scrape: plain HTTP if the peer sends a request, raw text otherwise */
+static void irecv_metrics_serve_connection(int fd)
+{
+	char request[1024];
+	ssize_t received = 0;
+	struct pollfd pfd;
+	char* text = NULL;
+	size_t length = 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 200) > 0) {
+		received = recv(fd, request, sizeof(request) - 1, 0);
+	}
+
+	if (irecv_metrics_render(&text, &length) != IRECV_E_SUCCESS) {
+		return;
+	}
+	if (received > 3 && memcmp(request, "GET", 3) == 0) {
+		char header[256];
+		int n = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", length);
+		irecv_metrics_send_all(fd, header, n);
+	}
+	irecv_metrics_send_all(fd, text, length);
+	free(text);
+}
+
+static void* irecv_metrics_server_thread(void* data)
+{
+	struct irecv_metrics_server* server = (struct irecv_metrics_server*)data;
+	struct pollfd pfd;
+
+	pfd.fd = server->fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&server->stop, __ATOMIC_ACQUIRE)) {
+		/* wake up regularly to notice irecv_metrics_stop() */
+		if (poll(&pfd, 1, 250) <= 0) {
+			continue;
+		}
+		int fd = accept(server->fd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		irecv_metrics_serve_connection(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+#endif
+
+irecv_error_t irecv_metrics_serve(const char* socket_path)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct sockaddr_un addr;
+
+	if (!socket_path || strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	if (metrics_server) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_metrics_server* server = (struct irecv_metrics_server*)calloc(1, sizeof(struct irecv_metrics_server));
+	if (!server) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->fd < 0) {
+		free(server);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	unlink(socket_path);
+	if (bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server->fd, 8) < 0) {
+		debug("%s: failed to listen on %s: %s\n", __func__, socket_path, strerror(errno));
+		close(server->fd);
+		free(server);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	server->path = strdup(socket_path);
+
+	if (thread_new(&server->thread, irecv_metrics_server_thread, server) != 0) {
+		close(server->fd);
+		unlink(server->path);
+		free(server->path);
+		free(server);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	metrics_server = server;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_metrics_stop(void)
+{
+#if defined(USE_DUMMY) || defined(_WIN32)
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct irecv_metrics_server* server = metrics_server;
+
+	if (!server) {
+		return IRECV_E_INVALID_INPUT;
+	}
+	metrics_server = NULL;
+
+	__atomic_store_n(&server->stop, 1, __ATOMIC_RELEASE);
+	thread_join(server->thread);
+	thread_free(server->thread);
+	close(server->fd);
+	unlink(server->path);
+	free(server->path);
+	free(server);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_set_timing_callback(irecv_timing_cb_t callback, void* user_data)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	timing_user_data = user_data;
+	__atomic_store_n(&timing_callback, callback, __ATOMIC_RELEASE);
+
+	/* library initialization happens before anyone can subscribe */
+	if (callback) {
+		struct irecv_timing timing;
+		timing.phase = IRECV_TIMING_INIT;
+		timing.ecid = 0;
+		timing.start = timing_init_start;
+		timing.duration = timing_init_end - timing_init_start;
+		timing.bytes = 0;
+		timing.error = IRECV_E_SUCCESS;
+		callback(&timing, user_data);
 	}
-	size_t length = fst.st_size;
 
-	char* buffer = (char*)malloc(length);
-	if (buffer == NULL) {
-		fclose(file);
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+const char* irecv_timing_phase_name(enum irecv_timing_phase phase)
+{
+	switch (phase) {
+	case IRECV_TIMING_INIT:
+		return "init";
+	case IRECV_TIMING_ENUMERATE:
+		return "enumerate";
+	case IRECV_TIMING_OPEN:
+		return "open";
+	case IRECV_TIMING_CONFIGURE:
+		return "configure";
+	case IRECV_TIMING_DESCRIPTORS:
+		return "descriptors";
+	case IRECV_TIMING_NONCES:
+		return "nonces";
+	case IRECV_TIMING_KIS_INIT:
+		return "kis_init";
+	case IRECV_TIMING_UPLOAD:
+		return "upload";
+	case IRECV_TIMING_MANIFEST:
+		return "manifest";
+	case IRECV_TIMING_RESET:
+		return "reset";
+	case IRECV_TIMING_CLOSE:
+		return "close";
+	default:
+		break;
+	}
+	return "unknown";
+}
+
+#ifndef USE_DUMMY
+static void irecv_console_feed(irecv_client_t client, const unsigned char* data, size_t length);
+#endif
+
+irecv_error_t irecv_receive(irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	char buffer[BUFFER_SIZE];
+	memset(buffer, '\0', BUFFER_SIZE);
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	int bytes = 0;
+	while (1) {
+		irecv_usb_set_interface(client, 1, 1);
+		int r = irecv_usb_bulk_transfer(client, 0x81, (unsigned char*) buffer, BUFFER_SIZE, &bytes, 500);
+		irecv_usb_set_interface(client, 0, 0);
+		if (r != 0) {
+			break;
+		}
+		if (bytes > 0) {
+			irecv_console_feed(client, (const unsigned char*)buffer, bytes);
+			if (client->received_callback != NULL) {
+				irecv_event_t event;
+				event.size = bytes;
+				event.data = buffer;
+				event.type = IRECV_RECEIVED;
+				if (client->received_callback(client, &event) != 0) {
+					break;
+				}
+			}
+		} else break;
+	}
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+#ifndef USE_DUMMY
+#define IRECV_EXPECT_POLL_MS 10
+#define IRECV_EXPECT_SLICE_MS 500
+#define IRECV_EXPECT_OUTPUT_MAX 0x10000
+
+struct irecv_expect_pattern {
+	unsigned char* text;
+	size_t length;
+	int id;
+	unsigned int flags;
+};
+
+struct irecv_expect {
+	irecv_client_t client;
+	unsigned int timeout;
+	struct irecv_expect_pattern* patterns;
+	unsigned int num_patterns;
+	/* Aho-Corasick automaton, compiled into a full transition table */
+	int* next;
+	int* match;
+	int dirty;
+	int state;
+	int matched;
+	unsigned char* output;
+	size_t output_len;
+	size_t output_size;
+	unsigned char* pending;
+	size_t pending_off;
+	size_t pending_len;
+	size_t pending_size;
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+	struct libusb_transfer* transfer;
+	unsigned char buffer[BUFFER_SIZE];
+	int in_flight;
+	int transfer_done;
+	int* wait_flag;
+#endif
+#endif
+};
+
+/* builds an Aho-Corasick automaton over patterns into a full transition table;
+ * match[state] holds the lowest pattern index ending in that state or -1 */
+static irecv_error_t irecv_automaton_build(const struct irecv_expect_pattern* patterns, unsigned int num_patterns, int** next_out, int** match_out)
+{
+	unsigned int num_states = 1;
+	unsigned int head = 0;
+	unsigned int tail = 0;
+	unsigned int i;
+	size_t j;
+	int* next;
+	int* match;
+	int* fail;
+	int* queue;
+	int c;
+
+	for (i = 0; i < num_patterns; i++) {
+		num_states += patterns[i].length;
+	}
+
+	next = (int*)malloc(sizeof(int) * 256 * num_states);
+	match = (int*)malloc(sizeof(int) * num_states);
+	fail = (int*)malloc(sizeof(int) * num_states);
+	queue = (int*)malloc(sizeof(int) * num_states);
+	if (!next || !match || !fail || !queue) {
+		free(next);
+		free(match);
+		free(fail);
+		free(queue);
 		return IRECV_E_OUT_OF_MEMORY;
 	}
+	memset(next, 0xFF, sizeof(int) * 256 * num_states);
+	memset(match, 0xFF, sizeof(int) * num_states);
+
+	/* build the trie; a duplicate pattern keeps the id it was first added with */
+	num_states = 1;
+	for (i = 0; i < num_patterns; i++) {
+		int s = 0;
+		for (j = 0; j < patterns[i].length; j++) {
+			int* t = &next[s * 256 + patterns[i].text[j]];
+			if (*t < 0) {
+				*t = num_states++;
+			}
+			s = *t;
+		}
+		if (match[s] < 0) {
+			match[s] = i;
+		}
+	}
 
-	size_t bytes = fread(buffer, 1, length, file);
-	fclose(file);
+	/* breadth-first pass computing failure links and filling in the missing
+	 * transitions, so matching costs a single table lookup per byte */
+	fail[0] = 0;
+	for (c = 0; c < 256; c++) {
+		int t = next[c];
+		if (t < 0) {
+			next[c] = 0;
+		} else {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail) {
+		int s = queue[head++];
+		int f = match[fail[s]];
+		if (f >= 0 && (match[s] < 0 || f < match[s])) {
+			match[s] = f;
+		}
+		for (c = 0; c < 256; c++) {
+			int t = next[s * 256 + c];
+			int ft = next[fail[s] * 256 + c];
+			if (t < 0) {
+				next[s * 256 + c] = ft;
+			} else {
+				fail[t] = ft;
+				queue[tail++] = t;
+			}
+		}
+	}
 
-	if (bytes != length) {
-		free(buffer);
-		return IRECV_E_UNKNOWN_ERROR;
+	free(fail);
+	free(queue);
+
+	*next_out = next;
+	*match_out = match;
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t irecv_expect_compile(struct irecv_expect* expect)
+{
+	int* next = NULL;
+	int* match = NULL;
+	irecv_error_t error = irecv_automaton_build(expect->patterns, expect->num_patterns, &next, &match);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
 	}
 
-	irecv_error_t error = irecv_send_buffer(client, (unsigned char*)buffer, length, options);
-	free(buffer);
+	free(expect->next);
+	free(expect->match);
+	expect->next = next;
+	expect->match = match;
+	expect->state = 0;
+	expect->dirty = 0;
+
+	return IRECV_E_SUCCESS;
+}
+
+static void irecv_expect_append(unsigned char** buf, size_t* len, size_t* size, const unsigned char* data, size_t length)
+{
+	if (*len + length > *size) {
+		size_t newsize = (*size) ? *size : BUFFER_SIZE;
+		unsigned char* newbuf;
+		while (newsize < *len + length) {
+			newsize *= 2;
+		}
+		newbuf = (unsigned char*)realloc(*buf, newsize);
+		if (!newbuf) {
+			return;
+		}
+		*buf = newbuf;
+		*size = newsize;
+	}
+	memcpy(*buf + *len, data, length);
+	*len += length;
+}
+
+static void irecv_expect_record_output(struct irecv_expect* expect, const unsigned char* data, size_t length)
+{
+	if (length > IRECV_EXPECT_OUTPUT_MAX) {
+		data += length - IRECV_EXPECT_OUTPUT_MAX;
+		length = IRECV_EXPECT_OUTPUT_MAX;
+	}
+	if (expect->output_len + length > IRECV_EXPECT_OUTPUT_MAX) {
+		/* keep the most recent output only */
+		size_t drop = expect->output_len + length - IRECV_EXPECT_OUTPUT_MAX;
+		memmove(expect->output, expect->output + drop, expect->output_len - drop);
+		expect->output_len -= drop;
+	}
+	irecv_expect_append(&expect->output, &expect->output_len, &expect->output_size, data, length);
+}
+
+/* runs the automaton over data and returns the number of bytes consumed;
+ * *index receives the matching pattern or -1 if all data was consumed */
+static size_t irecv_expect_feed(struct irecv_expect* expect, const unsigned char* data, size_t length, int* index)
+{
+	size_t i;
+	int s;
+
+	if (expect->matched) {
+		expect->matched = 0;
+		expect->output_len = 0;
+		expect->state = 0;
+	}
+
+	*index = -1;
+	s = expect->state;
+	for (i = 0; i < length; i++) {
+		s = expect->next[s * 256 + data[i]];
+		if (expect->match[s] >= 0) {
+			*index = expect->match[s];
+			i++;
+			break;
+		}
+	}
+	expect->state = s;
+	irecv_expect_record_output(expect, data, i);
+	if (*index >= 0) {
+		expect->matched = 1;
+	}
+
+	return i;
+}
+
+static void irecv_expect_deliver(struct irecv_expect* expect, const unsigned char* data, size_t length)
+{
+	irecv_client_t client = expect->client;
+	irecv_console_feed(client, data, length);
+	if (client->received_callback != NULL) {
+		irecv_event_t event;
+		event.size = (int)length;
+		event.data = (const char*)data;
+		event.type = IRECV_RECEIVED;
+		client->received_callback(client, &event);
+	}
+}
+
+/* feeds freshly received data; anything following a match is kept for the next wait */
+static int irecv_expect_process(struct irecv_expect* expect, const unsigned char* data, size_t length)
+{
+	int index;
+	size_t used;
+
+	irecv_expect_deliver(expect, data, length);
+	used = irecv_expect_feed(expect, data, length, &index);
+	if (used < length) {
+		irecv_expect_append(&expect->pending, &expect->pending_len, &expect->pending_size, data + used, length - used);
+	}
+
+	return index;
+}
+
+static int irecv_expect_process_pending(struct irecv_expect* expect)
+{
+	int index = -1;
+
+	if (expect->pending_off < expect->pending_len) {
+		expect->pending_off += irecv_expect_feed(expect, expect->pending + expect->pending_off, expect->pending_len - expect->pending_off, &index);
+	}
+	if (expect->pending_off == expect->pending_len) {
+		expect->pending_off = 0;
+		expect->pending_len = 0;
+	}
+
+	return index;
+}
+
+static unsigned int irecv_expect_remaining(uint64_t deadline)
+{
+	uint64_t now = irecv_time_us();
+	if (now >= deadline) {
+		return 0;
+	}
+	return (unsigned int)((deadline - now + 999) / 1000);
+}
+
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+static void LIBUSB_CALL irecv_expect_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct irecv_expect* expect = (struct irecv_expect*)transfer->user_data;
+	expect->transfer_done = 1;
+	*expect->wait_flag = 1;
+}
+
+static irecv_error_t irecv_expect_wait_async(irecv_expect_t* expects, unsigned int count, uint64_t deadline, unsigned int* index, int* match)
+{
+	irecv_error_t error = IRECV_E_TIMEOUT;
+	int completed = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		struct irecv_expect* expect = expects[i];
+		if (!expect->transfer) {
+			expect->transfer = libusb_alloc_transfer(0);
+			if (!expect->transfer) {
+				error = IRECV_E_OUT_OF_MEMORY;
+				goto leave;
+			}
+		}
+		expect->wait_flag = &completed;
+		expect->transfer_done = 0;
+		libusb_fill_bulk_transfer(expect->transfer, expect->client->handle, 0x81, expect->buffer, BUFFER_SIZE, irecv_expect_transfer_cb, expect, 0);
+		if (libusb_submit_transfer(expect->transfer) != 0) {
+			/* nothing was read yet, let the caller fall back to polling */
+			error = (i == 0) ? IRECV_E_UNSUPPORTED : IRECV_E_PIPE;
+			goto leave;
+		}
+		expect->in_flight = 1;
+	}
+
+	while (1) {
+		struct timeval tv;
+		unsigned int remaining = IRECV_EXPECT_SLICE_MS;
+		if (deadline) {
+			remaining = irecv_expect_remaining(deadline);
+			if (remaining == 0) {
+				break;
+			}
+		}
+		tv.tv_sec = remaining / 1000;
+		tv.tv_usec = (remaining % 1000) * 1000;
+		if (libusb_handle_events_timeout_completed(libirecovery_context, &tv, &completed) < 0) {
+			error = IRECV_E_PIPE;
+			break;
+		}
+		completed = 0;
+
+		for (i = 0; i < count; i++) {
+			struct irecv_expect* expect = expects[i];
+			struct libusb_transfer* transfer = expect->transfer;
+			if (!expect->in_flight || !expect->transfer_done) {
+				continue;
+			}
+			expect->in_flight = 0;
+			expect->transfer_done = 0;
+			if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+				error = IRECV_E_NO_DEVICE;
+				goto leave;
+			}
+			if (transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_TIMED_OUT) {
+				debug("console read failed with status %d\n", transfer->status);
+				error = IRECV_E_PIPE;
+				goto leave;
+			}
+			if (transfer->actual_length > 0) {
+				int m = irecv_expect_process(expect, expect->buffer, transfer->actual_length);
+				if (m >= 0) {
+					*index = i;
+					*match = m;
+					error = IRECV_E_SUCCESS;
+					goto leave;
+				}
+			}
+			if (libusb_submit_transfer(transfer) != 0) {
+				error = IRECV_E_PIPE;
+				goto leave;
+			}
+			expect->in_flight = 1;
+		}
+	}
+
+leave:
+	for (i = 0; i < count; i++) {
+		struct irecv_expect* expect = expects[i];
+		struct libusb_transfer* transfer = expect->transfer;
+		if (!expect->in_flight) {
+			continue;
+		}
+		if (!expect->transfer_done) {
+			libusb_cancel_transfer(transfer);
+			while (!expect->transfer_done) {
+				if (libusb_handle_events_timeout_completed(libirecovery_context, NULL, &expect->transfer_done) < 0) {
+					break;
+				}
+			}
+		}
+		/* data that raced with the cancellation is matched by the next wait */
+		if (expect->transfer_done && transfer->actual_length > 0 && (transfer->status == LIBUSB_TRANSFER_COMPLETED || transfer->status == LIBUSB_TRANSFER_CANCELLED)) {
+			irecv_expect_deliver(expect, expect->buffer, transfer->actual_length);
+			irecv_expect_append(&expect->pending, &expect->pending_len, &expect->pending_size, expect->buffer, transfer->actual_length);
+		}
+		expect->in_flight = 0;
+		expect->transfer_done = 0;
+	}
+	for (i = 0; i < count; i++) {
+		expects[i]->wait_flag = NULL;
+	}
 
 	return error;
+}
+#endif
+#endif
+
+static irecv_error_t irecv_expect_wait_sync(irecv_expect_t* expects, unsigned int count, uint64_t deadline, unsigned int* index, int* match)
+{
+	unsigned char buffer[BUFFER_SIZE];
+	unsigned int i;
+
+	while (1) {
+		for (i = 0; i < count; i++) {
+			struct irecv_expect* expect = expects[i];
+			unsigned int timeout = IRECV_EXPECT_POLL_MS;
+			int bytes = 0;
+			int r;
+
+			if (count == 1) {
+				/* a single device can block for the whole remaining time */
+				timeout = IRECV_EXPECT_SLICE_MS;
+				if (deadline) {
+					timeout = irecv_expect_remaining(deadline);
+					if (timeout == 0) {
+						return IRECV_E_TIMEOUT;
+					}
+				}
+			}
+			r = irecv_usb_bulk_transfer(expect->client, 0x81, buffer, BUFFER_SIZE, &bytes, timeout);
+#ifdef HAVE_IOKIT
+			if (r == IRECV_E_NO_DEVICE) {
+				return IRECV_E_NO_DEVICE;
+			}
+#else
+			if (r == LIBUSB_ERROR_NO_DEVICE) {
+				return IRECV_E_NO_DEVICE;
+			}
 #endif
+			if (bytes > 0) {
+				int m = irecv_expect_process(expect, buffer, bytes);
+				if (m >= 0) {
+					*index = i;
+					*match = m;
+					return IRECV_E_SUCCESS;
+				}
+			}
+		}
+		if (deadline && irecv_time_us() >= deadline) {
+			return IRECV_E_TIMEOUT;
+		}
+	}
 }
+#endif
 
-#ifndef USE_DUMMY
-static irecv_error_t irecv_get_status(irecv_client_t client, unsigned int* status)
+irecv_error_t irecv_expect_new(irecv_client_t client, irecv_expect_t* expect)
 {
-	if (check_context(client) != IRECV_E_SUCCESS) {
-		*status = 0;
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
+
+	if (!expect) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_expect* exp = (struct irecv_expect*)calloc(1, sizeof(struct irecv_expect));
+	if (!exp) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	exp->client = client;
+	exp->timeout = USB_TIMEOUT;
+
+	*expect = exp;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_expect_free(irecv_expect_t expect)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	unsigned int i;
+
+	if (!expect) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+	if (expect->transfer) {
+		libusb_free_transfer(expect->transfer);
+	}
+#endif
+#endif
+	for (i = 0; i < expect->num_patterns; i++) {
+		free(expect->patterns[i].text);
+	}
+	free(expect->patterns);
+	free(expect->next);
+	free(expect->match);
+	free(expect->output);
+	free(expect->pending);
+	free(expect);
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_expect_add(irecv_expect_t expect, const char* pattern, int id)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	struct irecv_expect_pattern* patterns;
+	size_t length;
+
+	if (!expect || !pattern || !*pattern) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	length = strlen(pattern);
+	patterns = (struct irecv_expect_pattern*)realloc(expect->patterns, sizeof(struct irecv_expect_pattern) * (expect->num_patterns + 1));
+	if (!patterns) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	expect->patterns = patterns;
+	patterns[expect->num_patterns].text = (unsigned char*)malloc(length);
+	if (!patterns[expect->num_patterns].text) {
+		return IRECV_E_OUT_OF_MEMORY;
 	}
+	memcpy(patterns[expect->num_patterns].text, pattern, length);
+	patterns[expect->num_patterns].length = length;
+	patterns[expect->num_patterns].id = id;
+	patterns[expect->num_patterns].flags = 0;
+	expect->num_patterns++;
+	expect->dirty = 1;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
+irecv_error_t irecv_expect_clear(irecv_expect_t expect)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	unsigned int i;
 
-	unsigned char buffer[6];
-	memset(buffer, '\0', 6);
-	if (irecv_usb_control_transfer(client, 0xA1, 3, 0, 0, buffer, 6, USB_TIMEOUT) != 6) {
-		*status = 0;
-		return IRECV_E_USB_STATUS;
+	if (!expect) {
+		return IRECV_E_INVALID_INPUT;
 	}
 
-	*status = (unsigned int) buffer[4];
+	for (i = 0; i < expect->num_patterns; i++) {
+		free(expect->patterns[i].text);
+	}
+	free(expect->patterns);
+	expect->patterns = NULL;
+	expect->num_patterns = 0;
+	expect->dirty = 1;
 
 	return IRECV_E_SUCCESS;
+#endif
 }
 
-static irecv_error_t irecv_kis_send_buffer(irecv_client_t client, unsigned char* buffer, unsigned long length, unsigned int options)
+irecv_error_t irecv_expect_set_timeout(irecv_expect_t expect, unsigned int timeout_ms)
 {
-	if (client->mode != IRECV_K_DFU_MODE) {
-		return IRECV_E_UNSUPPORTED;
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!expect) {
+		return IRECV_E_INVALID_INPUT;
 	}
 
-	unsigned long origLen = length;
+	expect->timeout = timeout_ms;
 
-	KIS_upload_chunk *chunk = calloc(1, sizeof(KIS_upload_chunk));
-	uint64_t address = 0;
-	while (length) {
-		unsigned long toUpload = length;
-		if (toUpload > 0x4000)
-			toUpload = 0x4000;
+	return IRECV_E_SUCCESS;
+#endif
+}
 
-#ifdef _WIN32
-		memcpy(chunk->data, buffer, toUpload);
-		chunk->size    = toUpload;
-		chunk->address = address;
+irecv_error_t irecv_expect_send(irecv_expect_t expect, const char* command)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
 #else
-		irecv_error_t error = irecv_kis_request_init(&chunk->hdr, KIS_PORTAL_RSM, KIS_INDEX_UPLOAD, 3, toUpload, 0);
-		if (error != IRECV_E_SUCCESS) {
-			free(chunk);
-			debug("Failed to init chunk header, error %d\n", error);
-			return error;
-		}
+	if (!expect) {
+		return IRECV_E_INVALID_INPUT;
+	}
 
-		chunk->address = address;
-		chunk->size    = toUpload;
-		memcpy(chunk->data, buffer, toUpload);
+	return irecv_send_command(expect->client, command);
 #endif
+}
 
-#ifdef _WIN32
-		DWORD transferred = 0;
-		int ret = DeviceIoControl(client->handle, 0x220008, chunk, sizeof(*chunk), NULL, 0, (PDWORD)&transferred, NULL);
-		irecv_error_t error = (ret) ? IRECV_E_SUCCESS : IRECV_E_USB_UPLOAD;
+irecv_error_t irecv_expect_wait_any(irecv_expect_t* expects, unsigned int count, unsigned int timeout_ms, unsigned int* index, int* id)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
 #else
-		KIS_generic_reply reply;
-		size_t rcvSize = sizeof(reply);
-		error = irecv_kis_request(client, &chunk->hdr, sizeof(*chunk) - (0x4000 - toUpload), &reply.hdr, &rcvSize);
-#endif
-		if (error != IRECV_E_SUCCESS) {
-			free(chunk);
-			debug("Failed to upload chunk, error %d\n", error);
-			return error;
-		}
+	irecv_error_t error = IRECV_E_SUCCESS;
+	uint64_t deadline = 0;
+	unsigned int i;
+	unsigned int which = 0;
+	int match = -1;
 
-		address += toUpload;
-		buffer  += toUpload;
-		length  -= toUpload;
+	if (!expects || count == 0) {
+		return IRECV_E_INVALID_INPUT;
+	}
 
-		if (client->progress_callback != NULL) {
-			irecv_event_t event;
-			event.progress = ((double) (origLen - length) / (double) origLen) * 100.0;
-			event.type = IRECV_PROGRESS;
-			event.data = (char*)"Uploading";
-			event.size = origLen - length;
-			client->progress_callback(client, &event);
-		} else {
-			debug("Sent: %lu bytes - %lu of %lu\n", toUpload, origLen - length, origLen);
+	for (i = 0; i < count; i++) {
+		if (!expects[i] || expects[i]->num_patterns == 0) {
+			return IRECV_E_INVALID_INPUT;
+		}
+		if (check_context(expects[i]->client) != IRECV_E_SUCCESS) {
+			return IRECV_E_NO_DEVICE;
+		}
+		if (expects[i]->client->isKIS) {
+			return IRECV_E_UNSUPPORTED;
+		}
+		if (expects[i]->dirty) {
+			error = irecv_expect_compile(expects[i]);
+			if (error != IRECV_E_SUCCESS) {
+				return error;
+			}
 		}
 	}
-	free(chunk);
 
-	if (options & IRECV_SEND_OPT_DFU_NOTIFY_FINISH) {
+	/* output left over from an earlier read may already contain a match */
+	for (i = 0; i < count; i++) {
+		match = irecv_expect_process_pending(expects[i]);
+		if (match >= 0) {
+			which = i;
+			break;
+		}
+	}
+
+	if (match < 0) {
 #ifdef _WIN32
-		DWORD amount = (DWORD)origLen;
-		DWORD transferred = 0;
-		int ret = DeviceIoControl(client->handle, 0x22000C, &amount, 4, NULL, 0, (PDWORD)&transferred, NULL);
-		irecv_error_t error = (ret) ? IRECV_E_SUCCESS : IRECV_E_USB_UPLOAD;
+		/* console reads are not implemented by the Windows backend */
+		return IRECV_E_UNSUPPORTED;
 #else
-		irecv_error_t error = irecv_kis_config_write32(client, KIS_PORTAL_RSM, KIS_INDEX_BOOT_IMG, origLen);
+		if (timeout_ms > 0) {
+			deadline = irecv_time_us() + (uint64_t)timeout_ms * 1000;
+		}
+		for (i = 0; i < count; i++) {
+			irecv_usb_set_interface(expects[i]->client, 1, 1);
+		}
+#ifndef HAVE_IOKIT
+		error = irecv_expect_wait_async(expects, count, deadline, &which, &match);
+		if (error == IRECV_E_UNSUPPORTED)
 #endif
+		error = irecv_expect_wait_sync(expects, count, deadline, &which, &match);
+		for (i = 0; i < count; i++) {
+			irecv_usb_set_interface(expects[i]->client, 0, 0);
+		}
 		if (error != IRECV_E_SUCCESS) {
-			debug("Failed to boot image, error %d\n", error);
 			return error;
 		}
+#endif
+	}
+
+	if (index) {
+		*index = which;
+	}
+	if (id) {
+		*id = expects[which]->patterns[match].id;
 	}
 
 	return IRECV_E_SUCCESS;
+#endif
 }
+
+irecv_error_t irecv_expect_wait(irecv_expect_t expect, int* id)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!expect) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	return irecv_expect_wait_any(&expect, 1, expect->timeout, NULL, id);
 #endif
+}
 
-irecv_error_t irecv_send_buffer(irecv_client_t client, unsigned char* buffer, unsigned long length, unsigned int options)
+irecv_error_t irecv_expect_get_output(irecv_expect_t expect, const char** data, size_t* length)
 {
 #ifdef USE_DUMMY
 	return IRECV_E_UNSUPPORTED;
 #else
-	if (client->isKIS)
-		return irecv_kis_send_buffer(client, buffer, length, options);
+	if (!expect || !data || !length) {
+		return IRECV_E_INVALID_INPUT;
+	}
 
-	irecv_error_t error = 0;
-	int recovery_mode = ((client->mode != IRECV_K_DFU_MODE) && (client->mode != IRECV_K_PORT_DFU_MODE) && (client->mode != IRECV_K_WTF_MODE));
+	*data = (const char*)expect->output;
+	*length = expect->output_len;
 
-	if (check_context(client) != IRECV_E_SUCCESS)
-		return IRECV_E_NO_DEVICE;
+	return IRECV_E_SUCCESS;
+#endif
+}
 
-	unsigned int h1 = 0xFFFFFFFF;
-	unsigned char dfu_xbuf[12] = {0xff, 0xff, 0xff, 0xff, 0xac, 0x05, 0x00, 0x01, 0x55, 0x46, 0x44, 0x10};
-	int dfu_crc = 1;
-	int packet_size = recovery_mode ? 0x8000 : 0x800;
-	if (!recovery_mode && (options & IRECV_SEND_OPT_DFU_SMALL_PKT)) {
-		packet_size = 0x40;
-		dfu_crc = 0;
-	}
-	int last = length % packet_size;
-	int packets = length / packet_size;
+#ifndef USE_DUMMY
+/*
+ * Console markers. Received data is run through an Aho-Corasick automaton
+ * built from the markers, one table lookup per byte, while the current line
+ * is kept in a fixed buffer so memory use does not grow with the amount of
+ * output. Markers anchored at the start of a line are stored with a leading
+ * newline and the automaton starts out as if one had just been seen.
+ */
+#define IRECV_CONSOLE_LINE_MAX 256
+
+struct irecv_console {
+	struct irecv_expect_pattern* markers;
+	unsigned int num_markers;
+	int* next;
+	int* match;
+	int dirty;
+	int state;
+	/* first end-of-line marker seen on the current line, -1 if none */
+	int pending;
+	uint64_t pending_time;
+	char line[IRECV_CONSOLE_LINE_MAX];
+	size_t line_len;
+};
 
-	if (last != 0) {
-		packets++;
-	} else {
-		last = packet_size;
+static const struct {
+	int kind;
+	const char* pattern;
+	unsigned int flags;
+} irecv_console_defaults[] = {
+	{ IRECV_CONSOLE_PROMPT, "] ", IRECV_CONSOLE_LINE_START | IRECV_CONSOLE_IMMEDIATE },
+	{ IRECV_CONSOLE_IMAGE_LOAD, "Loading ", 0 },
+	{ IRECV_CONSOLE_IMAGE_LOAD, "Loaded image", 0 },
+	{ IRECV_CONSOLE_PANIC, "panic", 0 },
+	{ IRECV_CONSOLE_PANIC, "Panic", 0 },
+	{ IRECV_CONSOLE_WAITING, "waiting for", 0 },
+	{ IRECV_CONSOLE_WAITING, "Waiting for", 0 },
+	{ IRECV_CONSOLE_COMMAND_ERROR, "Command not found", 0 },
+	{ IRECV_CONSOLE_COMMAND_ERROR, "Unknown command", 0 },
+};
+
+static irecv_error_t irecv_console_add(struct irecv_console* console, int kind, const char* pattern, unsigned int flags)
+{
+	struct irecv_expect_pattern* markers;
+	size_t anchor = (flags & IRECV_CONSOLE_LINE_START) ? 1 : 0;
+	size_t length = strlen(pattern);
+
+	markers = (struct irecv_expect_pattern*)realloc(console->markers, sizeof(struct irecv_expect_pattern) * (console->num_markers + 1));
+	if (!markers) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	console->markers = markers;
+	markers[console->num_markers].text = (unsigned char*)malloc(anchor + length);
+	if (!markers[console->num_markers].text) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	if (anchor) {
+		markers[console->num_markers].text[0] = '\n';
 	}
+	memcpy(markers[console->num_markers].text + anchor, pattern, length);
+	markers[console->num_markers].length = anchor + length;
+	markers[console->num_markers].id = kind;
+	markers[console->num_markers].flags = flags;
+	console->num_markers++;
+	console->dirty = 1;
 
-	/* initiate transfer */
-	if (recovery_mode) {
-		error = irecv_usb_control_transfer(client, 0x41, 0, 0, 0, NULL, 0, USB_TIMEOUT);
-	} else {
-		uint8_t state = 0;
-		if (irecv_usb_control_transfer(client, 0xa1, 5, 0, 0, (unsigned char*)&state, 1, USB_TIMEOUT) == 1) {
-			error = IRECV_E_SUCCESS;
-		} else {
-			return IRECV_E_USB_UPLOAD;
-		}
-		switch (state) {
-		case 2:
-			/* DFU IDLE */
-			break;
-		case 10:
-			debug("DFU ERROR, issuing CLRSTATUS\n");
-			irecv_usb_control_transfer(client, 0x21, 4, 0, 0, NULL, 0, USB_TIMEOUT);
-			error = IRECV_E_USB_UPLOAD;
-			break;
-		default:
-			debug("Unexpected state %d, issuing ABORT\n", state);
-			irecv_usb_control_transfer(client, 0x21, 6, 0, 0, NULL, 0, USB_TIMEOUT);
-			error = IRECV_E_USB_UPLOAD;
-			break;
-		}
+	return IRECV_E_SUCCESS;
+}
+
+static void irecv_console_clear(struct irecv_console* console)
+{
+	unsigned int i;
+
+	for (i = 0; i < console->num_markers; i++) {
+		free(console->markers[i].text);
 	}
+	free(console->markers);
+	console->markers = NULL;
+	console->num_markers = 0;
+	console->dirty = 1;
+}
 
-	if (error != IRECV_E_SUCCESS) {
-		return error;
+static void irecv_console_free(irecv_client_t client)
+{
+	struct irecv_console* console = client->console;
+
+	if (!console) {
+		return;
 	}
+	irecv_console_clear(console);
+	free(console->next);
+	free(console->match);
+	free(console);
+	client->console = NULL;
+}
 
-	int i = 0;
-	unsigned long count = 0;
-	unsigned int status = 0;
-	int bytes = 0;
-	for (i = 0; i < packets; i++) {
-		int size = (i + 1) < packets ? packet_size : last;
+/* creates the parser with the default markers on first use */
+static irecv_error_t irecv_console_ensure(irecv_client_t client)
+{
+	struct irecv_console* console;
+	unsigned int i;
 
-		/* Use bulk transfer for recovery mode and control transfer for DFU and WTF mode */
-		if (recovery_mode) {
-			error = irecv_usb_bulk_transfer(client, 0x04, &buffer[i * packet_size], size, &bytes, USB_TIMEOUT);
-		} else {
-			if (dfu_crc) {
-				int j;
-				for (j = 0; j < size; j++) {
-					crc32_step(h1, buffer[i*packet_size + j]);
-				}
-			}
-			if (dfu_crc && i+1 == packets) {
-				int j;
-				if (size+16 > packet_size) {
-					bytes = irecv_usb_control_transfer(client, 0x21, 1, i, 0, &buffer[i * packet_size], size, USB_TIMEOUT);
-					if (bytes != size) {
-						return IRECV_E_USB_UPLOAD;
-					}
-					count += size;
-					size = 0;
-				}
-				for (j = 0; j < 2; j++) {
-					crc32_step(h1, dfu_xbuf[j*6 + 0]);
-					crc32_step(h1, dfu_xbuf[j*6 + 1]);
-					crc32_step(h1, dfu_xbuf[j*6 + 2]);
-					crc32_step(h1, dfu_xbuf[j*6 + 3]);
-					crc32_step(h1, dfu_xbuf[j*6 + 4]);
-					crc32_step(h1, dfu_xbuf[j*6 + 5]);
-				}
+	if (client->console) {
+		return IRECV_E_SUCCESS;
+	}
 
-				char* newbuf = (char*)malloc(size + 16);
-				if (size > 0) {
-					memcpy(newbuf, &buffer[i * packet_size], size);
-				}
-				memcpy(newbuf+size, dfu_xbuf, 12);
-				newbuf[size+12] = h1 & 0xFF;
-				newbuf[size+13] = (h1 >> 8) & 0xFF;
-				newbuf[size+14] = (h1 >> 16) & 0xFF;
-				newbuf[size+15] = (h1 >> 24) & 0xFF;
-				size += 16;
-				bytes = irecv_usb_control_transfer(client, 0x21, 1, i, 0, (unsigned char*)newbuf, size, USB_TIMEOUT);
-				free(newbuf);
-			} else {
-				bytes = irecv_usb_control_transfer(client, 0x21, 1, i, 0, &buffer[i * packet_size], size, USB_TIMEOUT);
-			}
+	console = (struct irecv_console*)calloc(1, sizeof(struct irecv_console));
+	if (!console) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	console->pending = -1;
+	client->console = console;
+	for (i = 0; i < sizeof(irecv_console_defaults) / sizeof(irecv_console_defaults[0]); i++) {
+		if (irecv_console_add(console, irecv_console_defaults[i].kind, irecv_console_defaults[i].pattern, irecv_console_defaults[i].flags) != IRECV_E_SUCCESS) {
+			irecv_console_free(client);
+			return IRECV_E_OUT_OF_MEMORY;
 		}
+	}
 
-		if (bytes != size) {
-			return IRECV_E_USB_UPLOAD;
-		}
+	return IRECV_E_SUCCESS;
+}
 
-		if (!recovery_mode) {
-			error = irecv_get_status(client, &status);
-		}
+/* drops the partial line, e.g. after the device re-attached */
+static void irecv_console_reset(struct irecv_console* console)
+{
+	console->state = (console->next) ? console->next['\n'] : 0;
+	console->pending = -1;
+	console->line_len = 0;
+}
 
-		if (error != IRECV_E_SUCCESS) {
-			return error;
-		}
+static irecv_error_t irecv_console_compile(struct irecv_console* console)
+{
+	int* next = NULL;
+	int* match = NULL;
+	irecv_error_t error = irecv_automaton_build(console->markers, console->num_markers, &next, &match);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
 
-		if (!recovery_mode && status != 5) {
-			int retry = 0;
+	free(console->next);
+	free(console->match);
+	console->next = next;
+	console->match = match;
+	console->dirty = 0;
+	irecv_console_reset(console);
 
-			while (retry++ < 20) {
-				irecv_get_status(client, &status);
-				if (status == 5) {
-					break;
-				}
-				sleep(1);
-			}
+	return IRECV_E_SUCCESS;
+}
 
-			if (status != 5) {
-				return IRECV_E_USB_UPLOAD;
-			}
-		}
+static void irecv_console_emit(irecv_client_t client, int index, uint64_t timestamp)
+{
+	struct irecv_console* console = client->console;
+	struct irecv_console_event console_event;
+	irecv_event_t event;
 
-		count += size;
-		if (client->progress_callback != NULL) {
-			irecv_event_t event;
-			event.progress = ((double) count/ (double) length) * 100.0;
-			event.type = IRECV_PROGRESS;
-			event.data = (char*)"Uploading";
-			event.size = count;
-			client->progress_callback(client, &event);
-		} else {
-			debug("Sent: %d bytes - %lu of %lu\n", bytes, count, length);
-		}
-	}
+	console->line[console->line_len] = '\0';
+	console_event.kind = console->markers[index].id;
+	console_event.timestamp = timestamp;
+	console_event.line = console->line;
+	console_event.length = console->line_len;
+
+	event.size = (int)sizeof(console_event);
+	event.data = (const char*)&console_event;
+	event.progress = 0;
+	event.type = IRECV_CONSOLE;
+	client->console_callback(client, &event);
+}
 
-	if (recovery_mode && length % 512 == 0) {
-		/* send a ZLP */
-		bytes = 0;
-		irecv_usb_bulk_transfer(client, 0x04, buffer, 0, &bytes, USB_TIMEOUT);
-	}
+static void irecv_console_feed(irecv_client_t client, const unsigned char* data, size_t length)
+{
+	struct irecv_console* console;
+	size_t i;
+	int s;
 
-	if ((options & IRECV_SEND_OPT_DFU_NOTIFY_FINISH) && !recovery_mode) {
-		irecv_usb_control_transfer(client, 0x21, 1, packets, 0, (unsigned char*) buffer, 0, USB_TIMEOUT);
+	if (client->console_callback == NULL || irecv_console_ensure(client) != IRECV_E_SUCCESS) {
+		return;
+	}
+	console = client->console;
+	if (console->num_markers == 0) {
+		return;
+	}
+	if (console->dirty && irecv_console_compile(console) != IRECV_E_SUCCESS) {
+		return;
+	}
 
-		for (i = 0; i < 2; i++) {
-			error = irecv_get_status(client, &status);
-			if (error != IRECV_E_SUCCESS) {
-				return error;
+	s = console->state;
+	for (i = 0; i < length; i++) {
+		unsigned char c = data[i];
+		if (c == '\n') {
+			if (console->pending >= 0) {
+				irecv_console_emit(client, console->pending, console->pending_time);
+				console->pending = -1;
 			}
+			console->line_len = 0;
+		} else if (c != '\r' && c != '\0' && console->line_len < IRECV_CONSOLE_LINE_MAX - 1) {
+			console->line[console->line_len++] = (char)c;
 		}
-
-		if ((options & IRECV_SEND_OPT_DFU_FORCE_ZLP)) {
-			/* we send a pseudo ZLP here just in case */
-			irecv_usb_control_transfer(client, 0x21, 1, 0, 0, 0, 0, USB_TIMEOUT);
+		s = console->next[s * 256 + c];
+		if (console->match[s] >= 0) {
+			int index = console->match[s];
+			if (console->markers[index].flags & IRECV_CONSOLE_IMMEDIATE) {
+				irecv_console_emit(client, index, irecv_time_us());
+			} else if (console->pending < 0) {
+				console->pending = index;
+				console->pending_time = irecv_time_us();
+			}
 		}
-
-		irecv_reset(client);
 	}
-
-	return IRECV_E_SUCCESS;
-#endif
+	console->state = s;
 }
+#endif
 
-irecv_error_t irecv_receive(irecv_client_t client)
+irecv_error_t irecv_console_add_marker(irecv_client_t client, int kind, const char* pattern, unsigned int flags)
 {
 #ifdef USE_DUMMY
 	return IRECV_E_UNSUPPORTED;
 #else
-	char buffer[BUFFER_SIZE];
-	memset(buffer, '\0', BUFFER_SIZE);
+	irecv_error_t error;
 
-	if (check_context(client) != IRECV_E_SUCCESS)
-		return IRECV_E_NO_DEVICE;
+	if (!client || !pattern || !*pattern || strpbrk(pattern, "\r\n")) {
+		return IRECV_E_INVALID_INPUT;
+	}
 
-	int bytes = 0;
-	while (1) {
-		irecv_usb_set_interface(client, 1, 1);
-		int r = irecv_usb_bulk_transfer(client, 0x81, (unsigned char*) buffer, BUFFER_SIZE, &bytes, 500);
-		irecv_usb_set_interface(client, 0, 0);
-		if (r != 0) {
-			break;
-		}
-		if (bytes > 0) {
-			if (client->received_callback != NULL) {
-				irecv_event_t event;
-				event.size = bytes;
-				event.data = buffer;
-				event.type = IRECV_RECEIVED;
-				if (client->received_callback(client, &event) != 0) {
-					break;
-				}
-			}
-		} else break;
+	error = irecv_console_ensure(client);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
+	}
+
+	return irecv_console_add(client->console, kind, pattern, flags);
+#endif
+}
+
+irecv_error_t irecv_console_clear_markers(irecv_client_t client)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	irecv_error_t error;
+
+	if (!client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	error = irecv_console_ensure(client);
+	if (error != IRECV_E_SUCCESS) {
+		return error;
 	}
+
+	irecv_console_clear(client->console);
+
 	return IRECV_E_SUCCESS;
 #endif
 }
@@ -3849,7 +9958,7 @@ irecv_error_t irecv_reset_counters(irecv_client_t client)
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
-	if ((client->mode == IRECV_K_DFU_MODE) || (client->mode == IRECV_K_PORT_DFU_MODE) || (client->mode == IRECV_K_WTF_MODE)) {
+	if (client->strategy->flags & IRECV_STRATEGY_DFU_CLASS) {
 		irecv_usb_control_transfer(client, 0x21, 4, 0, 0, 0, 0, USB_TIMEOUT);
 	}
 
@@ -3857,30 +9966,26 @@ irecv_error_t irecv_reset_counters(irecv_client_t client)
 #endif
 }
 
-irecv_error_t irecv_recv_buffer(irecv_client_t client, char* buffer, unsigned long length)
+#ifndef USE_DUMMY
+static irecv_error_t irecv_recv_buffer_raw(irecv_client_t client, char* buffer, unsigned long length)
 {
-#ifdef USE_DUMMY
-	return IRECV_E_UNSUPPORTED;
-#else
-	int recovery_mode = ((client->mode != IRECV_K_DFU_MODE) && (client->mode != IRECV_K_PORT_DFU_MODE) && (client->mode != IRECV_K_WTF_MODE));
-
 	if (check_context(client) != IRECV_E_SUCCESS)
 		return IRECV_E_NO_DEVICE;
 
-	int packet_size = recovery_mode ? 0x2000: 0x800;
-	int last = length % packet_size;
-	int packets = length / packet_size;
+	uint16_t packet_size = client->strategy->recv_packet_size;
+	uint16_t last = (uint16_t)(length % packet_size);
+	uint64_t packets = length / packet_size;
 	if (last != 0) {
 		packets++;
 	} else {
 		last = packet_size;
 	}
 
-	int i = 0;
+	uint64_t i = 0;
 	int bytes = 0;
-	unsigned long count = 0;
+	uint64_t count = 0;
 	for (i = 0; i < packets; i++) {
-		unsigned short size = (i+1) < packets ? packet_size : last;
+		uint16_t size = (i+1) < packets ? packet_size : last;
 		bytes = irecv_usb_control_transfer(client, 0xA1, 2, 0, 0, (unsigned char*)&buffer[i * packet_size], size, USB_TIMEOUT);
 
 		if (bytes != size) {
@@ -3888,19 +9993,270 @@ irecv_error_t irecv_recv_buffer(irecv_client_t client, char* buffer, unsigned lo
 		}
 
 		count += size;
+		irecv_sched_account(client, size);
+		irecv_progress_advance(client, count);
 		if (client->progress_callback != NULL) {
 			irecv_event_t event;
 			event.progress = ((double) count/ (double) length) * 100.0;
 			event.type = IRECV_PROGRESS;
 			event.data = (char*)"Downloading";
-			event.size = count;
+			event.size = irecv_event_size(count);
 			client->progress_callback(client, &event);
 		} else {
-			debug("Sent: %d bytes - %lu of %lu\n", bytes, count, length);
+			debug("Sent: %d bytes - %" PRIu64 " of %" PRIu64 "\n", bytes, count, (uint64_t)length);
 		}
 	}
 
 	return IRECV_E_SUCCESS;
+}
+#endif
+
+irecv_error_t irecv_recv_buffer(irecv_client_t client, char* buffer, unsigned long length)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	irecv_error_t error;
+
+	irecv_progress_begin(client, IRECV_TRANSFER_WAITING, length);
+	error = irecv_sched_acquire(client);
+	if (error != IRECV_E_SUCCESS) {
+		irecv_progress_leave(client, IRECV_TRANSFER_FAILED, error);
+		return error;
+	}
+	irecv_progress_begin(client, IRECV_TRANSFER_DOWNLOAD, length);
+	error = irecv_recv_buffer_raw(client, buffer, length);
+	irecv_sched_release(client);
+	irecv_progress_end(client, error);
+
+	return error;
+#endif
+}
+
+#ifndef USE_DUMMY
+/* number of UPLOAD requests kept in flight when streaming */
+#define IRECV_RECV_STREAM_DEPTH 4
+
+static irecv_error_t irecv_recv_stream_deliver(irecv_client_t client, const unsigned char* data, uint16_t size, uint64_t* count, uint64_t length, irecv_recv_sink_cb_t sink, void* user_data)
+{
+	if (sink(data, size, user_data) != 0) {
+		debug("Receive aborted by sink\n");
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+
+	*count += size;
+	irecv_sched_account(client, size);
+	irecv_progress_advance(client, *count);
+	if (client->progress_callback != NULL) {
+		irecv_event_t event;
+		event.progress = ((double) *count / (double) length) * 100.0;
+		event.type = IRECV_PROGRESS;
+		event.data = (char*)"Downloading";
+		event.size = irecv_event_size(*count);
+		client->progress_callback(client, &event);
+	}
+
+	return IRECV_E_SUCCESS;
+}
+
+static irecv_error_t irecv_recv_stream_sync(irecv_client_t client, uint64_t length, uint16_t packet_size, irecv_recv_sink_cb_t sink, void* user_data)
+{
+	irecv_error_t error = IRECV_E_SUCCESS;
+	uint64_t count = 0;
+
+	unsigned char* buffer = (unsigned char*)malloc(packet_size);
+	if (!buffer) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+
+	while (count < length) {
+		uint16_t size = (length - count < packet_size) ? (uint16_t)(length - count) : packet_size;
+		int bytes = irecv_usb_control_transfer(client, 0xA1, 2, 0, 0, buffer, size, USB_TIMEOUT);
+		if (bytes != size) {
+			error = IRECV_E_USB_UPLOAD;
+			break;
+		}
+		error = irecv_recv_stream_deliver(client, buffer, size, &count, length, sink, user_data);
+		if (error != IRECV_E_SUCCESS) {
+			break;
+		}
+	}
+	free(buffer);
+
+	return error;
+}
+
+#ifndef _WIN32
+#ifndef HAVE_IOKIT
+static void LIBUSB_CALL irecv_recv_stream_cb(struct libusb_transfer *transfer)
+{
+	*(int*)transfer->user_data = 1;
+}
+
+static irecv_error_t irecv_recv_stream_async(irecv_client_t client, uint64_t length, uint16_t packet_size, irecv_recv_sink_cb_t sink, void* user_data)
+{
+	struct libusb_transfer* xfer[IRECV_RECV_STREAM_DEPTH];
+	unsigned char* buf[IRECV_RECV_STREAM_DEPTH];
+	uint16_t xfer_size[IRECV_RECV_STREAM_DEPTH];
+	int done[IRECV_RECV_STREAM_DEPTH];
+	int in_flight[IRECV_RECV_STREAM_DEPTH];
+	irecv_error_t error = IRECV_E_SUCCESS;
+	uint64_t submitted = 0;
+	uint64_t count = 0;
+	unsigned int slot = 0;
+	int i;
+
+	memset(xfer, '\0', sizeof(xfer));
+	memset(buf, '\0', sizeof(buf));
+	memset(in_flight, '\0', sizeof(in_flight));
+
+	for (i = 0; i < IRECV_RECV_STREAM_DEPTH; i++) {
+		xfer[i] = libusb_alloc_transfer(0);
+		buf[i] = (unsigned char*)malloc(LIBUSB_CONTROL_SETUP_SIZE + packet_size);
+		if (!xfer[i] || !buf[i]) {
+			error = IRECV_E_UNSUPPORTED;
+			goto leave;
+		}
+	}
+
+	/* UPLOAD requests on the control pipe complete in submission order */
+	while (count < length) {
+		for (i = 0; i < IRECV_RECV_STREAM_DEPTH && submitted < length; i++) {
+			unsigned int s = (slot + i) % IRECV_RECV_STREAM_DEPTH;
+			if (in_flight[s]) {
+				continue;
+			}
+			xfer_size[s] = (length - submitted < packet_size) ? (uint16_t)(length - submitted) : packet_size;
+			done[s] = 0;
+			libusb_fill_control_setup(buf[s], 0xA1, 2, 0, 0, xfer_size[s]);
+			libusb_fill_control_transfer(xfer[s], client->handle, buf[s], irecv_recv_stream_cb, &done[s], USB_TIMEOUT);
+			if (libusb_submit_transfer(xfer[s]) != 0) {
+				/* nothing was requested yet, let the caller fall back to synchronous reads */
+				error = (submitted == 0) ? IRECV_E_UNSUPPORTED : IRECV_E_USB_UPLOAD;
+				goto leave;
+			}
+			in_flight[s] = 1;
+			submitted += xfer_size[s];
+		}
+
+		while (!done[slot]) {
+			if (libusb_handle_events_timeout_completed(libirecovery_context, NULL, &done[slot]) < 0) {
+				error = IRECV_E_USB_UPLOAD;
+				goto leave;
+			}
+		}
+		in_flight[slot] = 0;
+
+		if (xfer[slot]->status != LIBUSB_TRANSFER_COMPLETED || xfer[slot]->actual_length != xfer_size[slot]) {
+			debug("UPLOAD request failed with status %d\n", xfer[slot]->status);
+			error = IRECV_E_USB_UPLOAD;
+			goto leave;
+		}
+
+		error = irecv_recv_stream_deliver(client, libusb_control_transfer_get_data(xfer[slot]), xfer_size[slot], &count, length, sink, user_data);
+		if (error != IRECV_E_SUCCESS) {
+			goto leave;
+		}
+		slot = (slot + 1) % IRECV_RECV_STREAM_DEPTH;
+	}
+
+leave:
+	for (i = 0; i < IRECV_RECV_STREAM_DEPTH; i++) {
+		if (in_flight[i]) {
+			libusb_cancel_transfer(xfer[i]);
+			while (!done[i]) {
+				if (libusb_handle_events_timeout_completed(libirecovery_context, NULL, &done[i]) < 0) {
+					break;
+				}
+			}
+		}
+		if (xfer[i]) {
+			libusb_free_transfer(xfer[i]);
+		}
+		free(buf[i]);
+	}
+
+	return error;
+}
+#endif
+#endif
+#endif
+
+irecv_error_t irecv_recv_stream(irecv_client_t client, uint64_t length, irecv_recv_sink_cb_t sink, void* user_data)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	irecv_error_t error;
+
+	if (check_context(client) != IRECV_E_SUCCESS)
+		return IRECV_E_NO_DEVICE;
+
+	if (!sink) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	uint16_t packet_size = client->strategy->recv_packet_size;
+
+	irecv_progress_begin(client, IRECV_TRANSFER_WAITING, length);
+	error = irecv_sched_acquire(client);
+	if (error != IRECV_E_SUCCESS) {
+		irecv_progress_leave(client, IRECV_TRANSFER_FAILED, error);
+		return error;
+	}
+	irecv_progress_begin(client, IRECV_TRANSFER_DOWNLOAD, length);
+	uint64_t start = irecv_time_us();
+#ifndef _WIN32
+#ifdef HAVE_IOKIT
+	error = irecv_recv_stream_sync(client, length, packet_size, sink, user_data);
+#else
+	error = irecv_recv_stream_async(client, length, packet_size, sink, user_data);
+	if (error == IRECV_E_UNSUPPORTED) {
+		error = irecv_recv_stream_sync(client, length, packet_size, sink, user_data);
+	}
+#endif
+#else
+	error = irecv_recv_stream_sync(client, length, packet_size, sink, user_data);
+#endif
+	uint64_t elapsed = irecv_time_us() - start;
+	irecv_sched_release(client);
+	irecv_progress_end(client, error);
+
+	if (error == IRECV_E_SUCCESS && elapsed > 0) {
+		debug("Received %" PRIu64 " bytes in %.3f seconds (%.1f KiB/s)\n", length, (double)elapsed / 1000000.0, (double)length * 1000000.0 / (double)elapsed / 1024.0);
+	}
+
+	return error;
+#endif
+}
+
+#ifndef USE_DUMMY
+static int irecv_recv_file_sink(const unsigned char* data, size_t size, void* user_data)
+{
+	return (fwrite(data, 1, size, (FILE*)user_data) == size) ? 0 : -1;
+}
+#endif
+
+irecv_error_t irecv_recv_to_file(irecv_client_t client, const char* filename, uint64_t length)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!filename) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	FILE* file = fopen(filename, "wb");
+	if (file == NULL) {
+		return IRECV_E_FILE_NOT_FOUND;
+	}
+
+	irecv_error_t error = irecv_recv_stream(client, length, irecv_recv_file_sink, file);
+	if (fclose(file) != 0 && error == IRECV_E_SUCCESS) {
+		error = IRECV_E_UNKNOWN_ERROR;
+	}
+
+	return error;
 #endif
 }
 
@@ -4004,6 +10360,169 @@ irecv_error_t irecv_devices_get_device_by_hardware_model(const char* hardware_mo
 	return IRECV_E_NO_DEVICE;
 }
 
+#ifndef USE_DUMMY
+/* take over the USB state of a freshly opened client, keeping everything else */
+static void irecv_session_rebind(irecv_client_t client, irecv_client_t new_client)
+{
+	irecv_close_usb(client);
+
+	irecv_device_info_blob_release(client->device_info_blob);
+
+	client->usb_config = new_client->usb_config;
+	client->usb_interface = new_client->usb_interface;
+	client->usb_alt_interface = new_client->usb_alt_interface;
+	client->mode = new_client->mode;
+	client->isKIS = new_client->isKIS;
+	client->strategy = new_client->strategy;
+	client->device_info = new_client->device_info;
+	client->device_info_blob = new_client->device_info_blob;
+	client->handle = new_client->handle;
+#ifdef HAVE_IOKIT
+	client->usbInterface = new_client->usbInterface;
+#endif
+	client->topology = new_client->topology;
+	if (client->console) {
+		irecv_console_reset(client->console);
+	}
+	irecv_metrics_unregister(new_client);
+	free(new_client);
+
+	if (client->connected_callback != NULL) {
+		irecv_event_t event;
+		event.size = 0;
+		event.data = NULL;
+		event.progress = 0;
+		event.type = IRECV_CONNECTED;
+		client->connected_callback(client, &event);
+	}
+}
+
+static void irecv_session_event_cb(const irecv_device_event_t* event, void *user_data)
+{
+	struct irecv_session *session = (struct irecv_session*)user_data;
+
+	if (!event->device_info) {
+		return;
+	}
+
+	if (event->type == IRECV_DEVICE_REMOVE) {
+		irecv_session_mark_detached(session);
+	} else if (event->type == IRECV_DEVICE_ADD) {
+		mutex_lock(&session->mutex);
+		session->attached = 1;
+		cond_signal(&session->cond);
+		mutex_unlock(&session->mutex);
+	}
+}
+
+static irecv_error_t irecv_session_reattach(irecv_client_t client)
+{
+	struct irecv_session *session = client->session;
+	uint64_t deadline = irecv_time_us() + (uint64_t)session->timeout * 1000;
+
+	if (client->handle != NULL) {
+		if (client->disconnected_callback != NULL) {
+			irecv_event_t event;
+			event.size = 0;
+			event.data = NULL;
+			event.progress = 0;
+			event.type = IRECV_DISCONNECTED;
+			client->disconnected_callback(client, &event);
+		}
+		irecv_close_usb(client);
+	}
+
+	debug("Waiting for device with ECID %016" PRIx64 " to re-attach\n", session->ecid);
+	while (1) {
+		uint64_t now = irecv_time_us();
+		if (now >= deadline) {
+			debug("Device did not re-attach in time\n");
+			return IRECV_E_NO_DEVICE;
+		}
+
+		/* hotplug wakes us up early, otherwise poll periodically */
+		unsigned int wait = (unsigned int)((deadline - now) / 1000);
+		if (wait > 500) {
+			wait = 500;
+		}
+		mutex_lock(&session->mutex);
+		if (!session->attached) {
+			cond_wait_timeout(&session->cond, &session->mutex, wait);
+		}
+		mutex_unlock(&session->mutex);
+
+		irecv_client_t new_client = NULL;
+		if (irecv_open_with_ecid_mode(&new_client, session->ecid, client->readonly) == IRECV_E_SUCCESS) {
+			mutex_lock(&session->mutex);
+			__atomic_store_n(&session->detached, 0, __ATOMIC_RELEASE);
+			mutex_unlock(&session->mutex);
+			irecv_session_rebind(client, new_client);
+			return IRECV_E_SUCCESS;
+		}
+	}
+}
+#endif
+
+irecv_error_t irecv_set_auto_reconnect(irecv_client_t client, unsigned int timeout_ms)
+{
+#ifdef USE_DUMMY
+	return IRECV_E_UNSUPPORTED;
+#else
+	if (!client) {
+		return IRECV_E_INVALID_INPUT;
+	}
+
+	struct irecv_session *session = client->session;
+
+	if (timeout_ms == 0) {
+		if (session) {
+			irecv_device_event_unsubscribe(session->events);
+			client->session = NULL;
+			cond_destroy(&session->cond);
+			mutex_destroy(&session->mutex);
+			free(session);
+		}
+		return IRECV_E_SUCCESS;
+	}
+
+	if (session) {
+		session->timeout = timeout_ms;
+		return IRECV_E_SUCCESS;
+	}
+
+	/* the session finds the device again by ECID, and an ECID of 0 would
+	 * match any device; read-only and KIS clients may not have one */
+	if (client->device_info.ecid == 0) {
+		debug("%s: device has no ECID, cannot follow it across re-enumeration\n", __func__);
+		return IRECV_E_UNSUPPORTED;
+	}
+
+	session = (struct irecv_session*)calloc(1, sizeof(struct irecv_session));
+	if (!session) {
+		return IRECV_E_OUT_OF_MEMORY;
+	}
+	session->ecid = client->device_info.ecid;
+	session->timeout = timeout_ms;
+	mutex_init(&session->mutex);
+	cond_init(&session->cond);
+
+	struct irecv_device_event_filter filter;
+	memset(&filter, '\0', sizeof(filter));
+	filter.ecids = &session->ecid;
+	filter.num_ecids = 1;
+	irecv_error_t error = irecv_device_event_subscribe_filtered(&session->events, &filter, irecv_session_event_cb, session);
+	if (error != IRECV_E_SUCCESS) {
+		cond_destroy(&session->cond);
+		mutex_destroy(&session->mutex);
+		free(session);
+		return error;
+	}
+	client->session = session;
+
+	return IRECV_E_SUCCESS;
+#endif
+}
+
 irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause)
 {
 #ifdef USE_DUMMY
@@ -4011,17 +10530,23 @@ irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause)
 #else
 	irecv_error_t error = 0;
 	irecv_client_t new_client = NULL;
-	irecv_event_cb_t progress_callback = client->progress_callback;
-	irecv_event_cb_t received_callback = client->received_callback;
-	irecv_event_cb_t connected_callback = client->connected_callback;
-	irecv_event_cb_t precommand_callback = client->precommand_callback;
-	irecv_event_cb_t postcommand_callback = client->postcommand_callback;
-	irecv_event_cb_t disconnected_callback = client->disconnected_callback;
+
+	if (client == NULL) {
+		return NULL;
+	}
 
 	uint64_t ecid = client->device_info.ecid;
 
-	if (check_context(client) == IRECV_E_SUCCESS) {
-		irecv_close(client);
+	if (client->handle != NULL) {
+		if (client->disconnected_callback != NULL) {
+			irecv_event_t event;
+			event.size = 0;
+			event.data = NULL;
+			event.progress = 0;
+			event.type = IRECV_DISCONNECTED;
+			client->disconnected_callback(client, &event);
+		}
+		irecv_close_usb(client);
 	}
 
 	if (initial_pause > 0) {
@@ -4031,25 +10556,14 @@ irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause)
 
 	error = irecv_open_with_ecid_and_attempts(&new_client, ecid, 10);
 	if (error != IRECV_E_SUCCESS) {
+		/* already reported as disconnected above */
+		client->disconnected_callback = NULL;
+		irecv_close(client);
 		return NULL;
 	}
 
-	new_client->progress_callback = progress_callback;
-	new_client->received_callback = received_callback;
-	new_client->connected_callback = connected_callback;
-	new_client->precommand_callback = precommand_callback;
-	new_client->postcommand_callback = postcommand_callback;
-	new_client->disconnected_callback = disconnected_callback;
-
-	if (new_client->connected_callback != NULL) {
-		irecv_event_t event;
-		event.size = 0;
-		event.data = NULL;
-		event.progress = 0;
-		event.type = IRECV_CONNECTED;
-		new_client->connected_callback(new_client, &event);
-	}
+	irecv_session_rebind(client, new_client);
 
-	return new_client;
+	return client;
 #endif
 }
@@ -0,0 +1,381 @@
+/*
+ * sha2.c
+ * SHA-256 and SHA-384 message digests
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "sha2.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#define ROR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x,n) (((x) >> (n)) | ((x) << (64 - (n))))
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+static uint32_t load_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t load_be64(const unsigned char *p)
+{
+	return ((uint64_t)load_be32(p) << 32) | (uint64_t)load_be32(p + 4);
+}
+
+static void store_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = (unsigned char)(v >> 24);
+	p[1] = (unsigned char)(v >> 16);
+	p[2] = (unsigned char)(v >> 8);
+	p[3] = (unsigned char)v;
+}
+
+static void store_be64(unsigned char *p, uint64_t v)
+{
+	store_be32(p, (uint32_t)(v >> 32));
+	store_be32(p + 4, (uint32_t)v);
+}
+
+static void sha256_blocks_generic(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	uint32_t w[64];
+	int i;
+
+	while (blocks--) {
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (i = 0; i < 16; i++) {
+			w[i] = load_be32(data + i*4);
+		}
+		for (i = 16; i < 64; i++) {
+			uint32_t s0 = ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3);
+			uint32_t s1 = ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+		for (i = 0; i < 64; i++) {
+			uint32_t t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += 64;
+	}
+}
+
+#ifdef HAVE_SHA_NI
+/* SHA-256 using the x86 SHA extensions, 4 rounds per sha256rnds2 pair */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	const __m128i shuf_mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i tmp, state0, state1, msg, msgtmp0, msgtmp1, msgtmp2, msgtmp3;
+	__m128i abef_save, cdgh_save;
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);          /* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);    /* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);    /* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0); /* CDGH */
+
+	while (blocks--) {
+		abef_save = state0;
+		cdgh_save = state1;
+
+		msgtmp0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), shuf_mask);
+		msgtmp1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), shuf_mask);
+		msgtmp2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), shuf_mask);
+		msgtmp3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), shuf_mask);
+
+		for (i = 0; i < 16; i++) {
+			__m128i cur;
+			switch (i & 3) {
+			case 0: cur = msgtmp0; break;
+			case 1: cur = msgtmp1; break;
+			case 2: cur = msgtmp2; break;
+			default: cur = msgtmp3; break;
+			}
+			msg = _mm_add_epi32(cur, _mm_loadu_si128((const __m128i*)&sha256_k[i*4]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+			if (i < 12) {
+				/* extend the message schedule for the group four steps ahead */
+				switch (i & 3) {
+				case 0:
+					msgtmp0 = _mm_sha256msg1_epu32(msgtmp0, msgtmp1);
+					msgtmp0 = _mm_add_epi32(msgtmp0, _mm_alignr_epi8(msgtmp3, msgtmp2, 4));
+					msgtmp0 = _mm_sha256msg2_epu32(msgtmp0, msgtmp3);
+					break;
+				case 1:
+					msgtmp1 = _mm_sha256msg1_epu32(msgtmp1, msgtmp2);
+					msgtmp1 = _mm_add_epi32(msgtmp1, _mm_alignr_epi8(msgtmp0, msgtmp3, 4));
+					msgtmp1 = _mm_sha256msg2_epu32(msgtmp1, msgtmp0);
+					break;
+				case 2:
+					msgtmp2 = _mm_sha256msg1_epu32(msgtmp2, msgtmp3);
+					msgtmp2 = _mm_add_epi32(msgtmp2, _mm_alignr_epi8(msgtmp1, msgtmp0, 4));
+					msgtmp2 = _mm_sha256msg2_epu32(msgtmp2, msgtmp1);
+					break;
+				default:
+					msgtmp3 = _mm_sha256msg1_epu32(msgtmp3, msgtmp0);
+					msgtmp3 = _mm_add_epi32(msgtmp3, _mm_alignr_epi8(msgtmp2, msgtmp1, 4));
+					msgtmp3 = _mm_sha256msg2_epu32(msgtmp3, msgtmp2);
+					break;
+				}
+			}
+		}
+
+		state0 = _mm_add_epi32(state0, abef_save);
+		state1 = _mm_add_epi32(state1, cdgh_save);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);       /* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);    /* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0); /* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);    /* ABEF */
+	_mm_storeu_si128((__m128i*)&state[0], state0);
+	_mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+static int sha256_have_shani(void)
+{
+	static int detected = -1;
+	if (detected < 0) {
+		unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+		int sha = 0, sse41 = 0;
+		if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+			sse41 = (ecx >> 19) & 1;
+		}
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+			sha = (ebx >> 29) & 1;
+		}
+		detected = sha && sse41;
+	}
+	return detected;
+}
+#endif
+
+static void sha256_blocks(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+#ifdef HAVE_SHA_NI
+	if (sha256_have_shani()) {
+		sha256_blocks_shani(state, data, blocks);
+		return;
+	}
+#endif
+	sha256_blocks_generic(state, data, blocks);
+}
+
+static void sha512_blocks(uint64_t state[8], const unsigned char *data, size_t blocks)
+{
+	uint64_t w[80];
+	int i;
+
+	while (blocks--) {
+		uint64_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint64_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (i = 0; i < 16; i++) {
+			w[i] = load_be64(data + i*8);
+		}
+		for (i = 16; i < 80; i++) {
+			uint64_t s0 = ROR64(w[i-15], 1) ^ ROR64(w[i-15], 8) ^ (w[i-15] >> 7);
+			uint64_t s1 = ROR64(w[i-2], 19) ^ ROR64(w[i-2], 61) ^ (w[i-2] >> 6);
+			w[i] = w[i-16] + s0 + w[i-7] + s1;
+		}
+		for (i = 0; i < 80; i++) {
+			uint64_t t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) + ((e & f) ^ (~e & g)) + sha512_k[i] + w[i];
+			uint64_t t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += 128;
+	}
+}
+
+void irecv_sha256_init(irecv_sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+void irecv_sha256_update(irecv_sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)data;
+
+	ctx->length += len;
+	if (ctx->used > 0) {
+		size_t n = 64 - ctx->used;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->block + ctx->used, p, n);
+		ctx->used += n;
+		p += n;
+		len -= n;
+		if (ctx->used < 64) {
+			return;
+		}
+		sha256_blocks(ctx->state, ctx->block, 1);
+		ctx->used = 0;
+	}
+	if (len >= 64) {
+		sha256_blocks(ctx->state, p, len / 64);
+		p += len & ~(size_t)63;
+		len &= 63;
+	}
+	if (len > 0) {
+		memcpy(ctx->block, p, len);
+		ctx->used = len;
+	}
+}
+
+void irecv_sha256_final(irecv_sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+	uint64_t bits = ctx->length * 8;
+	int i;
+
+	ctx->block[ctx->used++] = 0x80;
+	if (ctx->used > 56) {
+		memset(ctx->block + ctx->used, 0, 64 - ctx->used);
+		sha256_blocks(ctx->state, ctx->block, 1);
+		ctx->used = 0;
+	}
+	memset(ctx->block + ctx->used, 0, 56 - ctx->used);
+	store_be64(ctx->block + 56, bits);
+	sha256_blocks(ctx->state, ctx->block, 1);
+
+	for (i = 0; i < 8; i++) {
+		store_be32(digest + i*4, ctx->state[i]);
+	}
+}
+
+void irecv_sha384_init(irecv_sha384_ctx *ctx)
+{
+	static const uint64_t iv[8] = {
+		0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+		0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+	};
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->length = 0;
+	ctx->used = 0;
+}
+
+void irecv_sha384_update(irecv_sha384_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char*)data;
+
+	ctx->length += len;
+	if (ctx->used > 0) {
+		size_t n = 128 - ctx->used;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(ctx->block + ctx->used, p, n);
+		ctx->used += n;
+		p += n;
+		len -= n;
+		if (ctx->used < 128) {
+			return;
+		}
+		sha512_blocks(ctx->state, ctx->block, 1);
+		ctx->used = 0;
+	}
+	if (len >= 128) {
+		sha512_blocks(ctx->state, p, len / 128);
+		p += len & ~(size_t)127;
+		len &= 127;
+	}
+	if (len > 0) {
+		memcpy(ctx->block, p, len);
+		ctx->used = len;
+	}
+}
+
+void irecv_sha384_final(irecv_sha384_ctx *ctx, unsigned char digest[SHA384_DIGEST_LENGTH])
+{
+	int i;
+
+	ctx->block[ctx->used++] = 0x80;
+	if (ctx->used > 112) {
+		memset(ctx->block + ctx->used, 0, 128 - ctx->used);
+		sha512_blocks(ctx->state, ctx->block, 1);
+		ctx->used = 0;
+	}
+	memset(ctx->block + ctx->used, 0, 112 - ctx->used);
+	/* 128-bit message length, the upper half is always zero here */
+	store_be64(ctx->block + 112, 0);
+	store_be64(ctx->block + 120, ctx->length * 8);
+	sha512_blocks(ctx->state, ctx->block, 1);
+
+	for (i = 0; i < 6; i++) {
+		store_be64(digest + i*8, ctx->state[i]);
+	}
+}
@@ -0,0 +1,47 @@
+/*
+ * sha2.h
+ * SHA-256 and SHA-384 message digests
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef SHA2_H
+#define SHA2_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA384_DIGEST_LENGTH 48
+
+typedef struct {
+	uint32_t state[8];
+	uint64_t length;
+	unsigned char block[64];
+	size_t used;
+} irecv_sha256_ctx;
+
+typedef struct {
+	uint64_t state[8];
+	uint64_t length;
+	unsigned char block[128];
+	size_t used;
+} irecv_sha384_ctx;
+
+void irecv_sha256_init(irecv_sha256_ctx *ctx);
+void irecv_sha256_update(irecv_sha256_ctx *ctx, const void *data, size_t len);
+void irecv_sha256_final(irecv_sha256_ctx *ctx, unsigned char digest[SHA256_DIGEST_LENGTH]);
+
+void irecv_sha384_init(irecv_sha384_ctx *ctx);
+void irecv_sha384_update(irecv_sha384_ctx *ctx, const void *data, size_t len);
+void irecv_sha384_final(irecv_sha384_ctx *ctx, unsigned char digest[SHA384_DIGEST_LENGTH]);
+
+#endif
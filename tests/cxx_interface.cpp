@@ -0,0 +1,338 @@
+/*
+ * cxx_interface.cpp
+ * The C++ interface against the emulated device, and its cost next to the C API
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <libirecovery.hpp>
+
+extern "C" {
+#include "emu_usb.h"
+}
+
+#define IMAGE_SIZE (8 * 0x100000 + 321)
+#define ROUNDS 15
+
+static std::atomic<unsigned long> allocations{0};
+
+void* operator new(std::size_t size)
+{
+	allocations++;
+	void* p = std::malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+static std::vector<std::byte> image;
+
+/* coroutines are handed to the thread that calls run() */
+class run_loop {
+public:
+	void post(std::coroutine_handle<> h) noexcept
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		queue_.push_back(h);
+		cond_.notify_one();
+	}
+
+	/* resumes posted coroutines until done is set or nothing arrives for a while */
+	bool run(const std::atomic<bool>& done)
+	{
+		while (!done) {
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (!cond_.wait_for(lock, std::chrono::seconds(5), [this] { return !queue_.empty(); })) {
+				return false;
+			}
+			std::coroutine_handle<> h = queue_.front();
+			queue_.erase(queue_.begin());
+			lock.unlock();
+			h.resume();
+		}
+		return true;
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::vector<std::coroutine_handle<>> queue_;
+};
+
+struct task {
+	struct promise_type {
+		task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::abort(); }
+	};
+};
+
+struct await_state {
+	std::atomic<bool> done{false};
+	irecv::error err = IRECV_E_UNKNOWN_ERROR;
+	std::thread::id thread;
+	unsigned long allocations = 0;
+	irecv_mode mode{};
+};
+
+static task send_inline(irecv::client& c, await_state& state)
+{
+	unsigned long before = allocations;
+	state.err = co_await c.async_send(image);
+	state.allocations = allocations - before;
+	state.thread = std::this_thread::get_id();
+	state.done = true;
+}
+
+static task send_on(irecv::client& c, run_loop& loop, await_state& state)
+{
+	state.err = co_await c.async_send_command("setenv auto-boot false", loop);
+	state.thread = std::this_thread::get_id();
+	state.done = true;
+}
+
+static task wait_future(irecv::future& f, await_state& state)
+{
+	state.err = co_await f;
+	state.thread = std::this_thread::get_id();
+	state.done = true;
+}
+
+static task wait_future_on(irecv::future& f, run_loop& loop, await_state& state)
+{
+	state.err = co_await f.via(loop);
+	state.thread = std::this_thread::get_id();
+	state.done = true;
+}
+
+static task wait_device(run_loop& loop, await_state& state)
+{
+	auto r = co_await irecv::wait_for_device(loop, 0);
+	state.err = r.err;
+	state.mode = r.value;
+	state.thread = std::this_thread::get_id();
+	state.done = true;
+}
+
+static int test_awaitables()
+{
+	std::thread::id self = std::this_thread::get_id();
+	int failed = 0;
+
+	emu_set_pid(EMU_PID_RECOVERY);
+	emu_reset();
+	emu_expect_image(reinterpret_cast<const unsigned char*>(image.data()), image.size(), image.size());
+
+	/* the upload is recorded when the client is closed */
+	{
+		auto opened = irecv::client::open();
+		if (!opened) {
+			std::fprintf(stderr, "Could not open the emulated device: %s\n", irecv::strerror(opened.err));
+			return 1;
+		}
+		irecv::client c = std::move(opened.value);
+
+		/* without an executor the upload runs on the awaiting thread and allocates nothing */
+		await_state sent;
+		send_inline(c, sent);
+		if (!sent.done || sent.err != IRECV_E_SUCCESS || sent.thread != self || sent.allocations != 0) {
+			std::fprintf(stderr, "async_send: done %d, %s, %lu allocations\n", (int)sent.done, irecv::strerror(sent.err), sent.allocations);
+			failed++;
+		}
+
+		run_loop loop;
+		await_state command;
+		send_on(c, loop, command);
+		if (!loop.run(command.done) || command.err != IRECV_E_SUCCESS || command.thread != self) {
+			std::fprintf(stderr, "async_send_command did not continue on the executor\n");
+			failed++;
+		}
+
+		/* queued entries resume on the queue thread, or on the executor */
+		auto submitted = c.submit_command("setenv auto-boot true");
+		await_state queued;
+		if (submitted) {
+			wait_future(submitted.value, queued);
+			while (!queued.done) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+		if (!submitted || queued.err != IRECV_E_SUCCESS) {
+			std::fprintf(stderr, "Awaiting a queued command failed\n");
+			failed++;
+		}
+
+		submitted = c.submit_command("setenv auto-boot false");
+		await_state via;
+		if (submitted) {
+			wait_future_on(submitted.value, loop, via);
+			if (!via.done) {
+				loop.run(via.done);
+			}
+		}
+		if (!submitted || !via.done || via.err != IRECV_E_SUCCESS || via.thread != self) {
+			std::fprintf(stderr, "A queued command did not continue on the executor\n");
+			failed++;
+		}
+
+		await_state device;
+		wait_device(loop, device);
+		if (!device.done) {
+			loop.run(device.done);
+		}
+		if (!device.done || device.err != IRECV_E_SUCCESS || device.mode != IRECV_K_RECOVERY_MODE_2 || device.thread != self) {
+			std::fprintf(stderr, "wait_for_device did not report the device on the executor\n");
+			failed++;
+		}
+	}
+
+	struct emu_upload upload;
+	if (emu_get_upload(0, &upload) != 0 || upload.bytes != image.size() || upload.mismatches != 0) {
+		std::fprintf(stderr, "async_send did not arrive intact\n");
+		failed++;
+	}
+
+	return failed;
+}
+
+/* a failed reconnect closes the client, the wrapper must not keep it */
+static int test_reconnect()
+{
+	int failed = 0;
+
+	emu_set_pid(EMU_PID_RECOVERY);
+	auto opened = irecv::client::open();
+	if (!opened) {
+		std::fprintf(stderr, "Could not open the emulated device\n");
+		return 1;
+	}
+	irecv::client c = std::move(opened.value);
+
+	if (c.reconnect() != IRECV_E_SUCCESS || !c || c.send_command("getenv build-version") != IRECV_E_SUCCESS) {
+		std::fprintf(stderr, "Reconnecting to a present device failed\n");
+		failed++;
+	}
+
+	emu_set_present(0);
+	if (c.reconnect() != IRECV_E_UNABLE_TO_CONNECT || c) {
+		std::fprintf(stderr, "Reconnecting to a missing device did not leave the client empty\n");
+		failed++;
+	}
+	emu_set_present(1);
+
+	return failed;
+}
+
+template <typename F>
+static double best_seconds(F send)
+{
+	double best = 0;
+	for (int i = 0; i < ROUNDS; i++) {
+		auto start = std::chrono::steady_clock::now();
+		if (send() != IRECV_E_SUCCESS) {
+			return -1;
+		}
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		if (i == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+/* the wrapper forwards to the same C calls, so it must not be measurably slower */
+static int test_parity()
+{
+	emu_set_pid(EMU_PID_RECOVERY);
+	emu_reset();
+	emu_expect_image(nullptr, 0, 0);
+
+	auto opened = irecv::client::open();
+	if (!opened) {
+		std::fprintf(stderr, "Could not open the emulated device\n");
+		return 1;
+	}
+	irecv::client c = std::move(opened.value);
+	irecv_client_t raw = c.get();
+
+	unsigned long before = allocations;
+	double c_time = best_seconds([&]() {
+		return irecv_send_buffer(raw, reinterpret_cast<unsigned char*>(image.data()), image.size(), 0);
+	});
+	double cxx_time = best_seconds([&]() {
+		return c.send(image);
+	});
+	unsigned long allocated = allocations - before;
+
+	if (c_time < 0 || cxx_time < 0) {
+		std::fprintf(stderr, "Upload failed\n");
+		return 1;
+	}
+	std::printf("%d bytes, best of %d: C %.1f us, C++ %.1f us\n", IMAGE_SIZE, ROUNDS, c_time * 1e6, cxx_time * 1e6);
+	if (allocated != 0) {
+		std::fprintf(stderr, "The C++ interface allocated %lu times\n", allocated);
+		return 1;
+	}
+	if (cxx_time > c_time * 1.25 + 0.002) {
+		std::fprintf(stderr, "The C++ interface is slower than the C API\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+int main()
+{
+	int failed = 0;
+
+	image.resize(IMAGE_SIZE);
+	for (std::size_t i = 0; i < image.size(); i++) {
+		image[i] = static_cast<std::byte>(i * 13 + (i >> 9));
+	}
+
+	failed += test_awaitables();
+	failed += test_parity();
+	failed += test_reconnect();
+
+	if (failed) {
+		std::fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,739 @@
+/*
+ * emu_usb.c
+ * In-process libusb emulation of a device in recovery or DFU mode
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/* The tests link the library sources against this file instead of libusb,
+ * so everything here implements the public libusb API as the library uses
+ * it. The transfer helpers libusb.h defines inline are not repeated. */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "emu_usb.h"
+
+#define EMU_UPLOADS_MAX 64
+
+struct libusb_context {
+	int unused;
+};
+
+struct libusb_device {
+	int unused;
+};
+
+struct emu_state {
+	struct emu_upload upload;
+	int active;
+	uint32_t crc;
+	unsigned char tail[4];
+	unsigned int ntail;
+};
+
+struct libusb_device_handle {
+	uint16_t pid;
+	struct emu_state state;
+	unsigned int mappings;
+};
+
+/* memory handed out by libusb_dev_mem_alloc(), usbfs maps it per handle */
+struct emu_mapping {
+	unsigned char* buffer;
+	size_t length;
+	libusb_device_handle* handle;
+	struct emu_mapping* next;
+};
+
+struct emu_pending {
+	struct libusb_transfer* transfer;
+	int cancelled;
+	struct emu_pending* next;
+};
+
+static struct libusb_device emu_device;
+static uint16_t emu_pid = EMU_PID_DFU;
+static int emu_present = 1;
+
+static const unsigned char* emu_pattern = NULL;
+static size_t emu_period = 0;
+static uint64_t emu_length = 0;
+
+static mutex_t emu_mutex;
+static thread_once_t emu_once = THREAD_ONCE_INIT;
+static struct emu_upload emu_uploads[EMU_UPLOADS_MAX];
+static unsigned int emu_nuploads = 0;
+static struct emu_pending* emu_queue = NULL;
+static struct emu_mapping* emu_mappings = NULL;
+static struct emu_dev_mem emu_dev_mem;
+
+static uint32_t emu_crc_table[256];
+
+static void emu_init(void)
+{
+	uint32_t i;
+	int k;
+
+	mutex_init(&emu_mutex);
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c >> 1) ^ (0xEDB88320 & -(c & 1));
+		}
+		emu_crc_table[i] = c;
+	}
+}
+
+static void emu_lock(void)
+{
+	thread_once(&emu_once, emu_init);
+	mutex_lock(&emu_mutex);
+}
+
+static void emu_unlock(void)
+{
+	mutex_unlock(&emu_mutex);
+}
+
+void emu_set_pid(uint16_t pid)
+{
+	emu_lock();
+	emu_pid = pid;
+	emu_unlock();
+}
+
+void emu_set_present(int present)
+{
+	emu_lock();
+	emu_present = present;
+	emu_unlock();
+}
+
+void emu_expect_image(const unsigned char* pattern, size_t period, uint64_t length)
+{
+	emu_lock();
+	emu_pattern = (period > 0) ? pattern : NULL;
+	emu_period = period;
+	emu_length = length;
+	emu_unlock();
+}
+
+unsigned int emu_upload_count(void)
+{
+	unsigned int count;
+
+	emu_lock();
+	count = emu_nuploads;
+	emu_unlock();
+
+	return count;
+}
+
+int emu_get_upload(unsigned int index, struct emu_upload* upload)
+{
+	int res = -1;
+
+	emu_lock();
+	if (index < emu_nuploads) {
+		*upload = emu_uploads[index];
+		res = 0;
+	}
+	emu_unlock();
+
+	return res;
+}
+
+void emu_get_dev_mem(struct emu_dev_mem* dev_mem)
+{
+	emu_lock();
+	*dev_mem = emu_dev_mem;
+	emu_unlock();
+}
+
+void emu_reset(void)
+{
+	emu_lock();
+	emu_nuploads = 0;
+	emu_dev_mem.allocs = 0;
+	emu_dev_mem.errors = 0;
+	emu_unlock();
+}
+
+static void emu_upload_begin(libusb_device_handle* handle)
+{
+	struct emu_state* state = &handle->state;
+
+	memset(state, '\0', sizeof(struct emu_state));
+	state->upload.pid = handle->pid;
+	state->upload.last_block = -1;
+	state->crc = 0xFFFFFFFF;
+	state->active = 1;
+}
+
+#define emu_crc_step(crc, b) \
+	crc = (emu_crc_table[(crc ^ (b)) & 0xFF] ^ (crc >> 8))
+
+/* the CRC covers everything but the last four bytes, which carry it */
+static void emu_upload_crc(struct emu_state* state, const unsigned char* data, int length)
+{
+	unsigned int i;
+
+	if (length >= 4) {
+		for (i = 0; i < state->ntail; i++) {
+			emu_crc_step(state->crc, state->tail[i]);
+		}
+		for (i = 0; i < (unsigned int)length - 4; i++) {
+			emu_crc_step(state->crc, data[i]);
+		}
+		memcpy(state->tail, data + length - 4, 4);
+		state->ntail = 4;
+		return;
+	}
+	for (i = 0; i < (unsigned int)length; i++) {
+		if (state->ntail == 4) {
+			emu_crc_step(state->crc, state->tail[0]);
+			memmove(state->tail, state->tail + 1, 3);
+			state->ntail = 3;
+		}
+		state->tail[state->ntail++] = data[i];
+	}
+}
+
+static void emu_upload_data(libusb_device_handle* handle, const unsigned char* data, int length)
+{
+	struct emu_state* state = &handle->state;
+	uint64_t offset = state->upload.bytes;
+	int i = 0;
+
+	while (emu_pattern && i < length && offset + i < emu_length) {
+		size_t start = (size_t)((offset + i) % emu_period);
+		size_t len = emu_period - start;
+		size_t j;
+		if (len > (size_t)(length - i)) {
+			len = length - i;
+		}
+		if (len > emu_length - offset - i) {
+			len = (size_t)(emu_length - offset - i);
+		}
+		if (memcmp(data + i, emu_pattern + start, len) != 0) {
+			for (j = 0; j < len; j++) {
+				if (data[i + j] != emu_pattern[start + j]) {
+					state->upload.mismatches++;
+				}
+			}
+		}
+		i += (int)len;
+	}
+	state->upload.bytes += length;
+	state->upload.packets++;
+}
+
+static void emu_upload_end(libusb_device_handle* handle)
+{
+	struct emu_state* state = &handle->state;
+
+	if (!state->active) {
+		return;
+	}
+	state->active = 0;
+	if (state->ntail == 4) {
+		uint32_t crc = 0;
+		int i;
+		for (i = 3; i >= 0; i--) {
+			crc = (crc << 8) | state->tail[i];
+		}
+		state->upload.crc_ok = (crc == state->crc);
+	}
+
+	emu_lock();
+	if (emu_nuploads < EMU_UPLOADS_MAX) {
+		emu_uploads[emu_nuploads++] = state->upload;
+	}
+	emu_unlock();
+}
+
+int LIBUSB_CALL libusb_init(libusb_context** ctx)
+{
+	thread_once(&emu_once, emu_init);
+	if (ctx) {
+		*ctx = (libusb_context*)calloc(1, sizeof(libusb_context));
+	}
+	return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_exit(libusb_context* ctx)
+{
+	free(ctx);
+}
+
+int LIBUSB_CALL libusb_set_option(libusb_context* ctx, enum libusb_option option, ...)
+{
+	return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_set_debug(libusb_context* ctx, int level)
+{
+}
+
+const char* LIBUSB_CALL libusb_error_name(int errcode)
+{
+	return "LIBUSB_ERROR_EMULATED";
+}
+
+ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context* ctx, libusb_device*** list)
+{
+	ssize_t count = 0;
+
+	*list = (libusb_device**)calloc(2, sizeof(libusb_device*));
+	emu_lock();
+	if (emu_present) {
+		(*list)[count++] = &emu_device;
+	}
+	emu_unlock();
+
+	return count;
+}
+
+void LIBUSB_CALL libusb_free_device_list(libusb_device** list, int unref_devices)
+{
+	free(list);
+}
+
+libusb_device* LIBUSB_CALL libusb_ref_device(libusb_device* dev)
+{
+	return dev;
+}
+
+void LIBUSB_CALL libusb_unref_device(libusb_device* dev)
+{
+}
+
+int LIBUSB_CALL libusb_get_device_descriptor(libusb_device* dev, struct libusb_device_descriptor* desc)
+{
+	memset(desc, '\0', sizeof(struct libusb_device_descriptor));
+	desc->bLength = 18;
+	desc->bDescriptorType = 1;
+	desc->idVendor = 0x05ac;
+	emu_lock();
+	desc->idProduct = emu_pid;
+	emu_unlock();
+	desc->iSerialNumber = 3;
+	desc->bNumConfigurations = 1;
+
+	return LIBUSB_SUCCESS;
+}
+
+uint8_t LIBUSB_CALL libusb_get_bus_number(libusb_device* dev)
+{
+	return 1;
+}
+
+uint8_t LIBUSB_CALL libusb_get_port_number(libusb_device* dev)
+{
+	return 2;
+}
+
+int LIBUSB_CALL libusb_get_port_numbers(libusb_device* dev, uint8_t* port_numbers, int port_numbers_len)
+{
+	if (port_numbers_len < 2) {
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+	port_numbers[0] = 1;
+	port_numbers[1] = 2;
+
+	return 2;
+}
+
+libusb_device* LIBUSB_CALL libusb_get_parent(libusb_device* dev)
+{
+	return NULL;
+}
+
+uint8_t LIBUSB_CALL libusb_get_device_address(libusb_device* dev)
+{
+	return 5;
+}
+
+int LIBUSB_CALL libusb_get_device_speed(libusb_device* dev)
+{
+	/* LIBUSB_SPEED_HIGH */
+	return 3;
+}
+
+libusb_device* LIBUSB_CALL libusb_get_device(libusb_device_handle* dev_handle)
+{
+	return &emu_device;
+}
+
+int LIBUSB_CALL libusb_open(libusb_device* dev, libusb_device_handle** dev_handle)
+{
+	libusb_device_handle* handle = (libusb_device_handle*)calloc(1, sizeof(libusb_device_handle));
+	if (!handle) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	emu_lock();
+	handle->pid = emu_pid;
+	emu_unlock();
+	*dev_handle = handle;
+
+	return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_close(libusb_device_handle* dev_handle)
+{
+	emu_upload_end(dev_handle);
+	emu_lock();
+	if (dev_handle->mappings > 0) {
+		/* the mappings outlive the handle they have to be returned to */
+		emu_dev_mem.errors += dev_handle->mappings;
+	}
+	emu_unlock();
+	free(dev_handle);
+}
+
+int LIBUSB_CALL libusb_get_configuration(libusb_device_handle* dev_handle, int* config)
+{
+	*config = 1;
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_set_configuration(libusb_device_handle* dev_handle, int configuration)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_claim_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_release_interface(libusb_device_handle* dev_handle, int interface_number)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_set_interface_alt_setting(libusb_device_handle* dev_handle, int interface_number, int alternate_setting)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_clear_halt(libusb_device_handle* dev_handle, unsigned char endpoint)
+{
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_reset_device(libusb_device_handle* dev_handle)
+{
+	return LIBUSB_SUCCESS;
+}
+
+#if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105))
+unsigned char* LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle* dev_handle, size_t length)
+{
+	struct emu_mapping* mapping = (struct emu_mapping*)calloc(1, sizeof(struct emu_mapping));
+
+	if (!mapping) {
+		return NULL;
+	}
+	mapping->buffer = (unsigned char*)malloc(length);
+	if (!mapping->buffer) {
+		free(mapping);
+		return NULL;
+	}
+	mapping->length = length;
+	mapping->handle = dev_handle;
+
+	emu_lock();
+	mapping->next = emu_mappings;
+	emu_mappings = mapping;
+	dev_handle->mappings++;
+	emu_dev_mem.allocs++;
+	emu_dev_mem.live++;
+	emu_unlock();
+
+	return mapping->buffer;
+}
+
+int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle* dev_handle, unsigned char* buffer, size_t length)
+{
+	struct emu_mapping** link;
+	struct emu_mapping* mapping = NULL;
+
+	emu_lock();
+	for (link = &emu_mappings; *link; link = &(*link)->next) {
+		if ((*link)->buffer == buffer) {
+			mapping = *link;
+			*link = mapping->next;
+			break;
+		}
+	}
+	if (!mapping) {
+		emu_dev_mem.errors++;
+		emu_unlock();
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	if (mapping->handle != dev_handle || mapping->length != length) {
+		emu_dev_mem.errors++;
+	} else {
+		dev_handle->mappings--;
+	}
+	emu_dev_mem.live--;
+	emu_unlock();
+
+	free(mapping->buffer);
+	free(mapping);
+
+	return LIBUSB_SUCCESS;
+}
+#endif
+
+int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle* dev_handle, uint8_t desc_index, unsigned char* data, int length)
+{
+	const char* str;
+	int len;
+
+	if (desc_index == 1) {
+		str = "NONC:00112233445566778899AABBCCDDEEFF00112233445566778899AABBCCDDEEFF SNON:0123456789ABCDEF0123456789ABCDEF01234567";
+	} else {
+		str = "CPID:8010 CPRV:11 CPFM:03 SCEP:01 BDID:08 ECID:001A2B3C4D5E6F70 IBFL:3C SRTG:[iBoot-2696.0.0.1.33]";
+	}
+	len = (int)strlen(str);
+	if (len > length - 1) {
+		len = length - 1;
+	}
+	memcpy(data, str, len);
+	data[len] = '\0';
+
+	return len;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle* dev_handle, uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, unsigned char* data, uint16_t wLength, unsigned int timeout)
+{
+	struct emu_state* state = &dev_handle->state;
+
+	if (request_type == 0xA1) {
+		switch (bRequest) {
+		case 2:
+			/* DFU_UPLOAD */
+			memset(data, 0x5A, wLength);
+			return wLength;
+		case 3:
+			/* DFU_GETSTATUS, always dfuDNLOAD-IDLE */
+			memset(data, '\0', wLength);
+			if (wLength >= 5) {
+				data[4] = 5;
+			}
+			return (wLength < 6) ? wLength : 6;
+		case 5:
+			/* DFU_GETSTATE, always dfuIDLE */
+			if (wLength > 0) {
+				data[0] = 2;
+			}
+			return (wLength > 0) ? 1 : 0;
+		default:
+			return LIBUSB_ERROR_PIPE;
+		}
+	}
+	if (request_type == 0x21 && bRequest == 1) {
+		/* DFU_DNLOAD; an empty block finishes the upload */
+		if (wLength == 0) {
+			emu_upload_end(dev_handle);
+			return 0;
+		}
+		if (!state->active) {
+			emu_upload_begin(dev_handle);
+			if (wValue != 0) {
+				state->upload.block_errors++;
+			}
+		} else if (wValue != (uint16_t)(state->upload.last_block + 1) && wValue != state->upload.last_block) {
+			/* a suffix that does not fit the last block goes out under the same number */
+			state->upload.block_errors++;
+		}
+		state->upload.last_block = wValue;
+		emu_upload_crc(state, data, wLength);
+		emu_upload_data(dev_handle, data, wLength);
+		return wLength;
+	}
+	if (request_type == 0x41 && bRequest == 0) {
+		/* recovery mode announces each bulk upload */
+		emu_upload_end(dev_handle);
+		emu_upload_begin(dev_handle);
+		return 0;
+	}
+	if (request_type == 0xC0) {
+		const char* value = "emulated";
+		int len = (int)strlen(value) + 1;
+		if (len > wLength) {
+			len = wLength;
+		}
+		memcpy(data, value, len);
+		return len;
+	}
+
+	return (request_type & 0x80) ? 0 : wLength;
+}
+
+int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle* dev_handle, unsigned char endpoint, unsigned char* data, int length, int* actual_length, unsigned int timeout)
+{
+	struct emu_state* state = &dev_handle->state;
+
+	*actual_length = 0;
+	if (endpoint & 0x80) {
+		/* the console has nothing to say */
+		usleep(1000 * ((timeout > 0 && timeout < 10) ? timeout : 10));
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	if (!state->active) {
+		return LIBUSB_ERROR_PIPE;
+	}
+	if (length == 0) {
+		state->upload.zlps++;
+	} else {
+		emu_upload_data(dev_handle, data, length);
+	}
+	*actual_length = length;
+
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout(libusb_context* ctx, struct timeval* tv)
+{
+	usleep(1000);
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_handle_events_timeout_completed(libusb_context* ctx, struct timeval* tv, int* completed)
+{
+	struct emu_pending* pending;
+	struct libusb_transfer* transfer;
+
+	emu_lock();
+	pending = emu_queue;
+	if (pending) {
+		emu_queue = pending->next;
+	}
+	emu_unlock();
+	if (!pending) {
+		usleep(100);
+		return LIBUSB_SUCCESS;
+	}
+
+	transfer = pending->transfer;
+	if (pending->cancelled) {
+		transfer->status = LIBUSB_TRANSFER_CANCELLED;
+		transfer->actual_length = 0;
+	} else if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		unsigned char* setup = transfer->buffer;
+		int res = libusb_control_transfer(transfer->dev_handle, setup[0], setup[1], setup[2] | (setup[3] << 8), setup[4] | (setup[5] << 8), libusb_control_transfer_get_data(transfer), setup[6] | (setup[7] << 8), transfer->timeout);
+		transfer->status = (res < 0) ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+		transfer->actual_length = (res < 0) ? 0 : res;
+	} else {
+		int res = libusb_bulk_transfer(transfer->dev_handle, transfer->endpoint, transfer->buffer, transfer->length, &transfer->actual_length, 10);
+		if (res == LIBUSB_ERROR_TIMEOUT && (transfer->endpoint & 0x80)) {
+			/* stays queued until there is something to read or it gets cancelled */
+			pending->next = NULL;
+			emu_lock();
+			struct emu_pending** tail = &emu_queue;
+			while (*tail) {
+				tail = &(*tail)->next;
+			}
+			*tail = pending;
+			emu_unlock();
+			return LIBUSB_SUCCESS;
+		}
+		transfer->status = (res < 0) ? LIBUSB_TRANSFER_ERROR : LIBUSB_TRANSFER_COMPLETED;
+	}
+	free(pending);
+	transfer->callback(transfer);
+
+	return LIBUSB_SUCCESS;
+}
+
+#if (defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)) || (defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000102))
+int LIBUSB_CALL libusb_hotplug_register_callback(libusb_context* ctx, int events, int flags, int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn, void* user_data, libusb_hotplug_callback_handle* callback_handle)
+{
+	int present;
+
+	emu_lock();
+	present = emu_present;
+	emu_unlock();
+	if (present && (flags & LIBUSB_HOTPLUG_ENUMERATE)) {
+		cb_fn(ctx, &emu_device, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+	}
+	if (callback_handle) {
+		*callback_handle = 1;
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+void LIBUSB_CALL libusb_hotplug_deregister_callback(libusb_context* ctx, libusb_hotplug_callback_handle callback_handle)
+{
+}
+#endif
+
+struct libusb_transfer* LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+	return (struct libusb_transfer*)calloc(1, sizeof(struct libusb_transfer));
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer* transfer)
+{
+	free(transfer);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer* transfer)
+{
+	struct emu_pending* pending = (struct emu_pending*)calloc(1, sizeof(struct emu_pending));
+	struct emu_pending** tail;
+
+	if (!pending) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	pending->transfer = transfer;
+	emu_lock();
+	tail = &emu_queue;
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+	*tail = pending;
+	emu_unlock();
+
+	return LIBUSB_SUCCESS;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer* transfer)
+{
+	struct emu_pending* pending;
+	int res = LIBUSB_ERROR_NOT_FOUND;
+
+	emu_lock();
+	for (pending = emu_queue; pending; pending = pending->next) {
+		if (pending->transfer == transfer) {
+			pending->cancelled = 1;
+			res = LIBUSB_SUCCESS;
+			break;
+		}
+	}
+	emu_unlock();
+
+	return res;
+}
@@ -0,0 +1,64 @@
+/*
+ * emu_usb.h
+ * In-process libusb emulation of a device in recovery or DFU mode
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifndef EMU_USB_H
+#define EMU_USB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EMU_PID_DFU      0x1227
+#define EMU_PID_RECOVERY 0x1281
+
+/* what the emulated device saw of one upload */
+struct emu_upload {
+	uint16_t pid;
+	uint64_t bytes;             /* data bytes, the DFU suffix included */
+	uint64_t packets;           /* bulk packets or DFU_DNLOAD blocks carrying data */
+	uint64_t zlps;              /* zero length bulk packets */
+	int last_block;             /* wValue of the last DFU_DNLOAD block, -1 if none */
+	uint64_t block_errors;      /* DFU_DNLOAD blocks whose wValue is out of sequence */
+	int crc_ok;                 /* the DFU suffix CRC matches the data in front of it */
+	uint64_t mismatches;        /* image bytes that differ from emu_expect_image() */
+};
+
+/* libusb_dev_mem_alloc() bookkeeping */
+struct emu_dev_mem {
+	unsigned int allocs;        /* buffers allocated since emu_reset() */
+	unsigned int live;          /* buffers not freed yet */
+	unsigned int errors;        /* buffers freed against another handle or with another
+	                               length, unknown buffers, handles closed under a buffer */
+};
+
+/* the device the next enumeration reports, EMU_PID_DFU by default */
+void emu_set_pid(uint16_t pid);
+
+/* make the device disappear from (0) or reappear in (1) the device list */
+void emu_set_present(int present);
+
+/* check every image byte at offset o against pattern[o % period]; NULL turns the check off */
+void emu_expect_image(const unsigned char* pattern, size_t period, uint64_t length);
+
+/* uploads are recorded when the device sees the next one start, the DFU
+ * finish request, or the handle being closed */
+unsigned int emu_upload_count(void);
+int emu_get_upload(unsigned int index, struct emu_upload* upload);
+
+void emu_get_dev_mem(struct emu_dev_mem* dev_mem);
+
+/* forget all recorded uploads and the dev_mem counters */
+void emu_reset(void);
+
+#endif
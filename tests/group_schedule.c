@@ -0,0 +1,144 @@
+/*
+ * group_schedule.c
+ * Group file uploads with fewer scheduler slots than members
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libirecovery.h>
+
+#include "emu_usb.h"
+
+#define MEMBERS 3
+/* more chunks than the shared ring holds, so a member that can't send stops the others */
+#define IMAGE_SIZE (6 * 0x100000 + 99)
+/* well below the time a member waits for a slot before it gives up */
+#define MAX_SECONDS 10
+
+static unsigned char image[IMAGE_SIZE];
+static char image_path[] = "group_schedule.XXXXXX";
+
+static int run_group(unsigned int max_streams, unsigned int max_workers)
+{
+	irecv_client_t clients[MEMBERS] = { NULL };
+	irecv_scheduler_t scheduler = NULL;
+	irecv_group_t group = NULL;
+	struct irecv_group_stats stats;
+	struct emu_upload upload;
+	irecv_error_t error;
+	time_t start;
+	int failed = 0;
+	int i;
+
+	printf("%d members, %u streams, %u workers\n", MEMBERS, max_streams, max_workers);
+	emu_set_pid(EMU_PID_RECOVERY);
+	emu_reset();
+	emu_expect_image(image, IMAGE_SIZE, IMAGE_SIZE);
+
+	if (irecv_scheduler_new(&scheduler, max_streams, max_streams) != IRECV_E_SUCCESS
+	 || irecv_group_new(&group, max_workers) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not create the scheduler and the group\n");
+		irecv_scheduler_free(scheduler);
+		return 1;
+	}
+	for (i = 0; i < MEMBERS; i++) {
+		if (irecv_open_with_ecid(&clients[i], 0) != IRECV_E_SUCCESS) {
+			fprintf(stderr, "Could not open the emulated device\n");
+			failed++;
+			break;
+		}
+		irecv_scheduler_attach(scheduler, clients[i]);
+		irecv_group_add(group, clients[i]);
+	}
+
+	if (!failed) {
+		start = time(NULL);
+		error = irecv_group_send_file(group, image_path, 0);
+		if (error != IRECV_E_SUCCESS) {
+			fprintf(stderr, "The group upload failed: %s\n", irecv_strerror(error));
+			failed++;
+		} else if (time(NULL) - start > MAX_SECONDS) {
+			fprintf(stderr, "The group upload took %d s\n", (int)(time(NULL) - start));
+			failed++;
+		}
+		if (irecv_group_get_stats(group, &stats) != IRECV_E_SUCCESS || stats.succeeded != MEMBERS) {
+			fprintf(stderr, "Not every member got the image\n");
+			failed++;
+		}
+	}
+
+	irecv_group_free(group);
+	for (i = 0; i < MEMBERS; i++) {
+		if (clients[i]) {
+			irecv_scheduler_detach(clients[i]);
+			irecv_close(clients[i]);
+		}
+	}
+	irecv_scheduler_free(scheduler);
+
+	if (!failed) {
+		for (i = 0; i < MEMBERS; i++) {
+			if (emu_get_upload(i, &upload) != 0 || upload.bytes != IMAGE_SIZE || upload.mismatches != 0) {
+				fprintf(stderr, "Upload %d did not arrive intact\n", i);
+				failed++;
+			}
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	FILE* f;
+	int fd;
+	int i;
+
+	for (i = 0; i < IMAGE_SIZE; i++) {
+		image[i] = (unsigned char)(i ^ (i >> 11));
+	}
+	fd = mkstemp(image_path);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create a temporary file\n");
+		return 1;
+	}
+	f = fdopen(fd, "wb");
+	if (!f || fwrite(image, 1, IMAGE_SIZE, f) != IMAGE_SIZE || fclose(f) != 0) {
+		fprintf(stderr, "Could not write %s\n", image_path);
+		unlink(image_path);
+		return 1;
+	}
+
+	/* one slot for the whole wave, two slots for three members, and enough slots */
+	failed += run_group(1, 0);
+	failed += run_group(2, 0);
+	failed += run_group(MEMBERS, 0);
+
+	unlink(image_path);
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
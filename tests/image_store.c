@@ -0,0 +1,251 @@
+/*
+ * image_store.c
+ * Sending from the content-addressed image store against the emulated device
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <libirecovery.h>
+
+#include "emu_usb.h"
+
+#define IMAGE_MAX (0x100000 + 123)
+#define LRU_SIZE 0x10000
+#define MANY_IMAGES 100
+
+static unsigned char image[IMAGE_MAX];
+
+static void remove_dir(const char* path)
+{
+	char entry_path[1024];
+	struct dirent* ent;
+	DIR* dir = opendir(path);
+
+	if (dir) {
+		while ((ent = readdir(dir)) != NULL) {
+			if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+				continue;
+			}
+			snprintf(entry_path, sizeof(entry_path), "%s/%s", path, ent->d_name);
+			unlink(entry_path);
+		}
+		closedir(dir);
+	}
+	rmdir(path);
+}
+
+/* sends from the store, or from image when store is NULL */
+static irecv_error_t send_image(uint16_t pid, irecv_image_store_t store, const unsigned char* digest, const unsigned char* data, uint64_t length, struct emu_upload* upload, struct irecv_upload_result* result)
+{
+	unsigned int options = (pid == EMU_PID_DFU) ? IRECV_SEND_OPT_DFU_NOTIFY_FINISH : 0;
+	irecv_client_t client = NULL;
+	irecv_error_t error;
+
+	emu_set_pid(pid);
+	emu_reset();
+	emu_expect_image(data, (size_t)length, length);
+
+	error = irecv_open_with_ecid(&client, 0);
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the emulated device: %s\n", irecv_strerror(error));
+		return error;
+	}
+	irecv_set_upload_digests(client, IRECV_DIGEST_CRC32 | IRECV_DIGEST_SHA256);
+
+	if (store) {
+		error = irecv_send_image_by_digest(client, store, digest, options);
+	} else {
+		error = irecv_send_buffer(client, (unsigned char*)data, (unsigned long)length, options);
+	}
+	if (error == IRECV_E_SUCCESS && result) {
+		error = irecv_get_upload_result(client, result);
+	}
+	irecv_close(client);
+
+	if (error == IRECV_E_SUCCESS && upload && emu_get_upload(0, upload) != 0) {
+		fprintf(stderr, "The device did not see an upload\n");
+		error = IRECV_E_UNKNOWN_ERROR;
+	}
+
+	return error;
+}
+
+/* the stored DFU CRC replaces hashing while sending, the traffic must not change */
+static int test_send(irecv_image_store_t store, uint16_t pid, uint64_t length)
+{
+	unsigned char digest[32];
+	struct emu_upload expected, upload;
+	struct irecv_upload_result expected_result, result;
+	const char* mode = (pid == EMU_PID_DFU) ? "DFU" : "Recovery";
+
+	if (irecv_image_store_add_buffer(store, image, (unsigned long)length, digest) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not add %" PRIu64 " bytes to the store\n", length);
+		return 1;
+	}
+	if (send_image(pid, NULL, NULL, image, length, &expected, &expected_result) != IRECV_E_SUCCESS) {
+		return 1;
+	}
+	if (send_image(pid, store, digest, image, length, &upload, &result) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "%s mode, %" PRIu64 " bytes: sending by digest failed\n", mode, length);
+		return 1;
+	}
+	if (upload.bytes != expected.bytes || upload.packets != expected.packets || upload.zlps != expected.zlps
+	 || upload.last_block != expected.last_block || upload.mismatches != 0 || upload.crc_ok != expected.crc_ok) {
+		fprintf(stderr, "%s mode, %" PRIu64 " bytes: sending by digest differs from sending the buffer\n", mode, length);
+		return 1;
+	}
+	if (pid == EMU_PID_DFU && !upload.crc_ok) {
+		fprintf(stderr, "%s mode, %" PRIu64 " bytes: wrong DFU suffix CRC\n", mode, length);
+		return 1;
+	}
+	if (result.crc32 != expected_result.crc32 || memcmp(result.sha256, digest, sizeof(digest)) != 0) {
+		fprintf(stderr, "%s mode, %" PRIu64 " bytes: sending by digest reported different digests\n", mode, length);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* room for three images; adding a fourth evicts the least recently sent one */
+static int test_eviction(const char* path)
+{
+	irecv_image_store_t store = NULL;
+	unsigned char digest[4][32];
+	static const char* expect[4] = { "kept", "evicted", "kept", "kept" };
+	int failed = 0;
+	int i;
+
+	if (irecv_image_store_open(path, 3 * LRU_SIZE, &store) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the store in %s\n", path);
+		return 1;
+	}
+	for (i = 0; i < 4; i++) {
+		if (i == 3 && send_image(EMU_PID_RECOVERY, store, digest[0], image, LRU_SIZE, NULL, NULL) != IRECV_E_SUCCESS) {
+			fprintf(stderr, "Could not send the first image by digest\n");
+			failed++;
+		}
+		image[0] = (unsigned char)i;
+		if (irecv_image_store_add_buffer(store, image, LRU_SIZE, digest[i]) != IRECV_E_SUCCESS) {
+			fprintf(stderr, "Could not add image %d to the store\n", i);
+			failed++;
+		}
+	}
+	for (i = 0; i < 4; i++) {
+		irecv_error_t error;
+		image[0] = (unsigned char)i;
+		error = send_image(EMU_PID_RECOVERY, store, digest[i], image, LRU_SIZE, NULL, NULL);
+		if ((error == IRECV_E_SUCCESS) != (strcmp(expect[i], "kept") == 0)) {
+			fprintf(stderr, "Image %d should have been %s, sending it returned %d\n", i, expect[i], error);
+			failed++;
+		}
+	}
+	irecv_image_store_close(store);
+
+	return failed;
+}
+
+/* more images than the initial index holds, found again after reopening */
+static int test_growth(const char* path)
+{
+	irecv_image_store_t store = NULL;
+	unsigned char digest[MANY_IMAGES][32];
+	struct irecv_upload_result result;
+	int failed = 0;
+	int i;
+
+	if (irecv_image_store_open(path, 0, &store) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the store in %s\n", path);
+		return 1;
+	}
+	for (i = 0; i < MANY_IMAGES; i++) {
+		memcpy(image, &i, sizeof(i));
+		if (irecv_image_store_add_buffer(store, image, 0x800, digest[i]) != IRECV_E_SUCCESS) {
+			fprintf(stderr, "Could not add image %d to the store\n", i);
+			failed++;
+		}
+	}
+	irecv_image_store_close(store);
+
+	if (irecv_image_store_open(path, 0, &store) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not reopen the store in %s\n", path);
+		return failed + 1;
+	}
+	for (i = 0; i < MANY_IMAGES; i++) {
+		memcpy(image, &i, sizeof(i));
+		if (send_image(EMU_PID_RECOVERY, store, digest[i], image, 0x800, NULL, &result) != IRECV_E_SUCCESS
+		 || memcmp(result.sha256, digest[i], 32) != 0) {
+			fprintf(stderr, "Image %d was not found after reopening the store\n", i);
+			failed++;
+		}
+	}
+	irecv_image_store_close(store);
+
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	static const uint64_t lengths[] = { 5 * 0x800, IMAGE_MAX };
+	char send_path[] = "image_store.XXXXXX";
+	char lru_path[] = "image_store.XXXXXX";
+	char growth_path[] = "image_store.XXXXXX";
+	irecv_image_store_t store = NULL;
+	uint32_t x = 0x9E3779B9;
+	int failed = 0;
+	unsigned int i;
+
+	for (i = 0; i < IMAGE_MAX; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		image[i] = (unsigned char)x;
+	}
+
+	if (!mkdtemp(send_path) || !mkdtemp(lru_path) || !mkdtemp(growth_path)) {
+		fprintf(stderr, "Could not create a temporary directory\n");
+		return 1;
+	}
+
+	if (irecv_image_store_open(send_path, 0, &store) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the store in %s\n", send_path);
+		failed++;
+	} else {
+		for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+			failed += test_send(store, EMU_PID_DFU, lengths[i]);
+			failed += test_send(store, EMU_PID_RECOVERY, lengths[i]);
+		}
+		irecv_image_store_close(store);
+	}
+	failed += test_eviction(lru_path);
+	failed += test_growth(growth_path);
+
+	remove_dir(send_path);
+	remove_dir(lru_path);
+	remove_dir(growth_path);
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
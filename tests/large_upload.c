@@ -0,0 +1,188 @@
+/*
+ * large_upload.c
+ * Uploads past 4 GiB in DFU and recovery mode against the emulated device
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <libirecovery.h>
+
+#include "emu_usb.h"
+
+#define PATTERN_SIZE (1 << 20)
+#define FOUR_GIB 0x100000000ULL
+
+static unsigned char pattern[PATTERN_SIZE];
+
+/* covers length bytes of the repeated pattern with irregular, unaligned parts */
+static struct irecv_iovec* make_iov(uint64_t length, unsigned int* count)
+{
+	unsigned int size = 16;
+	unsigned int n = 0;
+	uint64_t offset = 0;
+	struct irecv_iovec* iov = (struct irecv_iovec*)malloc(size * sizeof(struct irecv_iovec));
+
+	while (iov && offset < length) {
+		uint64_t start = offset % PATTERN_SIZE;
+		uint64_t len = PATTERN_SIZE - start;
+		if (n % 3 == 1 && len > 0x1235) {
+			len -= 0x1235;
+		}
+		if (len > length - offset) {
+			len = length - offset;
+		}
+		if (n == size) {
+			struct irecv_iovec* grown = (struct irecv_iovec*)realloc(iov, 2 * size * sizeof(struct irecv_iovec));
+			if (!grown) {
+				free(iov);
+				return NULL;
+			}
+			iov = grown;
+			size *= 2;
+		}
+		iov[n].iov_base = pattern + start;
+		iov[n].iov_len = (size_t)len;
+		offset += len;
+		n++;
+	}
+	*count = n;
+
+	return iov;
+}
+
+static int run_upload(uint16_t pid, uint64_t length, unsigned int options, struct emu_upload* upload)
+{
+	irecv_client_t client = NULL;
+	struct irecv_upload_result result;
+	unsigned int count = 0;
+	struct irecv_iovec* iov;
+	irecv_error_t error;
+	int res = -1;
+
+	iov = make_iov(length, &count);
+	if (!iov) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+
+	emu_set_pid(pid);
+	emu_reset();
+	emu_expect_image(pattern, PATTERN_SIZE, length);
+
+	error = irecv_open_with_ecid(&client, 0);
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the emulated device: %s\n", irecv_strerror(error));
+		free(iov);
+		return -1;
+	}
+
+	error = irecv_send_iov(client, iov, count, options);
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Upload of %" PRIu64 " bytes failed: %s\n", length, irecv_strerror(error));
+	} else if (irecv_get_upload_result(client, &result) != IRECV_E_SUCCESS || result.bytes != length) {
+		fprintf(stderr, "Upload result does not report %" PRIu64 " bytes\n", length);
+	} else {
+		res = 0;
+	}
+	irecv_close(client);
+	free(iov);
+
+	if (res == 0 && emu_get_upload(0, upload) != 0) {
+		fprintf(stderr, "The device did not see an upload\n");
+		res = -1;
+	}
+
+	return res;
+}
+
+static int check(int cond, const char* what, uint64_t got, uint64_t expected)
+{
+	if (!cond) {
+		fprintf(stderr, "%s: got %" PRIu64 ", expected %" PRIu64 "\n", what, got, expected);
+		return 1;
+	}
+	return 0;
+}
+
+/* DFU block numbers are 16 bits wide and wrap every 128 MiB */
+static int test_dfu(uint64_t length)
+{
+	struct emu_upload upload;
+	uint64_t blocks = (length + 0x7FF) / 0x800;
+	int failed = 0;
+
+	printf("DFU upload of %" PRIu64 " bytes\n", length);
+	if (run_upload(EMU_PID_DFU, length, IRECV_SEND_OPT_DFU_NOTIFY_FINISH, &upload) != 0) {
+		return 1;
+	}
+	failed += check(upload.bytes == length + 16, "DFU bytes", upload.bytes, length + 16);
+	failed += check(upload.last_block == (int)((blocks - 1) & 0xFFFF), "last DFU block", (uint64_t)upload.last_block, (blocks - 1) & 0xFFFF);
+	failed += check(upload.block_errors == 0, "DFU blocks out of sequence", upload.block_errors, 0);
+	failed += check(upload.mismatches == 0, "mismatching image bytes", upload.mismatches, 0);
+	failed += check(upload.crc_ok, "DFU suffix CRC ok", upload.crc_ok, 1);
+
+	return failed;
+}
+
+/* a bulk upload that ends on a packet boundary has to be terminated by a ZLP */
+static int test_recovery(uint64_t length)
+{
+	struct emu_upload upload;
+	uint64_t zlps = (length % 512 == 0) ? 1 : 0;
+	int failed = 0;
+
+	printf("Recovery mode upload of %" PRIu64 " bytes\n", length);
+	if (run_upload(EMU_PID_RECOVERY, length, 0, &upload) != 0) {
+		return 1;
+	}
+	failed += check(upload.bytes == length, "bulk bytes", upload.bytes, length);
+	failed += check(upload.packets == (length + 0x7FFF) / 0x8000, "bulk packets", upload.packets, (length + 0x7FFF) / 0x8000);
+	failed += check(upload.zlps == zlps, "ZLPs", upload.zlps, zlps);
+	failed += check(upload.mismatches == 0, "mismatching image bytes", upload.mismatches, 0);
+
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t x = 0x12345678;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < PATTERN_SIZE; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		pattern[i] = (unsigned char)x;
+	}
+
+	/* the last block is full, so the suffix goes out in a block of its own */
+	failed += test_dfu(FOUR_GIB + 3 * 0x800);
+	failed += test_dfu(0x800 * 0x10000 + 0x123);
+	failed += test_recovery(FOUR_GIB + 0x8000);
+	failed += test_recovery(3 * 0x8000 + 100);
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * metrics.c
+ * OpenMetrics output for a client of the emulated device
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <libirecovery.h>
+
+#include "emu_usb.h"
+
+#define UPLOAD_SIZE 100000
+
+static unsigned char image[UPLOAD_SIZE];
+
+/* the value of the first sample whose name and labels start with prefix, -1 if there is none */
+static int64_t sample_value(const char* text, const char* prefix)
+{
+	const char* line = text;
+	size_t len = strlen(prefix);
+
+	while (line && *line) {
+		if (strncmp(line, prefix, len) == 0) {
+			const char* value = strchr(line, ' ');
+			return (value) ? strtoll(value + 1, NULL, 10) : -1;
+		}
+		line = strchr(line, '\n');
+		if (line) {
+			line++;
+		}
+	}
+
+	return -1;
+}
+
+/* every sample belongs to a family announced by a TYPE line, and the text ends with # EOF */
+static int check_format(const char* text)
+{
+	static const char* suffixes[] = { "_total", "_bucket", "_sum", "_count", NULL };
+	char families[8192] = " ";
+	const char* line = text;
+	const char* eof = strstr(text, "# EOF\n");
+
+	if (!eof || eof[6] != '\0') {
+		fprintf(stderr, "The output does not end with # EOF\n");
+		return 1;
+	}
+	while (line < eof) {
+		const char* end = strchr(line, '\n');
+		char name[128];
+		size_t len;
+		int i;
+
+		if (strncmp(line, "# TYPE ", 7) == 0) {
+			len = strcspn(line + 7, " ");
+			if (strlen(families) + len + 2 < sizeof(families)) {
+				strncat(families, line + 7, len);
+				strcat(families, " ");
+			}
+		} else if (line[0] != '#') {
+			len = strcspn(line, "{ ");
+			if (len == 0 || len >= sizeof(name) - 2 || line[len + strcspn(line + len, " ")] != ' ') {
+				fprintf(stderr, "Malformed sample: %.*s\n", (int)(end - line), line);
+				return 1;
+			}
+			name[0] = ' ';
+			memcpy(name + 1, line, len);
+			name[len + 1] = '\0';
+			for (i = 0; suffixes[i]; i++) {
+				size_t slen = strlen(suffixes[i]);
+				if (len > slen && strcmp(name + 1 + len - slen, suffixes[i]) == 0) {
+					name[1 + len - slen] = '\0';
+					break;
+				}
+			}
+			strcat(name, " ");
+			if (!strstr(families, name)) {
+				fprintf(stderr, "Sample without a TYPE line: %.*s\n", (int)(end - line), line);
+				return 1;
+			}
+		}
+		line = end + 1;
+	}
+
+	return 0;
+}
+
+static int test_counters(void)
+{
+	irecv_client_t client = NULL;
+	char* text = NULL;
+	size_t length = 0;
+	int failed = 0;
+
+	emu_set_pid(EMU_PID_RECOVERY);
+	if (irecv_open_with_ecid(&client, 0) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the emulated device\n");
+		return 1;
+	}
+	if (irecv_send_buffer(client, image, UPLOAD_SIZE, 0) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Upload failed\n");
+		failed++;
+	}
+	/* the console has nothing to say, these polls end with a timeout */
+	irecv_receive(client);
+	irecv_receive(client);
+
+	if (irecv_metrics_render(&text, &length) != IRECV_E_SUCCESS || length != strlen(text)) {
+		fprintf(stderr, "Could not render the metrics\n");
+		irecv_close(client);
+		return failed + 1;
+	}
+	failed += check_format(text);
+	if (sample_value(text, "irecv_sent_bytes_total ") != UPLOAD_SIZE) {
+		fprintf(stderr, "irecv_sent_bytes_total is not %d\n", UPLOAD_SIZE);
+		failed++;
+	}
+	if (sample_value(text, "irecv_client_sent_bytes_total{") != UPLOAD_SIZE) {
+		fprintf(stderr, "irecv_client_sent_bytes_total is not %d\n", UPLOAD_SIZE);
+		failed++;
+	}
+	if (sample_value(text, "irecv_transfers_total{result=\"success\"} ") != 1) {
+		fprintf(stderr, "irecv_transfers_total does not count the upload\n");
+		failed++;
+	}
+	if (sample_value(text, "irecv_timeouts_total ") != 0) {
+		fprintf(stderr, "Console polls were counted as timeouts\n");
+		failed++;
+	}
+	if (sample_value(text, "irecv_clients ") != 1) {
+		fprintf(stderr, "irecv_clients does not count the open client\n");
+		failed++;
+	}
+	free(text);
+	irecv_close(client);
+
+	return failed;
+}
+
+static int test_socket(void)
+{
+	char path[] = "metrics.XXXXXX";
+	char response[65536];
+	struct sockaddr_un addr;
+	const char* request = "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	size_t received = 0;
+	ssize_t n;
+	int failed = 0;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create a temporary file\n");
+		return 1;
+	}
+	close(fd);
+	if (irecv_metrics_serve(path) != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not serve the metrics on %s\n", path);
+		unlink(path);
+		return 1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Could not connect to %s\n", path);
+		failed++;
+	} else {
+		send(fd, request, strlen(request), 0);
+		while (received < sizeof(response) - 1 && (n = recv(fd, response + received, sizeof(response) - 1 - received, 0)) > 0) {
+			received += n;
+		}
+		response[received] = '\0';
+		if (strncmp(response, "HTTP/1.0 200 OK\r\n", 17) != 0 || !strstr(response, "\r\n\r\n")) {
+			fprintf(stderr, "The socket did not answer with an HTTP response\n");
+			failed++;
+		} else {
+			failed += check_format(strstr(response, "\r\n\r\n") + 4);
+		}
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	irecv_metrics_stop();
+	unlink(path);
+
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+
+	memset(image, 0xA5, sizeof(image));
+	failed += test_counters();
+	failed += test_socket();
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * readahead_send.c
+ * Files and pipes streamed through the read-ahead ring against the emulated device
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <libirecovery.h>
+#include <libimobiledevice-glue/thread.h>
+
+#include "emu_usb.h"
+
+/* not a multiple of the 1 MiB ring chunks, so a chunk sent twice or out of order shows */
+#define PATTERN_SIZE (0x100000 + 4093)
+
+enum {
+	SEND_BUFFER,
+	SEND_FILE,
+	SEND_PIPE
+};
+
+static const char* send_names[] = { "buffer", "file", "pipe" };
+
+struct pipe_writer {
+	int fd;
+	const unsigned char* data;
+	uint64_t length;
+};
+
+static unsigned char* image = NULL;
+static char image_path[] = "readahead_send.XXXXXX";
+
+/* odd sized writes, so the reader sees short reads */
+static void* pipe_writer_run(void* arg)
+{
+	struct pipe_writer* writer = (struct pipe_writer*)arg;
+	uint64_t offset = 0;
+
+	while (offset < writer->length) {
+		size_t size = (writer->length - offset < 7777) ? (size_t)(writer->length - offset) : 7777;
+		ssize_t written = write(writer->fd, writer->data + offset, size);
+		if (written <= 0) {
+			break;
+		}
+		offset += written;
+	}
+	close(writer->fd);
+
+	return NULL;
+}
+
+static int write_image(uint64_t length)
+{
+	FILE* f = fopen(image_path, "wb");
+	if (!f) {
+		return -1;
+	}
+	if (length > 0 && fwrite(image, 1, (size_t)length, f) != length) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+static int send_image(uint16_t pid, int how, uint64_t length, struct emu_upload* upload, struct irecv_upload_result* result)
+{
+	unsigned int options = (pid == EMU_PID_DFU) ? IRECV_SEND_OPT_DFU_NOTIFY_FINISH : 0;
+	irecv_client_t client = NULL;
+	struct pipe_writer writer;
+	THREAD_T thread = THREAD_T_NULL;
+	int fds[2] = { -1, -1 };
+	irecv_error_t error;
+
+	emu_set_pid(pid);
+	emu_reset();
+	emu_expect_image(image, PATTERN_SIZE, length);
+
+	error = irecv_open_with_ecid(&client, 0);
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the emulated device: %s\n", irecv_strerror(error));
+		return -1;
+	}
+	irecv_set_upload_digests(client, IRECV_DIGEST_CRC32 | IRECV_DIGEST_SHA256);
+
+	switch (how) {
+	case SEND_FILE:
+		error = irecv_send_file(client, image_path, options);
+		break;
+	case SEND_PIPE:
+		if (pipe(fds) != 0) {
+			error = IRECV_E_UNKNOWN_ERROR;
+			break;
+		}
+		writer.fd = fds[1];
+		writer.data = image;
+		writer.length = length;
+		if (thread_new(&thread, pipe_writer_run, &writer) != 0) {
+			close(fds[1]);
+			close(fds[0]);
+			error = IRECV_E_UNKNOWN_ERROR;
+			break;
+		}
+		error = irecv_send_fd(client, fds[0], options);
+		close(fds[0]);
+		thread_join(thread);
+		thread_free(thread);
+		break;
+	default:
+		error = irecv_send_buffer(client, image, (unsigned long)length, options);
+		break;
+	}
+	if (error == IRECV_E_SUCCESS) {
+		error = irecv_get_upload_result(client, result);
+	}
+	irecv_close(client);
+
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Sending %" PRIu64 " bytes from a %s failed: %s\n", length, send_names[how], irecv_strerror(error));
+		return -1;
+	}
+	if (emu_get_upload(0, upload) != 0) {
+		fprintf(stderr, "The device did not see an upload\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int compare_sends(uint16_t pid, uint64_t length)
+{
+	struct emu_upload expected;
+	struct irecv_upload_result expected_result;
+	int failed = 0;
+	int how;
+
+	if (write_image(length) != 0) {
+		fprintf(stderr, "Could not write %s\n", image_path);
+		return 1;
+	}
+	if (send_image(pid, SEND_BUFFER, length, &expected, &expected_result) != 0) {
+		return 1;
+	}
+	if (expected.mismatches != 0 || (pid == EMU_PID_DFU && !expected.crc_ok)) {
+		fprintf(stderr, "Sending %" PRIu64 " bytes from a buffer did not arrive intact\n", length);
+		return 1;
+	}
+
+	for (how = SEND_FILE; how <= SEND_PIPE; how++) {
+		struct emu_upload upload;
+		struct irecv_upload_result result;
+		if (send_image(pid, how, length, &upload, &result) != 0) {
+			failed++;
+			continue;
+		}
+		if (upload.bytes != expected.bytes || upload.packets != expected.packets || upload.zlps != expected.zlps
+		 || upload.last_block != expected.last_block || upload.block_errors != 0 || upload.mismatches != 0
+		 || upload.crc_ok != expected.crc_ok) {
+			fprintf(stderr, "%s mode, %" PRIu64 " bytes: a %s sent different USB traffic than a buffer\n", (pid == EMU_PID_DFU) ? "DFU" : "Recovery", length, send_names[how]);
+			failed++;
+		}
+		if (result.bytes != expected_result.bytes || result.crc32 != expected_result.crc32
+		 || memcmp(result.sha256, expected_result.sha256, sizeof(result.sha256)) != 0) {
+			fprintf(stderr, "%s mode, %" PRIu64 " bytes: a %s got different digests than a buffer\n", (pid == EMU_PID_DFU) ? "DFU" : "Recovery", length, send_names[how]);
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char** argv)
+{
+	/* one chunk read inline, chunk and packet boundaries, more chunks than the ring holds */
+	static const uint64_t lengths[] = {
+		0x800 - 1,
+		0x100000 - 1,
+		0x100000,
+		0x100000 + 1,
+		4 * 0x100000,
+		4 * 0x100000 + 0x8000,
+		9 * 0x100000 + 17
+	};
+	uint64_t max = lengths[sizeof(lengths) / sizeof(lengths[0]) - 1];
+	uint32_t x = 0x2545F491;
+	int failed = 0;
+	uint64_t i;
+	int fd;
+
+	image = (unsigned char*)malloc((size_t)max);
+	if (!image) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < PATTERN_SIZE; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		image[i] = (unsigned char)x;
+	}
+	for (i = PATTERN_SIZE; i < max; i++) {
+		image[i] = image[i % PATTERN_SIZE];
+	}
+
+	fd = mkstemp(image_path);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create a temporary file\n");
+		free(image);
+		return 1;
+	}
+	close(fd);
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		printf("%" PRIu64 " bytes\n", lengths[i]);
+		failed += compare_sends(EMU_PID_DFU, lengths[i]);
+		failed += compare_sends(EMU_PID_RECOVERY, lengths[i]);
+	}
+
+	unlink(image_path);
+	free(image);
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * staging_memory.c
+ * Bulk staging memory is returned to the handle it was allocated from
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the GNU Lesser General Public License
+ * (LGPL) version 2.1 which accompanies this distribution, and is available at
+ * http://www.gnu.org/licenses/lgpl-2.1.html
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libusb.h>
+#include <libirecovery.h>
+
+#include "emu_usb.h"
+
+/* a few read-ahead chunks and a tail, sent in recovery mode so the ring is bulk staging memory */
+#define IMAGE_SIZE (3 * 0x100000 + 5)
+
+static unsigned char image[IMAGE_SIZE];
+static char image_path[] = "staging_memory.XXXXXX";
+
+static int send_image(unsigned int reconnect_ms, struct emu_dev_mem* dev_mem)
+{
+	irecv_client_t client = NULL;
+	struct emu_upload upload;
+	irecv_error_t error;
+
+	emu_set_pid(EMU_PID_RECOVERY);
+	emu_reset();
+	emu_expect_image(image, IMAGE_SIZE, IMAGE_SIZE);
+
+	error = irecv_open_with_ecid(&client, 0);
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Could not open the emulated device: %s\n", irecv_strerror(error));
+		return 1;
+	}
+	if (reconnect_ms > 0) {
+		error = irecv_set_auto_reconnect(client, reconnect_ms);
+		if (error != IRECV_E_SUCCESS) {
+			fprintf(stderr, "Could not turn on auto-reconnect: %s\n", irecv_strerror(error));
+			irecv_close(client);
+			return 1;
+		}
+	}
+	error = irecv_send_file(client, image_path, 0);
+	irecv_close(client);
+	if (error != IRECV_E_SUCCESS) {
+		fprintf(stderr, "Sending the image failed: %s\n", irecv_strerror(error));
+		return 1;
+	}
+	if (emu_get_upload(0, &upload) != 0 || upload.bytes != IMAGE_SIZE || upload.mismatches != 0) {
+		fprintf(stderr, "The image did not arrive intact\n");
+		return 1;
+	}
+	emu_get_dev_mem(dev_mem);
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	struct emu_dev_mem dev_mem;
+	int failed = 0;
+	FILE* f;
+	int fd;
+	int i;
+
+#if !defined(LIBUSB_API_VERSION) || (LIBUSB_API_VERSION < 0x01000105)
+	/* libusb_dev_mem_alloc() does not exist, staging memory is always heap memory */
+	return 77;
+#endif
+
+	for (i = 0; i < IMAGE_SIZE; i++) {
+		image[i] = (unsigned char)(i * 7 + (i >> 12));
+	}
+	fd = mkstemp(image_path);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create a temporary file\n");
+		return 1;
+	}
+	f = fdopen(fd, "wb");
+	if (!f || fwrite(image, 1, IMAGE_SIZE, f) != IMAGE_SIZE || fclose(f) != 0) {
+		fprintf(stderr, "Could not write %s\n", image_path);
+		unlink(image_path);
+		return 1;
+	}
+
+	/* the ring comes from the client's handle and goes back to it */
+	if (send_image(0, &dev_mem) != 0) {
+		failed++;
+	} else if (dev_mem.allocs == 0 || dev_mem.live != 0 || dev_mem.errors != 0) {
+		fprintf(stderr, "Staging memory: %u allocated, %u not freed, %u freed wrongly\n", dev_mem.allocs, dev_mem.live, dev_mem.errors);
+		failed++;
+	}
+
+	/* a session may close the handle under a send, so it gets heap memory */
+	if (send_image(5000, &dev_mem) != 0) {
+		failed++;
+	} else if (dev_mem.allocs != 0 || dev_mem.errors != 0) {
+		fprintf(stderr, "An auto-reconnect client got %u staging buffers\n", dev_mem.allocs);
+		failed++;
+	}
+
+	unlink(image_path);
+
+	if (failed) {
+		fprintf(stderr, "%d check(s) failed\n", failed);
+		return 1;
+	}
+
+	return 0;
+}
@@ -32,7 +32,10 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include <libirecovery.h>
+#include <libimobiledevice-glue/thread.h>
 #ifdef HAVE_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -46,9 +49,14 @@
 #include <windows.h>
 #include <conio.h>
 #define sleep(n) Sleep(1000 * n)
+#else
+#include <sys/select.h>
 #endif
 
 #define FILE_HISTORY_PATH ".irecovery"
+#define CONSOLE_READ_SIZE 0x1000
+#define CONSOLE_READ_TIMEOUT 500
+#define CONSOLE_MAX_FAST_FAILURES 3
 #define debug(...) if (verbose) fprintf(stderr, __VA_ARGS__)
 
 enum {
@@ -68,6 +76,35 @@ enum {
 static unsigned int quit = 0;
 static unsigned int verbose = 0;
 
+enum {
+	kTimingsOff,
+	kTimingsText,
+	kTimingsJSON
+};
+
+static struct {
+	struct irecv_timing* entries;
+	unsigned int count;
+	unsigned int size;
+} timings;
+
+/* console output is read by a separate thread so it keeps flowing while the
+ * prompt waits for input; with readline it is buffered and printed by the
+ * shell loop, which redraws the prompt around it */
+static struct {
+	irecv_client_t client;
+	THREAD_T thread;
+	mutex_t device_lock;
+	mutex_t lock;
+	int running;
+	int failed;
+	int deferred;
+	char* buf;
+	size_t len;
+	size_t size;
+	int wake[2];
+} console;
+
 void print_progress_bar(double progress);
 int received_cb(irecv_client_t client, const irecv_event_t* event);
 int progress_cb(irecv_client_t client, const irecv_event_t* event);
@@ -108,34 +145,66 @@ static const char* mode_to_str(int mode)
 	}
 }
 
+/* reads until end of file, so "-" (stdin) and pipes work as well as regular files */
 static void buffer_read_from_filename(const char *filename, char **buffer, uint64_t *length)
 {
 	FILE *f;
-	uint64_t size;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
 
 	*length = 0;
 
-	f = fopen(filename, "rb");
+	if (!strcmp(filename, "-")) {
+		f = stdin;
+	} else {
+		f = fopen(filename, "rb");
+	}
 	if (!f) {
 		return;
 	}
 
-	fseek(f, 0, SEEK_END);
-	size = ftell(f);
-	rewind(f);
+	while (1) {
+		if (capacity - size < 4096) {
+			size_t newcap = (capacity) ? capacity * 2 : 65536;
+			char *newbuf = (char*)realloc(buf, newcap + 1);
+			if (!newbuf) {
+				free(buf);
+				buf = NULL;
+				size = 0;
+				break;
+			}
+			buf = newbuf;
+			capacity = newcap;
+		}
+		size_t n = fread(buf + size, sizeof(char), capacity - size, f);
+		size += n;
+		if (n == 0) {
+			break;
+		}
+	}
+	if (f != stdin) {
+		fclose(f);
+	}
 
 	if (size == 0) {
-		fclose(f);
+		free(buf);
 		return;
 	}
 
-	*buffer = (char*)malloc(sizeof(char)*(size+1));
-	fread(*buffer, sizeof(char), size, f);
-	fclose(f);
-
+	*buffer = buf;
 	*length = size;
 }
 
+/* FILE may be "-" to stream the image from stdin */
+static irecv_error_t send_file(irecv_client_t client, const char *filename, unsigned int options)
+{
+	if (!strcmp(filename, "-")) {
+		return irecv_send_fd(client, fileno(stdin), options);
+	}
+	return irecv_send_file(client, filename, options);
+}
+
 static void print_hex(unsigned char *buf, size_t len)
 {
 	size_t i;
@@ -144,6 +213,25 @@ static void print_hex(unsigned char *buf, size_t len)
 	}
 }
 
+/* -q only reads descriptors, except in Debug USB (KIS) mode where device info needs a claimed interface */
+static irecv_error_t open_for_query(irecv_client_t *client, uint64_t ecid)
+{
+	int mode = 0;
+	irecv_error_t err = irecv_open_with_ecid_readonly(client, ecid);
+	if (err == IRECV_E_SUCCESS) {
+		irecv_get_mode(*client, &mode);
+		if (mode != 0x1881) {
+			return err;
+		}
+		irecv_close(*client);
+		*client = NULL;
+	} else if (err != IRECV_E_NO_DEVICE) {
+		return err;
+	}
+
+	return irecv_open_with_ecid(client, ecid);
+}
+
 static void print_device_info(irecv_client_t client)
 {
 	int ret, mode;
@@ -262,7 +350,14 @@ static void parse_command(irecv_client_t client, unsigned char* command, unsigne
 			buffer_read_from_filename(filename, &buffer, &buffer_length);
 			if (buffer) {
 				buffer[buffer_length] = '\0';
-				irecv_execute_script(client, buffer);
+				if (console.running) {
+					mutex_lock(&console.device_lock);
+					irecv_execute_script(client, buffer);
+					irecv_usb_set_interface(client, 1, 1);
+					mutex_unlock(&console.device_lock);
+				} else {
+					irecv_execute_script(client, buffer);
+				}
 				free(buffer);
 			} else {
 				printf("Could not read file '%s'\n", filename);
@@ -320,18 +415,289 @@ static void get_input(char *buf, int maxlen)
 }
 #endif
 
+static void console_write(const char* data, size_t size)
+{
+	int wake = 0;
+
+	if (!console.deferred) {
+		fwrite(data, 1, size, stdout);
+		fflush(stdout);
+		return;
+	}
+
+	mutex_lock(&console.lock);
+	if (console.len + size > console.size) {
+		size_t newsize = (console.size) ? console.size : CONSOLE_READ_SIZE * 16;
+		char* newbuf;
+		while (newsize < console.len + size) {
+			newsize *= 2;
+		}
+		newbuf = realloc(console.buf, newsize);
+		if (!newbuf) {
+			mutex_unlock(&console.lock);
+			return;
+		}
+		console.buf = newbuf;
+		console.size = newsize;
+	}
+	memcpy(console.buf + console.len, data, size);
+	wake = (console.len == 0);
+	console.len += size;
+	mutex_unlock(&console.lock);
+
+#ifndef _WIN32
+	if (wake && write(console.wake[1], "", 1) < 0) {
+		debug("Could not wake up shell: %s\n", strerror(errno));
+	}
+#endif
+}
+
+static uint64_t console_time_ms(void)
+{
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static int console_failed(void)
+{
+	int failed;
+
+	if (!console.running) {
+		return 0;
+	}
+	mutex_lock(&console.lock);
+	failed = console.failed;
+	mutex_unlock(&console.lock);
+
+	return failed;
+}
+
+static void* console_reader(void* data)
+{
+	char buf[CONSOLE_READ_SIZE];
+	int fast_failures = 0;
+
+	while (1) {
+		int bytes = 0;
+		mutex_lock(&console.lock);
+		int running = console.running;
+		mutex_unlock(&console.lock);
+		if (!running) {
+			break;
+		}
+		uint64_t start = console_time_ms();
+		mutex_lock(&console.device_lock);
+		int ret = irecv_usb_bulk_transfer(console.client, 0x81, (unsigned char*)buf, sizeof(buf), &bytes, CONSOLE_READ_TIMEOUT);
+		mutex_unlock(&console.device_lock);
+		if (bytes > 0) {
+			console_write(buf, bytes);
+		}
+		/* the error codes depend on the USB backend, but a read that only
+		 * timed out took the whole timeout; one failing right away again
+		 * and again means the device is gone (after go, reboot or unplug) */
+		if (ret == 0 || ret == IRECV_E_TIMEOUT || console_time_ms() - start >= CONSOLE_READ_TIMEOUT / 2) {
+			fast_failures = 0;
+		} else if (++fast_failures >= CONSOLE_MAX_FAST_FAILURES) {
+			debug("Console read failed with error %d\n", ret);
+			mutex_lock(&console.lock);
+			console.failed = 1;
+			mutex_unlock(&console.lock);
+#ifndef _WIN32
+			if (console.deferred && write(console.wake[1], "", 1) < 0) {
+				debug("Could not wake up shell: %s\n", strerror(errno));
+			}
+#endif
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static void console_start(irecv_client_t client, int deferred)
+{
+#ifndef _WIN32
+	int mode = 0;
+
+	/* the Windows backend has no console reads, DFU mode no console */
+	irecv_get_mode(client, &mode);
+	if (mode < IRECV_K_RECOVERY_MODE_1 || mode > IRECV_K_RECOVERY_MODE_4) {
+		return;
+	}
+	if (deferred && pipe(console.wake) < 0) {
+		return;
+	}
+	console.client = client;
+	console.deferred = deferred;
+	console.running = 1;
+	console.failed = 0;
+	mutex_init(&console.lock);
+	mutex_init(&console.device_lock);
+	irecv_usb_set_interface(client, 1, 1);
+	if (thread_new(&console.thread, console_reader, NULL) != 0) {
+		console.running = 0;
+		mutex_destroy(&console.lock);
+		mutex_destroy(&console.device_lock);
+		if (deferred) {
+			close(console.wake[0]);
+			close(console.wake[1]);
+		}
+	}
+#endif
+}
+
+static void console_stop(void)
+{
+	if (!console.running) {
+		return;
+	}
+	mutex_lock(&console.lock);
+	console.running = 0;
+	mutex_unlock(&console.lock);
+	thread_join(console.thread);
+	thread_free(console.thread);
+	irecv_usb_set_interface(console.client, 0, 0);
+	mutex_destroy(&console.lock);
+	mutex_destroy(&console.device_lock);
+	if (console.deferred) {
+		close(console.wake[0]);
+		close(console.wake[1]);
+		console.deferred = 0;
+	}
+	free(console.buf);
+	console.buf = NULL;
+	console.len = 0;
+	console.size = 0;
+}
+
+static void execute_shell_command(irecv_client_t client, const char* cmd)
+{
+	irecv_error_t error;
+
+	if (_is_breq_command(cmd)) {
+		error = irecv_send_command_breq(client, cmd, 1);
+	} else {
+		error = irecv_send_command(client, cmd);
+	}
+	if (error != IRECV_E_SUCCESS) {
+		quit = 1;
+	}
+
+	append_command_to_history(cmd);
+}
+
+#if defined(HAVE_READLINE) && !defined(_WIN32)
+static irecv_client_t shell_client = NULL;
+
+static void console_flush(void)
+{
+	char* data;
+	size_t len;
+	char dummy[64];
+
+	if (read(console.wake[0], dummy, sizeof(dummy)) < 0) {
+		return;
+	}
+
+	mutex_lock(&console.lock);
+	data = console.buf;
+	len = console.len;
+	console.buf = NULL;
+	console.len = 0;
+	console.size = 0;
+	mutex_unlock(&console.lock);
+
+	if (len > 0) {
+		/* print above the prompt and restore whatever was typed so far */
+		char* line = rl_copy_text(0, rl_end);
+		int point = rl_point;
+		rl_set_prompt("");
+		rl_replace_line("", 0);
+		rl_redisplay();
+		fwrite(data, 1, len, stdout);
+		fflush(stdout);
+		rl_set_prompt("> ");
+		rl_replace_line(line, 0);
+		rl_point = point;
+		rl_on_new_line();
+		rl_redisplay();
+		free(line);
+	}
+	free(data);
+}
+
+static void shell_line_cb(char* cmd)
+{
+	if (!cmd) {
+		quit = 1;
+		return;
+	}
+	if (*cmd) {
+		execute_shell_command(shell_client, cmd);
+	}
+	free(cmd);
+}
+#endif
+
 static void init_shell(irecv_client_t client)
 {
-	irecv_error_t error = 0;
 	load_command_history();
 	irecv_event_subscribe(client, IRECV_PROGRESS, &progress_cb, NULL);
 	irecv_event_subscribe(client, IRECV_RECEIVED, &received_cb, NULL);
 	irecv_event_subscribe(client, IRECV_PRECOMMAND, &precommand_cb, NULL);
 	irecv_event_subscribe(client, IRECV_POSTCOMMAND, &postcommand_cb, NULL);
+#if defined(HAVE_READLINE) && !defined(_WIN32)
+	console_start(client, 1);
+	shell_client = client;
+	rl_callback_handler_install("> ", shell_line_cb);
 	while (!quit) {
-		error = irecv_receive(client);
-		if (error != IRECV_E_SUCCESS) {
-			debug("%s\n", irecv_strerror(error));
+		fd_set fds;
+		int maxfd = STDIN_FILENO;
+		struct timeval tv = { 0, 200000 };
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		if (console.running) {
+			FD_SET(console.wake[0], &fds);
+			if (console.wake[0] > maxfd) {
+				maxfd = console.wake[0];
+			}
+		}
+		if (select(maxfd + 1, &fds, NULL, NULL, &tv) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		if (console.running && FD_ISSET(console.wake[0], &fds)) {
+			console_flush();
+			if (console_failed()) {
+				/* the device went away, leave like the receive loop below does */
+				quit = 1;
+				break;
+			}
+		}
+		if (FD_ISSET(STDIN_FILENO, &fds)) {
+			rl_callback_read_char();
+		}
+	}
+	rl_callback_handler_remove();
+	console_stop();
+#else
+	irecv_error_t error = 0;
+	console_start(client, 0);
+	while (!quit) {
+		if (!console.running) {
+			error = irecv_receive(client);
+			if (error != IRECV_E_SUCCESS) {
+				debug("%s\n", irecv_strerror(error));
+				break;
+			}
+		} else if (console_failed()) {
 			break;
 		}
 #ifdef HAVE_READLINE
@@ -344,37 +710,24 @@ static void init_shell(irecv_client_t client)
 		get_input(cmdbuf, sizeof(cmdbuf));
 #endif
 		if (cmd && *cmd) {
-			if (_is_breq_command(cmd)) {
-				error = irecv_send_command_breq(client, cmd, 1);
-			} else {
-				error = irecv_send_command(client, cmd);
-			}
-			if (error != IRECV_E_SUCCESS) {
-				quit = 1;
-			}
-
-			append_command_to_history(cmd);
+			execute_shell_command(client, cmd);
 		}
 #ifdef HAVE_READLINE
 		free(cmd);
 #endif
 	}
+	console_stop();
+#endif
 }
 
 int received_cb(irecv_client_t client, const irecv_event_t* event)
 {
 	if (event->type == IRECV_RECEIVED) {
-		int i = 0;
-		int size = event->size;
-		const char* data = event->data;
-		for (i = 0; i < size; i++) {
-			printf("%c", data[i]);
-		}
+		console_write(event->data, event->size);
 	}
 
 	return 0;
 }
-
 int precommand_cb(irecv_client_t client, const irecv_event_t* event)
 {
 	if (event->type == IRECV_PRECOMMAND) {
@@ -460,6 +813,55 @@ void print_progress_bar(double progress)
 	}
 }
 
+static void timing_cb(const struct irecv_timing* timing, void* user_data)
+{
+	if (timings.count == timings.size) {
+		unsigned int newsize = (timings.size) ? timings.size * 2 : 16;
+		struct irecv_timing* entries = realloc(timings.entries, sizeof(struct irecv_timing) * newsize);
+		if (!entries) {
+			return;
+		}
+		timings.entries = entries;
+		timings.size = newsize;
+	}
+	timings.entries[timings.count++] = *timing;
+}
+
+static void print_timings(int format)
+{
+	uint64_t base = (timings.count > 0) ? timings.entries[0].start : 0;
+	uint64_t total = 0;
+	unsigned int i;
+
+	if (format == kTimingsJSON) {
+		fprintf(stderr, "{\"timings\":[");
+		for (i = 0; i < timings.count; i++) {
+			const struct irecv_timing* t = &timings.entries[i];
+			fprintf(stderr, "%s{\"phase\":\"%s\",\"ecid\":\"0x%" PRIx64 "\",\"start_us\":%" PRIu64 ",\"duration_us\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"error\":%d}",
+				(i > 0) ? "," : "", irecv_timing_phase_name(t->phase), t->ecid, t->start - base, t->duration, t->bytes, t->error);
+		}
+		fprintf(stderr, "]}\n");
+		return;
+	}
+
+	fprintf(stderr, "%-12s %12s %12s\n", "PHASE", "START (ms)", "TIME (ms)");
+	for (i = 0; i < timings.count; i++) {
+		const struct irecv_timing* t = &timings.entries[i];
+		fprintf(stderr, "%-12s %12.3f %12.3f", irecv_timing_phase_name(t->phase), (double)(t->start - base) / 1000.0, (double)t->duration / 1000.0);
+		if (t->phase == IRECV_TIMING_UPLOAD && t->duration > 0) {
+			fprintf(stderr, "  %" PRIu64 " bytes, %.2f MB/s", t->bytes, (double)t->bytes / (double)t->duration);
+		}
+		if (t->error != IRECV_E_SUCCESS) {
+			fprintf(stderr, "  (%s)", irecv_strerror(t->error));
+		}
+		fprintf(stderr, "\n");
+		if (t->start + t->duration - base > total) {
+			total = t->start + t->duration - base;
+		}
+	}
+	fprintf(stderr, "%-12s %12s %12.3f\n", "total", "", (double)total / 1000.0);
+}
+
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -472,15 +874,16 @@ static void print_usage(int argc, char **argv)
 	printf("  -i, --ecid ECID\tconnect to specific device by its ECID\n");
 	printf("  -c, --command CMD\trun CMD on device\n");
 	printf("  -m, --mode\t\tprint current device mode\n");
-	printf("  -f, --file FILE\tsend file to device\n");
+	printf("  -f, --file FILE\tsend file to device (- reads from stdin)\n");
 	printf("  -k, --payload FILE\tsend limera1n usb exploit payload from FILE\n");
 	printf("  -r, --reset\t\treset client\n");
 	printf("  -n, --normal\t\treboot device into normal mode (exit recovery loop)\n");
-	printf("  -e, --script FILE\texecutes recovery script from FILE\n");
+	printf("  -e, --script FILE\texecutes recovery script from FILE (- for stdin)\n");
 	printf("  -s, --shell\t\tstart an interactive shell\n");
 	printf("  -q, --query\t\tquery device info\n");
 	printf("  -a, --devices\t\tlist information for all known devices\n");
 	printf("  -v, --verbose\t\tenable verbose output, repeat for higher verbosity\n");
+	printf("  --timings[=json]\tprint how long each phase of the run took\n");
 	printf("  -h, --help\t\tprints this usage information\n");
 	printf("  -V, --version\t\tprints version information\n");
 	printf("\n");
@@ -505,6 +908,7 @@ int main(int argc, char* argv[])
 		{ "verbose", no_argument,       NULL, 'v' },
 		{ "help",    no_argument,       NULL, 'h' },
 		{ "version", no_argument,       NULL, 'V' },
+		{ "timings", optional_argument, NULL, 't' },
 		{ NULL, 0, NULL, 0 }
 	};
 	int i = 0;
@@ -512,6 +916,7 @@ int main(int argc, char* argv[])
 	int action = kNoAction;
 	uint64_t ecid = 0;
 	int mode = -1;
+	int timings_format = kTimingsOff;
 	char* argument = NULL;
 	irecv_error_t error = 0;
 
@@ -592,6 +997,17 @@ int main(int argc, char* argv[])
 				print_devices();
 				return 0;
 
+			case 't':
+				if (optarg && !strcmp(optarg, "json")) {
+					timings_format = kTimingsJSON;
+				} else if (optarg) {
+					fprintf(stderr, "ERROR: Unknown timings format '%s'\n", optarg);
+					return -1;
+				} else {
+					timings_format = kTimingsText;
+				}
+				break;
+
 			case 'V':
 				printf("%s %s", TOOL_NAME, PACKAGE_VERSION);
 #ifdef HAVE_READLINE
@@ -615,11 +1031,14 @@ int main(int argc, char* argv[])
 	if (verbose)
 		irecv_set_debug_level(verbose);
 
+	if (timings_format != kTimingsOff)
+		irecv_set_timing_callback(timing_cb, NULL);
+
 	irecv_client_t client = NULL;
 	for (i = 0; i <= 5; i++) {
 		debug("Attempting to connect... \n");
 
-		irecv_error_t err = irecv_open_with_ecid(&client, ecid);
+		irecv_error_t err = (action == kQueryInfo) ? open_for_query(&client, ecid) : irecv_open_with_ecid(&client, ecid);
 		if (err == IRECV_E_UNSUPPORTED) {
 			fprintf(stderr, "ERROR: %s\n", irecv_strerror(err));
 			return -1;
@@ -649,7 +1068,7 @@ int main(int argc, char* argv[])
 
 		case kSendFile:
 			irecv_event_subscribe(client, IRECV_PROGRESS, &progress_cb, NULL);
-			error = irecv_send_file(client, argument, IRECV_SEND_OPT_DFU_NOTIFY_FINISH);
+			error = send_file(client, argument, IRECV_SEND_OPT_DFU_NOTIFY_FINISH);
 			debug("%s\n", irecv_strerror(error));
 			break;
 
@@ -673,7 +1092,7 @@ int main(int argc, char* argv[])
 			}
 			if (argument != NULL) {
 				irecv_event_subscribe(client, IRECV_PROGRESS, &progress_cb, NULL);
-				error = irecv_send_file(client, argument, 0);
+				error = send_file(client, argument, 0);
 				if (error != IRECV_E_SUCCESS) {
 					debug("%s\n", irecv_strerror(error));
 					break;
@@ -756,5 +1175,11 @@ int main(int argc, char* argv[])
 
 	irecv_close(client);
 
+	if (timings_format != kTimingsOff) {
+		irecv_set_timing_callback(NULL, NULL);
+		print_timings(timings_format);
+		free(timings.entries);
+	}
+
 	return 0;
 }